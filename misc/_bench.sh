@@ -0,0 +1,26 @@
+# Helpers for the bench-*.sh scripts, which time commands without hyperfine
+
+# _fmtus <microseconds>
+# Prints a duration in milliseconds, e.g. "12.345 ms"
+_fmtus() {
+  printf "%d.%03d ms" $(( $1 / 1000 )) $(( $1 % 1000 ))
+}
+
+# _bench_runs <runs> <prepare> <command> [<arg> ...]
+# Runs command with args <runs> times, each run preceded by prepare unless it is empty, and
+# prints the average, min and max time of the runs (not counting prepare.)
+_bench_runs() {
+  local runs=$1 prepare=$2 i t1 t2 d min= max=0 total=0
+  shift 2
+  for ((i = 0; i < runs; i++)); do
+    [ -z "$prepare" ] || "$prepare"
+    t1=${EPOCHREALTIME/./}
+    "$@" >/dev/null 2>&1
+    t2=${EPOCHREALTIME/./}
+    d=$(( t2 - t1 ))
+    total=$(( total + d ))
+    [ -z "$min" ] || [ $d -lt $min ] && min=$d
+    [ $d -gt $max ] && max=$d
+  done
+  echo "  runs: $runs  avg: $(_fmtus $(( total / runs )))  min: $(_fmtus $min)  max: $(_fmtus $max)"
+}
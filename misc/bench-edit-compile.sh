@@ -0,0 +1,80 @@
+#!/bin/bash
+#
+# Measures edit-compile latency of debug builds: the time "co build" takes to rebuild a large
+# package after one of its files changed. Generates a package of <nfiles> source files with
+# <nfuns> functions each in a temporary directory, builds it once and then, for each run,
+# edits one file (so that the build cache misses) and rebuilds.
+#
+set -e
+cd "$(dirname "$0")/.."
+. misc/_bench.sh
+
+if [ $# -lt 1 ] || [ "$1" == "-h" ] || [ "$1" == "--help" ]; then
+  echo "usage: $0 <co-executable> [<nfiles> [<nfuns> [<runs>]]]" >&2
+  echo "  nfiles  number of source files in the package (default: 100)" >&2
+  echo "  nfuns   number of functions per source file (default: 50)" >&2
+  echo "  runs    number of edit-compile runs (default: 10)" >&2
+  exit 1
+fi
+
+CO=$(command -v "$1" || echo "$1")
+NFILES=${2:-100}
+NFUNS=${3:-50}
+RUNS=${4:-10}
+
+PKGDIR=$(mktemp -d -t co-bench-edit-compile.XXXXXXXX)
+trap "rm -rf '$PKGDIR'" EXIT
+export COCACHE=$PKGDIR/.cache
+
+# genfile <index> writes <nfuns> functions to $PKGDIR/f<index>.co
+genfile() {
+  local i=$1 j
+  for ((j = 0; j < NFUNS; j++)); do
+    cat <<END
+fun f${i}_${j}(x, y int) int {
+  a = x + $j
+  b = a * y
+  if a > b {
+    a = b - x
+  }
+  c = a + b
+  c = c * 2
+  c - a
+}
+
+END
+  done
+}
+
+for ((i = 0; i < NFILES; i++)); do
+  genfile $i > "$PKGDIR/f$i.co"
+done
+cat > "$PKGDIR/main.co" <<END
+fun main() int {
+  f0_0(1, 0)
+}
+END
+
+CMD=( "$CO" build -o "$PKGDIR/out.exe" "$PKGDIR" )
+
+# edit.sh changes the body of a function, like a typical edit between builds
+cat > "$PKGDIR/edit.sh" <<END
+#!/bin/sh
+n=\$(( \$(cat "$PKGDIR/.edits" 2>/dev/null || echo 0) + 1 ))
+echo \$n > "$PKGDIR/.edits"
+printf 'fun main() int {\n  f0_0(1, %d)\n}\n' \$n > "$PKGDIR/main.co"
+END
+chmod +x "$PKGDIR/edit.sh"
+
+# initial build; fails early with a useful message if co can't build the package
+"${CMD[@]}" >/dev/null
+
+echo "${CMD[*]}"
+echo "  package: $NFILES files, $(( NFILES * NFUNS )) functions, $(cat "$PKGDIR"/*.co | wc -l) lines"
+
+if command -v hyperfine >/dev/null; then
+  hyperfine --runs "$RUNS" --prepare "$PKGDIR/edit.sh" "${CMD[*]}"
+  exit
+fi
+
+_bench_runs "$RUNS" "$PKGDIR/edit.sh" "${CMD[@]}"
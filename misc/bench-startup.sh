@@ -0,0 +1,35 @@
+#!/bin/bash
+#
+# Measures compiler startup time: from exec of co until the first source file is parsed.
+# Uses "co build --parse-only", which initializes LLVM the same way a full build does but
+# stops after parsing.
+#
+set -e
+cd "$(dirname "$0")/.."
+. misc/_bench.sh
+
+if [ $# -lt 1 ] || [ "$1" == "-h" ] || [ "$1" == "--help" ]; then
+  echo "usage: $0 <co-executable> [<srcfile> [<runs>]]" >&2
+  echo "  srcfile  source file to parse (default: example/hello.co)" >&2
+  echo "  runs     number of runs (default: 100)" >&2
+  exit 1
+fi
+
+CO=$1
+SRCFILE=${2:-example/hello.co}
+RUNS=${3:-100}
+CMD=( "$CO" build --parse-only "$SRCFILE" )
+
+# fail early with a useful message if co can't parse srcfile
+"${CMD[@]}" >/dev/null
+
+if command -v hyperfine >/dev/null; then
+  exec hyperfine --warmup 5 --runs "$RUNS" --shell=none "${CMD[*]}"
+fi
+
+for ((i = 0; i < 5; i++)); do  # warmup
+  "${CMD[@]}" >/dev/null 2>&1
+done
+
+echo "${CMD[*]}"
+_bench_runs "$RUNS" "" "${CMD[@]}"
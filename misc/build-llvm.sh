@@ -19,7 +19,8 @@ ZLIB_VERSION=1.2.11
 ZLIB_CHECKSUM=e1cb0d5c92da8e9a8c2635dfa249c341dfd00322
 
 # CO_LLVM_BUILD_COMPILER_RT: Enables building the compiler-rt suite with llvm.
-# This is only required for co debug builds as it provides sanitizer runtimes.
+# This is required for co debug builds as it provides sanitizer runtimes, and for
+# profile-guided optimization (co build --pgo-gen) as it provides the profile runtime.
 # Building compiler-rt makes the build SIGNIFICANTLY slower (~7k extra sources.)
 # TODO: make this configurable for a CI -safe or -fast build.
 CO_LLVM_BUILD_COMPILER_RT=true
@@ -150,7 +151,7 @@ _llvm_build() {
       -DCOMPILER_RT_CAN_EXECUTE_TESTS=OFF \
       -DCOMPILER_RT_BUILD_LIBFUZZER=OFF \
       -DCOMPILER_RT_BUILD_CRT=OFF \
-      -DCOMPILER_RT_BUILD_PROFILE=OFF \
+      -DCOMPILER_RT_BUILD_PROFILE=ON \
       -DCOMPILER_RT_BUILD_MEMPROF=OFF \
       -DSANITIZER_USE_STATIC_CXX_ABI=ON \
     )
@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+#
+# This script generates a header defining CO_BUILD_ID, which identifies a build of co in
+# cache keys (see src/co/cache.c.)
+#
+# The id is a hash of the git revision, the contents of all source files in <srcdir>, the
+# build configuration and the contents of the given files (the compilers used to build co
+# and llvm-config, which identifies the LLVM libraries co is linked with.) Any change to any
+# of these, committed or not, gives a new id. Hashing the sources rather than relying on the
+# build time makes the id stable across clean rebuilds of the same tree.
+#
+# The header is only written when the id changes so that it does not cause recompilation.
+#
+import sys, os, os.path, hashlib, subprocess
+
+def err(msg):
+  print(msg)
+  sys.exit(1)
+
+if len(sys.argv) < 4:
+  err("usage: %s <outfile> <srcdir> <config> [<file> ...]" % sys.argv[0])
+outfile = sys.argv[1]
+srcdir = sys.argv[2]
+config = sys.argv[3]
+files = sys.argv[4:]
+
+SOURCE_EXTS = (".c", ".h", ".cc", ".hh", ".S", ".def", ".lisp")
+
+h = hashlib.sha1()
+
+def hash_str(s):
+  h.update(s.encode("utf8"))
+  h.update(b"\0")
+
+def hash_file(filename, name):
+  hash_str(name)
+  with open(filename, "rb") as f:
+    while True:
+      buf = f.read(65536)
+      if not buf:
+        break
+      h.update(buf)
+
+gitrev = ""
+try:
+  gitrev = subprocess.check_output(
+    ["git", "rev-parse", "--short=12", "HEAD"], cwd=srcdir, stderr=subprocess.DEVNULL
+  ).decode("utf8").strip()
+except (OSError, subprocess.CalledProcessError):
+  pass
+hash_str(gitrev)
+hash_str(config)
+
+for dirpath, dirnames, filenames in os.walk(srcdir):
+  dirnames.sort() # os.walk order depends on the file system
+  for name in sorted(filenames):
+    if name.endswith(SOURCE_EXTS):
+      filename = os.path.join(dirpath, name)
+      hash_file(filename, os.path.relpath(filename, srcdir))
+
+for filename in files:
+  if not os.path.isfile(filename):
+    err("gen_buildid.py: %s not found" % filename)
+  hash_file(filename, os.path.basename(filename))
+
+buildid = h.hexdigest()[:16]
+if gitrev:
+  buildid = gitrev + "-" + buildid
+
+content = (
+  "// generated by misc/gen_buildid.py -- do not edit\n"
+  "#define CO_BUILD_ID \"%s\"\n" % buildid
+)
+try:
+  with open(outfile, "r") as f:
+    if f.read() == content:
+      sys.exit(0)
+except OSError:
+  pass
+os.makedirs(os.path.dirname(os.path.abspath(outfile)), exist_ok=True)
+with open(outfile, "w") as f:
+  f.write(content)
@@ -57,9 +57,10 @@ static const char* bn_fun_fqname(BNBuilder* b, Node* n) {
 
     if (b->build->debug) {
       // "name^typeid"
-      b->strings = str_makeroom(b->strings, symlen(n->fun.name) + symlen(n->type->t.id) + 1);
+      Sym tid = GetTypeID(b->build, n->type);
+      b->strings = str_makeroom(b->strings, symlen(n->fun.name) + symlen(tid) + 1);
       b->strings = str_append(b->strings, n->fun.name, symlen(n->fun.name));
-      b->strings = str_append(b->strings, n->type->t.id, symlen(n->type->t.id));
+      b->strings = str_append(b->strings, tid, symlen(tid));
     } else {
       // "f1F"
       u32 index = PtrMapLen(&b->funmap);
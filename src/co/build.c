@@ -1,6 +1,7 @@
 #include "common.h"
 #include "build.h"
 #include "parse/parse.h" // universe_syms
+#include "util/rtimer.h"
 
 void build_init(Build*   b,
   Mem                    mem,
@@ -11,29 +12,98 @@ void build_init(Build*   b,
 {
   assertnotnull(mem);
   memset(b, 0, sizeof(Build));
-  b->mem       = mem;
+  b->mem       = memarena_init(&b->arena, mem, 0);
   b->safe      = true;
   b->syms      = syms;
   b->pkg       = pkg;
   b->diagh     = diagh;
   b->userdata  = userdata;
   b->diaglevel = DiagMAX;
+  b->emit      = CoEmitExe;
+  b->outfile   = "out1.exe";
   b->sint_type = sizeof(long) > 4 ? TypeCode_i64 : TypeCode_i32; // default to host size
   b->uint_type = sizeof(long) > 4 ? TypeCode_u64 : TypeCode_u32;
-  SymMapInit(&b->types, 32, mem);
+  typetab_init(&b->types, mem);
   ArrayInit(&b->diagarray);
+  mtx_init(&b->diagmu, mtx_plain);
   posmap_init(&b->posmap, mem);
 }
 
 void build_dispose(Build* b) {
   ArrayFree(&b->diagarray, b->mem);
-  SymMapDispose(&b->types);
+  mtx_destroy(&b->diagmu);
+  typetab_dispose(&b->types);
   posmap_dispose(&b->posmap);
+  memarena_dispose(&b->arena); // AST, scopes, diagnostics etc.
   #if DEBUG
   memset(b, 0, sizeof(*b));
   #endif
 }
 
+u32 build_cgparts(const Build* b) {
+  // codegen without optimizations is fast enough that splitting costs more than it saves
+  if (b->opt == CoOptNone)
+    return 1;
+  return b->cgparts ? b->cgparts : os_ncpu();
+}
+
+Str build_outpath(const Build* b, const char* ext) {
+  const char* name = b->outfile;
+  size_t len = strlen(name);
+  if (!ext)
+    return str_cpy(name, len);
+  // strip extension of the last path component
+  const char* base = strrchr(name, PATH_SEPARATOR);
+  base = base ? base + 1 : name;
+  const char* dot = strrchr(base, '.');
+  if (dot && dot > base)
+    len = (size_t)(dot - name);
+  Str s = str_cpy(name, len);
+  return str_appendcstr(s, ext);
+}
+
+static Str json_appendstr(Str s, const char* p) {
+  s = str_appendc(s, '"');
+  for (; *p; p++) {
+    u8 c = (u8)*p;
+    switch (c) {
+      case '"':  s = str_appendcstr(s, "\\\""); break;
+      case '\\': s = str_appendcstr(s, "\\\\"); break;
+      case '\n': s = str_appendcstr(s, "\\n"); break;
+      case '\t': s = str_appendcstr(s, "\\t"); break;
+      default:
+        if (c < 0x20) {
+          s = str_appendfmt(s, "\\u%04x", c);
+        } else {
+          s = str_appendc(s, (char)c);
+        }
+    }
+  }
+  return str_appendc(s, '"');
+}
+
+Str build_report_json(const BuildReport* r, Str s) {
+  s = str_appendcstr(s, "{\n  \"phases\": [");
+  for (u32 i = 0; i < r->phases.len; i++) {
+    const RTimerRecord* rec = r->phases.v[i];
+    s = str_appendcstr(s, i == 0 ? "\n    {\"name\": " : ",\n    {\"name\": ");
+    s = json_appendstr(s, rec->message);
+    s = str_appendfmt(s, ", \"ns\": %llu}", (unsigned long long)rec->duration);
+  }
+  s = str_appendcstr(s, r->phases.len ? "\n  ],\n  \"llvm\": " : "],\n  \"llvm\": ");
+  s = str_appendcstr(s, r->llvm ? r->llvm : "null");
+  return str_appendcstr(s, "\n}\n");
+}
+
+void build_report_dispose(BuildReport* r) {
+  for (u32 i = 0; i < r->phases.len; i++)
+    rtimer_record_free(r->phases.v[i]);
+  ArrayFree(&r->phases, MemHeap);
+  if (r->llvm)
+    str_free(r->llvm);
+  r->llvm = NULL;
+}
+
 Diagnostic* build_mkdiag(Build* b) {
   auto d = memalloct(b->mem, Diagnostic);
   d->build = b;
@@ -48,21 +118,26 @@ void diag_free(Diagnostic* d) {
 }
 
 void build_diag(Build* b, DiagLevel level, PosSpan pos, const char* message) {
+  mtx_lock(&b->diagmu);
   if (level <= DiagError)
     b->errcount++;
-  if (level > b->diaglevel || b->diagh == NULL)
-    return;
-  auto d = build_mkdiag(b);
-  d->level = level;
-  d->pos = pos;
-  d->message = memstrdup(b->mem, message);
-  b->diagh(d, b->userdata);
+  if (level <= b->diaglevel && b->diagh != NULL) {
+    auto d = build_mkdiag(b);
+    d->level = level;
+    d->pos = pos;
+    d->message = memstrdup(b->mem, message);
+    b->diagh(d, b->userdata);
+  }
+  mtx_unlock(&b->diagmu);
 }
 
 void build_diagv(Build* b, DiagLevel level, PosSpan pos, const char* fmt, va_list ap) {
   if (level > b->diaglevel || b->diagh == NULL) {
-    if (level <= DiagError)
+    if (level <= DiagError) {
+      mtx_lock(&b->diagmu);
       b->errcount++;
+      mtx_unlock(&b->diagmu);
+    }
     return;
   }
   char buf[256];
@@ -141,10 +216,54 @@ Build* test_build_new() {
 }
 
 void test_build_free(Build* b) {
-  auto mem = b->mem;
+  auto mem = b->arena.parent;
   // sympool_dispose(b->syms); // not needed because of MemFree
   build_dispose(b);
   MemLinearFree(mem);
 }
 
+R_TEST(build_outpath) {
+  Build* b = test_build_new();
+  struct { const char* outfile; const char* ext; const char* expect; } tests[] = {
+    { "out1.exe",    NULL,    "out1.exe" },
+    { "out1.exe",    ".o",    "out1.o" },
+    { "foo",         ".o",    "foo.o" },
+    { "a.b/foo",     ".s",    "a.b/foo.s" },
+    { "a/foo.bar.o", ".1.o",  "a/foo.bar.1.o" },
+    { "a/.foo",      ".ll",   "a/.foo.ll" },
+  };
+  for (u32 i = 0; i < countof(tests); i++) {
+    b->outfile = tests[i].outfile;
+    Str s = build_outpath(b, tests[i].ext);
+    asserteq(strcmp(s, tests[i].expect), 0);
+    str_free(s);
+  }
+  test_build_free(b);
+}
+
+R_TEST(build_report_json) {
+  BuildReport r = {0};
+  Str s = build_report_json(&r, str_new(0));
+  asserteq(strcmp(s, "{\n  \"phases\": [],\n  \"llvm\": null\n}\n"), 0);
+  str_free(s);
+
+  RTimer rt = { .records = &r.phases };
+  rtimer_start(&rt);
+  rtimer_log(&rt, "parse %s", "\"a\\b\".co");
+  asserteq(r.phases.len, 1);
+  RTimerRecord* rec = r.phases.v[0];
+  rec->duration = 123;
+  r.llvm = str_cpy("{}", 2);
+  s = build_report_json(&r, str_new(0));
+  asserteq(strcmp(s,
+    "{\n"
+    "  \"phases\": [\n"
+    "    {\"name\": \"parse \\\"a\\\\b\\\".co\", \"ns\": 123}\n"
+    "  ],\n"
+    "  \"llvm\": {}\n"
+    "}\n"), 0);
+  str_free(s);
+  build_report_dispose(&r);
+}
+
 #endif /* R_TESTING_ENABLED */
@@ -1,7 +1,9 @@
 #pragma once
 #include "util/sym.h"
 #include "util/symmap.h"
+#include "util/ptrmap.h"
 #include "util/array.h"
+#include "util/arena.h"
 #include "pos.h"
 #include "types.h"
 
@@ -18,6 +20,29 @@ typedef enum CoOptType {
   CoOptSmall, // -Oz
 } CoOptType;
 
+// CoEmit is a set of build products
+typedef enum CoEmit {
+  CoEmitExe = 1 << 0, // executable
+  CoEmitObj = 1 << 1, // object file (.o)
+  CoEmitAsm = 1 << 2, // assembly (.s)
+  CoEmitBC  = 1 << 3, // LLVM bitcode (.bc)
+  CoEmitLL  = 1 << 4, // LLVM IR text (.ll)
+} CoEmit;
+
+// CoPGO selects a profile-guided optimization mode
+typedef enum CoPGO {
+  CoPGONone,
+  CoPGOGen, // instrument code to write a raw profile (.profraw) when the program exits
+  CoPGOUse, // optimize with an indexed profile (.profdata; see llvm_profdata_merge)
+} CoPGO;
+
+// CoDebugInfo selects the debug information (DWARF) to emit
+typedef enum CoDebugInfo {
+  CoDebugInfoNone,
+  CoDebugInfoLineTables, // line tables and function names; enough for profilers
+  CoDebugInfoFull,       // line tables, functions and local variables
+} CoDebugInfo;
+
 // DiagLevel is the level of severity of a diagnostic message
 typedef enum DiagLevel {
   DiagError,
@@ -37,15 +62,46 @@ typedef struct Diagnostic {
 // msg is a preformatted error message and is only valid until this function returns.
 typedef void(DiagHandler)(Diagnostic* d, void* userdata);
 
+// TypeTable interns types by structure. See InternASTType.
+typedef struct TypeTableEntry {
+  size_t              hash;
+  struct Node* nullable type; // canonical type; NULL for free slots
+} TypeTableEntry;
+typedef struct TypeTable {
+  Mem             mem;
+  rwmtx_t         mu;      // guards all fields
+  u32             cap;     // capacity of entries (power of two)
+  u32             len;     // number of entries in use
+  TypeTableEntry* entries; // open-addressed table of canonical types
+  PtrMap          canon;   // type node => canonical type node
+} TypeTable;
+
+// BuildReport collects timings and optimization remarks of a build (see Build.report)
+typedef struct BuildReport {
+  Array        phases; // RTimerRecord* of phases timed with rtimer_log (see util/rtimer.h)
+  Str nullable llvm;   // JSON object with LLVM pass timings and remarks (see llvm_optmod)
+} BuildReport;
+
 // Build holds information for one "build" of one top-level package
 struct Build {
-  Mem                   mem;       // memory space for AST nodes, diagnostics etc.
+  Mem                   mem;       // memory space for AST nodes, diagnostics etc. (arena)
+  MemArena              arena;     // backs mem; freed in one go by build_dispose
   Pkg*                  pkg;       // top-level package for which we are building
   CoOptType             opt;       // optimization type
   bool                  debug;     // build a debug build (include debug information etc)
+  CoDebugInfo           debuginfo; // debug information to emit
   bool                  safe;      // enable boundary checks and memory ref checks
+  u32                   cgparts;   // LLVM codegen partitions when optimizing (0 = one per CPU)
+  bool                  thinlto;   // emit ThinLTO bitcode; optimize across modules when linking
+  const char* nullable  ltocache;  // ThinLTO cache directory used when linking (NULL = none)
+  CoPGO                 pgo;       // profile-guided optimization mode
+  const char* nullable  pgofile;   // CoPGOGen: .profraw to write (NULL = default.profraw)
+                                   // CoPGOUse: .profdata to read
+  BuildReport* nullable report;    // if set, timings and remarks are recorded here
+  CoEmit                emit;      // products to emit (default CoEmitExe)
+  const char*           outfile;   // executable filename; also names other products
   SymPool*              syms;      // symbol pool
-  SymMap                types;     // interned types
+  TypeTable             types;     // interned types
   DiagHandler* nullable diagh;     // diagnostics handler
   void* nullable        userdata;  // custom user data passed to error handler
   u32                   errcount;  // total number of errors since last call to build_init
@@ -53,6 +109,7 @@ struct Build {
   TypeCode              uint_type; // concrete type of "uint"
   DiagLevel             diaglevel; // diagnostics filter (some > diaglevel is ignored)
   Array                 diagarray; // all diagnostic messages produced. Stored in mem.
+  mtx_t                 diagmu;    // guards errcount, diagarray and calls to diagh
   PosMap                posmap;    // maps Source <-> Pos
 };
 
@@ -77,7 +134,9 @@ struct Source {
   bool       ismmap;   // true if the file is memory-mapped
 };
 
-// build_init initializes a Build structure
+// build_init initializes a Build structure.
+// b->mem is an arena which allocates its chunks in mem. Use memarena_sub(&b->arena) to get
+// memory for threads which allocate in parallel (b->mem is not thread safe.)
 void build_init(Build*,
   Mem                    mem,
   SymPool*               syms,
@@ -88,6 +147,22 @@ void build_init(Build*,
 // build_dispose frees up internal resources used by Build
 void build_dispose(Build*);
 
+// build_cgparts returns the maximum number of partitions that LLVM codegen is split into,
+// each producing an object file of its own: 1 when not optimizing, else b->cgparts or the
+// number of CPUs. Fewer partitions are used for modules with fewer functions.
+u32 build_cgparts(const Build* b);
+
+// build_outpath returns the filename of the build product with filename extension ext
+// (e.g. ".o"), which is b->outfile with its extension replaced by ext. If ext is NULL,
+// returns b->outfile (the executable.) Caller should str_free the result.
+Str build_outpath(const Build* b, const char* nullable ext);
+
+// build_report_json appends r as a JSON object to s
+Str build_report_json(const BuildReport* r, Str s);
+
+// build_report_dispose frees memory used by r
+void build_report_dispose(BuildReport* r);
+
 // build_emit_diag invokes b->diagh. d must have been allocated in b->mem.
 static void build_emit_diag(Build* b, Diagnostic* d);
 
@@ -97,6 +172,7 @@ static void build_emit_diag(Build* b, Diagnostic* d);
 Diagnostic* build_mkdiag(Build*);
 
 // build_diag invokes b->diagh with message (the message's bytes are copied into b->mem)
+// The build_diag* functions are thread safe; calls to b->diagh are serialized.
 void build_diag(Build*, DiagLevel, PosSpan, const char* message);
 
 // build_diagv formats a diagnostic message invokes b->diagh
@@ -0,0 +1,422 @@
+#include "common.h"
+#include "cache.h"
+
+#include <sys/stat.h>
+
+// CO_BUILD_ID identifies the build of co in cache keys. It is generated by misc/gen_buildid.py
+// on every build from the git revision, the contents of co's sources, the build configuration
+// and the compilers co is built with, so that cached products are invalidated whenever any of
+// these change, including uncommitted edits, but survive a clean rebuild of the same tree.
+#include <co_buildid.h>
+
+// CACHE_FORMAT_VERSION should be incremented when the layout of cache entries changes
+#define CACHE_FORMAT_VERSION 2
+
+
+static void sha1_cstr(SHA1Ctx* sha1, const char* nullable s) {
+  // include terminating NUL to separate adjacent strings
+  if (s)
+    sha1_update(sha1, s, strlen(s) + 1);
+  else
+    sha1_update(sha1, "", 1);
+}
+
+// sha1_file adds the contents of file at filename to sha1
+static bool sha1_file(SHA1Ctx* sha1, const char* filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return false;
+  u8 buf[16384];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) != 0) {
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      close(fd);
+      return false;
+    }
+    sha1_update(sha1, buf, (size_t)n);
+  }
+  close(fd);
+  return true;
+}
+
+static int source_cmp(const void* a, const void* b) {
+  return strcmp((*(const Source**)a)->filename, (*(const Source**)b)->filename);
+}
+
+static bool buildcache_key(const Build* b, const char* triple, u8 key[20]) {
+  SHA1Ctx sha1;
+  sha1_init(&sha1);
+
+  // compiler and build options
+  u8 opts[] = {
+    CACHE_FORMAT_VERSION,
+    (u8)b->opt,
+    (u8)b->safe,
+    (u8)b->debug,
+    (u8)b->debuginfo,
+    (u8)b->thinlto, // products are bitcode rather than object code
+    (u8)b->pgo,
+    (u8)b->sint_type,
+    (u8)b->uint_type,
+  };
+  sha1_update(&sha1, opts, sizeof(opts));
+  // number of codegen partitions, which determines the object files of the build
+  u32 cgparts = build_cgparts(b);
+  sha1_update(&sha1, &cgparts, sizeof(cgparts));
+  sha1_cstr(&sha1, CO_BUILD_ID);
+  sha1_cstr(&sha1, triple);
+  sha1_cstr(&sha1, b->pkg->id);
+
+  // profile-guided optimization: instrumented code names its profile file and optimized
+  // code depends on the contents of the profile
+  if (b->pgo == CoPGOGen) {
+    sha1_cstr(&sha1, b->pgofile);
+  } else if (b->pgo == CoPGOUse && !sha1_file(&sha1, b->pgofile)) {
+    return false;
+  }
+
+  // sources, sorted by filename as srclist order depends on the order of readdir
+  u32 srcc = 0;
+  for (Source* src = b->pkg->srclist; src; src = src->next)
+    srcc++;
+  Source** srcv = memalloc(MemHeap, sizeof(void*) * MAX(srcc, 1));
+  u32 i = 0;
+  for (Source* src = b->pkg->srclist; src; src = src->next)
+    srcv[i++] = src;
+  qsort(srcv, srcc, sizeof(void*), source_cmp);
+
+  bool ok = true;
+  for (i = 0; i < srcc; i++) {
+    Source* src = srcv[i];
+    if (!SourceOpenBody(src)) {
+      ok = false;
+      break;
+    }
+    SourceChecksum(src);
+    sha1_cstr(&sha1, src->filename);
+    sha1_update(&sha1, src->sha1, sizeof(src->sha1));
+  }
+  memfree(MemHeap, srcv);
+
+  sha1_final(key, &sha1);
+  return ok;
+}
+
+bool buildcache_init(BuildCache* c, const char* rootdir, const Build* b, const char* triple) {
+  u8 key[20];
+  c->key = NULL;
+  c->dir = NULL;
+  if (!buildcache_key(b, triple, key))
+    return false;
+
+  c->key = str_new(sizeof(key) * 2);
+  for (u32 i = 0; i < sizeof(key); i++)
+    c->key = str_appendfmt(c->key, "%02x", key[i]);
+
+  char fanout[3] = { c->key[0], c->key[1], 0 };
+  Str dir = path_join(rootdir, fanout);
+  c->dir = path_join(dir, c->key);
+  str_free(dir);
+  return true;
+}
+
+void buildcache_dispose(BuildCache* c) {
+  if (c->key)
+    str_free(c->key);
+  if (c->dir)
+    str_free(c->dir);
+  c->key = NULL;
+  c->dir = NULL;
+}
+
+Str buildcache_path(const BuildCache* c, const char* name) {
+  return path_join(c->dir, name);
+}
+
+bool buildcache_has(const BuildCache* c, const char* name) {
+  Str path = buildcache_path(c, name);
+  struct stat st;
+  bool ok = stat(path, &st) == 0 && S_ISREG(st.st_mode);
+  str_free(path);
+  return ok;
+}
+
+Str nullable buildcache_load(const BuildCache* c, const char* name) {
+  Str path = buildcache_path(c, name);
+  int fd = open(path, O_RDONLY);
+  str_free(path);
+  if (fd < 0)
+    return NULL;
+  Str s = str_new(256);
+  char buf[4096];
+  while (1) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n == 0)
+      break;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      int _errno = errno;
+      close(fd);
+      str_free(s);
+      errno = _errno;
+      return NULL;
+    }
+    s = str_append(s, buf, (u32)n);
+  }
+  close(fd);
+  return s;
+}
+
+static bool writeall(int fd, const u8* p, size_t n) {
+  while (n > 0) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p += w;
+    n -= (size_t)w;
+  }
+  return true;
+}
+
+static bool copyfile(int dstfd, int srcfd) {
+  u8 buf[16384];
+  while (1) {
+    ssize_t n = read(srcfd, buf, sizeof(buf));
+    if (n == 0)
+      return true;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    if (!writeall(dstfd, buf, (size_t)n))
+      return false;
+  }
+}
+
+// store writes a product to a temporary file which is then renamed into place.
+// Contents are read from srcfd, or if srcfd is -1, from data.
+static bool store(
+  const BuildCache* c, const char* name, int srcfd, const void* nullable data, size_t size)
+{
+  if (!fs_mkdirs(MemHeap, c->dir, 0700))
+    return false;
+  Str path = buildcache_path(c, name);
+  Str tmppath = str_appendcstr(str_cpy(path, str_len(path)), ".XXXXXX");
+  bool ok = false;
+  int dstfd = mkstemp(tmppath);
+  if (dstfd > -1) {
+    ok = srcfd > -1 ? copyfile(dstfd, srcfd) : writeall(dstfd, data, size);
+    ok = close(dstfd) == 0 && ok;
+    ok = ok && rename(tmppath, path) == 0;
+    if (!ok) {
+      int _errno = errno;
+      unlink(tmppath);
+      errno = _errno;
+    }
+  }
+  str_free(tmppath);
+  str_free(path);
+  return ok;
+}
+
+bool buildcache_store(const BuildCache* c, const char* name, const char* filename) {
+  int srcfd = open(filename, O_RDONLY);
+  if (srcfd < 0)
+    return false;
+  bool ok = store(c, name, srcfd, NULL, 0);
+  close(srcfd);
+  return ok;
+}
+
+bool buildcache_store_data(const BuildCache* c, const char* name, const void* data, size_t size) {
+  return store(c, name, -1, data, size);
+}
+
+
+#if R_TESTING_ENABLED
+
+R_TEST(buildcache_key) {
+  auto b = test_build_new();
+  const char* text = "fun main() int { 0 }\n";
+  auto src = memalloct(b->mem, Source);
+  SourceInitMem(src, b->pkg, "a.co", text, strlen(text));
+  PkgAddSource(b->pkg, src);
+
+  BuildCache c1, c2;
+  assert(buildcache_init(&c1, "cache", b, "x86_64-unknown-linux-gnu"));
+  assert(buildcache_init(&c2, "cache", b, "x86_64-unknown-linux-gnu"));
+  asserteq(str_len(c1.key), 40);
+  assert(strcmp(c1.key, c2.key) == 0); // stable
+  buildcache_dispose(&c2);
+
+  // changing an option changes the key
+  b->opt = CoOptFast;
+  assert(buildcache_init(&c2, "cache", b, "x86_64-unknown-linux-gnu"));
+  assert(strcmp(c1.key, c2.key) != 0);
+  buildcache_dispose(&c2);
+  b->opt = CoOptNone;
+  b->thinlto = true;
+  assert(buildcache_init(&c2, "cache", b, "x86_64-unknown-linux-gnu"));
+  assert(strcmp(c1.key, c2.key) != 0);
+  buildcache_dispose(&c2);
+  b->thinlto = false;
+  b->pgo = CoPGOGen;
+  assert(buildcache_init(&c2, "cache", b, "x86_64-unknown-linux-gnu"));
+  assert(strcmp(c1.key, c2.key) != 0);
+  buildcache_dispose(&c2);
+  b->pgo = CoPGONone;
+  b->debuginfo = CoDebugInfoLineTables;
+  assert(buildcache_init(&c2, "cache", b, "x86_64-unknown-linux-gnu"));
+  assert(strcmp(c1.key, c2.key) != 0);
+  buildcache_dispose(&c2);
+  b->debuginfo = CoDebugInfoNone;
+
+  // the number of codegen partitions changes the key of optimized builds, which are split
+  // into that many object files
+  b->opt = CoOptFast;
+  b->cgparts = 2;
+  assert(buildcache_init(&c2, "cache", b, "x86_64-unknown-linux-gnu"));
+  BuildCache c3;
+  b->cgparts = 3;
+  assert(buildcache_init(&c3, "cache", b, "x86_64-unknown-linux-gnu"));
+  assert(strcmp(c2.key, c3.key) != 0);
+  buildcache_dispose(&c2);
+  buildcache_dispose(&c3);
+  b->opt = CoOptNone;
+  assert(buildcache_init(&c2, "cache", b, "x86_64-unknown-linux-gnu"));
+  assert(strcmp(c1.key, c2.key) == 0); // unoptimized builds are never split
+  buildcache_dispose(&c2);
+  b->cgparts = 0;
+
+  // changing the target changes the key
+  assert(buildcache_init(&c2, "cache", b, "aarch64-unknown-linux-gnu"));
+  assert(strcmp(c1.key, c2.key) != 0);
+  buildcache_dispose(&c2);
+
+  // changing source contents changes the key
+  const char* text2 = "fun main() int { 1 }\n";
+  src->body = (const u8*)text2;
+  assert(buildcache_init(&c2, "cache", b, "x86_64-unknown-linux-gnu"));
+  assert(strcmp(c1.key, c2.key) != 0);
+  buildcache_dispose(&c2);
+
+  buildcache_dispose(&c1);
+  SourceDispose(src);
+  test_build_free(b);
+}
+
+
+// write_testfile writes a file named name in dir with the contents of text.
+// Returns the path of the file; caller should str_free it.
+static Str write_testfile(const char* dir, const char* name, const char* text) {
+  Str path = path_join(dir, name);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  assert(fd > -1);
+  asserteq(write(fd, text, strlen(text)), (ssize_t)strlen(text));
+  close(fd);
+  return path;
+}
+
+R_TEST(buildcache_key_pgo) {
+  char dir[] = "/tmp/co-buildcache-test.XXXXXX";
+  assertnotnull(mkdtemp(dir));
+  auto b = test_build_new();
+  const char* text = "fun main() int { 0 }\n";
+  auto src = memalloct(b->mem, Source);
+  SourceInitMem(src, b->pkg, "a.co", text, strlen(text));
+  PkgAddSource(b->pkg, src);
+  Str prof1 = write_testfile(dir, "a.profdata", "profile 1");
+  Str prof2 = write_testfile(dir, "b.profdata", "profile 2");
+  Str prof3 = write_testfile(dir, "c.profdata", "profile 1");
+
+  // the key of a build optimized with a profile depends on the contents of the profile,
+  // not on its filename
+  b->pgo = CoPGOUse;
+  b->pgofile = prof1;
+  BuildCache c1, c2;
+  assert(buildcache_init(&c1, "cache", b, "x86_64-unknown-linux-gnu"));
+  b->pgofile = prof2;
+  assert(buildcache_init(&c2, "cache", b, "x86_64-unknown-linux-gnu"));
+  assert(strcmp(c1.key, c2.key) != 0);
+  buildcache_dispose(&c2);
+  b->pgofile = prof3;
+  assert(buildcache_init(&c2, "cache", b, "x86_64-unknown-linux-gnu"));
+  assert(strcmp(c1.key, c2.key) == 0);
+  buildcache_dispose(&c2);
+
+  // a profile which is updated in place changes the key
+  str_free(write_testfile(dir, "c.profdata", "profile 3"));
+  assert(buildcache_init(&c2, "cache", b, "x86_64-unknown-linux-gnu"));
+  assert(strcmp(c1.key, c2.key) != 0);
+  buildcache_dispose(&c2);
+
+  // a profile which can't be read is an error
+  unlink(prof3);
+  assert(!buildcache_init(&c2, "cache", b, "x86_64-unknown-linux-gnu"));
+
+  // an instrumented build depends on the name of the profile it writes, not on its contents
+  b->pgo = CoPGOGen;
+  b->pgofile = prof1;
+  assert(buildcache_init(&c2, "cache", b, "x86_64-unknown-linux-gnu"));
+  assert(strcmp(c1.key, c2.key) != 0);
+  BuildCache c3;
+  b->pgofile = prof2;
+  assert(buildcache_init(&c3, "cache", b, "x86_64-unknown-linux-gnu"));
+  assert(strcmp(c2.key, c3.key) != 0);
+  buildcache_dispose(&c2);
+  buildcache_dispose(&c3);
+
+  buildcache_dispose(&c1);
+  unlink(prof1);
+  unlink(prof2);
+  rmdir(dir);
+  str_free(prof1);
+  str_free(prof2);
+  str_free(prof3);
+  SourceDispose(src);
+  test_build_free(b);
+}
+
+R_TEST(buildcache_store) {
+  char rootdir[] = "/tmp/co-buildcache-test.XXXXXX";
+  assertnotnull(mkdtemp(rootdir));
+  auto b = test_build_new();
+  BuildCache c;
+  assert(buildcache_init(&c, rootdir, b, "x86_64-unknown-linux-gnu"));
+  assert(!buildcache_has(&c, "pkg.o"));
+  assert(buildcache_store_data(&c, "pkg.o", "hello", 5));
+  assert(buildcache_has(&c, "pkg.o"));
+  assertnull(buildcache_load(&c, "pkg.objs"));
+  Str data = buildcache_load(&c, "pkg.o");
+  assertnotnull(data);
+  asserteq(str_len(data), 5);
+  assert(memcmp(data, "hello", 5) == 0);
+  str_free(data);
+
+  Str path = buildcache_path(&c, "pkg.o");
+  char buf[8];
+  int fd = open(path, O_RDONLY);
+  assert(fd > -1);
+  asserteq(read(fd, buf, sizeof(buf)), 5);
+  assert(memcmp(buf, "hello", 5) == 0);
+  close(fd);
+  unlink(path);
+  str_free(path);
+
+  rmdir(c.dir);
+  Str fanout = path_dir(c.dir);
+  rmdir(fanout);
+  str_free(fanout);
+  rmdir(rootdir);
+  buildcache_dispose(&c);
+  test_build_free(b);
+}
+
+#endif /* R_TESTING_ENABLED */
@@ -0,0 +1,44 @@
+#pragma once
+#include "build.h"
+
+ASSUME_NONNULL_BEGIN
+
+// BuildCache is a content-addressed store of build products, rooted in a directory
+// like COCACHE. Each entry is a directory named by a key which is derived from the
+// contents of a package's sources, the compiler and the build options:
+//   <root>/<key[0:2]>/<key>/<name>
+typedef struct BuildCache {
+  Str key; // hex-encoded SHA-1 key of the build
+  Str dir; // directory of the cache entry
+} BuildCache;
+
+// buildcache_init computes the cache key for b (targeting triple) and initializes cache
+// for the entry in rootdir. Source bodies of b->pkg, and the profile of a CoPGOUse build,
+// are opened and checksummed.
+// Returns false on I/O error (check errno).
+bool buildcache_init(BuildCache*, const char* rootdir, const Build* b, const char* triple);
+
+// buildcache_dispose frees memory used by cache
+void buildcache_dispose(BuildCache*);
+
+// buildcache_path returns the path of product name (e.g. "pkg.o") in the cache entry.
+// Caller should str_free the result.
+Str buildcache_path(const BuildCache*, const char* name);
+
+// buildcache_has returns true if the cache entry contains a product name
+bool buildcache_has(const BuildCache*, const char* name);
+
+// buildcache_load returns the contents of product name in the cache entry, or NULL if
+// there is no such product or it can't be read (check errno.)
+// Caller should str_free the result.
+Str nullable buildcache_load(const BuildCache*, const char* name);
+
+// buildcache_store copies file at filename into the cache entry as name.
+// The product appears atomically; concurrent builds never see a partial file.
+bool buildcache_store(const BuildCache*, const char* name, const char* filename);
+
+// buildcache_store_data stores size bytes at data in the cache entry as name.
+// Like buildcache_store, the product appears atomically.
+bool buildcache_store_data(const BuildCache*, const char* name, const void* data, size_t size);
+
+ASSUME_NONNULL_END
@@ -1,4 +1,5 @@
 #include "common.h"
+#include "cache.h"
 #include "parse/parse.h"
 #include "ir/ir.h"
 #include "ir/irbuilder.h"
@@ -28,13 +29,15 @@ static const char* COCACHE = NULL; // directory for build cache. default: COPATH
 // rtimer helpers
 #define ENABLE_RTIMER_LOGGING
 #ifdef ENABLE_RTIMER_LOGGING
-  #define RTIMER_INIT          RTimer rtimer_ = {0}
-  #define RTIMER_START()       rtimer_start(&rtimer_)
-  #define RTIMER_LOG(fmt, ...) rtimer_log(&rtimer_, fmt, ##__VA_ARGS__)
+  #define RTIMER_INIT           RTimer rtimer_ = {0}
+  #define RTIMER_START()        rtimer_start(&rtimer_)
+  #define RTIMER_LOG(fmt, ...)  rtimer_log(&rtimer_, fmt, ##__VA_ARGS__)
+  #define RTIMER_RECORD(arrayp) (rtimer_.records = (arrayp)) // record durations in arrayp
 #else
-  #define RTIMER_INIT          do{}while(0)
-  #define RTIMER_START()       do{}while(0)
-  #define RTIMER_LOG(fmt, ...) do{}while(0)
+  #define RTIMER_INIT           do{}while(0)
+  #define RTIMER_START()        do{}while(0)
+  #define RTIMER_LOG(fmt, ...)  do{}while(0)
+  #define RTIMER_RECORD(arrayp) do{}while(0)
 #endif
 
 #ifdef DEBUG
@@ -77,14 +80,288 @@ static void diag_handler(Diagnostic* d, void* userdata) {
 }
 
 
+#ifdef CO_WITH_LLVM
+// Object files of a build are stored in the build cache as pkg.o, pkg.1.o, pkg.2.o, ...
+// (one per codegen partition; see Build.cgparts.) CACHED_OBJS lists their names, one per
+// line, and is stored last so that an entry which has it is complete.
+#define CACHED_OBJS "pkg.objs"
+
+static Str cached_obj_name(u32 partition) {
+  return partition == 0 ? str_fmt("pkg.o") : str_fmt("pkg.%u.o", partition);
+}
+
+// store_cached stores the products of a build in the build cache.
+// objv holds the object code of each codegen partition (see llvm_build_and_emit.)
+static bool store_cached(const Build* build, const BuildCache* cache, const Array* objv) {
+  bool ok = true;
+  Str objs = str_new(16 * objv->len);
+  for (u32 i = 0; ok && i < objv->len; i++) {
+    LLVMMemoryBufferRef obj = objv->v[i];
+    Str name = cached_obj_name(i);
+    ok = buildcache_store_data(cache, name, LLVMGetBufferStart(obj), LLVMGetBufferSize(obj));
+    objs = str_appendfmt(objs, "%s\n", name);
+    str_free(name);
+  }
+  if (ok && (build->emit & CoEmitBC)) {
+    Str filename = build_outpath(build, ".bc");
+    ok = buildcache_store(cache, "pkg.bc", filename);
+    str_free(filename);
+  }
+  if (ok)
+    ok = buildcache_store_data(cache, CACHED_OBJS, objs, str_len(objs));
+  str_free(objs);
+  return ok;
+}
+
+// link_cached links an executable from the object files of a build cache entry, as listed
+// in CACHED_OBJS. With build->thinlto these are ThinLTO bitcode files and lld does the
+// optimization and codegen, reusing unchanged modules from build->ltocache.
+static bool link_cached(Build* build, const BuildCache* cache, const char* triple,
+  const char* exe_file)
+{
+  Str objs = buildcache_load(cache, CACHED_OBJS);
+  if (!objs) {
+    errlog("failed to read %s in build cache %s (%s)", CACHED_OBJS, cache->dir,
+      strerror(errno));
+    return false;
+  }
+  Array inputs;
+  ArrayInit(&inputs);
+  for (const char* s = objs; *s; ) {
+    const char* end = strchr(s, '\n');
+    size_t len = end ? (size_t)(end - s) : strlen(s);
+    if (len > 0) {
+      Str name = str_cpy(s, len);
+      ArrayPush(&inputs, buildcache_path(cache, name), MemHeap);
+      str_free(name);
+    }
+    s += end ? len + 1 : len;
+  }
+  str_free(objs);
+  CoLLDOptions lldopt = {
+    .targetTriple = triple,
+    .opt = build->opt,
+    .outfile = exe_file,
+    .infilec = inputs.len,
+    .infilev = (const char**)inputs.v,
+    .thinlto = build->thinlto,
+    .ltocachedir = build->ltocache,
+    .profrt = build->pgo == CoPGOGen,
+  };
+  char* errmsg;
+  bool ok = lld_link(&lldopt, &errmsg);
+  if (!ok) {
+    errlog("lld_link: %s", errmsg);
+  } else if (strlen(errmsg) > 0) {
+    fwrite(errmsg, strlen(errmsg), 1, stderr); // print warnings
+  }
+  LLVMDisposeMessage(errmsg);
+  for (u32 i = 0; i < inputs.len; i++)
+    str_free(inputs.v[i]);
+  ArrayFree(&inputs, MemHeap);
+  return ok;
+}
+
+static bool is_profraw(const char* filename) {
+  size_t len = strlen(filename);
+  return len >= 8 && strcmp(filename + len - 8, ".profraw") == 0;
+}
+
+// pgo_use_profile sets up build to optimize with the profiles in the comma-separated list
+// of files pgouse. A single .profdata file is used as is. Otherwise the profiles (e.g. one
+// .profraw file for each run of an instrumented program) are merged into
+// build_outpath(build, ".profdata") which is then used.
+static bool pgo_use_profile(Build* build, const char* pgouse) {
+  Array files;
+  ArrayInit(&files);
+  for (const char* s = pgouse; *s; ) {
+    const char* end = strchr(s, ',');
+    size_t len = end ? (size_t)(end - s) : strlen(s);
+    if (len > 0)
+      ArrayPush(&files, str_cpy(s, len), MemHeap);
+    s += end ? len + 1 : len;
+  }
+  bool ok = true;
+  if (files.len == 0) {
+    errlog("--pgo-use: no profile");
+    ok = false;
+  } else if (files.len == 1 && !is_profraw(files.v[0])) {
+    if (access(files.v[0], R_OK) != 0) {
+      errlog("%s: %s", (const char*)files.v[0], strerror(errno));
+      ok = false;
+    } else {
+      build->pgofile = files.v[0];
+      files.len = 0; // build owns the string now
+    }
+  } else {
+    Str outfile = build_outpath(build, ".profdata");
+    char* errmsg;
+    ok = llvm_profdata_merge((const char**)files.v, files.len, outfile, &errmsg);
+    if (!ok) {
+      errlog("failed to merge profiles: %s", errmsg);
+      str_free(outfile);
+    } else {
+      if (strlen(errmsg) > 0)
+        fwrite(errmsg, strlen(errmsg), 1, stderr); // print warnings
+      build->pgofile = outfile;
+    }
+    LLVMDisposeMessage(errmsg);
+  }
+  for (u32 i = 0; i < files.len; i++)
+    str_free(files.v[i]);
+  ArrayFree(&files, MemHeap);
+  return ok;
+}
+#endif
+
+
+// write_report writes build->report as JSON to build_outpath(build, ".report.json")
+static bool write_report(const Build* build) {
+  Str filename = build_outpath(build, ".report.json");
+  Str s = build_report_json(build->report, str_new(4096));
+  FILE* fp = fopen(filename, "w");
+  bool ok = fp && fwrite(s, str_len(s), 1, fp) == 1;
+  ok = fp && fclose(fp) == 0 && ok;
+  if (ok) {
+    dlog("wrote report %s", filename);
+  } else {
+    errlog("failed to write %s (%s)", filename, strerror(errno));
+  }
+  str_free(s);
+  str_free(filename);
+  return ok;
+}
+
+
+static const struct { const char* name; CoEmit emit; } kEmitNames[] = {
+  { "exe", CoEmitExe },
+  { "obj", CoEmitObj },
+  { "asm", CoEmitAsm },
+  { "bc",  CoEmitBC },
+  { "ll",  CoEmitLL },
+};
+
+// parse_emit parses a comma-separated list of product names, e.g. "exe,asm"
+static bool parse_emit(const char* s, CoEmit* emit) {
+  *emit = 0;
+  while (*s) {
+    const char* end = strchr(s, ',');
+    size_t len = end ? (size_t)(end - s) : strlen(s);
+    u32 i = 0;
+    for (; i < countof(kEmitNames); i++) {
+      if (strlen(kEmitNames[i].name) == len && memcmp(kEmitNames[i].name, s, len) == 0)
+        break;
+    }
+    if (i == countof(kEmitNames)) {
+      errlog("unknown product \"%.*s\" in --emit (expected exe, obj, asm, bc or ll)",
+        (int)len, s);
+      return false;
+    }
+    *emit |= kEmitNames[i].emit;
+    s += end ? len + 1 : len;
+  }
+  if (*emit == 0) {
+    errlog("--emit: empty list");
+    return false;
+  }
+  return true;
+}
+
+
+// cmd_build implements "build" and "run". Run builds the program in memory and runs its main
+// function in a JIT, exiting with the status main returns.
 int cmd_build(int argc, const char** argv) {
-  if (argc < 3) {
+  bool run = strcmp(argv[1], "run") == 0;
+  const char* buildonlyarg = NULL; // an option which run does not support
+  CoEmit emit = CoEmitExe;
+  const char* outfile = NULL;
+  const char* input = NULL;
+  bool parseonly = false;
+  bool thinlto = false;
+  bool report = false;
+  CoPGO pgo = CoPGONone;
+  const char* pgofile = NULL; // --pgo-gen file or --pgo-use files
+  int debuginfo = -1; // CoDebugInfo; -1 for the default of the optimization level
+  CoOptType opt = CoOptNone;
+  int exitcode = 0;
+  for (int i = 2; i < argc; i++) {
+    const char* arg = argv[i];
+    if (strncmp(arg, "--emit=", 7) == 0) {
+      if (!parse_emit(arg + 7, &emit))
+        return 1;
+      buildonlyarg = arg;
+    } else if (strcmp(arg, "-o") == 0) {
+      if (++i == argc) {
+        errlog("missing filename after -o");
+        return 1;
+      }
+      outfile = argv[i];
+      buildonlyarg = arg;
+    } else if (strcmp(arg, "--pgo-gen") == 0 || strncmp(arg, "--pgo-gen=", 10) == 0) {
+      pgo = CoPGOGen;
+      pgofile = arg[9] == '=' ? arg + 10 : NULL;
+      buildonlyarg = arg;
+    } else if (strncmp(arg, "--pgo-use=", 10) == 0) {
+      pgo = CoPGOUse;
+      pgofile = arg + 10;
+      buildonlyarg = arg;
+    } else if (strcmp(arg, "-O0") == 0) {
+      opt = CoOptNone;
+    } else if (strcmp(arg, "-O") == 0 || strcmp(arg, "-O3") == 0) {
+      opt = CoOptFast;
+      buildonlyarg = arg;
+    } else if (strcmp(arg, "-Os") == 0 || strcmp(arg, "-Oz") == 0) {
+      opt = CoOptSmall;
+      buildonlyarg = arg;
+    } else if (strcmp(arg, "-g") == 0) {
+      debuginfo = CoDebugInfoFull;
+    } else if (strcmp(arg, "-gline-tables-only") == 0) {
+      debuginfo = CoDebugInfoLineTables;
+    } else if (strcmp(arg, "-g0") == 0) {
+      debuginfo = CoDebugInfoNone;
+    } else if (strcmp(arg, "--report") == 0) {
+      report = true;
+      buildonlyarg = arg; // the JIT records no LLVM passes or remarks
+    } else if (strcmp(arg, "--thinlto") == 0) {
+      thinlto = true;
+      buildonlyarg = arg;
+    } else if (strcmp(arg, "--parse-only") == 0) {
+      parseonly = true;
+    } else if (arg[0] == '-' && arg[1] != 0) {
+      errlog("unknown option: %s", arg);
+      return 1;
+    } else if (input) {
+      errlog("unexpected argument: %s", arg);
+      return 1;
+    } else {
+      input = arg;
+    }
+  }
+  if (!input) {
     errlog("missing input");
     return 1;
   }
+  if (run && buildonlyarg) {
+    errlog("%s can not be used with run", buildonlyarg);
+    return 1;
+  }
+  if (pgo == CoPGOUse && opt == CoOptNone) {
+    // a profile only guides optimizations, so it would have no effect
+    errlog("--pgo-use requires an optimized build (-O, -Os or -Oz)");
+    return 1;
+  }
+  #ifndef CO_WITH_LLVM
+  if (run) {
+    errlog("run is not available (built without LLVM)");
+    return 1;
+  }
+  #endif
 
   RTIMER_INIT;
   auto timestart = nanotime();
+  BuildReport buildreport = {0};
+  if (report)
+    RTIMER_RECORD(&buildreport.phases);
 
   Pkg pkg = {
     .mem  = MemHeap,
@@ -99,17 +376,17 @@ int cmd_build(int argc, const char** argv) {
     return 1;
   }
 
-  // guess argument 1 is a directory
-  pkg.dir = argv[2];
+  // guess input is a directory
+  pkg.dir = input;
   RTIMER_START();
   if (!PkgScanSources(&pkg)) {
     if (errno != ENOTDIR)
       panic("%s (errno %d %s)", pkg.dir, errno, strerror(errno));
     // guessed wrong; it's probably a file
     errno = 0; // clear errno to make errlog messages sane
-    pkg.dir = path_dir(argv[2]);
-    if (!PkgAddFileSource(&pkg, argv[2]))
-      panic("%s (errno %d %s)", argv[2], errno, strerror(errno));
+    pkg.dir = path_dir(input);
+    if (!PkgAddFileSource(&pkg, input))
+      panic("%s (errno %d %s)", input, errno, strerror(errno));
   }
   RTIMER_LOG("find source files");
 
@@ -117,36 +394,80 @@ int cmd_build(int argc, const char** argv) {
   RTIMER_START();
   SymPool syms = {0};
   sympool_init(&syms, universe_syms(), MemHeap, NULL);
-  Mem astmem = MemHeap; // allocate AST in global memory pool
-  //Mem astmem = MemLinearAlloc(1024/*pages*/); // allocate AST in a linear slab of memory
   Build build = {0};
-  build_init(&build, astmem, &syms, &pkg, diag_handler, NULL);
+  build_init(&build, MemHeap, &syms, &pkg, diag_handler, NULL); // AST in build.arena
   build.debug = true; // include debug info
-  // build.opt = CoOptFast;
+  build.opt = opt;
+  if (debuginfo < 0) {
+    // line tables are cheap and keep stack traces and profiles of optimized code useful
+    debuginfo = build.opt == CoOptNone ? CoDebugInfoFull : CoDebugInfoLineTables;
+  }
+  build.debuginfo = (CoDebugInfo)debuginfo;
+  build.emit = emit;
+  if (outfile)
+    build.outfile = outfile;
+  if (thinlto) {
+    build.thinlto = true;
+    build.ltocache = path_join(COCACHE, "thinlto");
+  }
+  build.pgo = pgo;
+  if (report)
+    build.report = &buildreport;
+  if (pgo == CoPGOGen)
+    build.pgofile = pgofile;
   RTIMER_LOG("init build state");
 
+  // skip straight to linking if the build cache has an object for this exact build.
+  // The cache only holds object files, so this is only possible when we just need to link.
+  #ifdef CO_WITH_LLVM
+    RTIMER_START();
+    const char* triple = llvm_init_targets(); // host
+    RTIMER_LOG("init llvm targets");
+    if (pgo == CoPGOUse) {
+      RTIMER_START();
+      if (!pgo_use_profile(&build, pgofile))
+        return 1;
+      RTIMER_LOG("read profile %s", build.pgofile);
+    }
+    BuildCache cache;
+    RTIMER_START();
+    if (!buildcache_init(&cache, COCACHE, &build, triple)) {
+      errlog("failed to read sources of %s (%s)", pkg.dir, strerror(errno));
+      return 1;
+    }
+    bool cachehit = buildcache_has(&cache, CACHED_OBJS);
+    RTIMER_LOG("build cache %s %s", cachehit ? "hit" : "miss", cache.key);
+    if (cachehit && build.emit == CoEmitExe && !parseonly && !run) {
+      RTIMER_START();
+      bool ok = link_cached(&build, &cache, triple, build.outfile);
+      buildcache_dispose(&cache);
+      if (!ok)
+        return 1;
+      RTIMER_LOG("lld link executable %s", build.outfile);
+      goto end;
+    }
+  #endif
+
   // setup package namespace and create package AST node
   Scope* pkgscope = ScopeNew(GetGlobalScope(), build.mem);
   Node* pkgnode = CreatePkgAST(&build, pkgscope);
 
   // parse source files
   RTIMER_START();
-  Source* src = pkg.srclist;
-  Parser parser = {0};
-  while (src) {
-    Node* filenode = Parse(&parser, &build, src, ParseFlagsDefault, pkgscope);
-    if (!filenode)
-      return 1;
-    NodeArrayAppend(build.mem, &pkgnode->cunit.a, filenode);
-    NodeTransferUnresolved(pkgnode, filenode);
-    src = src->next;
-  }
+  if (!ParsePkg(&build, pkgnode, ParseFlagsDefault, /*nthreads*/0))
+    return 1;
   RTIMER_LOG("parse");
   dump_ast("", pkgnode);
   if (build.errcount) {
     errlog("%u %s", build.errcount, build.errcount == 1 ? "error" : "errors");
     return 1;
   }
+  if (parseonly) {
+    #ifdef CO_WITH_LLVM
+    buildcache_dispose(&cache);
+    #endif
+    goto end;
+  }
 
   // validate AST produced by parser
   #ifdef DEBUG
@@ -208,6 +529,11 @@ int cmd_build(int argc, const char** argv) {
     if (!NodeValidate(&build, pkgnode, NodeValidateMissingTypes))
       return 1;
     dlog("AST validated OK");
+    MemArenaStats memstats;
+    memarena_stats(&build.arena, &memstats);
+    dlog("AST memory: %zu kB (peak %zu kB) in %u chunks of %zu kB total, %u sub-arenas",
+      memstats.nbytes / 1024, memstats.peak / 1024, memstats.nchunks,
+      memstats.chunkbytes / 1024, memstats.nsubs);
   #endif
 
   //goto end; // XXX
@@ -231,18 +557,33 @@ int cmd_build(int argc, const char** argv) {
     RTIMER_START();
 
     // build.safe = false;
-    #if 0
-    // JIT
-    //build.opt = CoOptFast;
-    llvm_jit(&build, pkgnode);
-    #else
+    // build.cgparts = 1; // disable parallel codegen
+    Array objv; // LLVMMemoryBufferRef
+    ArrayInit(&objv);
+    if (run) {
+      // JIT
+      buildcache_dispose(&cache);
+      if (!llvm_jit(&build, pkgnode, COCACHE, NULL, &exitcode))
+        return 1;
+      RTIMER_LOG("llvm total");
+      goto end;
+    }
     // Build native executable
-    // build.opt = CoOptFast;
-    if (!llvm_build_and_emit(&build, pkgnode, NULL/*target=host*/)) {
+    CoLLVMBackend* backend = llvm_backend_create();
+    bool ok = llvm_build_and_emit(backend, &build, pkgnode, triple, &objv);
+    llvm_backend_dispose(backend);
+    if (!ok)
       return 1;
-    }
-    #endif
     RTIMER_LOG("llvm total");
+
+    // store products in the build cache. Failure is not fatal; the next build just misses.
+    if (!store_cached(&build, &cache, &objv)) {
+      errlog("failed to update build cache %s (%s)", cache.dir, strerror(errno));
+    }
+    buildcache_dispose(&cache);
+    for (u32 i = 0; i < objv.len; i++)
+      LLVMDisposeMemoryBuffer(objv.v[i]);
+    ArrayFree(&objv, MemHeap);
   #endif
 
 
@@ -258,21 +599,59 @@ int cmd_build(int argc, const char** argv) {
 
   // ————————————————————————————————
   UNUSED /* label */ end:
-  {
+  if (!run) {
     // print how much (real) time we spent
     auto timeend = nanotime();
     char abuf[40];
     auto buflen = fmtduration(abuf, countof(abuf), timeend - timestart);
     printf("done in %.*s (real time)\n", buflen, abuf);
   }
-  return 0;
+  if (build.report) {
+    write_report(&build);
+    build_report_dispose(build.report);
+  }
+  build_dispose(&build);
+  return exitcode;
 }
 
 int main_usage(const char* arg0, int exit_code) {
   fprintf(exit_code == 0 ? stdout : stderr,
-    "usage: %s build <srcdir>\n"
-    "       %s build <srcfile> <outfile>\n"
+    "usage: %s build [options] <srcdir>|<srcfile>\n"
+    "       %s run [options] <srcdir>|<srcfile>\n"
     "       %s help\n"
+    "build options:\n"
+    "  --emit=<products>  Comma-separated list of products to emit. Default: exe\n"
+    "                     exe  executable\n"
+    "                     obj  object file (.o)\n"
+    "                     asm  assembly (.s)\n"
+    "                     bc   LLVM bitcode (.bc)\n"
+    "                     ll   LLVM IR text (.ll)\n"
+    "  -o <file>          Write executable to <file>. Other products are named by\n"
+    "                     replacing the extension of <file>. Default: out1.exe\n"
+    "  -O, -O3            Optimize for speed, generating code in parallel\n"
+    "  -Os, -Oz           Optimize for size, generating code in parallel\n"
+    "  -O0                Do not optimize. Default\n"
+    "  --thinlto          Use ThinLTO: optimize across modules when linking, caching\n"
+    "                     the result of each module in $COCACHE/thinlto\n"
+    "  --pgo-gen[=<file>] Instrument the executable to write a profile to <file> when\n"
+    "                     run, for --pgo-use. Default: default.profraw\n"
+    "                     Build with the -O level the profile will be used with.\n"
+    "  --pgo-use=<files>  Optimize with comma-separated profiles (.profraw or .profdata)\n"
+    "                     Requires -O, -Os or -Oz.\n"
+    "                     Several profiles or .profraw are merged into a .profdata\n"
+    "                     file named like the executable.\n"
+    "  -g                 Emit full debug info: line tables, functions and variables.\n"
+    "                     Default for unoptimized builds\n"
+    "  -gline-tables-only Emit debug info for source locations only. Default for\n"
+    "                     optimized builds\n"
+    "  -g0                Emit no debug info\n"
+    "  --report           Write phase and LLVM pass timings, time spent per function and\n"
+    "                     missed inlining and vectorization remarks as JSON to a\n"
+    "                     .report.json file named like the executable\n"
+    "  --parse-only       Stop after parsing (see misc/bench-startup.sh)\n"
+    "run compiles the program in memory with a JIT, caching code in $COCACHE/jit, and\n"
+    "runs it, exiting with the status returned by main. It accepts the build options\n"
+    "-O0, -g, -gline-tables-only, -g0 and --parse-only.\n"
     "",
     arg0,
     arg0,
@@ -323,6 +702,12 @@ static bool init(const char* argv0) {
 }
 
 int main(int argc, const char** argv) {
+  #ifdef CO_WITH_LLVM
+    // helper process of an isolated link
+    if (argc > 1 && strcmp(argv[1], LLD_HELPER_CMD) == 0)
+      return lld_helper_main(argc - 2, argv + 2);
+  #endif
+
   #if R_TESTING_ENABLED
     if (testing_main(1, argv) != 0)
       return 1;
@@ -336,7 +721,7 @@ int main(int argc, const char** argv) {
   if (argc < 2)
     return main_usage(argv[0], 1);
 
-  if (strcmp(argv[1], "build") == 0)
+  if (strcmp(argv[1], "build") == 0 || strcmp(argv[1], "run") == 0)
     return cmd_build(argc, argv);
 
   // help | -h* | --help
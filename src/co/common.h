@@ -49,3 +49,13 @@
   //   memfree(MemHeap, a);
   // }
 #endif
+
+#if R_TESTING_ENABLED
+// co_bench_enabled returns true if benchmarks should run. Benchmarks are R_TESTs which return
+// right away unless the environment variable CO_BENCH is set (to anything but "0"), e.g.
+//   CO_BENCH=1 ./test_colib -testonly
+inline static bool co_bench_enabled() {
+  const char* s = getenv("CO_BENCH");
+  return s && *s && strcmp(s, "0") != 0;
+}
+#endif
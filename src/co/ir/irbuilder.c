@@ -947,7 +947,7 @@ static IRFun* ast_add_fun(IRBuilder* u, Node* n) {
   u32 nparams = 0;
   if (params)
     nparams = params->kind == NTuple ? params->array.a.len : 1;
-  f = IRFunNew(u->mem, n->type->t.id, n->fun.name, n->pos, nparams);
+  f = IRFunNew(u->mem, GetTypeID(u->build, n->type), n->fun.name, n->pos, nparams);
   auto entryb = IRBlockNew(f, IRBlockCont, n->pos);
 
   // Since functions can be self-referential, add the function before we generate its body
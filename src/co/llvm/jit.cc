@@ -90,4 +90,139 @@ void jit_addmodule(CoJIT* jit, LLVMModuleRef M) {
     j.ES.getMainJITDylib(),
     ThreadSafeModule(std::move(module), j.ctx)));
 }
-*/
\ No newline at end of file
+*/
+
+// —— object cache ——
+//
+// JITObjectCache stores objects compiled by the JIT in a directory, keyed on the SHA-1 of the
+// module's bitcode and the identity of the target machine which compiled it:
+//   <dir>/<key[0:2]>/<key>.o
+// SimpleCompiler calls getObject before compiling a module and notifyObjectCompiled after,
+// so a module which has been compiled before for the same target machine is never codegen'd.
+
+using namespace llvm;
+
+class JITObjectCache final : public ObjectCache {
+  std::string                          dir;
+  std::string                          tmid; // target machine identity
+  CoLLVMJITCacheStats* nullable        stats;
+  std::mutex                           mu;
+  DenseMap<const Module*, std::string> pending; // module => path, between getObject & notify
+
+public:
+  JITObjectCache(StringRef dir, const TargetMachine& TM, CoLLVMJITCacheStats* nullable stats)
+    : dir(dir.str()), stats(stats)
+  {
+    raw_string_ostream s(tmid);
+    s << LLVM_VERSION_STRING << '\0'
+      << TM.getTargetTriple().str() << '\0'
+      << TM.getTargetCPU() << '\0'
+      << TM.getTargetFeatureString() << '\0'
+      << (int)TM.getOptLevel() << '\0'
+      << (int)TM.getRelocationModel();
+    s.flush();
+  }
+
+  std::unique_ptr<MemoryBuffer> getObject(const Module* M) override {
+    std::string path = objpath(*M);
+    auto buf = MemoryBuffer::getFile(path, /*IsText*/false, /*RequiresNullTerminator*/false);
+    std::lock_guard<std::mutex> lock(mu);
+    if (buf) {
+      if (stats)
+        stats->hits++;
+      return std::move(*buf);
+    }
+    if (stats)
+      stats->misses++;
+    pending[M] = std::move(path);
+    return nullptr;
+  }
+
+  void notifyObjectCompiled(const Module* M, MemoryBufferRef obj) override {
+    std::string path;
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      auto it = pending.find(M);
+      if (it == pending.end())
+        return;
+      path = std::move(it->second);
+      pending.erase(it);
+    }
+    // Write to a temporary file which is renamed into place so that concurrent runs
+    // never see a partial object. Failure is not fatal; the next run just misses.
+    if (sys::fs::create_directories(sys::path::parent_path(path)))
+      return;
+    int fd;
+    SmallString<128> tmppath;
+    if (sys::fs::createUniqueFile(path + ".tmp%%%%%%", fd, tmppath))
+      return;
+    {
+      raw_fd_ostream f(fd, /*shouldClose*/true);
+      f << obj.getBuffer();
+      f.close();
+      if (f.has_error()) {
+        f.clear_error();
+        sys::fs::remove(tmppath);
+        return;
+      }
+    }
+    if (sys::fs::rename(tmppath, path))
+      sys::fs::remove(tmppath);
+  }
+
+private:
+  // objpath returns the path of the cache entry for M.
+  // The key must be computed before codegen, which modifies M.
+  std::string objpath(const Module& M) {
+    SmallVector<char, 0> bc;
+    raw_svector_ostream bcs(bc);
+    WriteBitcodeToFile(M, bcs);
+    SHA1 sha1;
+    sha1.update(tmid);
+    sha1.update(ArrayRef<uint8_t>((const uint8_t*)bc.data(), bc.size()));
+    std::string key = toHex(sha1.final(), /*LowerCase*/true);
+    SmallString<128> path(dir);
+    sys::path::append(path, key.substr(0, 2), key + ".o");
+    return std::string(path.str());
+  }
+};
+
+
+// JITCachingCompiler is a SimpleCompiler which owns its target machine and object cache
+class JITCachingCompiler final : public orc::SimpleCompiler {
+  std::unique_ptr<TargetMachine> TM;
+  JITObjectCache                 cache;
+public:
+  JITCachingCompiler(
+    std::unique_ptr<TargetMachine> tm, StringRef dir, CoLLVMJITCacheStats* nullable stats)
+    : orc::SimpleCompiler(*tm, &cache)
+    , TM(std::move(tm))
+    , cache(dir, *TM, stats)
+  {}
+};
+
+
+LLVMErrorRef llvm_jit_create(
+  LLVMOrcLLJITRef* result, const char* nullable cachedir, CoLLVMJITCacheStats* nullable stats)
+{
+  orc::LLJITBuilder builder;
+  if (cachedir) {
+    std::string dir = cachedir;
+    builder.setCompileFunctionCreator(
+      [dir, stats](orc::JITTargetMachineBuilder JTMB)
+        -> Expected<std::unique_ptr<orc::IRCompileLayer::IRCompiler>>
+      {
+        auto TM = JTMB.createTargetMachine();
+        if (!TM)
+          return TM.takeError();
+        return std::make_unique<JITCachingCompiler>(std::move(*TM), dir, stats);
+      });
+  }
+  auto J = builder.create();
+  if (!J) {
+    *result = nullptr;
+    return wrap(J.takeError());
+  }
+  *result = reinterpret_cast<LLVMOrcLLJITRef>(J->release());
+  return nullptr;
+}
@@ -1,7 +1,24 @@
 #include "../common.h"
 #include "llvm.h"
 #include "llvm-includes.hh"
+#include <deque>
 #include <sstream>
+#if defined(__linux__)
+  #include <sys/mman.h> // memfd_create
+#endif
+#if !defined(_WIN32)
+  #include <fcntl.h>
+  #include <spawn.h>
+  #include <sys/wait.h>
+  #include <unistd.h>
+  extern char** environ;
+#endif
+
+// CO_LLVM_PREFIX is the directory LLVM is installed in, which has the compiler-rt runtime
+// libraries (see misc/build-llvm.sh)
+#ifndef CO_LLVM_PREFIX
+  #define CO_LLVM_PREFIX "deps/llvm"
+#endif
 
 // DEBUG_LLD_INVOCATION: define to print arguments used for linker invocations to stderr
 //#define DEBUG_LLD_INVOCATION
@@ -18,33 +35,207 @@ using namespace llvm;
 //   wasm-ld (WebAssembly)
 
 
-// Sooooo lld's memory may become corrupt and requires a restart of the program.
-// _lld_is_corrupt tracks this state. See lld::safeLldMain in lld/tools/lld/lld.cpp
-static const char* _lld_is_corrupt = NULL;
+// lld keeps its state (configuration, symbol table, arenas etc) in globals, so only one
+// link can run in a process at a time. _lld_mu serializes links and guards _lld_is_corrupt.
+// When links are isolated (see lld_set_isolated) each link runs in a helper process instead.
+static std::mutex        _lld_mu;
+static std::atomic<bool> _lld_isolated{false};
 
-
-static void _set_lld_is_corrupt(int errcode) {
-  if (_lld_is_corrupt == NULL) {
-    size_t bufcap = 128;
-    char* buf = (char*)malloc(bufcap);
-    snprintf(buf, bufcap, "lld crashed with exception code %d", errcode);
-    _lld_is_corrupt = buf;
-  }
-}
+// Sooooo lld's memory may become corrupt when it crashes and lld can't be used again in this
+// process. _lld_is_corrupt tracks this state; once set, links run in helper processes (like
+// isolated links) instead. See lld::safeLldMain in lld/tools/lld/lld.cpp
+static bool _lld_is_corrupt = false;
 
 typedef bool(*LinkFun)(
   llvm::ArrayRef<const char*> args, bool canExitEarly,
   llvm::raw_ostream &stdoutOS, llvm::raw_ostream &stderrOS);
 
-// _link is a helper wrapper for calling the various object-specific linker functions
+
+// _run_link calls linkf and then resets lld's global state.
 // It has been adapted from lld::safeLldMain in lld/tools/lld/lld.cpp
-// Always sets errmsg
-static bool _link(LinkFun linkf, llvm::ArrayRef<const char*> args, char** errmsg) {
-  if (_lld_is_corrupt) {
-    *errmsg = LLVMCreateMessage(_lld_is_corrupt);
+// Returns false and sets *crashcode to a non-zero value if lld crashed.
+static bool _run_link(
+  LinkFun linkf, llvm::ArrayRef<const char*> args, raw_ostream& errout, int* crashcode)
+{
+  bool ok = false;
+  *crashcode = 0;
+  {
+    // The crash recovery is here only to be able to recover from arbitrary
+    // control flow when fatal() is called (through setjmp/longjmp or __try/__except).
+    llvm::CrashRecoveryContext crc;
+    // llvm::errs()
+    const bool exitEarly = false;
+    if (!crc.RunSafely([&]() { ok = linkf(args, exitEarly, llvm::outs(), errout); }))
+      *crashcode = crc.RetCode ? crc.RetCode : 1;
+  }
+
+  // Cleanup memory and reset everything back in pristine condition. This path
+  // is only taken when LLD is in test, or when it is used as a library.
+  llvm::CrashRecoveryContext crc;
+  if (!crc.RunSafely([&]() { lld::errorHandler().reset(); })) {
+    // The memory is corrupted beyond any possible recovery
+    if (*crashcode == 0)
+      *crashcode = crc.RetCode ? crc.RetCode : 1;
+  }
+  return ok && *crashcode == 0;
+}
+
+
+// _link_in_process runs a link in this process.
+// Returns false without linking and sets *corrupt if an earlier link left lld corrupt.
+static bool _link_in_process(
+  LinkFun linkf, llvm::ArrayRef<const char*> args, bool* corrupt, char** errmsg)
+{
+  std::lock_guard<std::mutex> lock(_lld_mu);
+  *corrupt = _lld_is_corrupt;
+  if (_lld_is_corrupt)
+    return false;
+
+  // stderr
+  std::string errstr;
+  raw_string_ostream errout(errstr);
+
+  int crashcode;
+  bool ok = _run_link(linkf, args, errout, &crashcode);
+  if (crashcode != 0) {
+    _lld_is_corrupt = true;
+    errout << "lld crashed with exception code " << crashcode;
+  }
+  *errmsg = LLVMCreateMessage(errout.str().c_str());
+  return ok;
+}
+
+
+#if !defined(_WIN32)
+// _helper_exe returns the path of the executable of this process, which is the helper
+// executable of isolated links (see lld_helper_main.) Returns an empty string if unknown.
+static const std::string& _helper_exe() {
+  static const std::string path =
+    sys::fs::getMainExecutable(nullptr, (void*)(uintptr_t)&lld_helper_main);
+  return path;
+}
+
+#if !defined(__linux__)
+// _set_cloexec sets FD_CLOEXEC on fd
+static bool _set_cloexec(int fd) {
+  int flags = fcntl(fd, F_GETFD);
+  return flags != -1 && fcntl(fd, F_SETFD, flags | FD_CLOEXEC) != -1;
+}
+#endif
+
+// _link_isolated runs a link in a helper process: this process's executable started with
+// posix_spawn, which runs lld_helper_main. Since the helper is a new process, lld starts out
+// with pristine state, any memory the link uses is returned to the OS when the helper exits
+// and links in helpers run concurrently. Unlike fork, posix_spawn is safe in a multithreaded
+// process as it runs no code of this process in the child before exec.
+// infds are the file descriptors of in-memory inputs, named "/proc/self/fd/N" in args.
+// Messages from lld are sent back to this process over a pipe.
+static bool _link_isolated(
+  const char* triple, llvm::ArrayRef<const char*> args, const std::vector<int>& infds,
+  char** errmsg)
+{
+  const std::string& exe = _helper_exe();
+  if (exe.empty()) {
+    *errmsg = LLVMCreateMessage("lld: unable to locate helper executable");
+    return false;
+  }
+
+  // The pipe must not leak into processes spawned concurrently by other threads, which would
+  // keep its write end open and make us wait for them. Without pipe2 there's a short window
+  // in which it can.
+  int fds[2];
+  #if defined(__linux__)
+    bool ok = pipe2(fds, O_CLOEXEC) == 0;
+  #else
+    bool ok = pipe(fds) == 0;
+    if (ok && (!_set_cloexec(fds[0]) || !_set_cloexec(fds[1]))) {
+      ::close(fds[0]);
+      ::close(fds[1]);
+      ok = false;
+    }
+  #endif
+  if (!ok) {
+    *errmsg = LLVMCreateMessage(strerror(errno));
     return false;
   }
 
+  // The helper writes messages to stderr, which is the write end of the pipe, and gets the
+  // in-memory inputs at file descriptors above all of ours so that dup2 doesn't clobber any
+  // of them. dup2 clears FD_CLOEXEC of the new file descriptor; everything else is closed
+  // when the helper executes.
+  int basefd = MAX(fds[0], fds[1]) + 1;
+  for (int fd : infds)
+    basefd = MAX(basefd, fd + 1);
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+  std::deque<std::string> tmpstrings;
+  std::vector<const char*> argv;
+  argv.reserve(args.size() + 4);
+  argv.emplace_back(exe.c_str());
+  argv.emplace_back(LLD_HELPER_CMD);
+  argv.emplace_back(triple);
+  for (const char* arg : args) {
+    for (size_t i = 0; i < infds.size(); i++) {
+      if (("/proc/self/fd/" + std::to_string(infds[i])) == arg) {
+        int childfd = basefd + (int)i;
+        posix_spawn_file_actions_adddup2(&actions, infds[i], childfd);
+        tmpstrings.emplace_back("/proc/self/fd/" + std::to_string(childfd));
+        arg = tmpstrings.back().c_str();
+        break;
+      }
+    }
+    argv.emplace_back(arg);
+  }
+  argv.emplace_back(nullptr);
+
+  llvm::outs().flush(); // the helper shares our stdout
+  pid_t pid;
+  int err = posix_spawn(
+    &pid, exe.c_str(), &actions, nullptr, (char* const*)argv.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  ::close(fds[1]);
+  if (err != 0) {
+    ::close(fds[0]);
+    std::string msg = "lld: failed to start " + exe + ": " + strerror(err);
+    *errmsg = LLVMCreateMessage(msg.c_str());
+    return false;
+  }
+
+  // read messages until the helper exits
+  std::string errstr;
+  char buf[4096];
+  while (1) {
+    ssize_t n = ::read(fds[0], buf, sizeof(buf));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    errstr.append(buf, (size_t)n);
+  }
+  ::close(fds[0]);
+
+  int status = 0;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+  ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  if (WIFSIGNALED(status)) {
+    errstr += "lld crashed with signal " + std::to_string(WTERMSIG(status));
+  } else if (WIFEXITED(status) && WEXITSTATUS(status) == 2 && errstr.size() == 0) {
+    errstr += "lld crashed";
+  }
+  *errmsg = LLVMCreateMessage(errstr.c_str());
+  return ok;
+}
+#endif
+
+
+// _link is a helper wrapper for calling the various object-specific linker functions.
+// infds are the file descriptors of in-memory inputs (see InMemoryInputs.)
+// Always sets errmsg
+static bool _link(
+  LinkFun linkf, const char* triple, llvm::ArrayRef<const char*> args,
+  const std::vector<int>& infds, char** errmsg)
+{
   #ifdef DEBUG_LLD_INVOCATION
   {
     bool first = true;
@@ -62,36 +253,26 @@ static bool _link(LinkFun linkf, llvm::ArrayRef<const char*> args, char** errmsg
   }
   #endif
 
-  // stderr
-  std::string errstr;
-  raw_string_ostream errout(errstr);
-
-  bool ok = false;
-  {
-    // The crash recovery is here only to be able to recover from arbitrary
-    // control flow when fatal() is called (through setjmp/longjmp or __try/__except).
-    llvm::CrashRecoveryContext crc;
-    // llvm::errs()
-    const bool exitEarly = false;
-    if (!crc.RunSafely([&]() { ok = linkf(args, exitEarly, llvm::outs(), errout); }))
-      _set_lld_is_corrupt(crc.RetCode);
+  #if !defined(_WIN32)
+  if (_lld_isolated.load(std::memory_order_relaxed))
+    return _link_isolated(triple, args, infds, errmsg);
+  #endif
+  bool corrupt;
+  bool ok = _link_in_process(linkf, args, &corrupt, errmsg);
+  if (corrupt) {
+    // an earlier link crashed; lld can only be used in a new process from now on
+    #if !defined(_WIN32)
+      return _link_isolated(triple, args, infds, errmsg);
+    #else
+      *errmsg = LLVMCreateMessage("lld crashed earlier and can't be used again");
+    #endif
   }
+  return ok;
+}
 
-  // Cleanup memory and reset everything back in pristine condition. This path
-  // is only taken when LLD is in test, or when it is used as a library.
-  llvm::CrashRecoveryContext crc;
-  if (!crc.RunSafely([&]() { lld::errorHandler().reset(); })) {
-    // The memory is corrupted beyond any possible recovery
-    _set_lld_is_corrupt(crc.RetCode);
-  }
 
-  auto errs = errout.str();
-  if (!ok && errs.size() == 0 && _lld_is_corrupt) {
-    *errmsg = LLVMCreateMessage(_lld_is_corrupt);
-  } else {
-    *errmsg = LLVMCreateMessage(errs.c_str());
-  }
-  return ok;
+void lld_set_isolated(bool enable) {
+  _lld_isolated.store(enable, std::memory_order_relaxed);
 }
 
 
@@ -111,15 +292,72 @@ static LinkFun select_linkfn(Triple& triple, const char** cliname) {
 }
 
 
+// init_targets initializes the targets lld needs to link for triple.
+// lld's COFF driver requires all targets. Other drivers only need the target of the
+// triple (for LTO.)
+static bool init_targets(const Triple& triple, const char* triplestr, char** errmsg) {
+  if (triple.getObjectFormat() == Triple::COFF) {
+    llvm_init_all_targets();
+    return true;
+  }
+  return llvm_init_target(triplestr, errmsg);
+}
+
+
+int lld_helper_main(int argc, const char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <triple> <lld-command> [<arg> ...]\n", LLD_HELPER_CMD);
+    return 1;
+  }
+  Triple triple(Triple::normalize(argv[0]));
+  const char* cliname = "";
+  LinkFun linkfn = select_linkfn(triple, &cliname);
+  if (!linkfn || strcmp(cliname, argv[1]) != 0) {
+    fprintf(stderr, "%s: unexpected linker %s for %s\n", LLD_HELPER_CMD, argv[1], argv[0]);
+    return 1;
+  }
+  char* errmsg;
+  if (!init_targets(triple, argv[0], &errmsg)) {
+    fprintf(stderr, "%s\n", errmsg);
+    LLVMDisposeMessage(errmsg);
+    return 1;
+  }
+  int crashcode;
+  bool ok = _run_link(linkfn, llvm::ArrayRef<const char*>(argv + 1, argc - 1), llvm::errs(),
+    &crashcode);
+  llvm::outs().flush();
+  llvm::errs().flush();
+  return crashcode != 0 ? 2 : ok ? 0 : 1;
+}
+
+
+// kThinLTOCachePolicy limits the size of the ThinLTO cache (see CoLLDOptions.ltocachedir.)
+// Entries are pruned after a week of not being used (the default) or, least recently used
+// first, when the cache grows beyond 1 GB.
+static const char* kThinLTOCachePolicy = "prune_after=168h:cache_size_bytes=1g";
+
+
+// lto_level returns the LTO optimization level ("0" to "3") for opt.
+// lld has no size levels; like clang for -Os and -Oz, CoOptSmall uses level 2.
+static const char* lto_level(CoOptType opt) {
+  switch (opt) {
+    case CoOptNone:  return "0";
+    case CoOptFast:  return "3";
+    case CoOptSmall: return "2";
+  }
+  return "2";
+}
+
 // build_args selects the linker function and adds args according to options and triple.
 // This does not add options.infilev but it does add options.outfile (if not null) as that flag is
 // linker-dependent.
 // tmpstrings is a list of std::strings that should outlive the call to the returned LinkFun.
+// It's a deque since args point into its strings, which must not move when it grows.
 static LinkFun build_args(
   CoLLDOptions&             options,
   Triple&                   triple,
   std::vector<const char*>& args,
-  std::vector<std::string>& tmpstrings)
+  std::deque<std::string>&  tmpstrings)
 {
   auto mktmpstr = [&](std::string&& s) {
     tmpstrings.emplace_back(s);
@@ -151,16 +389,39 @@ static LinkFun build_args(
 
   // linker flavor-specific arguments
   switch (triple.getObjectFormat()) {
-    case Triple::COFF:
+    case Triple::COFF: {
       // flavor=lld-link
-    dlog("TODO: COFF-specific args");
+      dlog("TODO: COFF-specific args");
+      if (options.thinlto) {
+        args.emplace_back(mktmpstr(std::string("/opt:lldlto=") + lto_level(options.opt)));
+        std::string jobs = options.ltojobs ? std::to_string(options.ltojobs) : "all";
+        args.emplace_back(mktmpstr("/opt:lldltojobs=" + jobs));
+        if (options.ltocachedir) {
+          args.emplace_back(mktmpstr(std::string("/lldltocache:") + options.ltocachedir));
+          args.emplace_back(mktmpstr(std::string("/lldltocachepolicy:") + kThinLTOCachePolicy));
+        }
+      }
       break;
+    }
     case Triple::ELF:
-    case Triple::Wasm:
+    case Triple::Wasm: {
       // flavor=ld.lld
       args.emplace_back("--no-pie");
-      args.emplace_back(options.opt == CoOptNone ? "--lto-O0" : "--lto-O3");
+      if (options.thinlto) {
+        // ThinLTO backends (optimization and codegen of each module after the thin link)
+        // run in parallel, and with a cache directory only modules whose imports or
+        // exports changed are compiled again
+        args.emplace_back(mktmpstr(std::string("--lto-O") + lto_level(options.opt)));
+        std::string jobs = options.ltojobs ? std::to_string(options.ltojobs) : "all";
+        args.emplace_back(mktmpstr("--thinlto-jobs=" + jobs));
+        if (options.ltocachedir) {
+          args.emplace_back(mktmpstr(std::string("--thinlto-cache-dir=") + options.ltocachedir));
+          args.emplace_back(
+            mktmpstr(std::string("--thinlto-cache-policy=") + kThinLTOCachePolicy));
+        }
+      }
       break;
+    }
     case Triple::MachO:
       // flavor=ld64.lld
       args.emplace_back("-static");
@@ -207,13 +468,98 @@ static LinkFun build_args(
 }
 
 
+// InMemoryInputs makes object files in memory available to lld, which only reads input
+// files by path. On Linux each buffer is copied to an anonymous memory-backed file
+// (memfd) which lld opens as /proc/self/fd/N, so nothing touches the filesystem. Isolated
+// links pass the memfds on to the helper process (see _link_isolated.)
+// Elsewhere buffers are written to temporary files which are removed after linking, so
+// on macOS and Windows inputs still make the round trip through the filesystem that object
+// files written by codegen did. Avoiding it would take changes to lld: its drivers read
+// every input with MemoryBuffer::getFile and have no way to be handed buffers.
+// A memfd is not faster than a file: it is shmem, like tmpfs, which in a write-then-read
+// loop was as fast as ext4's page cache for objects of up to 64 kB and about half as fast
+// for objects of 1 MB and more. Its benefits are that no file is left behind by a crash
+// and that isolated links can be given the fd. "lld_bench" compares whole links.
+struct InMemoryInputs {
+  std::vector<std::string> paths;
+  std::vector<int>         fds;
+  std::vector<std::string> tmpfiles;
+
+  ~InMemoryInputs() {
+    for (int fd : fds)
+      ::close(fd);
+    for (auto& path : tmpfiles)
+      sys::fs::remove(path);
+  }
+
+  bool add(LLVMMemoryBufferRef buf, char** errmsg) {
+    int fd = -1;
+    #if defined(__linux__) && defined(MFD_CLOEXEC)
+    fd = memfd_create("co-lld-input", MFD_CLOEXEC);
+    if (fd > -1) {
+      fds.push_back(fd); // must stay open until lld has read it
+      paths.emplace_back("/proc/self/fd/" + std::to_string(fd));
+    }
+    #endif
+    bool istmpfile = fd < 0;
+    if (istmpfile) {
+      SmallString<128> path;
+      if (std::error_code EC = sys::fs::createTemporaryFile("co-lld-input", "o", fd, path)) {
+        *errmsg = LLVMCreateMessage(EC.message().c_str());
+        return false;
+      }
+      tmpfiles.emplace_back(path.str());
+      paths.emplace_back(path.str());
+    }
+    raw_fd_ostream f(fd, /*shouldClose*/istmpfile);
+    f << StringRef(LLVMGetBufferStart(buf), LLVMGetBufferSize(buf));
+    f.flush();
+    if (f.has_error()) {
+      std::string msg = "failed to write linker input: " + f.error().message();
+      f.clear_error();
+      *errmsg = LLVMCreateMessage(msg.c_str());
+      return false;
+    }
+    return true;
+  }
+};
+
+
+// profile_rt_path returns the path of compiler-rt's profile runtime library for triple;
+// the library clang links with -fprofile-generate.
+static bool profile_rt_path(const Triple& triple, std::string& path, char** errmsg) {
+  SmallString<128> p(CO_LLVM_PREFIX);
+  sys::path::append(p, "lib", "clang", LLVM_VERSION_STRING, "lib");
+  std::string arch = Triple::getArchTypeName(triple.getArch()).str();
+  if (triple.isOSDarwin()) {
+    sys::path::append(p, "darwin", "libclang_rt.profile_osx.a");
+  } else if (triple.isOSWindows()) {
+    sys::path::append(p, "windows", "clang_rt.profile-" + arch + ".lib");
+  } else {
+    std::string os = Triple::getOSTypeName(triple.getOS()).str();
+    sys::path::append(p, os, "libclang_rt.profile-" + arch + ".a");
+  }
+  path = p.str().str();
+  if (!sys::fs::exists(path)) {
+    std::string msg = "profile runtime library not found: " + path +
+      " (build LLVM with -DCOMPILER_RT_BUILD_PROFILE=ON)";
+    *errmsg = LLVMCreateMessage(msg.c_str());
+    return false;
+  }
+  return true;
+}
+
+
 bool lld_link(CoLLDOptions* optionsptr, char** errmsg) {
   CoLLDOptions& options = *optionsptr;
   Triple triple(Triple::normalize(options.targetTriple));
 
   // arguments to linker and temporary string storage for them
   std::vector<const char*> args;
-  std::vector<std::string> tmpstrings;
+  std::deque<std::string>  tmpstrings;
+
+  if (!init_targets(triple, options.targetTriple, errmsg))
+    return false;
 
   // select linker function and build arguments
   LinkFun linkfn = build_args(options, triple, args, tmpstrings);
@@ -226,8 +572,32 @@ bool lld_link(CoLLDOptions* optionsptr, char** errmsg) {
   for (u32 i = 0; i < options.infilec; i++)
     args.emplace_back(options.infilev[i]);
 
+  // add input files in memory
+  InMemoryInputs inmem;
+  for (u32 i = 0; i < options.inbufc; i++) {
+    if (!inmem.add(options.inbufv[i], errmsg))
+      return false;
+  }
+  for (auto& path : inmem.paths)
+    args.emplace_back(path.c_str());
+
+  // Profile runtime. It writes the counters of instrumented code to a file at exit and is
+  // pulled in by a reference to __llvm_profile_runtime, which instrumented code only has
+  // on Darwin.
+  std::string profrt;
+  if (options.profrt) {
+    if (!profile_rt_path(triple, profrt, errmsg))
+      return false;
+    if (triple.getObjectFormat() == Triple::COFF) {
+      args.emplace_back("/include:__llvm_profile_runtime");
+    } else if (!triple.isOSDarwin()) {
+      args.emplace_back("-u__llvm_profile_runtime");
+    }
+    args.emplace_back(profrt.c_str());
+  }
+
   // invoke linker
-  return _link(linkfn, args, errmsg);
+  return _link(linkfn, options.targetTriple, args, inmem.fds, errmsg);
 }
 
 
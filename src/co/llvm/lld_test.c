@@ -0,0 +1,217 @@
+#include "../common.h"
+#if R_TESTING_ENABLED
+#include "llvm.h"
+
+#if defined(__linux__)
+  #include <unistd.h>
+#else
+  #include <sys/resource.h>
+#endif
+
+// test_objcode creates object code for the host of a program which main function returns 0
+static LLVMMemoryBufferRef test_objcode() {
+  const char* triple = llvm_init_targets();
+  LLVMContextRef ctx = LLVMContextCreate();
+  LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("lld_test", ctx);
+  LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+  LLVMValueRef fn = LLVMAddFunction(mod, "main", LLVMFunctionType(i32, NULL, 0, false));
+  LLVMBuilderRef b = LLVMCreateBuilderInContext(ctx);
+  LLVMPositionBuilderAtEnd(b, LLVMAppendBasicBlockInContext(ctx, fn, "entry"));
+  LLVMBuildRet(b, LLVMConstInt(i32, 0, false));
+  LLVMDisposeBuilder(b);
+
+  char* errmsg;
+  LLVMTargetRef target;
+  if (LLVMGetTargetFromTriple(triple, &target, &errmsg) != 0)
+    panic("LLVMGetTargetFromTriple: %s", errmsg);
+  LLVMTargetMachineRef tm = LLVMCreateTargetMachine(
+    target, triple, "", "", LLVMCodeGenLevelNone, LLVMRelocStatic, LLVMCodeModelDefault);
+  LLVMSetTarget(mod, triple);
+  LLVMMemoryBufferRef obj;
+  if (LLVMTargetMachineEmitToMemoryBuffer(tm, mod, LLVMObjectFile, &errmsg, &obj) != 0)
+    panic("LLVMTargetMachineEmitToMemoryBuffer: %s", errmsg);
+  LLVMDisposeTargetMachine(tm);
+  LLVMDisposeModule(mod);
+  LLVMContextDispose(ctx);
+  return obj;
+}
+
+// test_link1 links obj into an executable at outfile. If objfile is not NULL, obj is first
+// written to objfile which lld then reads, rather than passing obj to lld in memory.
+static bool test_link1(
+  LLVMMemoryBufferRef obj, const char* nullable objfile, const char* outfile)
+{
+  CoLLDOptions opt = {
+    .targetTriple = llvm_init_targets(),
+    .opt = CoOptNone,
+    .outfile = outfile,
+  };
+  if (objfile) {
+    FILE* fp = fopen(objfile, "wb");
+    if (!fp || fwrite(LLVMGetBufferStart(obj), LLVMGetBufferSize(obj), 1, fp) != 1)
+      panic("failed to write %s", objfile);
+    fclose(fp);
+    opt.infilec = 1;
+    opt.infilev = &objfile;
+  } else {
+    opt.inbufc = 1;
+    opt.inbufv = &obj;
+  }
+  char* errmsg;
+  bool ok = lld_link(&opt, &errmsg);
+  if (!ok)
+    errlog("lld_link: %s", errmsg);
+  LLVMDisposeMessage(errmsg);
+  return ok;
+}
+
+static bool test_link(LLVMMemoryBufferRef obj, const char* outfile) {
+  return test_link1(obj, NULL, outfile);
+}
+
+typedef struct LinkThreadArgs {
+  LLVMMemoryBufferRef obj;
+  u32                 nlinks;
+  u32                 nfail;
+  char                outfile[64];
+} LinkThreadArgs;
+
+static int link_thread(void* arg) {
+  LinkThreadArgs* a = arg;
+  for (u32 i = 0; i < a->nlinks; i++) {
+    if (!test_link(a->obj, a->outfile))
+      a->nfail++;
+  }
+  unlink(a->outfile);
+  return 0;
+}
+
+// test_link_concurrently links nlinks times in each of nthreads threads.
+// Returns the number of failed links.
+static u32 test_link_concurrently(LLVMMemoryBufferRef obj, u32 nthreads, u32 nlinks) {
+  LinkThreadArgs argv[8];
+  thrd_t threads[8];
+  assert(nthreads <= countof(threads));
+  for (u32 i = 0; i < nthreads; i++) {
+    argv[i] = (LinkThreadArgs){ .obj = obj, .nlinks = nlinks };
+    snprintf(argv[i].outfile, sizeof(argv[i].outfile), "/tmp/co-lld-test-%d-%u.exe",
+      (int)getpid(), i);
+    asserteq(thrd_create(&threads[i], link_thread, &argv[i]), thrd_success);
+  }
+  u32 nfail = 0;
+  for (u32 i = 0; i < nthreads; i++) {
+    thrd_join(threads[i], NULL);
+    nfail += argv[i].nfail;
+  }
+  return nfail;
+}
+
+
+R_TEST(lld_link_concurrent) {
+  // lld_link serializes concurrent in-process links; all of them succeed
+  LLVMMemoryBufferRef obj = test_objcode();
+  asserteq(test_link_concurrently(obj, 4, 2), 0);
+  LLVMDisposeMemoryBuffer(obj);
+}
+
+
+#if !defined(_WIN32)
+R_TEST(lld_link_isolated) {
+  // isolated links run in helper processes (this test executable, see lld_helper_main)
+  // started concurrently from several threads, with inputs in memory
+  LLVMMemoryBufferRef obj = test_objcode();
+  lld_set_isolated(true);
+  asserteq(test_link_concurrently(obj, 4, 2), 0);
+
+  // messages of the helper are passed on
+  char outfile[64];
+  snprintf(outfile, sizeof(outfile), "/tmp/co-lld-test-%d.exe", (int)getpid());
+  const char* infile = "/tmp/co-lld-test-does-not-exist.o";
+  CoLLDOptions opt = {
+    .targetTriple = llvm_init_targets(),
+    .opt = CoOptNone,
+    .outfile = outfile,
+    .infilec = 1,
+    .infilev = &infile,
+  };
+  char* errmsg;
+  assert(!lld_link(&opt, &errmsg));
+  assertnotnull(strstr(errmsg, infile));
+  LLVMDisposeMessage(errmsg);
+
+  lld_set_isolated(false);
+  LLVMDisposeMemoryBuffer(obj);
+}
+#endif
+
+
+// lld_bench links the same program 1000 times, in-process and isolated, and reports time
+// per link and how much the resident memory of this process grew (see co_bench_enabled.)
+// It also links with the object file written to disk before each link, like codegen did
+// before lld_link accepted inputs in memory, to compare with in-memory inputs.
+
+// rss_bytes returns the resident set size of this process. Where the current value is not
+// available, returns the peak resident set size.
+static size_t rss_bytes() {
+  #if defined(__linux__)
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (!fp)
+      return 0;
+    unsigned long size = 0, resident = 0;
+    if (fscanf(fp, "%lu %lu", &size, &resident) != 2)
+      resident = 0;
+    fclose(fp);
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+  #else
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    #if defined(__APPLE__)
+      return (size_t)ru.ru_maxrss; // bytes
+    #else
+      return (size_t)ru.ru_maxrss * 1024; // kB
+    #endif
+  #endif
+}
+
+static void bench_links(LLVMMemoryBufferRef obj, const char* name, bool infile, u32 nlinks) {
+  char outfile[64];
+  char objfile[64];
+  snprintf(outfile, sizeof(outfile), "/tmp/co-lld-bench-%d.exe", (int)getpid());
+  snprintf(objfile, sizeof(objfile), "/tmp/co-lld-bench-%d.o", (int)getpid());
+  size_t rss_start = rss_bytes();
+  size_t rss_first = 0;
+  u64 starttm = nanotime();
+  for (u32 i = 0; i < nlinks; i++) {
+    if (!test_link1(obj, infile ? objfile : NULL, outfile))
+      panic("link %u failed", i);
+    if (i == 0)
+      rss_first = rss_bytes();
+  }
+  u64 d = nanotime() - starttm;
+  size_t rss_end = rss_bytes();
+  unlink(outfile);
+  if (infile)
+    unlink(objfile);
+  char durstr[40];
+  auto durlen = fmtduration(durstr, countof(durstr), d / nlinks);
+  fprintf(stderr,
+    "lld_bench: %-10s %u links  %.*s/link  RSS %zu kB -> %zu kB after 1st link -> %zu kB"
+    " (%+ld kB since 1st link)\n",
+    name, nlinks, durlen, durstr, rss_start / 1024, rss_first / 1024, rss_end / 1024,
+    ((long)rss_end - (long)rss_first) / 1024);
+}
+
+R_TEST(lld_bench) {
+  if (!co_bench_enabled())
+    return;
+  LLVMMemoryBufferRef obj = test_objcode();
+  lld_set_isolated(true);
+  bench_links(obj, "isolated", false, 1000);
+  asserteq(test_link_concurrently(obj, 8, 125), 0);
+  lld_set_isolated(false);
+  bench_links(obj, "in-process", false, 1000);
+  bench_links(obj, "file", true, 1000);
+  LLVMDisposeMemoryBuffer(obj);
+}
+
+#endif /* R_TESTING_ENABLED */
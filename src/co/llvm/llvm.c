@@ -16,13 +16,15 @@
 // rtimer helpers
 #define ENABLE_RTIMER_LOGGING
 #ifdef ENABLE_RTIMER_LOGGING
-  #define RTIMER_INIT          RTimer rtimer_ = {0}
-  #define RTIMER_START()       rtimer_start(&rtimer_)
-  #define RTIMER_LOG(fmt, ...) rtimer_log(&rtimer_, fmt, ##__VA_ARGS__)
+  #define RTIMER_INIT           RTimer rtimer_ = {0}
+  #define RTIMER_START()        rtimer_start(&rtimer_)
+  #define RTIMER_LOG(fmt, ...)  rtimer_log(&rtimer_, fmt, ##__VA_ARGS__)
+  #define RTIMER_RECORD(arrayp) (rtimer_.records = (arrayp)) // record durations in arrayp
 #else
-  #define RTIMER_INIT          do{}while(0)
-  #define RTIMER_START()       do{}while(0)
-  #define RTIMER_LOG(fmt, ...) do{}while(0)
+  #define RTIMER_INIT           do{}while(0)
+  #define RTIMER_START()        do{}while(0)
+  #define RTIMER_LOG(fmt, ...)  do{}while(0)
+  #define RTIMER_RECORD(arrayp) do{}while(0)
 #endif
 
 #ifdef DEBUG_BUILD_EXPR
@@ -61,11 +63,15 @@ typedef struct B {
   LLVMContextRef  ctx;
   LLVMModuleRef   mod;
   LLVMBuilderRef  builder;
+  LLVMBuilderRef  allocab; // builds allocas in the entry block (see build_alloca)
 
   // debug info
   bool prettyIR; // if true, include names in the IR (function params, variables, etc)
-  //std::unique_ptr<DIBuilder>   DBuilder;
-  //DebugInfo                    debug;
+  LLVMDIBuilderRef nullable dib;     // NULL when build->debuginfo is CoDebugInfoNone
+  LLVMMetadataRef  nullable dicu;    // DICompileUnit
+  LLVMMetadataRef  nullable discope; // DISubprogram of the function being built
+  PtrMap                    difiles; // Source* => DIFile
+  PtrMap                    ditypes; // Type* => DIType (CoDebugInfoFull only)
 
   // development debugging support
   #ifdef DEBUG_BUILD_EXPR
@@ -84,7 +90,7 @@ typedef struct B {
   Mutability mut;       // true if inside mutable data context
   u32        fnest;         // function nest depth
   Value      varalloc;      // memory preallocated for a var's init
-  SymMap     internedTypes; // AST types, keyed by typeid
+  PtrMap     internedTypes; // AST types, keyed by canonical type (Type* => LLVMTypeRef)
   PtrMap     defaultInits;  // constant initializers (LLVMTypeRef => Value)
 
   // memory generation check (specific to current function)
@@ -245,6 +251,29 @@ static Value build_load(B* b, LLVMTypeRef elem_ty, Value ptr, const char* vname)
 }
 
 
+// build_alloca allocates stack memory for a value of type ty in the current function.
+// The alloca is placed at the head of the function's entry block, no matter where the
+// builder is, making it a "static" alloca: a fixed slot in the stack frame which mem2reg
+// can promote and which FastISel handles without falling back to SelectionDAG.
+// An alloca in any other block is dynamic; it adjusts the stack pointer each time it runs.
+// This decides where allocas go, not how many there are: there is one per mutable var or
+// temporary which needs memory; immutable vars are SSA values without an alloca.
+// Allocas are built with a builder of their own, so the insertion point and debug location
+// of b->builder are left untouched. Allocas have no debug location as they belong to the
+// function as a whole rather than to any source location.
+static Value build_alloca(B* b, LLVMTypeRef ty, const char* vname) {
+  LLVMBasicBlockRef curb = notnull(LLVMGetInsertBlock(b->builder));
+  LLVMBasicBlockRef entryb = LLVMGetEntryBasicBlock(LLVMGetBasicBlockParent(curb));
+  Value instr0 = LLVMGetFirstInstruction(entryb);
+  if (instr0) {
+    LLVMPositionBuilderBefore(b->allocab, instr0);
+  } else {
+    LLVMPositionBuilderAtEnd(b->allocab, entryb);
+  }
+  return LLVMBuildAlloca(b->allocab, ty, vname);
+}
+
+
 // static Value build_copy(B* b, Value dstptr, Value srcptr, Value sizeval) {
 //   asserteq_debug(LLVMGetTypeKind(LLVMTypeOf(srcptr)), LLVMPointerTypeKind);
 //   asserteq_debug(LLVMTypeOf(dstptr), LLVMTypeOf(srcptr));
@@ -450,22 +479,15 @@ static Value build_default_value(B* b, Type* tn) {
 }
 
 
-inline static Sym ntypeid(B* b, Type* tn) {
-  return tn->t.id ? tn->t.id : (tn->t.id = GetTypeID(b->build, tn));
-}
-
-
 static LLVMTypeRef nullable get_intern_type(B* b, Type* tn) {
   assert_debug(NodeIsType(tn));
-  Sym tid = ntypeid(b, tn);
-  return (LLVMTypeRef)SymMapGet(&b->internedTypes, tid);
+  return (LLVMTypeRef)PtrMapGet(&b->internedTypes, InternASTType(b->build, tn));
 }
 
 static void add_intern_type(B* b, Type* tn, LLVMTypeRef tr) {
   assert_debug(NodeIsType(tn));
   assertnull_debug(get_intern_type(b, tn)); // must not be defined
-  Sym tid = ntypeid(b, tn);
-  SymMapSet(&b->internedTypes, tid, tr);
+  PtrMapSet(&b->internedTypes, InternASTType(b->build, tn), tr);
 }
 
 
@@ -572,6 +594,165 @@ static Value build_funproto(B* b, Node* n, const char* name) {
 // }
 
 
+// di_file_create creates a DIFile for a source file
+static LLVMMetadataRef di_file_create(B* b, const char* filename) {
+  const char* dir = "";
+  u32 dirlen = 0;
+  const char* base = strrchr(filename, '/');
+  if (base) {
+    dir = filename;
+    dirlen = (u32)(base - filename);
+    base++;
+  } else {
+    base = filename;
+  }
+  return LLVMDIBuilderCreateFile(b->dib, base, strlen(base), dir, dirlen);
+}
+
+
+// di_file returns the DIFile of the source that pos is in
+static LLVMMetadataRef di_file(B* b, Pos pos) {
+  Source* src = pos_source(&b->build->posmap, pos);
+  if (!src)
+    return LLVMDIScopeGetFile(b->dicu);
+  LLVMMetadataRef file = PtrMapGet(&b->difiles, src);
+  if (!file) {
+    file = di_file_create(b, src->filename);
+    PtrMapSet(&b->difiles, src, file);
+  }
+  return file;
+}
+
+
+// di_init starts debug info for the module, with a compile unit for the package
+static void di_init(B* b) {
+  Build* build = b->build;
+  b->dib = LLVMCreateDIBuilder(b->mod);
+  PtrMapInit(&b->difiles, 8, build->mem);
+  PtrMapInit(&b->ditypes, 16, build->mem);
+
+  // DWARF version and the version of the debug info metadata format
+  LLVMAddModuleFlag(b->mod, LLVMModuleFlagBehaviorWarning, "Dwarf Version", 13,
+    LLVMValueAsMetadata(LLVMConstInt(b->t_i32, 4, false)));
+  LLVMAddModuleFlag(b->mod, LLVMModuleFlagBehaviorWarning, "Debug Info Version", 18,
+    LLVMValueAsMetadata(LLVMConstInt(b->t_i32, LLVMDebugMetadataVersion(), false)));
+
+  // There's no DWARF language code for Co; debuggers and profilers do fine with C.
+  Source* src = build->pkg->srclist;
+  LLVMMetadataRef file = di_file_create(b, src ? src->filename : build->pkg->dir);
+  bool isOptimized = build->opt != CoOptNone;
+  LLVMDWARFEmissionKind kind = build->debuginfo == CoDebugInfoFull ?
+    LLVMDWARFEmissionFull : LLVMDWARFEmissionLineTablesOnly;
+  const char* producer = "co";
+  b->dicu = LLVMDIBuilderCreateCompileUnit(
+    b->dib, LLVMDWARFSourceLanguageC, file, producer, strlen(producer), isOptimized,
+    /*Flags*/"", 0, /*RuntimeVer*/0, /*SplitName*/"", 0, kind, /*DWOId*/0,
+    /*SplitDebugInlining*/true, /*DebugInfoForProfiling*/false, /*SysRoot*/"", 0,
+    /*SDK*/"", 0);
+}
+
+
+// di_set_loc sets the source location of instructions built from now on to pos.
+// Does nothing outside of functions or when not emitting debug info.
+static void di_set_loc(B* b, Pos pos) {
+  if (!b->discope || !pos_isknown(pos))
+    return;
+  LLVMMetadataRef loc = LLVMDIBuilderCreateDebugLocation(
+    b->ctx, pos_line(pos), pos_col(pos), b->discope, NULL);
+  LLVMSetCurrentDebugLocation2(b->builder, loc);
+}
+
+
+// di_fun creates a DISubprogram for function n
+static LLVMMetadataRef di_fun(B* b, Node* n, Value fn) {
+  LLVMMetadataRef file = di_file(b, n->pos);
+  size_t linknamelen;
+  const char* linkname = LLVMGetValueName2(fn, &linknamelen);
+  const char* name = linkname;
+  size_t namelen = linknamelen;
+  if (n->fun.name) {
+    name = n->fun.name;
+    namelen = symlen(n->fun.name);
+  }
+  u32 line = pos_line(n->pos);
+  LLVMMetadataRef fnty = LLVMDIBuilderCreateSubroutineType(
+    b->dib, file, NULL, 0, LLVMDIFlagZero);
+  bool isLocalToUnit = LLVMGetLinkage(fn) != LLVMExternalLinkage;
+  bool isOptimized = b->build->opt != CoOptNone;
+  LLVMMetadataRef sp = LLVMDIBuilderCreateFunction(
+    b->dib, file, name, namelen, linkname, linknamelen, file, line, fnty,
+    isLocalToUnit, /*IsDefinition*/true, /*ScopeLine*/line, LLVMDIFlagPrototyped, isOptimized);
+  LLVMSetSubprogram(fn, sp);
+  return sp;
+}
+
+
+// di_type returns the debug info type for t, or NULL if values of type t are not described
+static LLVMMetadataRef nullable di_type(B* b, Type* t) {
+  if (t->kind != NBasicType)
+    return NULL;
+  LLVMMetadataRef dt = PtrMapGet(&b->ditypes, t);
+  if (dt)
+    return dt;
+  TypeCode tc = t->t.basic.typeCode;
+  LLVMDWARFTypeEncoding enc;
+  u64 sizebits;
+  if (tc == TypeCode_bool) {
+    enc = 0x02; // DW_ATE_boolean
+    sizebits = 8;
+  } else if (TypeCodeIsFloat(tc)) {
+    enc = 0x04; // DW_ATE_float
+    sizebits = tc == TypeCode_f32 ? 32 : 64;
+  } else if (TypeCodeIsInt(tc)) {
+    enc = TypeCodeIsSigned(tc) ? 0x05 : 0x08; // DW_ATE_signed : DW_ATE_unsigned
+    sizebits = LLVMGetIntTypeWidth(get_type(b, t));
+  } else {
+    return NULL;
+  }
+  const char* name = TypeCodeName(tc);
+  dt = LLVMDIBuilderCreateBasicType(b->dib, name, strlen(name), sizebits, enc, LLVMDIFlagZero);
+  PtrMapSet(&b->ditypes, t, dt);
+  return dt;
+}
+
+
+// di_var describes local variable n, which lives in storage: memory of an alloca or,
+// for immutable variables, the value itself. argno is the 1-based index of a parameter,
+// or 0 for a variable which is not a parameter. Only done for CoDebugInfoFull.
+static void di_var(B* b, Node* n, Value storage, u32 argno) {
+  if (!b->discope || b->build->debuginfo != CoDebugInfoFull || !storage || !n->var.name)
+    return;
+  LLVMBasicBlockRef block = LLVMGetInsertBlock(b->builder);
+  if (LLVMGetBasicBlockTerminator(block)) // unreachable code
+    return;
+  LLVMMetadataRef type = di_type(b, n->type);
+  if (!type)
+    return;
+  LLVMMetadataRef file = LLVMDIScopeGetFile(b->discope);
+  Sym name = n->var.name;
+  u32 line = pos_line(n->pos);
+  bool alwaysPreserve = b->build->opt == CoOptNone;
+  LLVMMetadataRef var;
+  if (argno > 0) {
+    var = LLVMDIBuilderCreateParameterVariable(
+      b->dib, b->discope, name, symlen(name), argno, file, line, type, alwaysPreserve,
+      LLVMDIFlagZero);
+  } else {
+    var = LLVMDIBuilderCreateAutoVariable(
+      b->dib, b->discope, name, symlen(name), file, line, type, alwaysPreserve,
+      LLVMDIFlagZero, /*AlignInBits*/0);
+  }
+  LLVMMetadataRef loc = LLVMDIBuilderCreateDebugLocation(
+    b->ctx, line, pos_col(n->pos), b->discope, NULL);
+  LLVMMetadataRef expr = LLVMDIBuilderCreateExpression(b->dib, NULL, 0);
+  if (LLVMIsAAllocaInst(storage)) {
+    LLVMDIBuilderInsertDeclareAtEnd(b->dib, storage, var, expr, loc, block);
+  } else {
+    LLVMDIBuilderInsertDbgValueAtEnd(b->dib, storage, var, expr, loc, block);
+  }
+}
+
+
 static Value build_fun(B* b, Node* n, const char* vname) {
   asserteq_debug(n->kind, NFun);
   notnull(n->type);
@@ -585,7 +766,7 @@ static Value build_fun(B* b, Node* n, const char* vname) {
   LLVMValueRef fn; {
     const char* name = f->name;
     if (name == NULL || strcmp(name, "main") != 0)
-      name = str_fmt("%s%s", name, n->type->t.id);
+      name = str_fmt("%s%s", name, GetTypeID(b->build, n->type));
     fn = build_funproto(b, n, name);
     if (name != f->name)
       str_free((Str)name);
@@ -611,6 +792,15 @@ static Value build_fun(B* b, Node* n, const char* vname) {
   LLVMBasicBlockRef entryb = LLVMAppendBasicBlockInContext(b->ctx, fn, ""/*"entry"*/);
   LLVMPositionBuilderAtEnd(b->builder, entryb);
 
+  // save any current debug scope and location and start a new scope for the function
+  LLVMMetadataRef prevscope = b->discope;
+  LLVMMetadataRef prevloc = NULL;
+  if (b->dib) {
+    prevloc = LLVMGetCurrentDebugLocation2(b->builder);
+    b->discope = di_fun(b, n, fn);
+    di_set_loc(b, n->pos);
+  }
+
   // process params eagerly
   if (n->fun.params) {
     auto a = n->fun.params->array.a;
@@ -623,6 +813,7 @@ static Value build_fun(B* b, Node* n, const char* vname) {
       if (NodeIsConst(pn) /*&& !arg_type_needs_alloca(ty)*/) {
         // immutable pimitive value does not need a local alloca
         pn->irval = pv;
+        di_var(b, pn, pv, i + 1);
       } else { // mutable
         const char* name = pn->var.name;
         #if DEBUG
@@ -631,8 +822,9 @@ static Value build_fun(B* b, Node* n, const char* vname) {
         name = namebuf;
         #endif
 
-        pn->irval = LLVMBuildAlloca(b->builder, ty, name);
+        pn->irval = build_alloca(b, ty, name);
         build_store(b, pv, pn->irval);
+        di_var(b, pn, pn->irval, i + 1);
       }
     }
   }
@@ -667,6 +859,12 @@ static Value build_fun(B* b, Node* n, const char* vname) {
     b->mgen_alloca = mgen_alloca;
   }
 
+  // restore any debug scope and location
+  if (b->dib) {
+    b->discope = prevscope;
+    LLVMSetCurrentDebugLocation2(b->builder, prevloc);
+  }
+
   b->fnest--;
 
   return fn;
@@ -681,15 +879,22 @@ static Value build_block(B* b, Node* n, const char* vname) {
   bool noload = b->noload; // save
   b->noload = true;
 
+  // each expression of the block starts a new source location
+  LLVMMetadataRef prevloc = b->discope ? LLVMGetCurrentDebugLocation2(b->builder) : NULL;
+
   for (u32 i = 0; i < n->array.a.len; i++) {
     if (i == n->array.a.len - 1) {
       // load last expression of a block that is in turn being loaded
       b->noload = noload;
     }
-    v = build_expr(b, n->array.a.v[i], "");
+    Node* cn = n->array.a.v[i];
+    di_set_loc(b, cn->pos);
+    v = build_expr(b, cn, "");
   }
 
   b->noload = noload; // restore
+  if (prevloc)
+    LLVMSetCurrentDebugLocation2(b->builder, prevloc);
   // last expr of block is its value (TODO: is this true? is that Co's semantic?)
   return v;
 }
@@ -783,7 +988,7 @@ static Value build_init_store(B* b, Node* n, Value init, const char* vname) {
     return ptr;
   }
   // mutable, on stack
-  Value ptr = LLVMBuildAlloca(b->builder, LLVMTypeOf(init), vname);
+  Value ptr = build_alloca(b, LLVMTypeOf(init), vname);
   build_store(b, init, ptr);
   return ptr;
 }
@@ -1048,7 +1253,7 @@ static Value build_anon_struct(
       LLVMTypeRef ty = LLVMTypeOf(init);
       Value ptr = take_varalloca(b, ty);
       if (!ptr)
-        ptr = LLVMBuildAlloca(b->builder, ty, vname);
+        ptr = build_alloca(b, ty, vname);
       build_store(b, init, ptr);
       *ptr_out = ptr;
     } else {
@@ -1074,7 +1279,7 @@ static Value build_anon_struct(
   LLVMTypeRef ty = LLVMStructTypeInContext(b->ctx, typesv, numvalues, /*packed*/false);
   Value ptr = take_varalloca(b, ty);
   if (!ptr)
-    ptr = LLVMBuildAlloca(b->builder, ty, vname);
+    ptr = build_alloca(b, ty, vname);
 
   for (u32 i = 0; i < numvalues; i++) {
     LLVMValueRef fieldptr = LLVMBuildStructGEP2(b->builder, ty, ptr, i, "");
@@ -1225,12 +1430,18 @@ static Value load_var(B* b, Node* n, const char* vname) {
 }
 
 
-static Value build_var_def(B* b, Node* n, const char* vname) {
+// build_var_def builds the definition of a local var.
+// If initp is not NULL, it is set to the value stored as the initial value of a mutable var,
+// or NULL if none was stored.
+static Value build_var_def(B* b, Node* n, const char* vname, Value nullable* nullable initp) {
   asserteq_debug(n->kind, NVar);
   assertnull_debug(n->irval);
   assert_debug( ! NodeIsParam(n)); // params are eagerly built by build_fun
   notnull(LLVMGetInsertBlock(b->builder)); // local, not global
 
+  if (initp)
+    *initp = NULL;
+
   if (n->flags & NodeFlagUnused) // skip unused var
     return NULL;
 
@@ -1250,6 +1461,7 @@ static Value build_var_def(B* b, Node* n, const char* vname) {
       n->irval = build_default_value(b, n->type);
     }
     b->noload = noload; // restore
+    di_var(b, n, n->irval, 0);
     return (Value)n->irval;
   }
 
@@ -1263,7 +1475,7 @@ static Value build_var_def(B* b, Node* n, const char* vname) {
   #endif
 
   // dlog("var type: %s", fmttype(ty));
-  n->irval = LLVMBuildAlloca(b->builder, ty, vname);
+  n->irval = build_alloca(b, ty, vname);
 
   bool store = true;
 
@@ -1279,8 +1491,12 @@ static Value build_var_def(B* b, Node* n, const char* vname) {
     init = LLVMConstNull(ty);
   }
 
-  if (store)
+  if (store) {
     build_store(b, init, n->irval);
+    if (initp)
+      *initp = init;
+  }
+  di_var(b, n, n->irval, 0);
 
   b->noload = noload; // restore
   return (Value)n->irval;
@@ -1293,8 +1509,16 @@ static Value build_var(B* b, Node* n, const char* vname) {
   // build var if needed
   if (!n->irval) {
     Mutability mut = set_mut_based_on_node_const(b, n);
-    build_var_def(b, n, vname);
+    Value init;
+    build_var_def(b, n, vname, &init);
     b->mut = mut; // restore
+
+    // The value of a var definition is its initial value, which we just stored. Using it
+    // rather than loading it back gives the same result, without building a load for
+    // mem2reg to remove again. Only a var which mem2reg can't promote would otherwise keep
+    // the load in unoptimized code.
+    if (init && !b->noload)
+      return init;
   }
 
   return load_var(b, n, vname);
@@ -1412,7 +1636,7 @@ static Value build_assign_tuple(B* b, Node* n, const char* vname) {
       srcvalsv[i] = build_expr_mustload(b, srcn, "");
     } else {
       // variable definition
-      build_var_def(b, dstn, dstn->var.name);
+      build_var_def(b, dstn, dstn->var.name, NULL);
       srcvalsv[i] = load_var(b, dstn, dstn->var.name);
     }
     notnull(srcvalsv[i]);
@@ -1790,15 +2014,7 @@ static Value build_refstruct_deref(
     assertnull_debug(b->mgen_alloca); // should be in sync w/ mgen_failb
 
     // generate stack space for the "current failing ref" to be used by mgen_failb
-    LLVMBasicBlockRef entryb = LLVMGetEntryBasicBlock(fn);
-    LLVMPositionBuilderAtEnd(b->builder, entryb);
-    Value instr0 = LLVMGetFirstInstruction(entryb);
-    if (instr0) {
-      // make sure we add the alloca before the block's terminator.
-      // we do this by inserting the alloca to the head.
-      LLVMPositionBuilderBefore(b->builder, instr0);
-    }
-    b->mgen_alloca = LLVMBuildAlloca(b->builder, refty, "failref");
+    b->mgen_alloca = build_alloca(b, refty, "failref");
 
     // build the "ref failed" branch
     b->mgen_failb = LLVMAppendBasicBlockInContext(b->ctx, fn, "refcheck.fail");
@@ -1853,7 +2069,7 @@ static Value build_refstruct_new(B* b, Value valptr, Value genval, const char* v
   Value refptr = take_varalloca(b, refty); // use memory preallocated for var
   if (!refptr) {
     // TODO: can we use @llvm.lifetime.start to mark the lifetime range of this alloca?
-    refptr = LLVMBuildAlloca(b->builder, refty, vname);
+    refptr = build_alloca(b, refty, vname);
   }
   return build_refstruct_store(b, refptr, valptr, genval); // => refptr
 }
@@ -2015,7 +2231,7 @@ static Value build_index(B* b, Node* n, const char* vname) {
         if (vn->kind == NVar)
           vname = vn->var.name;
         #endif
-        Value ptr = LLVMBuildAlloca(b->builder, ty, dnamef(b, "%s.tmp", vname));
+        Value ptr = build_alloca(b, ty, dnamef(b, "%s.tmp", vname));
         build_store(b, v, ptr);
         v = ptr;
         ty = LLVMTypeOf(ptr);
@@ -2245,6 +2461,7 @@ static void build_module(Build* build, Node* pkgnode, LLVMModuleRef mod) {
     .ctx = ctx,
     .mod = mod,
     .builder = LLVMCreateBuilderInContext(ctx),
+    .allocab = LLVMCreateBuilderInContext(ctx),
     .prettyIR = true,
 
     // FPM: Apply per-function optimizations. Set to NULL to disable.
@@ -2283,8 +2500,10 @@ static void build_module(Build* build, Node* pkgnode, LLVMModuleRef mod) {
   #endif
 
   B* b = &_b;
-  SymMapInit(&b->internedTypes, 16, build->mem);
+  PtrMapInit(&b->internedTypes, 16, build->mem);
   PtrMapInit(&b->defaultInits, 16, build->mem);
+  if (build->debuginfo != CoDebugInfoNone)
+    di_init(b);
 
   // initialize function pass manager (optimize)
   if (b->FPM) {
@@ -2308,6 +2527,10 @@ static void build_module(Build* build, Node* pkgnode, LLVMModuleRef mod) {
   // build_fun1(b, "foo");
   // build_fun1(b, "main");
 
+  // resolve debug info; must be done before the module is verified
+  if (b->dib)
+    LLVMDIBuilderFinalize(b->dib);
+
   // verify IR
   #ifdef DEBUG
     char* errmsg;
@@ -2333,74 +2556,17 @@ static void build_module(Build* build, Node* pkgnode, LLVMModuleRef mod) {
 #ifdef DEBUG
 finish:
 #endif
-  SymMapDispose(&b->internedTypes);
+  PtrMapDispose(&b->internedTypes);
   PtrMapDispose(&b->defaultInits);
+  if (b->dib) {
+    PtrMapDispose(&b->difiles);
+    PtrMapDispose(&b->ditypes);
+    LLVMDisposeDIBuilder(b->dib);
+  }
   if (b->FPM)
     LLVMDisposePassManager(b->FPM);
   LLVMDisposeBuilder(b->builder);
-}
-
-
-static LLVMTargetRef select_target(const char* triple) {
-  // select target
-  char* errmsg;
-  LLVMTargetRef target;
-  if (LLVMGetTargetFromTriple(triple, &target, &errmsg) != 0) {
-    // error
-    errlog("LLVMGetTargetFromTriple: %s", errmsg);
-    LLVMDisposeMessage(errmsg);
-    target = NULL;
-  } else {
-    #if DEBUG
-    const char* name = LLVMGetTargetName(target);
-    const char* description = LLVMGetTargetDescription(target);
-    const char* jit = LLVMTargetHasJIT(target) ? " jit" : "";
-    const char* mc = LLVMTargetHasTargetMachine(target) ? " mc" : "";
-    const char* _asm = LLVMTargetHasAsmBackend(target) ? " asm" : "";
-    dlog("selected target: %s (%s) [abilities:%s%s%s]", name, description, jit, mc, _asm);
-    #endif
-  }
-  return target;
-}
-
-
-static LLVMTargetMachineRef select_target_machine(
-  LLVMTargetRef       target,
-  const char*         triple,
-  LLVMCodeGenOptLevel optLevel,
-  LLVMCodeModel       codeModel)
-{
-  if (!target)
-    return NULL;
-
-  const char* CPU = "";      // "" for generic
-  const char* features = ""; // "" for none
-
-  // select host CPU and features (NOT PORTABLE!) when optimizing
-  char* hostCPUName = NULL;
-  char* hostFeatures = NULL;
-  if (optLevel != LLVMCodeGenLevelNone) {
-    hostCPUName = LLVMGetHostCPUName();
-    hostFeatures = LLVMGetHostCPUFeatures();
-    CPU = hostCPUName;
-    features = hostFeatures;
-  }
-
-  LLVMTargetMachineRef targetMachine = LLVMCreateTargetMachine(
-    target, triple, CPU, features, optLevel, LLVMRelocStatic, codeModel);
-  if (!targetMachine) {
-    errlog("LLVMCreateTargetMachine failed");
-    return NULL;
-  } else {
-    char* triple1 = LLVMGetTargetMachineTriple(targetMachine);
-    dlog("selected target machine: %s", triple1);
-    LLVMDisposeMessage(triple1);
-  }
-  if (hostCPUName) {
-    LLVMDisposeMessage(hostCPUName);
-    LLVMDisposeMessage(hostFeatures);
-  }
-  return targetMachine;
+  LLVMDisposeBuilder(b->allocab);
 }
 
 
@@ -2434,14 +2600,16 @@ static int llvm_jit_handle_err(LLVMErrorRef Err) {
 }
 
 
-int llvm_jit(Build* build, Node* pkgnode) {
+bool llvm_jit(
+  Build* build, Node* pkgnode, const char* cachedir, CoLLVMJITCacheStats* stats, int* result)
+{
   dlog("llvm_jit");
   RTIMER_INIT;
-  // TODO: see llvm/examples/OrcV2Examples/LLJITWithObjectCache/LLJITWithObjectCache.cpp
-  // for an example of caching compiled code objects, like LLVM IR modules.
 
-  int main_result = 0;
+  bool ok = false;
   LLVMErrorRef err;
+  CoLLVMJITCacheStats cachestats = {0};
+  Str jitcachedir = cachedir ? path_join(cachedir, "jit") : NULL;
 
   RTIMER_START();
 
@@ -2451,32 +2619,24 @@ int llvm_jit(Build* build, Node* pkgnode) {
 
   // Create the JIT instance
   LLVMOrcLLJITRef J;
-  if ((err = LLVMOrcCreateLLJIT(&J, 0))) {
-    main_result = llvm_jit_handle_err(err);
-    goto llvm_shutdown;
+  if ((err = llvm_jit_create(&J, jitcachedir, &cachestats))) {
+    llvm_jit_handle_err(err);
+    goto end;
   }
   RTIMER_LOG("llvm JIT init");
 
 
   // build module
   LLVMOrcThreadSafeModuleRef M = llvm_jit_buildmod(build, pkgnode);
-  LLVMOrcResourceTrackerRef RT;
-
-
-  // // get execution session
-  // LLVMOrcExecutionSessionRef ES = LLVMOrcLLJITGetExecutionSession(J);
-  // LLVMOrcObjectLayerRef objlayer =
-  //   LLVMOrcCreateRTDyldObjectLinkingLayerWithSectionMemoryManager(ES);
-
 
   // Add our module to the JIT
   LLVMOrcJITDylibRef MainJD = LLVMOrcLLJITGetMainJITDylib(J);
-    RT = LLVMOrcJITDylibCreateResourceTracker(MainJD);
+  LLVMOrcResourceTrackerRef RT = LLVMOrcJITDylibCreateResourceTracker(MainJD);
   if ((err = LLVMOrcLLJITAddLLVMIRModuleWithRT(J, RT, M))) {
     // If adding the ThreadSafeModule fails then we need to clean it up
     // ourselves. If adding it succeeds the JIT will manage the memory.
     LLVMOrcDisposeThreadSafeModule(M);
-    main_result = llvm_jit_handle_err(err);
+    llvm_jit_handle_err(err);
     goto jit_cleanup;
   }
 
@@ -2484,67 +2644,106 @@ int llvm_jit(Build* build, Node* pkgnode) {
   RTIMER_START();
   LLVMOrcJITTargetAddress entry_addr;
   if ((err = LLVMOrcLLJITLookup(J, &entry_addr, "main"))) {
-    main_result = llvm_jit_handle_err(err);
+    llvm_jit_handle_err(err);
     goto mod_cleanup;
   }
-  RTIMER_LOG("llvm JIT lookup entry function \"main\"");
+  // the lookup compiles the module (or loads it from the object cache)
+  RTIMER_LOG("llvm JIT lookup entry function \"main\" (object cache %u hit, %u miss)",
+    cachestats.hits, cachestats.misses);
 
 
   // If we made it here then everything succeeded. Execute our JIT'd code.
   RTIMER_START();
-  auto entry_fun = (long(*)(long))entry_addr;
-  long result = entry_fun(123l);
+  auto entry_fun = (int(*)(void))entry_addr;
+  *result = entry_fun();
   RTIMER_LOG("llvm JIT execute module main fun");
-  fprintf(stderr, "main => %ld\n", result);
-
+  ok = true;
 
   RTIMER_START();
 
 mod_cleanup:
   // Remove the code
   if ((err = LLVMOrcResourceTrackerRemove(RT))) {
-    main_result = llvm_jit_handle_err(err);
-    goto jit_cleanup;
-  }
-
-  // Attempt a second lookup — we expect an error as the code & symbols have been removed
-  #if DEBUG
-  LLVMOrcJITTargetAddress tmp;
-  if ((err = LLVMOrcLLJITLookup(J, &tmp, "main")) != 0) {
-    // expect error
-    LLVMDisposeErrorMessage(LLVMGetErrorMessage(err)); // must release error message
-  } else {
-    assert(err != 0); // expected error
+    llvm_jit_handle_err(err);
+    ok = false;
   }
-  #endif
 
 jit_cleanup:
   // Destroy our JIT instance. This will clean up any memory that the JIT has
   // taken ownership of. This operation is non-trivial (e.g. it may need to
-  // JIT static destructors) and may also fail. In that case we want to render
-  // the error to stderr, but not overwrite any existing return value.
+  // JIT static destructors) and may also fail. LLVM itself stays initialized so that
+  // llvm_jit can be called again.
   LLVMOrcReleaseResourceTracker(RT);
   if ((err = LLVMOrcDisposeLLJIT(J))) {
-    int x = llvm_jit_handle_err(err);
-    if (main_result == 0)
-      main_result = x;
+    llvm_jit_handle_err(err);
+    ok = false;
   }
-  // LLVMOrcDisposeObjectLayer(objlayer);
-
-llvm_shutdown:
-  // Shut down LLVM.
-  LLVMShutdown();
   RTIMER_LOG("llvm JIT cleanup");
-  return main_result;
+
+end:
+  if (jitcachedir)
+    str_free(jitcachedir);
+  if (stats) {
+    stats->hits += cachestats.hits;
+    stats->misses += cachestats.misses;
+  }
+  return ok;
 }
 
 
-bool llvm_build_and_emit(Build* build, Node* pkgnode, const char* triple) {
+// codegen_nparts returns the number of partitions to split codegen of mod into
+static u32 codegen_nparts(const Build* build, LLVMModuleRef mod) {
+  u32 nparts = build_cgparts(build);
+  if (nparts == 1)
+    return 1;
+  // no point in having more partitions than function definitions
+  u32 nfuns = 0;
+  for (LLVMValueRef fn = LLVMGetFirstFunction(mod); fn && nfuns < nparts;
+       fn = LLVMGetNextFunction(fn))
+  {
+    if (!LLVMIsDeclaration(fn))
+      nfuns++;
+  }
+  return MAX(1, nfuns);
+}
+
+
+// objfile_path returns the filename of the object file of a codegen partition
+static Str objfile_path(const Build* build, u32 partition) {
+  if (partition == 0)
+    return build_outpath(build, ".o");
+  char ext[16];
+  snprintf(ext, sizeof(ext), ".%u.o", partition);
+  return build_outpath(build, ext);
+}
+
+
+static bool writefile(const char* filename, const void* data, size_t size) {
+  FILE* fp = fopen(filename, "w");
+  if (!fp) {
+    errlog("failed to open \"%s\" for writing", filename);
+    return false;
+  }
+  bool ok = fwrite(data, size, 1, fp) == 1 || size == 0;
+  ok = fclose(fp) == 0 && ok;
+  if (!ok)
+    errlog("failed to write to \"%s\"", filename);
+  return ok;
+}
+
+
+bool llvm_build_and_emit(
+  CoLLVMBackend* backend, Build* build, Node* pkgnode, const char* triple, Array* objv)
+{
   dlog("llvm_build_and_emit");
   bool ok = false;
   RTIMER_INIT;
+  RTIMER_RECORD(build->report ? &build->report->phases : NULL);
+  u32 nparts = 0;
+  LLVMMemoryBufferRef* objbufv = NULL; // object code of each codegen partition
+  Str asm_file = NULL, bc_file = NULL, ir_file = NULL, exe_file = NULL;
 
-  LLVMContextRef ctx = LLVMContextCreate();
+  LLVMContextRef ctx = llvm_backend_context(backend);
   LLVMModuleRef mod = LLVMModuleCreateWithNameInContext(build->pkg->id, ctx);
 
 
@@ -2560,36 +2759,58 @@ bool llvm_build_and_emit(Build* build, Node* pkgnode, const char* triple) {
   const char* hostTriple = llvm_init_targets();
   if (!triple)
     triple = hostTriple; // default to host
-  LLVMTargetRef target = select_target(triple);
-  LLVMCodeGenOptLevel optLevel =
-    (build->opt == CoOptNone ? LLVMCodeGenLevelNone : LLVMCodeGenLevelDefault);
-  LLVMCodeModel codeModel =
-    (build->opt == CoOptSmall ? LLVMCodeModelSmall : LLVMCodeModelDefault);
-
-  // optLevel = LLVMCodeGenLevelAggressive;
-  LLVMTargetMachineRef targetm = select_target_machine(
-    target, triple, optLevel, codeModel);
-  if (!targetm)
+  char* errmsg;
+  if (!llvm_init_target(triple, &errmsg)) {
+    errlog("llvm_init_target: %s", errmsg);
+    LLVMDisposeMessage(errmsg);
     goto end;
+  }
+  LLVMTargetMachineRef targetm = llvm_backend_target_machine(
+    backend, triple, build->opt, &errmsg);
+  if (!targetm) {
+    errlog("llvm_backend_target_machine: %s", errmsg);
+    LLVMDisposeMessage(errmsg);
+    goto end;
+  }
 
   // set target
   LLVMSetTarget(mod, triple);
   LLVMTargetDataRef dataLayout = LLVMCreateTargetDataLayout(targetm);
   LLVMSetModuleDataLayout(mod, dataLayout);
+  LLVMDisposeTargetData(dataLayout);
   RTIMER_LOG("select llvm target");
 
 
-  char* errmsg;
+  // ThinLTO. lld's Mach-O linker does not support LTO
+  CoLLVMLTO lto = CoLLVMLTO_none;
+  if (build->thinlto) {
+    CoLLVMArch arch; CoLLVMVendor vendor; CoLLVMOS os; CoLLVMEnvironment env;
+    CoLLVMObjectFormat oformat;
+    llvm_triple_info(triple, &arch, &vendor, &os, &env, &oformat);
+    if (oformat == CoLLVMObjectFormat_MachO) {
+      dlog("ThinLTO not supported for %s; ignoring build->thinlto", triple);
+    } else {
+      lto = CoLLVMLTO_thin;
+    }
+  }
+
 
   // verify, optimize and target-fit module
   RTIMER_START();
   bool enable_tsan = false;
-  bool enable_lto = false;
-  if (!llvm_optmod(mod, targetm, build->opt, enable_tsan, enable_lto, &errmsg)) {
+  char* reportjson = NULL;
+  if (!llvm_optmod(
+        backend, mod, targetm, build->opt, enable_tsan, lto, build->pgo, build->pgofile,
+        build->report ? &reportjson : NULL, &errmsg))
+  {
     errlog("llvm_optmod: %s", errmsg);
     LLVMDisposeMessage(errmsg);
     goto end;
   }
+  if (reportjson) {
+    build->report->llvm = str_cpy(reportjson, strlen(reportjson));
+    LLVMDisposeMessage(reportjson);
+  }
   RTIMER_LOG("llvm optimize module");
   #ifdef DEBUG
   dlog("LLVM IR module after target-fit and optimizations:");
@@ -2597,23 +2818,62 @@ bool llvm_build_and_emit(Build* build, Node* pkgnode, const char* triple) {
   #endif
 
 
-  // emit
-  const char* obj_file = "out1.o";
-  const char* asm_file = "out1.s";
-  const char* bc_file  = "out1.bc";
-  const char* ir_file  = "out1.ll";
-  const char* exe_file = "out1.exe";
+  // emit products selected by build->emit
+  if (build->emit & CoEmitAsm) asm_file = build_outpath(build, ".s");
+  if (build->emit & CoEmitBC)  bc_file  = build_outpath(build, ".bc");
+  if (build->emit & CoEmitLL)  ir_file  = build_outpath(build, ".ll");
+  if (build->emit & CoEmitExe) exe_file = build_outpath(build, NULL);
 
-  // emit machine code (object)
-  if (obj_file) {
+  // emit ThinLTO bitcode to memory in place of machine code. Optimization (with functions
+  // imported from other modules) and codegen happens when linking.
+  // "Object files" written for CoEmitObj contain this bitcode, like "clang -flto=thin -c".
+  if (lto == CoLLVMLTO_thin && (build->emit & (CoEmitObj | CoEmitExe | CoEmitBC))) {
     RTIMER_START();
-    if (!llvm_emit_mc(mod, targetm, LLVMObjectFile, obj_file, &errmsg)) {
-      errlog("llvm_emit_mc (LLVMObjectFile): %s", errmsg);
-      LLVMDisposeMessage(errmsg);
-      // obj_file = NULL; // skip linking
-      goto end;
+    nparts = 1;
+    objbufv = memalloc(MemHeap, sizeof(LLVMMemoryBufferRef));
+    objbufv[0] = llvm_emit_thinlto_bc(mod);
+    RTIMER_LOG("llvm emit ThinLTO bitcode");
+  }
+
+  // emit machine code (object) to memory. Linking an executable needs it too.
+  if (lto == CoLLVMLTO_none && (build->emit & (CoEmitObj | CoEmitExe))) {
+    RTIMER_START();
+    nparts = codegen_nparts(build, mod);
+    objbufv = memalloc(MemHeap, sizeof(LLVMMemoryBufferRef) * nparts);
+    memset(objbufv, 0, sizeof(LLVMMemoryBufferRef) * nparts); // for cleanup on error
+    if (nparts == 1) {
+      if (LLVMTargetMachineEmitToMemoryBuffer(
+            targetm, mod, LLVMObjectFile, &errmsg, &objbufv[0]) != 0)
+      {
+        errlog("LLVMTargetMachineEmitToMemoryBuffer: %s", errmsg);
+        LLVMDisposeMessage(errmsg);
+        goto end;
+      }
+    } else {
+      // Note: this makes local symbols of mod external (with hidden visibility), which
+      // shows in the assembly, bitcode and IR text emitted below.
+      if (!llvm_emit_mc_parallel(mod, targetm, objbufv, nparts, &errmsg)) {
+        errlog("llvm_emit_mc_parallel: %s", errmsg);
+        LLVMDisposeMessage(errmsg);
+        goto end;
+      }
+    }
+    RTIMER_LOG("llvm codegen MC object (%u %s)",
+      nparts, nparts == 1 ? "partition" : "partitions");
+  }
+
+  // write object files
+  if (build->emit & CoEmitObj) {
+    RTIMER_START();
+    for (u32 i = 0; i < nparts; i++) {
+      Str obj_file = objfile_path(build, i);
+      bool ok1 = writefile(
+        obj_file, LLVMGetBufferStart(objbufv[i]), LLVMGetBufferSize(objbufv[i]));
+      str_free(obj_file);
+      if (!ok1)
+        goto end;
     }
-    RTIMER_LOG("llvm codegen MC object %s", obj_file);
+    RTIMER_LOG("write %u object %s", nparts, nparts == 1 ? "file" : "files");
   }
 
   // emit machine code (assembly)
@@ -2627,8 +2887,13 @@ bool llvm_build_and_emit(Build* build, Node* pkgnode, const char* triple) {
     RTIMER_LOG("llvm codegen MC assembly %s", asm_file);
   }
 
-  // emit LLVM bitcode
-  if (bc_file) {
+  // emit LLVM bitcode. With ThinLTO the module summary is included.
+  if (bc_file && lto == CoLLVMLTO_thin) {
+    RTIMER_START();
+    if (!writefile(bc_file, LLVMGetBufferStart(objbufv[0]), LLVMGetBufferSize(objbufv[0])))
+      goto end;
+    RTIMER_LOG("llvm codegen LLVM bitcode %s", bc_file);
+  } else if (bc_file) {
     RTIMER_START();
     if (!llvm_emit_bc(mod, bc_file, &errmsg)) {
       errlog("llvm_emit_bc: %s", errmsg);
@@ -2650,15 +2915,17 @@ bool llvm_build_and_emit(Build* build, Node* pkgnode, const char* triple) {
   }
 
   // link executable
-  if (exe_file && obj_file) {
+  if (exe_file) {
     RTIMER_START();
-    const char* inputv[] = { obj_file };
     CoLLDOptions lldopt = {
       .targetTriple = triple,
       .opt = build->opt,
       .outfile = exe_file,
-      .infilec = countof(inputv),
-      .infilev = inputv,
+      .inbufc = nparts,
+      .inbufv = objbufv,
+      .thinlto = lto == CoLLVMLTO_thin,
+      .ltocachedir = build->ltocache,
+      .profrt = build->pgo == CoPGOGen,
     };
     if (!lld_link(&lldopt, &errmsg)) {
       errlog("lld_link: %s", errmsg);
@@ -2677,8 +2944,22 @@ bool llvm_build_and_emit(Build* build, Node* pkgnode, const char* triple) {
   ok = true;
 
 end:
+  if (objbufv) {
+    for (u32 i = 0; i < nparts; i++) {
+      if (ok) {
+        ArrayPush(objv, objbufv[i], MemHeap);
+      } else if (objbufv[i]) {
+        LLVMDisposeMemoryBuffer(objbufv[i]);
+      }
+    }
+    memfree(MemHeap, objbufv);
+  }
+  Str outfiles[] = { asm_file, bc_file, ir_file, exe_file };
+  for (u32 i = 0; i < countof(outfiles); i++) {
+    if (outfiles[i])
+      str_free(outfiles[i]);
+  }
   LLVMDisposeModule(mod);
-  LLVMContextDispose(ctx);
   return ok;
 }
 
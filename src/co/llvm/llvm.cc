@@ -13,34 +13,41 @@ static bool llvm_error_to_errmsg(llvm::Error err, char** errmsg) {
 }
 
 
+// Target initialization functions, generated from the targets LLVM was configured with
+typedef void(*TargetInitFun)();
+typedef struct { const char* name; TargetInitFun target, mc; } TargetInitFuns;
+typedef struct { const char* name; TargetInitFun init; } TargetInitFun1;
+
+static const TargetInitFuns kTargetInitFuns[] = {
+  #define LLVM_TARGET(T) { #T, LLVMInitialize##T##Target, LLVMInitialize##T##TargetMC },
+  #include "llvm/Config/Targets.def"
+  #undef LLVM_TARGET
+};
+static const TargetInitFun1 kAsmPrinterInitFuns[] = {
+  #define LLVM_ASM_PRINTER(T) { #T, LLVMInitialize##T##AsmPrinter },
+  #include "llvm/Config/AsmPrinters.def"
+  #undef LLVM_ASM_PRINTER
+};
+static const TargetInitFun1 kAsmParserInitFuns[] = {
+  #define LLVM_ASM_PARSER(T) { #T, LLVMInitialize##T##AsmParser },
+  #include "llvm/Config/AsmParsers.def"
+  #undef LLVM_ASM_PARSER
+};
+
+static std::mutex     _targets_mu;
+static StringSet<>    _targets_initialized; // backend names, e.g. "X86"
+static bool           _targets_all_initialized = false;
+
+
 const char* llvm_init_targets() {
   static std::once_flag once;
   static char* hostTriple;
   std::call_once(once, [](){
-    #if 1
-      // Initialize ALL targets (this causes a lot of llvm code to be included in this program)
-      // Note: lld (liblldCOFF.a) requires all targets
-      InitializeAllTargetInfos();
-      InitializeAllTargets();
-      InitializeAllTargetMCs();
-      InitializeAllAsmPrinters();
-      InitializeAllAsmParsers();
-    #else
-      // For JIT only, call llvm::InitializeNativeTarget()
-      InitializeNativeTarget();
-
-      // Initialize some targets (see llvm/Config/Targets.def)
-      #define TARGETS(_) _(AArch64) _(WebAssembly) _(X86)
-      #define _(TargetName) \
-        LLVMInitialize##TargetName##TargetInfo(); \
-        LLVMInitialize##TargetName##Target(); \
-        LLVMInitialize##TargetName##TargetMC(); \
-        LLVMInitialize##TargetName##AsmPrinter(); \
-        /*LLVMInitialize##TargetName##AsmParser();*/
-      TARGETS(_)
-      #undef _
-    #endif
-
+    // Only initialize the native target here; other targets are initialized on demand by
+    // llvm_init_target as initializing all of them costs a lot of startup time.
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
     hostTriple = LLVMGetDefaultTargetTriple();
     // Note: if we ever make this non-static, LLVMDisposeMessage(hostTriple) when done.
   });
@@ -48,6 +55,58 @@ const char* llvm_init_targets() {
 }
 
 
+bool llvm_init_target(const char* triple, char** errmsg) {
+  llvm_init_targets();
+  std::lock_guard<std::mutex> lock(_targets_mu);
+  if (_targets_all_initialized)
+    return true;
+
+  // Registering target infos is cheap; it lets us look up the backend for triple
+  static std::once_flag once;
+  std::call_once(once, [](){ InitializeAllTargetInfos(); });
+
+  std::string errstr;
+  const Target* target = TargetRegistry::lookupTarget(Triple::normalize(triple), errstr);
+  if (!target) {
+    *errmsg = LLVMCreateMessage(errstr.c_str());
+    return false;
+  }
+  StringRef name = target->getBackendName();
+  if (!_targets_initialized.insert(name).second)
+    return true; // already initialized
+
+  for (auto& f : kTargetInitFuns) {
+    if (name == f.name) {
+      f.target();
+      f.mc();
+    }
+  }
+  for (auto& f : kAsmPrinterInitFuns) {
+    if (name == f.name)
+      f.init();
+  }
+  for (auto& f : kAsmParserInitFuns) {
+    if (name == f.name)
+      f.init();
+  }
+  return true;
+}
+
+
+void llvm_init_all_targets() {
+  llvm_init_targets();
+  std::lock_guard<std::mutex> lock(_targets_mu);
+  if (_targets_all_initialized)
+    return;
+  InitializeAllTargetInfos();
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+  InitializeAllAsmPrinters();
+  InitializeAllAsmParsers();
+  _targets_all_initialized = true;
+}
+
+
 void llvm_triple_info(
   const char*         triplestr,
   CoLLVMArch*         arch_type,
@@ -103,120 +162,515 @@ const char* CoLLVMEnvironment_name(CoLLVMEnvironment v) {
 }
 
 
-bool llvm_optmod(
-  LLVMModuleRef        M,
-  LLVMTargetMachineRef T,
-  CoOptType            opt,
-  bool                 enable_tsan,
-  bool                 enable_lto,
-  char**               errmsg)
-{
-  Module& module = *unwrap(M);
-  TargetMachine& targetMachine = *reinterpret_cast<TargetMachine*>(T);
+// OptReport records where llvm_optmod spends time and why optimizations were not done.
+// Time is measured exclusive of nested passes (e.g. a pass manager's time does not include
+// the time of the passes it runs) and attributed both to the pass and to the function it ran
+// on, if any. Missed-optimization and analysis remarks are recorded from the passes listed
+// in isReportedPass.
+struct OptReport {
+  struct PassTime { u64 ns = 0; u32 count = 0; };
+  struct Remark {
+    const char* kind;
+    std::string pass, name, function, file, message;
+    unsigned line, column;
+  };
+  struct Frame { StringRef pass; std::string function; u64 start; };
+
+  StringMap<PassTime> passes;
+  StringMap<u64>      functions;
+  std::vector<Remark> remarks;
+  std::vector<Frame>  stack; // running passes, innermost last
+
+  static bool isReportedPass(StringRef pass) {
+    return pass == "inline" || pass == "loop-vectorize" || pass == "slp-vectorizer";
+  }
 
-  module.setTargetTriple(targetMachine.getTargetTriple().str());
-  module.setDataLayout(targetMachine.createDataLayout());
+  // ir_function_name returns the name of the function a pass runs on, or "" if none
+  static std::string ir_function_name(Any IR) {
+    if (any_isa<const Function*>(IR))
+      return any_cast<const Function*>(IR)->getName().str();
+    if (any_isa<const Loop*>(IR))
+      return any_cast<const Loop*>(IR)->getHeader()->getParent()->getName().str();
+    if (any_isa<const LazyCallGraph::SCC*>(IR)) {
+      const LazyCallGraph::SCC* C = any_cast<const LazyCallGraph::SCC*>(IR);
+      if (C->size() == 1)
+        return C->begin()->getFunction().getName().str();
+    }
+    return ""; // module or SCC of several functions
+  }
+
+  void charge(Frame& f, u64 now) {
+    u64 ns = now - f.start;
+    passes[f.pass].ns += ns;
+    if (!f.function.empty())
+      functions[f.function] += ns;
+  }
+
+  void beforePass(StringRef pass, Any IR) {
+    u64 now = nanotime();
+    if (!stack.empty())
+      charge(stack.back(), now); // pause enclosing pass
+    stack.push_back({ pass, ir_function_name(IR), now });
+  }
+
+  void afterPass(StringRef pass) {
+    if (stack.empty())
+      return;
+    u64 now = nanotime();
+    charge(stack.back(), now);
+    passes[stack.back().pass].count++;
+    stack.pop_back();
+    if (!stack.empty())
+      stack.back().start = now; // resume enclosing pass
+  }
+
+  void addRemark(const DiagnosticInfoOptimizationBase& R) {
+    Remark r;
+    switch (R.getKind()) {
+      case DK_OptimizationRemark:       r.kind = "passed"; break;
+      case DK_OptimizationRemarkMissed: r.kind = "missed"; break;
+      default:                          r.kind = "analysis"; break;
+    }
+    r.pass = R.getPassName().str();
+    r.name = R.getRemarkName().str();
+    r.function = R.getFunction().getName().str();
+    r.message = R.getMsg();
+    r.line = 0;
+    r.column = 0;
+    if (R.isLocationAvailable()) {
+      r.file = R.getLocation().getRelativePath().str();
+      r.line = R.getLocation().getLine();
+      r.column = R.getLocation().getColumn();
+    }
+    remarks.push_back(std::move(r));
+  }
+
+  std::string json() const {
+    // sort passes and functions by time, most time first
+    std::vector<const StringMapEntry<PassTime>*> passv;
+    for (auto& e : passes)
+      passv.push_back(&e);
+    llvm::sort(passv, [](auto* a, auto* b) { return a->second.ns > b->second.ns; });
+    std::vector<const StringMapEntry<u64>*> funv;
+    for (auto& e : functions)
+      funv.push_back(&e);
+    llvm::sort(funv, [](auto* a, auto* b) { return a->second > b->second; });
+
+    std::string s;
+    raw_string_ostream os(s);
+    json::OStream J(os, 2);
+    J.object([&] {
+      J.attributeArray("passes", [&] {
+        for (auto* e : passv) {
+          J.object([&] {
+            J.attribute("name", e->first());
+            J.attribute("ns", (int64_t)e->second.ns);
+            J.attribute("count", (int64_t)e->second.count);
+          });
+        }
+      });
+      J.attributeArray("functions", [&] {
+        for (auto* e : funv) {
+          J.object([&] {
+            J.attribute("name", e->first());
+            J.attribute("ns", (int64_t)e->second);
+          });
+        }
+      });
+      J.attributeArray("remarks", [&] {
+        for (auto& r : remarks) {
+          J.object([&] {
+            J.attribute("kind", r.kind);
+            J.attribute("pass", r.pass);
+            J.attribute("name", r.name);
+            J.attribute("function", r.function);
+            if (!r.file.empty()) {
+              J.attribute("file", r.file);
+              J.attribute("line", (int64_t)r.line);
+              J.attribute("column", (int64_t)r.column);
+            }
+            J.attribute("message", r.message);
+          });
+        }
+      });
+    });
+    os.flush();
+    return s;
+  }
+};
+
+// OptReportDiagHandler records optimization remarks in an OptReport and passes other
+// diagnostics on to the handler it replaced
+struct OptReportDiagHandler : public DiagnosticHandler {
+  OptReport&                  report;
+  DiagnosticHandler* nullable prev;
 
-  bool optimize = opt != CoOptNone;
+  OptReportDiagHandler(OptReport& report, DiagnosticHandler* nullable prev)
+    : report(report), prev(prev) {}
 
-  // pass performance debugging
-  bool enable_time_report = false;
-  TimePassesIsEnabled = enable_time_report; // global llvm variable
+  bool isAnalysisRemarkEnabled(StringRef pass) const override {
+    return OptReport::isReportedPass(pass);
+  }
+  bool isMissedOptRemarkEnabled(StringRef pass) const override {
+    return OptReport::isReportedPass(pass);
+  }
+  bool isPassedOptRemarkEnabled(StringRef pass) const override { return false; }
+  bool isAnyRemarkEnabled() const override { return true; }
+
+  bool handleDiagnostics(const DiagnosticInfo& DI) override {
+    if (auto* R = dyn_cast<DiagnosticInfoOptimizationBase>(&DI)) {
+      if (R->isEnabled())
+        report.addRemark(*R);
+      return true;
+    }
+    return prev && prev->handleDiagnostics(DI);
+  }
+};
 
-  // Pipeline configurations
-  PipelineTuningOptions pipelineOpt;
-  pipelineOpt.LoopUnrolling = optimize;
-  pipelineOpt.SLPVectorization = optimize;
-  pipelineOpt.LoopVectorization = optimize;
-  pipelineOpt.LoopInterleaving = optimize;
-  pipelineOpt.MergeFunctions = optimize;
 
-  // Instrumentations
-  // https://github.com/ziglang/zig/blob/52d871844c643f396a2bddee0753d24ff7/src/zig_llvm.cpp#L190
+// OptPipeline is the optimization pipeline for one configuration of llvm_optmod, together
+// with the pass builder and analysis managers it runs with. It can be run on any number of
+// modules, one at a time. Analysis results are cleared after each run since they refer to
+// the module.
+struct OptPipeline {
   PassInstrumentationCallbacks instrCallbacks;
-  StandardInstrumentations std_instrumentations(false);
-  std_instrumentations.registerCallbacks(instrCallbacks);
-
-  // optimization pass builder
-  Optional<PGOOptions> pgo = None;
-  PassBuilder passBuilder(&targetMachine, pipelineOpt, pgo, &instrCallbacks);
-  LoopAnalysisManager     loopAM;
-  FunctionAnalysisManager functionAM;
-  CGSCCAnalysisManager    cgsccAM;
-  ModuleAnalysisManager   moduleAM;
-
-  // Register the AA (Alias Analysis) manager first so that our version is the one used
-  functionAM.registerPass([&] { return passBuilder.buildDefaultAAPipeline(); });
-
-  // Register TargetLibraryAnalysis
-  Triple targetTriple(module.getTargetTriple());
-  auto tlii = std::make_unique<TargetLibraryInfoImpl>(targetTriple);
-  functionAM.registerPass([&] { return TargetLibraryAnalysis(*tlii); });
-
-  // Initialize AnalysisManagers
-  passBuilder.registerModuleAnalyses(moduleAM);
-  passBuilder.registerCGSCCAnalyses(cgsccAM);
-  passBuilder.registerFunctionAnalyses(functionAM);
-  passBuilder.registerLoopAnalyses(loopAM);
-  passBuilder.crossRegisterProxies(loopAM, functionAM, cgsccAM, moduleAM);
+  StandardInstrumentations     stdInstrumentations;
+  OptReport* nullable          report = nullptr; // of the current run
+  PassBuilder                  passBuilder;
+  LoopAnalysisManager          loopAM;
+  FunctionAnalysisManager      functionAM;
+  CGSCCAnalysisManager         cgsccAM;
+  ModuleAnalysisManager        moduleAM;
+  ModulePassManager            MPM;
+  FunctionPassManager          FPM; // used instead of MPM when fast is true
+  bool                         fast;
 
   // type alias for convenience
   using OptimizationLevel = typename PassBuilder::OptimizationLevel;
 
-  // IR verification
-  #ifdef DEBUG
-  // Verify the input
-  passBuilder.registerPipelineStartEPCallback([](ModulePassManager& mpm, OptimizationLevel OL) {
-    mpm.addPass(VerifierPass());
-  });
-  // Verify the output
-  passBuilder.registerOptimizerLastEPCallback([](ModulePassManager& mpm, OptimizationLevel OL) {
-    mpm.addPass(VerifierPass());
-  });
-  #endif
+  static PipelineTuningOptions tuningOptions(bool optimize) {
+    PipelineTuningOptions pipelineOpt;
+    pipelineOpt.LoopUnrolling = optimize;
+    pipelineOpt.SLPVectorization = optimize;
+    pipelineOpt.LoopVectorization = optimize;
+    pipelineOpt.LoopInterleaving = optimize;
+    pipelineOpt.MergeFunctions = optimize;
+    return pipelineOpt;
+  }
 
-  // Passes specific for release build
-  if (optimize) {
+  OptPipeline(
+    TargetMachine&       targetMachine,
+    CoOptType            opt,
+    bool                 enable_tsan,
+    CoLLVMLTO            lto,
+    Optional<PGOOptions> pgoOpt)
+    : stdInstrumentations(false)
+    , passBuilder(&targetMachine, tuningOptions(opt != CoOptNone), pgoOpt, &instrCallbacks)
+  {
+    // Instrumentations
+    // https://github.com/ziglang/zig/blob/52d871844c643f396a2bddee0753d24ff7/src/zig_llvm.cpp#L190
+    stdInstrumentations.registerCallbacks(instrCallbacks);
+    instrCallbacks.registerBeforeNonSkippedPassCallback([this](StringRef pass, Any IR) {
+      if (report)
+        report->beforePass(pass, IR);
+    });
+    instrCallbacks.registerAfterPassCallback(
+      [this](StringRef pass, Any, const PreservedAnalyses&) {
+        if (report)
+          report->afterPass(pass);
+      });
+    instrCallbacks.registerAfterPassInvalidatedCallback(
+      [this](StringRef pass, const PreservedAnalyses&) {
+        if (report)
+          report->afterPass(pass);
+      });
+
+    // Debug builds skip the PassBuilder pipeline; its analyses and passes cost more than
+    // they save at -O0. mem2reg is the only pass we run, since instruction selection and
+    // register allocation have less to do without the loads and stores of local variables.
+    // (IR is verified in DEBUG builds of co when it's built.)
+    fast = opt == CoOptNone && lto == CoLLVMLTO_none && !pgoOpt && !enable_tsan;
+    if (fast) {
+      functionAM.registerPass([&] { return PassInstrumentationAnalysis(&instrCallbacks); });
+      functionAM.registerPass([] { return DominatorTreeAnalysis(); });
+      functionAM.registerPass([] { return AssumptionAnalysis(); });
+      FPM.addPass(PromotePass()); // mem2reg
+      return;
+    }
+
+    // Register the AA (Alias Analysis) manager first so that our version is the one used
+    functionAM.registerPass([&] { return passBuilder.buildDefaultAAPipeline(); });
+
+    // Register TargetLibraryAnalysis
+    TargetLibraryInfoImpl tlii(targetMachine.getTargetTriple());
+    functionAM.registerPass([&] { return TargetLibraryAnalysis(tlii); });
+
+    // Initialize AnalysisManagers
+    passBuilder.registerModuleAnalyses(moduleAM);
+    passBuilder.registerCGSCCAnalyses(cgsccAM);
+    passBuilder.registerFunctionAnalyses(functionAM);
+    passBuilder.registerLoopAnalyses(loopAM);
+    passBuilder.crossRegisterProxies(loopAM, functionAM, cgsccAM, moduleAM);
+
+    // IR verification
+    #ifdef DEBUG
+    // Verify the input
     passBuilder.registerPipelineStartEPCallback([](ModulePassManager& mpm, OptimizationLevel OL) {
-      mpm.addPass(createModuleToFunctionPassAdaptor(AddDiscriminatorsPass()));
+      mpm.addPass(VerifierPass());
     });
-  }
-
-  // Thread sanitizer
-  if (enable_tsan) {
+    // Verify the output
     passBuilder.registerOptimizerLastEPCallback([](ModulePassManager& mpm, OptimizationLevel OL) {
-      mpm.addPass(ThreadSanitizerPass());
+      mpm.addPass(VerifierPass());
     });
+    #endif
+
+    // Passes specific for release build
+    if (opt != CoOptNone) {
+      passBuilder.registerPipelineStartEPCallback(
+        [](ModulePassManager& mpm, OptimizationLevel OL) {
+          mpm.addPass(createModuleToFunctionPassAdaptor(AddDiscriminatorsPass()));
+        });
+    }
+
+    // Thread sanitizer
+    if (enable_tsan) {
+      passBuilder.registerOptimizerLastEPCallback(
+        [](ModulePassManager& mpm, OptimizationLevel OL) {
+          mpm.addPass(ThreadSanitizerPass());
+        });
+    }
+
+    // Initialize ModulePassManager
+    OptimizationLevel optLevel;
+    switch (opt) {
+      case CoOptNone:  optLevel = OptimizationLevel::O0; break;
+      case CoOptFast:  optLevel = OptimizationLevel::O3; break;
+      case CoOptSmall: optLevel = OptimizationLevel::Oz; break;
+    }
+    if (optLevel == OptimizationLevel::O0) {
+      // for LTO, PGO instrumentation or tsan
+      MPM = passBuilder.buildO0DefaultPipeline(optLevel, lto != CoLLVMLTO_none);
+      MPM.addPass(createModuleToFunctionPassAdaptor(PromotePass())); // mem2reg
+    } else if (lto == CoLLVMLTO_thin) {
+      // Leaves out passes that are better run after the thin link has imported functions
+      // from other modules (e.g. most inlining and loop unrolling)
+      MPM = passBuilder.buildThinLTOPreLinkDefaultPipeline(optLevel);
+    } else if (lto == CoLLVMLTO_full) {
+      MPM = passBuilder.buildLTOPreLinkDefaultPipeline(optLevel);
+    } else {
+      MPM = passBuilder.buildPerModuleDefaultPipeline(optLevel);
+    }
   }
 
-  // Initialize ModulePassManager
-  ModulePassManager MPM;
-  OptimizationLevel optLevel;
-  switch (opt) {
-    case CoOptNone:  optLevel = OptimizationLevel::O0; break;
-    case CoOptFast:  optLevel = OptimizationLevel::O3; break;
-    case CoOptSmall: optLevel = OptimizationLevel::Oz; break;
+  void run(Module& module, OptReport* nullable report) {
+    this->report = report;
+    if (fast) {
+      for (Function& F : module) {
+        if (!F.isDeclaration())
+          FPM.run(F, functionAM);
+      }
+      functionAM.clear();
+    } else {
+      MPM.run(module, moduleAM);
+      moduleAM.clear();
+      cgsccAM.clear();
+      functionAM.clear();
+      loopAM.clear();
+    }
+    this->report = nullptr;
   }
-  if (optLevel == OptimizationLevel::O0) {
-    MPM = passBuilder.buildO0DefaultPipeline(optLevel, enable_lto);
-    MPM.addPass(createModuleToFunctionPassAdaptor(PromotePass())); // mem2reg
-  } else if (enable_lto) {
-    MPM = passBuilder.buildLTOPreLinkDefaultPipeline(optLevel);
-  } else {
-    MPM = passBuilder.buildPerModuleDefaultPipeline(optLevel);
+};
+
+
+// CoLLVMBackend holds an LLVMContext, target machines and optimization pipelines which are
+// reused by the builds made with it.
+struct CoLLVMBackend {
+  // Builds leave types and constants behind in the context which are only freed with it.
+  // To bound memory use, the context is replaced after this many builds.
+  static const u32 kMaxContextUses = 32;
+
+  LLVMContextRef nullable ctx = nullptr;
+  u32                     ctxuses = 0;
+  std::string             hostCPU, hostFeatures; // "" until needed
+
+  // target machines by triple, CPU, features and codegen opt level (see tmKey)
+  StringMap<std::unique_ptr<TargetMachine>> targetMachines;
+
+  // optimization pipelines by configuration (see llvm_optmod.) Declared after
+  // targetMachines since pipelines refer to target machines.
+  using PipelineKey = std::tuple<TargetMachine*, CoOptType, bool, CoLLVMLTO, CoPGO, std::string>;
+  std::map<PipelineKey, std::unique_ptr<OptPipeline>> pipelines;
+
+  ~CoLLVMBackend() {
+    pipelines.clear();
+    targetMachines.clear();
+    if (ctx)
+      LLVMContextDispose(ctx);
+  }
+};
+
+
+CoLLVMBackend* llvm_backend_create() {
+  return new CoLLVMBackend();
+}
+
+
+void llvm_backend_dispose(CoLLVMBackend* backend) {
+  delete backend;
+}
+
+
+LLVMContextRef llvm_backend_context(CoLLVMBackend* backend) {
+  if (backend->ctx && backend->ctxuses == CoLLVMBackend::kMaxContextUses) {
+    LLVMContextDispose(backend->ctx);
+    backend->ctx = nullptr;
+  }
+  if (!backend->ctx) {
+    backend->ctx = LLVMContextCreate();
+    backend->ctxuses = 0;
+  }
+  backend->ctxuses++;
+  return backend->ctx;
+}
+
+
+LLVMTargetMachineRef llvm_backend_target_machine(
+  CoLLVMBackend* backend, const char* triple, CoOptType opt, char** errmsg)
+{
+  // select host CPU and features (NOT PORTABLE!) when optimizing
+  StringRef CPU = "";      // "" for generic
+  StringRef features = ""; // "" for none
+  if (opt != CoOptNone) {
+    if (backend->hostCPU.empty()) {
+      backend->hostCPU = sys::getHostCPUName().str();
+      SubtargetFeatures sf;
+      StringMap<bool> hostFeatureMap;
+      if (sys::getHostCPUFeatures(hostFeatureMap)) {
+        for (auto& e : hostFeatureMap)
+          sf.AddFeature(e.first(), e.second);
+      }
+      backend->hostFeatures = sf.getString();
+    }
+    CPU = backend->hostCPU;
+    features = backend->hostFeatures;
+  }
+  CodeGenOpt::Level optLevel = opt == CoOptNone ? CodeGenOpt::None : CodeGenOpt::Default;
+  Optional<CodeModel::Model> codeModel = None;
+  if (opt == CoOptSmall)
+    codeModel = CodeModel::Small;
+
+  std::string key;
+  raw_string_ostream(key) << triple << '\0' << CPU << '\0' << features << '\0' << (int)opt;
+  auto& tm = backend->targetMachines[key];
+  if (tm)
+    return reinterpret_cast<LLVMTargetMachineRef>(tm.get());
+
+  std::string errstr;
+  const Target* target = TargetRegistry::lookupTarget(triple, errstr);
+  if (!target) {
+    backend->targetMachines.erase(key);
+    *errmsg = LLVMCreateMessage(errstr.c_str());
+    return NULL;
+  }
+  tm.reset(target->createTargetMachine(
+    triple, CPU, features, TargetOptions(), Reloc::Static, codeModel, optLevel));
+  if (!tm) {
+    backend->targetMachines.erase(key);
+    *errmsg = LLVMCreateMessage("createTargetMachine failed");
+    return NULL;
+  }
+  if (opt == CoOptNone)
+    llvm_tm_use_fast_isel(reinterpret_cast<LLVMTargetMachineRef>(tm.get()));
+  dlog("created target machine: %s %s (%s)", triple, CPU.str().c_str(), target->getName());
+  return reinterpret_cast<LLVMTargetMachineRef>(tm.get());
+}
+
+
+bool llvm_optmod(
+  CoLLVMBackend*       backend,
+  LLVMModuleRef        M,
+  LLVMTargetMachineRef T,
+  CoOptType            opt,
+  bool                 enable_tsan,
+  CoLLVMLTO            lto,
+  CoPGO                pgo,
+  const char* nullable pgofile,
+  char** nullable      reportjson,
+  char**               errmsg)
+{
+  Module& module = *unwrap(M);
+  TargetMachine& targetMachine = *reinterpret_cast<TargetMachine*>(T);
+
+  module.setTargetTriple(targetMachine.getTargetTriple().str());
+  module.setDataLayout(targetMachine.createDataLayout());
+
+  // Profile-guided optimization.
+  // The PGO passes run early in the pipeline, before inlining, so that branch weights
+  // from the profile guide inlining, block placement and the hot/cold splitting of functions.
+  Optional<PGOOptions> pgoOpt = None;
+  switch (pgo) {
+    case CoPGONone:
+      break;
+    case CoPGOGen:
+      // Counters are written to pgofile, or "default.profraw" if pgofile is NULL, when the
+      // program exits. LLVM_PROFILE_FILE in the environment overrides the filename.
+      pgoOpt = PGOOptions(pgofile ? pgofile : "", "", "", PGOOptions::IRInstr);
+      break;
+    case CoPGOUse: {
+      // PGOInstrumentationUse reports an unreadable profile as a fatal error, so check it here.
+      // The profile is read each time the pipeline runs, so it may change between builds.
+      assert(pgofile != NULL);
+      auto reader = IndexedInstrProfReader::create(pgofile);
+      if (!reader)
+        return llvm_error_to_errmsg(reader.takeError(), errmsg);
+      pgoOpt = PGOOptions(pgofile, "", "", PGOOptions::IRUse);
+      break;
+    }
+  }
+
+  // find or create the pipeline for this configuration
+  auto& pipeline = backend->pipelines[CoLLVMBackend::PipelineKey(
+    &targetMachine, opt, enable_tsan, lto, pgo, pgofile ? pgofile : "")];
+  if (!pipeline)
+    pipeline = std::make_unique<OptPipeline>(targetMachine, opt, enable_tsan, lto, pgoOpt);
+
+  // pass timings and optimization remarks for reportjson
+  std::unique_ptr<OptReport> report;
+  std::unique_ptr<DiagnosticHandler> prevDiagHandler;
+  if (reportjson) {
+    report = std::make_unique<OptReport>();
+    LLVMContext& ctx = module.getContext();
+    prevDiagHandler = ctx.getDiagnosticHandler();
+    ctx.setDiagnosticHandler(
+      std::make_unique<OptReportDiagHandler>(*report, prevDiagHandler.get()));
   }
 
   // run passes
-  MPM.run(module, moduleAM);
+  pipeline->run(module, report.get());
 
-  // print perf information
-  if (enable_time_report)
-    TimerGroup::printAll(errs());
+  if (report) {
+    module.getContext().setDiagnosticHandler(std::move(prevDiagHandler));
+    *reportjson = LLVMCreateMessage(report->json().c_str());
+  }
 
   return true;
 }
 
 
+void llvm_tm_use_fast_isel(LLVMTargetMachineRef T) {
+  TargetMachine& targetMachine = *reinterpret_cast<TargetMachine*>(T);
+  assert(targetMachine.getOptLevel() == CodeGenOpt::None);
+  if (targetMachine.Options.EnableGlobalISel) {
+    // The target selected GlobalISel for -O0 (e.g. AArch64.) Make functions it can't
+    // handle fall back to SelectionDAG rather than failing.
+    targetMachine.setGlobalISelAbort(GlobalISelAbortMode::Disable);
+  } else {
+    targetMachine.setO0WantsFastISel(true);
+    targetMachine.setFastISel(true);
+  }
+}
+
+
 bool llvm_emit_bc(LLVMModuleRef M, const char* filename, char** errmsg) {
   // Note: llvm-c provides a simplified function LLVMWriteBitcodeToFile
 
@@ -260,6 +714,160 @@ bool llvm_emit_bc(LLVMModuleRef M, const char* filename, char** errmsg) {
 }
 
 
+LLVMMemoryBufferRef llvm_emit_thinlto_bc(LLVMModuleRef M) {
+  Module& module = *unwrap(M);
+
+  // The module summary describes the module's functions and globals (their references,
+  // calls with hotness, linkage, instruction count etc.) which is all the thin link reads
+  // to decide what to import into which module. Without profile data BFI is computed for
+  // functions which have branch weights only.
+  ProfileSummaryInfo PSI(module);
+  ModuleSummaryIndex index = buildModuleSummaryIndex(module, nullptr, &PSI);
+
+  // The module hash keys the module in the incremental ThinLTO cache
+  SmallVector<char, 0> buf;
+  {
+    raw_svector_ostream os(buf);
+    bool preserveUseListOrder = false;
+    bool genHash = true;
+    WriteBitcodeToFile(module, os, preserveUseListOrder, &index, genHash);
+  }
+
+  auto mb = std::make_unique<SmallVectorMemoryBuffer>(
+    std::move(buf), module.getModuleIdentifier());
+  return wrap(mb.release());
+}
+
+
+bool llvm_profdata_merge(
+  const char** inputv, u32 inputc, const char* outfile, char** errmsg)
+{
+  // Like "llvm-profdata merge", with all inputs weighted equally
+  InstrProfWriter writer;
+  std::string warnings;
+  for (u32 i = 0; i < inputc; i++) {
+    auto readerOrErr = InstrProfReader::create(inputv[i]);
+    if (!readerOrErr)
+      return llvm_error_to_errmsg(readerOrErr.takeError(), errmsg);
+    auto reader = std::move(readerOrErr.get());
+
+    // the first input determines the kind of the profile; all inputs must be of that kind
+    bool isIR = reader->isIRLevelProfile();
+    if (Error err = writer.setIsIRLevelProfile(isIR, reader->hasCSIRLevelProfile())) {
+      consumeError(std::move(err));
+      std::string msg = std::string(inputv[i]) + (isIR ?
+        ": can not merge IR-level profile with a front-end profile" :
+        ": can not merge front-end profile with an IR-level profile");
+      *errmsg = LLVMCreateMessage(msg.c_str());
+      return false;
+    }
+    writer.setInstrEntryBBEnabled(reader->instrEntryBBEnabled());
+
+    for (auto& record : *reader) {
+      const u64 weight = 1;
+      writer.addRecord(std::move(record), weight, [&](Error err) {
+        // e.g. a counter overflowed or a function's hash differs between inputs
+        warnings += std::string(inputv[i]) + ": " + toString(std::move(err)) + "\n";
+      });
+    }
+    if (reader->hasError())
+      return llvm_error_to_errmsg(reader->getError(), errmsg);
+  }
+
+  std::error_code EC;
+  raw_fd_ostream out(outfile, EC, sys::fs::OF_None);
+  if (EC) {
+    *errmsg = LLVMCreateMessage(EC.message().c_str());
+    return false;
+  }
+  if (Error err = writer.write(out))
+    return llvm_error_to_errmsg(std::move(err), errmsg);
+  out.close();
+  if (out.has_error()) {
+    std::string msg = "failed to write " + std::string(outfile) + ": " + out.error().message();
+    out.clear_error();
+    *errmsg = LLVMCreateMessage(msg.c_str());
+    return false;
+  }
+  *errmsg = LLVMCreateMessage(warnings.c_str());
+  return true;
+}
+
+
+bool llvm_emit_mc_parallel(
+  LLVMModuleRef        M,
+  LLVMTargetMachineRef T,
+  LLVMMemoryBufferRef* objv,
+  u32                  objc,
+  char**               errmsg)
+{
+  Module& module = *unwrap(M);
+  TargetMachine& targetMachine = *reinterpret_cast<TargetMachine*>(T);
+
+  std::vector<SmallVector<char, 0>> bufs(objc);
+  std::vector<std::unique_ptr<raw_svector_ostream>> streams;
+  SmallVector<raw_pwrite_stream*, 16> streamv;
+  for (u32 i = 0; i < objc; i++) {
+    streams.emplace_back(std::make_unique<raw_svector_ostream>(bufs[i]));
+    streamv.push_back(streams.back().get());
+  }
+
+  // TargetMachine is not thread safe; each thread gets its own copy of T
+  auto TMFactory = [&]() {
+    return std::unique_ptr<TargetMachine>(targetMachine.getTarget().createTargetMachine(
+      targetMachine.getTargetTriple().str(),
+      targetMachine.getTargetCPU(),
+      targetMachine.getTargetFeatureString(),
+      targetMachine.Options,
+      targetMachine.getRelocationModel(),
+      targetMachine.getCodeModel(),
+      targetMachine.getOptLevel()));
+  };
+
+  // splitCodeGen reports errors in its threads with report_fatal_error, which exits the
+  // process. Check up front that the threads' target machines can be created and can emit
+  // object code, which is what fails for a target machine configured wrong.
+  {
+    std::unique_ptr<TargetMachine> tm = TMFactory();
+    if (!tm) {
+      std::string msg = "failed to create target machine for " +
+        targetMachine.getTargetTriple().str();
+      *errmsg = LLVMCreateMessage(msg.c_str());
+      return false;
+    }
+    legacy::PassManager pm;
+    SmallVector<char, 0> tmpbuf;
+    raw_svector_ostream tmpos(tmpbuf);
+    if (tm->addPassesToEmitFile(pm, tmpos, nullptr, CGFT_ObjectFile)) {
+      *errmsg = LLVMCreateMessage("TargetMachine can't emit a file of this type");
+      return false;
+    }
+  }
+
+  // splitCodeGen distributes globals across partitions with SplitModule, keeping members of
+  // a comdat and aliases with their targets together. Each partition is serialized to
+  // bitcode, which a thread of a pool parses into a new LLVMContext and then codegens.
+  bool preserveLocals = false;
+  splitCodeGen(module, streamv, {}, TMFactory, CGFT_ObjectFile, preserveLocals);
+  streams.clear();
+  for (u32 i = 0; i < objc; i++) {
+    if (bufs[i].empty()) {
+      std::string msg = "no object code generated for partition " + std::to_string(i);
+      *errmsg = LLVMCreateMessage(msg.c_str());
+      return false;
+    }
+  }
+
+  // hand over the object code without copying it
+  for (u32 i = 0; i < objc; i++) {
+    auto buf = std::make_unique<SmallVectorMemoryBuffer>(
+      std::move(bufs[i]), module.getModuleIdentifier());
+    objv[i] = wrap(buf.release());
+  }
+  return true;
+}
+
+
 bool llvm_write_archive(
   const char* arhivefile, const char** filesv, u32 filesc, CoLLVMOS os, char** errmsg)
 {
@@ -4,9 +4,11 @@
 
 #include <llvm-c/Core.h>
 #include <llvm-c/Analysis.h>
+#include <llvm-c/DebugInfo.h>
 #include <llvm-c/Target.h>
 #include <llvm-c/Initialization.h>
 #include <llvm-c/TargetMachine.h>
+#include <llvm-c/LLJIT.h>
 
 #ifdef __cplusplus
   #define EXTERN_C extern "C"
@@ -170,18 +172,72 @@ typedef enum CoLLVMObjectFormat {
   CoLLVMObjectFormat_XCOFF,
 } CoLLVMObjectFormat;
 
+// CoLLVMLTO selects the kind of link-time optimization a module is prepared for
+typedef enum CoLLVMLTO {
+  CoLLVMLTO_none,
+  CoLLVMLTO_full, // whole program is merged into one module at link time
+  CoLLVMLTO_thin, // modules are optimized separately, importing from each other (ThinLTO)
+} CoLLVMLTO;
+
 // CoLLVMVersionTuple represents a version. -1 is used to indicate "not applicable."
 typedef struct CoLLVMVersionTuple { int major, minor, subminor, build; } CoLLVMVersionTuple;
 
-// llvm_build_and_emit
 typedef struct Node Node;
-EXTERN_C bool llvm_build_and_emit(Build* build, Node* pkgnode, const char* triple);
-EXTERN_C int llvm_jit(Build* build, Node* pkgnode);
 
-// llvm_init_targets initializes target info and returns the default target triplet.
+// CoLLVMBackend is a code generation session which is reused across builds, e.g. by a build
+// server or test runner which builds many times in one process. It keeps an LLVMContext,
+// target machines and optimization pipelines around so that only the first build which
+// needs one of them pays for setting it up. Target machines are cached per triple, CPU,
+// features and optimization level, pipelines per configuration of llvm_optmod.
+// A backend is not thread safe; builds running at the same time need a backend each.
+typedef struct CoLLVMBackend CoLLVMBackend;
+
+EXTERN_C CoLLVMBackend* llvm_backend_create();
+EXTERN_C void llvm_backend_dispose(CoLLVMBackend*);
+
+// llvm_backend_context returns the LLVMContext to create a build's module in.
+// The backend replaces its context every now and then to free up types and constants left
+// behind by earlier builds, so any module created in a context returned by a previous call
+// must have been disposed of.
+EXTERN_C LLVMContextRef llvm_backend_context(CoLLVMBackend*);
+
+// llvm_backend_target_machine returns a target machine for triple, creating it on first use.
+// When optimizing, it generates code for the host CPU. The target machine is owned by the
+// backend; do not dispose of it. The target of triple must have been initialized with
+// llvm_init_target.
+// Returns NULL on error and sets errmsg; caller should dispose it with LLVMDisposeMessage.
+EXTERN_C LLVMTargetMachineRef nullable llvm_backend_target_machine(
+  CoLLVMBackend*, const char* triple, CoOptType opt, char** errmsg);
+
+// llvm_build_and_emit builds pkgnode into an LLVM module and emits the products selected
+// by build->emit for triple, naming them with build_outpath. The module is built in the
+// context of backend, with its target machine and optimization pipeline for the build.
+// Object code is generated in memory and passed to lld_link as memory buffers, which copies
+// each of them once more into a memfd or a temporary file since lld only reads inputs by path
+// (see CoLLDOptions.inbufv.) Object files are only written for CoEmitObj:
+// build_outpath(build, ".o"), and when codegen is split into partitions (see Build.cgparts)
+// build_outpath(build, ".1.o"), build_outpath(build, ".2.o") and so on.
+// With build->thinlto, ThinLTO bitcode (see llvm_emit_thinlto_bc) takes the place of object
+// code, in memory and in object files, and lld optimizes and codegens it when linking.
+// On success the object code of each partition is appended to objv as LLVMMemoryBufferRef
+// (allocated in MemHeap); caller should LLVMDisposeMemoryBuffer each.
+EXTERN_C bool llvm_build_and_emit(
+  CoLLVMBackend* backend, Build* build, Node* pkgnode, const char* triple, Array* objv);
+
+// llvm_init_targets initializes the native target and returns the default target triplet.
 // Safe to call multiple times. Just returns a cached value on subsequent calls.
 EXTERN_C const char* llvm_init_targets();
 
+// llvm_init_target initializes the target (codegen, MC, asm printer and parser) for triple.
+// Only the native target is initialized by llvm_init_targets; call this before using any
+// other target. Safe to call multiple times and from multiple threads.
+// Returns false on error and sets errmsg; caller should dispose it with LLVMDisposeMessage.
+EXTERN_C bool llvm_init_target(const char* triple, char** errmsg);
+
+// llvm_init_all_targets initializes all targets, which is needed by some of lld's drivers.
+// Safe to call multiple times and from multiple threads.
+EXTERN_C void llvm_init_all_targets();
+
 // llvm_triple_info returns structured information about a target triple
 EXTERN_C void llvm_triple_info(
   const char*         triple,
@@ -203,16 +259,47 @@ EXTERN_C const char* CoLLVMArch_name(CoLLVMArch); // canonical name
 EXTERN_C const char* CoLLVMVendor_name(CoLLVMVendor); // canonical name
 EXTERN_C const char* CoLLVMEnvironment_name(CoLLVMEnvironment); // canonical name
 
-// llvm_optmod applies module-wide optimizations.
+// llvm_optmod applies module-wide optimizations, using the backend's pipeline for the
+// configuration (creating it on first use.) targetm must come from llvm_backend_target_machine.
+// With opt=CoOptNone and no lto, pgo or tsan, only mem2reg is run ("debug" builds.)
+// With lto other than CoLLVMLTO_none, the module is prepared for link-time optimization
+// (the "pre-link" pipeline) rather than fully optimized.
+// With pgo=CoPGOGen the module is instrumented to write a profile to pgofile when run and
+// with pgo=CoPGOUse it is optimized with the profile in pgofile (see Build.pgo.)
+// If reportjson is not NULL, it is set to a JSON object with the time spent in each pass and
+// in each function, and remarks about missed inlining and vectorization:
+//   { "passes":    [ {"name": "InstCombinePass", "ns": 1234, "count": 8}, ... ],
+//     "functions": [ {"name": "main", "ns": 1234}, ... ],
+//     "remarks":   [ {"kind": "missed", "pass": "loop-vectorize", "name": "MissedDetails",
+//                     "function": "main", "file": "a.co", "line": 3, "column": 5,
+//                     "message": "loop not vectorized"}, ... ] }
+// Caller should dispose it with LLVMDisposeMessage.
 // Returns false on error and sets errmsg; caller should dispose it with LLVMDisposeMessage.
 EXTERN_C bool llvm_optmod(
+  CoLLVMBackend*       backend,
   LLVMModuleRef        mod,
   LLVMTargetMachineRef targetm,
   CoOptType            opt,
   bool                 enable_tsan,
-  bool                 enable_lto,
+  CoLLVMLTO            lto,
+  CoPGO                pgo,
+  const char* nullable pgofile,
+  char** nullable      reportjson,
   char**               errmsg);
 
+// llvm_tm_use_fast_isel makes T select instructions the fastest way available for -O0 code
+// generation: with FastISel, or GlobalISel on targets which use it at -O0 (e.g. AArch64.)
+// Functions or instructions not supported by the fast selector fall back to SelectionDAG.
+// T must have been created with LLVMCodeGenLevelNone.
+EXTERN_C void llvm_tm_use_fast_isel(LLVMTargetMachineRef T);
+
+// llvm_profdata_merge merges profiles (.profraw files written by programs built with
+// CoPGOGen, or .profdata files) into an indexed profile at outfile, for use with CoPGOUse.
+// Always sets errmsg; on success it contains warnings (if any.)
+// Caller must always call LLVMDisposeMessage on errmsg.
+EXTERN_C bool llvm_profdata_merge(
+  const char** inputv, u32 inputc, const char* outfile, char** errmsg);
+
 // llvm_emit_bc writes LLVM IR (text) code to filename.
 // Returns false on error and sets errmsg; caller should dispose it with LLVMDisposeMessage.
 static bool llvm_emit_ir(LLVMModuleRef, const char* filename, char** errmsg);
@@ -221,12 +308,34 @@ static bool llvm_emit_ir(LLVMModuleRef, const char* filename, char** errmsg);
 // Returns false on error and sets errmsg; caller should dispose it with LLVMDisposeMessage.
 EXTERN_C bool llvm_emit_bc(LLVMModuleRef, const char* filename, char** errmsg);
 
+// llvm_emit_thinlto_bc returns LLVM bitcode of M with a module summary index and module hash,
+// for ThinLTO. Such bitcode can be given to lld_link in place of object code, which then
+// performs a thin link (see CoLLDOptions.ltojobs.) M should have been optimized with
+// llvm_optmod(..., CoLLVMLTO_thin, ...)
+// Caller should dispose of the buffer with LLVMDisposeMemoryBuffer.
+EXTERN_C LLVMMemoryBufferRef llvm_emit_thinlto_bc(LLVMModuleRef M);
+
 // llvm_emit_mc applies module-wide optimizations (unless CoBuildDebug) and emits machine-specific
 // code to asm_outfile and/or bin_outfile.
 // Returns false on error and sets errmsg; caller should dispose it with LLVMDisposeMessage.
 static bool llvm_emit_mc(
   LLVMModuleRef, LLVMTargetMachineRef, LLVMCodeGenFileType, const char* filename, char** errmsg);
 
+// llvm_emit_mc_parallel splits M into objc partitions and emits an object file in memory for
+// each partition to objv, generating machine code for the partitions concurrently on separate
+// threads, each with its own LLVMContext and target machine (a copy of T).
+// Local symbols of M are made external (with hidden visibility) so that they can be
+// referenced across partitions, which means M is modified.
+// Caller should dispose of the buffers with LLVMDisposeMemoryBuffer.
+// Returns false on error, with objv untouched, and sets errmsg; caller should dispose it with
+// LLVMDisposeMessage.
+EXTERN_C bool llvm_emit_mc_parallel(
+  LLVMModuleRef        M,
+  LLVMTargetMachineRef T,
+  LLVMMemoryBufferRef* objv,
+  u32                  objc,
+  char**               errmsg);
+
 // llvm_write_archive creates an archive (like the ar tool) at arhivefile with filesv.
 // Returns false on error and sets errmsg; caller should dispose it with LLVMDisposeMessage.
 EXTERN_C bool llvm_write_archive(
@@ -243,6 +352,18 @@ typedef struct CoLLDOptions {
   const char* nullable outfile; // output file. NULL for no output
   u32                  infilec; // input file count
   const char**         infilev; // input file array
+  u32                  inbufc;  // input memory buffer count
+  LLVMMemoryBufferRef* inbufv;  // input object files in memory (e.g. from codegen).
+                                // Each buffer is copied into a memory-backed file (memfd) on
+                                // Linux, or a temporary file elsewhere, for lld to read.
+
+  // ThinLTO. Set thinlto when some inputs are ThinLTO bitcode (see llvm_emit_thinlto_bc.)
+  // The backends optimize at the level of opt. Not supported for Mach-O.
+  bool                 thinlto;
+  u32                  ltojobs;     // ThinLTO backend threads (0 = one per CPU)
+  const char* nullable ltocachedir; // directory for incremental ThinLTO cache. NULL = none
+
+  bool                 profrt; // link the profile runtime (for code instrumented with CoPGOGen)
 } CoLLDOptions;
 
 // lld_link links objects, archives and shared libraries together into a library or executable.
@@ -250,10 +371,51 @@ typedef struct CoLLDOptions {
 // Always sets errmsg; on success it contains warning messages (if any.)
 // Caller must always call LLVMDisposeMessage on errmsg.
 // Returns true on success.
+// lld_link can be called any number of times and from any thread. lld only supports one link
+// per process at a time, so concurrent calls are serialized unless links are isolated.
 EXTERN_C bool lld_link(CoLLDOptions* options, char** errmsg);
 
+// lld_set_isolated controls whether lld_link runs lld in this process (the default) or in a
+// new helper process for each link. Isolated links run concurrently, do not grow this
+// process's memory and a crash in lld does not affect later links, at the cost of starting a
+// process per link. The helper is this process's executable, started with posix_spawn (not
+// fork, so it's safe to use from any thread), which must call lld_helper_main.
+// Has no effect on Windows. After lld crashed in this process, links are always isolated.
+EXTERN_C void lld_set_isolated(bool enable);
+
+// lld_helper_main is the main function of the helper process of isolated links (see
+// lld_set_isolated.) Executables which use lld_link must call it from main when argv[1] is
+// LLD_HELPER_CMD, before doing anything else:
+//   if (argc > 1 && strcmp(argv[1], LLD_HELPER_CMD) == 0)
+//     return lld_helper_main(argc - 2, argv + 2);
+// Messages from lld are written to stderr. Returns 0 on success, 1 if the link failed and
+// 2 if lld crashed.
+#define LLD_HELPER_CMD "__lld"
+EXTERN_C int lld_helper_main(int argc, const char** argv);
+
 // —— JIT ——
 
+// CoLLVMJITCacheStats counts lookups in the object cache of a JIT created by llvm_jit_create
+typedef struct CoLLVMJITCacheStats {
+  u32 hits;   // modules loaded from the cache
+  u32 misses; // modules compiled (and stored in the cache)
+} CoLLVMJITCacheStats;
+
+// llvm_jit_create creates a JIT for the host. If cachedir is not NULL, objects compiled by
+// the JIT are stored in cachedir, keyed on the module's bitcode and the target machine, and
+// modules found in the cache are loaded instead of compiled. Lookups are counted in stats.
+// stats must remain valid until the JIT is disposed of with LLVMOrcDisposeLLJIT.
+EXTERN_C LLVMErrorRef llvm_jit_create(
+  LLVMOrcLLJITRef* result, const char* nullable cachedir, CoLLVMJITCacheStats* nullable stats);
+
+// llvm_jit builds pkgnode and runs its main function in a JIT, storing the value returned by
+// main in *result. If cachedir is not NULL, compiled objects are cached in cachedir/jit so that
+// subsequent runs of the same program skip codegen (see llvm_jit_create.)
+// Returns false if the program could not be compiled or run; the error is printed to stderr.
+EXTERN_C bool llvm_jit(
+  Build* build, Node* pkgnode, const char* nullable cachedir,
+  CoLLVMJITCacheStats* nullable stats, int* result);
+
 typedef struct CoJIT CoJIT;
 
 EXTERN_C CoJIT* jit_create(Error* err);
@@ -0,0 +1,781 @@
+#include "../common.h"
+#if R_TESTING_ENABLED
+#include "llvm.h"
+#include "../parse/parse.h"
+#include <llvm-c/Object.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <sys/wait.h>
+
+// test_module builds a module with nfuns functions in ctx.
+// Function i returns x*i + (function i-1)(x); "main" calls the last one.
+static LLVMModuleRef test_module(LLVMContextRef ctx, u32 nfuns) {
+  LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("llvm_test", ctx);
+  LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+  LLVMTypeRef fnty = LLVMFunctionType(i32, &i32, 1, false);
+  LLVMBuilderRef b = LLVMCreateBuilderInContext(ctx);
+  LLVMValueRef prevfn = NULL;
+  char name[32];
+  for (u32 i = 0; i < nfuns; i++) {
+    snprintf(name, sizeof(name), "f%u", i);
+    LLVMValueRef fn = LLVMAddFunction(mod, name, fnty);
+    LLVMSetLinkage(fn, LLVMInternalLinkage);
+    LLVMPositionBuilderAtEnd(b, LLVMAppendBasicBlockInContext(ctx, fn, ""));
+    // store x to a local var and load it back, for mem2reg to do something
+    LLVMValueRef xptr = LLVMBuildAlloca(b, i32, "x");
+    LLVMBuildStore(b, LLVMGetParam(fn, 0), xptr);
+    LLVMValueRef x = LLVMBuildLoad2(b, i32, xptr, "");
+    LLVMValueRef v = LLVMBuildMul(b, x, LLVMConstInt(i32, i, false), "");
+    if (prevfn) {
+      LLVMValueRef r = LLVMBuildCall2(b, fnty, prevfn, &x, 1, "");
+      v = LLVMBuildAdd(b, v, r, "");
+    }
+    LLVMBuildRet(b, v);
+    prevfn = fn;
+  }
+  LLVMValueRef mainfn = LLVMAddFunction(mod, "main", LLVMFunctionType(i32, NULL, 0, false));
+  LLVMPositionBuilderAtEnd(b, LLVMAppendBasicBlockInContext(ctx, mainfn, ""));
+  LLVMValueRef arg = LLVMConstInt(i32, 1, false);
+  LLVMBuildRet(b, LLVMBuildCall2(b, fnty, prevfn, &arg, 1, ""));
+  LLVMDisposeBuilder(b);
+  return mod;
+}
+
+// test_build builds, optimizes and generates object code for a test module with backend,
+// like llvm_build_and_emit does
+static void test_build(CoLLVMBackend* backend, CoOptType opt, u32 nfuns) {
+  const char* triple = llvm_init_targets();
+  char* errmsg;
+  LLVMModuleRef mod = test_module(llvm_backend_context(backend), nfuns);
+  LLVMTargetMachineRef tm = llvm_backend_target_machine(backend, triple, opt, &errmsg);
+  if (!tm)
+    panic("llvm_backend_target_machine: %s", errmsg);
+  if (!llvm_optmod(
+        backend, mod, tm, opt, /*tsan*/false, CoLLVMLTO_none, CoPGONone, NULL, NULL, &errmsg))
+  {
+    panic("llvm_optmod: %s", errmsg);
+  }
+  LLVMMemoryBufferRef obj;
+  if (LLVMTargetMachineEmitToMemoryBuffer(tm, mod, LLVMObjectFile, &errmsg, &obj) != 0)
+    panic("LLVMTargetMachineEmitToMemoryBuffer: %s", errmsg);
+  assert(LLVMGetBufferSize(obj) > 0);
+  LLVMDisposeMemoryBuffer(obj);
+  LLVMDisposeModule(mod);
+}
+
+
+R_TEST(llvm_backend) {
+  const char* triple = llvm_init_targets();
+  CoLLVMBackend* backend = llvm_backend_create();
+  char* errmsg;
+
+  // target machines are cached per opt level (and triple, CPU and features)
+  LLVMTargetMachineRef tm0 = llvm_backend_target_machine(backend, triple, CoOptNone, &errmsg);
+  LLVMTargetMachineRef tm1 = llvm_backend_target_machine(backend, triple, CoOptFast, &errmsg);
+  assertnotnull(tm0);
+  assertnotnull(tm1);
+  assert(tm0 != tm1);
+  asserteq(llvm_backend_target_machine(backend, triple, CoOptNone, &errmsg), tm0);
+  asserteq(llvm_backend_target_machine(backend, triple, CoOptFast, &errmsg), tm1);
+  assertnull(llvm_backend_target_machine(backend, "nonsense-triple", CoOptNone, &errmsg));
+  LLVMDisposeMessage(errmsg);
+
+  // the same context is used for consecutive builds
+  LLVMContextRef ctx = llvm_backend_context(backend);
+  asserteq(llvm_backend_context(backend), ctx);
+
+  // pipelines run correctly more than once
+  for (int i = 0; i < 3; i++) {
+    test_build(backend, CoOptNone, 10);
+    test_build(backend, CoOptFast, 10);
+  }
+
+  llvm_backend_dispose(backend);
+}
+
+// count_substr returns the number of times sub occurs in s
+static u32 count_substr(const char* s, const char* sub) {
+  u32 n = 0;
+  for (s = strstr(s, sub); s; s = strstr(s + 1, sub))
+    n++;
+  return n;
+}
+
+R_TEST(llvm_fast_tier) {
+  // CoOptNone without lto, pgo or tsan runs mem2reg and nothing else, and generates code
+  // with a target machine set up by llvm_tm_use_fast_isel
+  CoLLVMBackend* backend = llvm_backend_create();
+  char* errmsg;
+  LLVMTargetMachineRef tm = llvm_backend_target_machine(
+    backend, llvm_init_targets(), CoOptNone, &errmsg);
+  assertnotnull(tm);
+  LLVMModuleRef mod = test_module(llvm_backend_context(backend), 10);
+  assert(llvm_optmod(
+    backend, mod, tm, CoOptNone, false, CoLLVMLTO_none, CoPGONone, NULL, NULL, &errmsg));
+  char* ir = LLVMPrintModuleToString(mod);
+  // vars are promoted to registers
+  assertnull(strstr(ir, "alloca"));
+  assertnull(strstr(ir, "load"));
+  // but nothing else is optimized: no function is inlined or removed and x*0 and x*1 are
+  // not folded
+  asserteq(count_substr(ir, "define internal i32 @f"), 10);
+  asserteq(count_substr(ir, " = mul i32 "), 10);
+  LLVMDisposeMessage(ir);
+
+  LLVMMemoryBufferRef obj;
+  assert(LLVMTargetMachineEmitToMemoryBuffer(tm, mod, LLVMObjectFile, &errmsg, &obj) == 0);
+  assert(LLVMGetBufferSize(obj) > 0);
+  LLVMDisposeMemoryBuffer(obj);
+  LLVMDisposeModule(mod);
+  llvm_backend_dispose(backend);
+}
+
+
+// json_skip_space returns s with leading whitespace skipped
+static const char* json_skip_space(const char* s) {
+  while (*s == ' ' || *s == '\n' || *s == '\t' || *s == '\r')
+    s++;
+  return s;
+}
+
+// json_string returns the end of the JSON string at s, or NULL if it's not a valid string
+static const char* json_string(const char* s) {
+  if (*s++ != '"')
+    return NULL;
+  while (*s != '"') {
+    if ((u8)*s < 0x20) // control character or end of input
+      return NULL;
+    if (*s++ != '\\')
+      continue;
+    if (*s == 'u') {
+      for (int i = 1; i <= 4; i++) {
+        if (!isxdigit(s[i]))
+          return NULL;
+      }
+      s += 5;
+    } else if (*s && strchr("\"\\/bfnrt", *s)) {
+      s++;
+    } else {
+      return NULL;
+    }
+  }
+  return s + 1;
+}
+
+// json_value returns the end of the JSON value at s, or NULL if s is not valid JSON
+static const char* json_value(const char* s) {
+  s = json_skip_space(s);
+  switch (*s) {
+    case '{': case '[': {
+      char end = *s == '{' ? '}' : ']';
+      s = json_skip_space(s + 1);
+      if (*s == end)
+        return s + 1;
+      while (1) {
+        if (end == '}') {
+          if (!(s = json_string(json_skip_space(s))))
+            return NULL;
+          s = json_skip_space(s);
+          if (*s++ != ':')
+            return NULL;
+        }
+        if (!(s = json_value(s)))
+          return NULL;
+        s = json_skip_space(s);
+        if (*s == end)
+          return s + 1;
+        if (*s++ != ',')
+          return NULL;
+      }
+    }
+    case '"':
+      return json_string(s);
+    case 't':
+      return strncmp(s, "true", 4) == 0 ? s + 4 : NULL;
+    case 'f':
+      return strncmp(s, "false", 5) == 0 ? s + 5 : NULL;
+    case 'n':
+      return strncmp(s, "null", 4) == 0 ? s + 4 : NULL;
+    default: // number
+      if (*s == '-')
+        s++;
+      if (!isdigit(*s))
+        return NULL;
+      while (isdigit(*s) || *s == '.' || *s == 'e' || *s == 'E' || *s == '+' || *s == '-')
+        s++;
+      return s;
+  }
+}
+
+// json_valid returns true if s is a single valid JSON value
+static bool json_valid(const char* s) {
+  const char* end = json_value(s);
+  return end && *json_skip_space(end) == 0;
+}
+
+R_TEST(llvm_optreport) {
+  CoLLVMBackend* backend = llvm_backend_create();
+  LLVMContextRef ctx = llvm_backend_context(backend);
+  char* errmsg;
+  LLVMTargetMachineRef tm = llvm_backend_target_machine(
+    backend, llvm_init_targets(), CoOptFast, &errmsg);
+  assertnotnull(tm);
+
+  // "main" calls "g", which is marked noinline, which the inliner reports as missed
+  LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("llvm_test", ctx);
+  LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+  LLVMTypeRef fnty = LLVMFunctionType(i32, &i32, 1, false);
+  LLVMBuilderRef b = LLVMCreateBuilderInContext(ctx);
+  LLVMValueRef fn = LLVMAddFunction(mod, "g", fnty);
+  u32 noinline = LLVMGetEnumAttributeKindForName("noinline", 8);
+  LLVMAddAttributeAtIndex(
+    fn, LLVMAttributeFunctionIndex, LLVMCreateEnumAttribute(ctx, noinline, 0));
+  LLVMPositionBuilderAtEnd(b, LLVMAppendBasicBlockInContext(ctx, fn, ""));
+  LLVMBuildRet(b, LLVMBuildMul(b, LLVMGetParam(fn, 0), LLVMConstInt(i32, 3, false), ""));
+  LLVMValueRef mainfn = LLVMAddFunction(mod, "main", LLVMFunctionType(i32, NULL, 0, false));
+  LLVMPositionBuilderAtEnd(b, LLVMAppendBasicBlockInContext(ctx, mainfn, ""));
+  LLVMValueRef arg = LLVMConstInt(i32, 1, false);
+  LLVMBuildRet(b, LLVMBuildCall2(b, fnty, fn, &arg, 1, ""));
+  LLVMDisposeBuilder(b);
+
+  char* json;
+  assert(llvm_optmod(
+    backend, mod, tm, CoOptFast, false, CoLLVMLTO_none, CoPGONone, NULL, &json, &errmsg));
+  assert(json_valid(json));
+  assertnotnull(strstr(json, "\"passes\": ["));
+  assertnotnull(strstr(json, "\"functions\": ["));
+  const char* remarks = strstr(json, "\"remarks\": [");
+  assertnotnull(remarks);
+  assertnotnull(strstr(remarks, "\"kind\": \"missed\""));
+  assertnotnull(strstr(remarks, "\"pass\": \"inline\""));
+  assertnotnull(strstr(remarks, "\"function\": \"main\""));
+  LLVMDisposeMessage(json);
+
+  // without optimization there is nothing to report
+  LLVMTargetMachineRef tm0 = llvm_backend_target_machine(
+    backend, llvm_init_targets(), CoOptNone, &errmsg);
+  LLVMModuleRef mod0 = test_module(ctx, 2);
+  assert(llvm_optmod(
+    backend, mod0, tm0, CoOptNone, false, CoLLVMLTO_none, CoPGONone, NULL, &json, &errmsg));
+  assert(json_valid(json));
+  assertnotnull(strstr(json, "\"remarks\": []"));
+  LLVMDisposeMessage(json);
+
+  LLVMDisposeModule(mod);
+  LLVMDisposeModule(mod0);
+  llvm_backend_dispose(backend);
+}
+
+
+// test_pkg parses and type-checks a package with a single source file of text in b
+static Node* test_pkg(Build* b, const char* text) {
+  b->pkg->id = "llvm_test";
+  auto src = memalloct(b->mem, Source);
+  SourceInitMem(src, b->pkg, "input.co", text, strlen(text));
+  PkgAddSource(b->pkg, src);
+  Scope* pkgscope = ScopeNew(GetGlobalScope(), b->mem);
+  Node* pkg = CreatePkgAST(b, pkgscope);
+  assert(ParsePkg(b, pkg, ParseFlagsDefault, 1));
+  if (NodeIsUnresolved(pkg))
+    pkg = ResolveSym(b, ParseFlagsDefault, pkg, pkgscope);
+  pkg = ResolveType(b, pkg);
+  asserteq(b->errcount, 0);
+  return pkg;
+}
+
+static int rmtree_visit(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+  return remove(path);
+}
+
+// rmtree removes dir and everything in it
+static void rmtree(const char* dir) {
+  nftw(dir, rmtree_visit, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+
+R_TEST(llvm_jit) {
+  char cachedir[] = "/tmp/co-llvm-jit-test.XXXXXX";
+  assertnotnull(mkdtemp(cachedir));
+  const char* text =
+    "fun add(x, y int) int {\n"
+    "  x + y\n"
+    "}\n"
+    "fun main() int {\n"
+    "  add(40, 2)\n"
+    "}\n";
+  CoLLVMJITCacheStats stats = {0};
+  for (u32 i = 0; i < 2; i++) {
+    Build* b = test_build_new();
+    Node* pkg = test_pkg(b, text);
+    int result = 0;
+    assert(llvm_jit(b, pkg, cachedir, &stats, &result));
+    asserteq(result, 42);
+    test_build_free(b);
+  }
+  // the second run loads the object compiled by the first one from the cache
+  asserteq(stats.misses, 1);
+  asserteq(stats.hits, 1);
+  rmtree(cachedir);
+}
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+// test_crt returns object code for a _start function which calls main and exits with the
+// value it returns, since lld_link does not link a C runtime
+static LLVMMemoryBufferRef test_crt(LLVMContextRef ctx, LLVMTargetMachineRef tm) {
+  #if defined(__x86_64__)
+    const char* text =
+      ".text\n.globl _start\n_start:\n"
+      "  call main\n  movl %eax, %edi\n  movl $60, %eax\n  syscall\n"; // exit(main())
+  #else
+    const char* text =
+      ".text\n.globl _start\n_start:\n"
+      "  bl main\n  mov x8, #93\n  svc #0\n"; // exit(main())
+  #endif
+  LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("crt", ctx);
+  char* triple = LLVMGetTargetMachineTriple(tm);
+  LLVMSetTarget(mod, triple);
+  LLVMDisposeMessage(triple);
+  LLVMSetModuleInlineAsm2(mod, text, strlen(text));
+  char* errmsg;
+  LLVMMemoryBufferRef obj;
+  if (LLVMTargetMachineEmitToMemoryBuffer(tm, mod, LLVMObjectFile, &errmsg, &obj) != 0)
+    panic("LLVMTargetMachineEmitToMemoryBuffer: %s", errmsg);
+  LLVMDisposeModule(mod);
+  return obj;
+}
+
+// count_fundefs returns the number of functions of a test_module defined in obj
+static u32 count_fundefs(LLVMContextRef ctx, LLVMMemoryBufferRef obj) {
+  char* errmsg;
+  LLVMBinaryRef bin = LLVMCreateBinary(obj, ctx, &errmsg);
+  if (!bin)
+    panic("LLVMCreateBinary: %s", errmsg);
+  u32 n = 0;
+  LLVMSymbolIteratorRef it = LLVMObjectFileCopySymbolIterator(bin);
+  for (; !LLVMObjectFileIsSymbolIteratorAtEnd(bin, it); LLVMMoveToNextSymbol(it)) {
+    const char* name = LLVMGetSymbolName(it);
+    // undefined symbols have no size
+    if ((name[0] == 'f' || strcmp(name, "main") == 0) && LLVMGetSymbolSize(it) > 0)
+      n++;
+  }
+  LLVMDisposeSymbolIterator(it);
+  LLVMDisposeBinary(bin);
+  return n;
+}
+
+R_TEST(llvm_emit_mc_parallel) {
+  char dir[] = "/tmp/co-llvm-mcparallel-test.XXXXXX";
+  assertnotnull(mkdtemp(dir));
+  CoLLVMBackend* backend = llvm_backend_create();
+  LLVMContextRef ctx = llvm_backend_context(backend);
+  const char* triple = llvm_init_targets();
+  char* errmsg;
+  LLVMTargetMachineRef tm = llvm_backend_target_machine(backend, triple, CoOptNone, &errmsg);
+  assertnotnull(tm);
+  LLVMModuleRef mod = test_module(ctx, 10);
+  assert(llvm_optmod(
+    backend, mod, tm, CoOptNone, false, CoLLVMLTO_none, CoPGONone, NULL, NULL, &errmsg));
+
+  // the functions, which call each other, are spread over the partitions
+  LLVMMemoryBufferRef objv[5];
+  const u32 nparts = 4;
+  assert(llvm_emit_mc_parallel(mod, tm, objv, nparts, &errmsg));
+  u32 nfuns = 0, nobjs = 0;
+  for (u32 i = 0; i < nparts; i++) {
+    u32 n = count_fundefs(ctx, objv[i]);
+    nfuns += n;
+    nobjs += n > 0;
+  }
+  asserteq(nfuns, 11); // f0 ... f9 and main
+  assert(nobjs > 1);
+  LLVMDisposeModule(mod);
+
+  // linked together, calls across partitions resolve; main returns f9(1) = 1+2+...+9
+  objv[nparts] = test_crt(ctx, tm);
+  Str exefile = path_join(dir, "out.exe");
+  CoLLDOptions lldopt = {
+    .targetTriple = triple,
+    .opt = CoOptNone,
+    .outfile = exefile,
+    .inbufc = countof(objv),
+    .inbufv = objv,
+  };
+  bool ok = lld_link(&lldopt, &errmsg);
+  if (!ok)
+    errlog("lld_link: %s", errmsg);
+  LLVMDisposeMessage(errmsg);
+  assert(ok);
+  int status = system(exefile);
+  assert(WIFEXITED(status));
+  asserteq(WEXITSTATUS(status), 45);
+
+  for (u32 i = 0; i < countof(objv); i++)
+    LLVMDisposeMemoryBuffer(objv[i]);
+  llvm_backend_dispose(backend);
+  rmtree(dir);
+  str_free(exefile);
+}
+
+R_TEST(llvm_thinlto_link) {
+  char dir[] = "/tmp/co-llvm-thinlto-test.XXXXXX";
+  assertnotnull(mkdtemp(dir));
+  CoLLVMBackend* backend = llvm_backend_create();
+  LLVMContextRef ctx = llvm_backend_context(backend);
+  const char* triple = llvm_init_targets();
+  char* errmsg;
+  LLVMTargetMachineRef tm = llvm_backend_target_machine(backend, triple, CoOptFast, &errmsg);
+  assertnotnull(tm);
+  LLVMModuleRef mod = test_module(ctx, 10);
+  assert(llvm_optmod(
+    backend, mod, tm, CoOptFast, false, CoLLVMLTO_thin, CoPGONone, NULL, NULL, &errmsg));
+
+  // bitcode with a module summary, for the thin link
+  LLVMMemoryBufferRef objv[2];
+  objv[0] = llvm_emit_thinlto_bc(mod);
+  assert(LLVMGetBufferSize(objv[0]) > 4);
+  asserteq(memcmp(LLVMGetBufferStart(objv[0]), "BC\xc0\xde", 4), 0);
+  objv[1] = test_crt(ctx, tm);
+  LLVMDisposeModule(mod);
+
+  // lld optimizes and generates code for the bitcode after the thin link, caching the
+  // result of each module in ltocachedir
+  Str exefile = path_join(dir, "out.exe");
+  Str cachedir = path_join(dir, "thinlto");
+  CoLLDOptions lldopt = {
+    .targetTriple = triple,
+    .opt = CoOptFast,
+    .outfile = exefile,
+    .inbufc = countof(objv),
+    .inbufv = objv,
+    .thinlto = true,
+    .ltojobs = 2,
+    .ltocachedir = cachedir,
+  };
+  for (int i = 0; i < 2; i++) { // again with the cache populated
+    bool ok = lld_link(&lldopt, &errmsg);
+    if (!ok)
+      errlog("lld_link: %s", errmsg);
+    LLVMDisposeMessage(errmsg);
+    assert(ok);
+    int status = system(exefile);
+    assert(WIFEXITED(status));
+    asserteq(WEXITSTATUS(status), 45);
+    unlink(exefile);
+  }
+  u32 ncached = 0;
+  DIR* d = opendir(cachedir);
+  assertnotnull(d);
+  for (struct dirent* e; (e = readdir(d)); )
+    ncached += strncmp(e->d_name, "llvmcache-", 10) == 0;
+  closedir(d);
+  asserteq(ncached, 1);
+
+  for (u32 i = 0; i < countof(objv); i++)
+    LLVMDisposeMemoryBuffer(objv[i]);
+  llvm_backend_dispose(backend);
+  rmtree(dir);
+  str_free(exefile);
+  str_free(cachedir);
+}
+#endif
+
+// write_testfile writes text to a file named name in dir and returns its path.
+// Caller should str_free the path.
+static Str write_testfile(const char* dir, const char* name, const char* text) {
+  Str path = path_join(dir, name);
+  FILE* fp = fopen(path, "w");
+  assertnotnull(fp);
+  asserteq(fwrite(text, strlen(text), 1, fp), 1);
+  asserteq(fclose(fp), 0);
+  return path;
+}
+
+R_TEST(llvm_profdata_merge) {
+  // Profiles in LLVM's text format stand in for .profraw files, which are only written by
+  // instrumented programs; the reader detects the format of each input by its contents.
+  char dir[] = "/tmp/co-llvm-profdata-test.XXXXXX";
+  assertnotnull(mkdtemp(dir));
+  Str ir1 = write_testfile(dir, "1.proftext",
+    ":ir\n"
+    "foo\n" "10\n" "2\n" "1\n" "2\n"
+    "\n"
+    "bar\n" "20\n" "1\n" "5\n");
+  Str ir2 = write_testfile(dir, "2.proftext",
+    ":ir\n"
+    "foo\n" "10\n" "2\n" "3\n" "4\n");
+  Str ir3 = write_testfile(dir, "3.proftext", // different number of counters for foo
+    ":ir\n"
+    "foo\n" "10\n" "3\n" "1\n" "1\n" "1\n");
+  Str fe = write_testfile(dir, "fe.proftext", // front-end (clang) profile
+    "foo\n" "10\n" "2\n" "1\n" "2\n");
+  Str out = path_join(dir, "out.profdata");
+  Str out2 = path_join(dir, "out2.profdata");
+  char* errmsg;
+
+  // merging writes an indexed profile without warnings
+  const char* inputs1[] = { ir1, ir2 };
+  assert(llvm_profdata_merge(inputs1, countof(inputs1), out, &errmsg));
+  asserteq(strcmp(errmsg, ""), 0);
+  LLVMDisposeMessage(errmsg);
+  u8 magic[8];
+  FILE* fp = fopen(out, "rb");
+  assertnotnull(fp);
+  asserteq(fread(magic, sizeof(magic), 1, fp), 1);
+  fclose(fp);
+  asserteq(memcmp(magic, "\xfflprofi\x81", 8), 0); // IndexedInstrProf::Magic (little endian)
+
+  // an indexed profile can be merged again
+  const char* inputs2[] = { out, ir1 };
+  assert(llvm_profdata_merge(inputs2, countof(inputs2), out2, &errmsg));
+  LLVMDisposeMessage(errmsg);
+
+  // records which don't match are dropped with a warning naming the input
+  const char* inputs3[] = { ir1, ir3 };
+  assert(llvm_profdata_merge(inputs3, countof(inputs3), out2, &errmsg));
+  assertnotnull(strstr(errmsg, ir3));
+  assertnotnull(strstr(errmsg, "mismatch"));
+  LLVMDisposeMessage(errmsg);
+
+  // IR-level and front-end profiles can't be merged, in either order
+  const char* inputs4[] = { ir1, fe };
+  assert(!llvm_profdata_merge(inputs4, countof(inputs4), out2, &errmsg));
+  assertnotnull(strstr(errmsg, fe));
+  LLVMDisposeMessage(errmsg);
+  const char* inputs5[] = { fe, ir1 };
+  assert(!llvm_profdata_merge(inputs5, countof(inputs5), out2, &errmsg));
+  assertnotnull(strstr(errmsg, ir1));
+  LLVMDisposeMessage(errmsg);
+
+  // missing input
+  Str missing = path_join(dir, "missing.profraw");
+  const char* inputs6[] = { ir1, missing };
+  assert(!llvm_profdata_merge(inputs6, countof(inputs6), out2, &errmsg));
+  LLVMDisposeMessage(errmsg);
+
+  rmtree(dir);
+  str_free(ir1);
+  str_free(ir2);
+  str_free(ir3);
+  str_free(fe);
+  str_free(out);
+  str_free(out2);
+  str_free(missing);
+}
+
+// pgo_test_module builds a module with a function "pick" which branches on its argument,
+// for a profile to weigh the branches of, and a "main" which calls it
+static LLVMModuleRef pgo_test_module(LLVMContextRef ctx) {
+  LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("llvm_test", ctx);
+  LLVMTypeRef i32 = LLVMInt32TypeInContext(ctx);
+  LLVMTypeRef fnty = LLVMFunctionType(i32, &i32, 1, false);
+  LLVMBuilderRef b = LLVMCreateBuilderInContext(ctx);
+  LLVMValueRef fn = LLVMAddFunction(mod, "pick", fnty);
+  LLVMValueRef x = LLVMGetParam(fn, 0);
+  LLVMBasicBlockRef entry = LLVMAppendBasicBlockInContext(ctx, fn, "");
+  LLVMBasicBlockRef then = LLVMAppendBasicBlockInContext(ctx, fn, "then");
+  LLVMBasicBlockRef els = LLVMAppendBasicBlockInContext(ctx, fn, "else");
+  LLVMPositionBuilderAtEnd(b, entry);
+  LLVMBuildCondBr(b, LLVMBuildICmp(b, LLVMIntSGT, x, LLVMConstInt(i32, 0, false), ""), then, els);
+  LLVMPositionBuilderAtEnd(b, then);
+  LLVMBuildRet(b, LLVMBuildMul(b, x, LLVMConstInt(i32, 3, false), ""));
+  LLVMPositionBuilderAtEnd(b, els);
+  LLVMBuildRet(b, LLVMBuildSub(b, x, LLVMConstInt(i32, 1, false), ""));
+  LLVMValueRef mainfn = LLVMAddFunction(mod, "main", LLVMFunctionType(i32, NULL, 0, false));
+  LLVMPositionBuilderAtEnd(b, LLVMAppendBasicBlockInContext(ctx, mainfn, ""));
+  LLVMValueRef arg = LLVMConstInt(i32, 1, false);
+  LLVMBuildRet(b, LLVMBuildCall2(b, fnty, fn, &arg, 1, ""));
+  LLVMDisposeBuilder(b);
+  return mod;
+}
+
+// pgo_test_optmod optimizes a pgo_test_module for opt with pgo and returns its IR text
+static Str pgo_test_optmod(
+  CoLLVMBackend* backend, CoOptType opt, CoPGO pgo, const char* pgofile)
+{
+  char* errmsg;
+  LLVMModuleRef mod = pgo_test_module(llvm_backend_context(backend));
+  LLVMTargetMachineRef tm = llvm_backend_target_machine(
+    backend, llvm_init_targets(), opt, &errmsg);
+  assertnotnull(tm);
+  if (!llvm_optmod(backend, mod, tm, opt, false, CoLLVMLTO_none, pgo, pgofile, NULL, &errmsg))
+    panic("llvm_optmod: %s", errmsg);
+  char* ir = LLVMPrintModuleToString(mod);
+  Str s = str_cpycstr(ir);
+  LLVMDisposeMessage(ir);
+  LLVMDisposeModule(mod);
+  return s;
+}
+
+R_TEST(llvm_pgo_use) {
+  char dir[] = "/tmp/co-llvm-pgo-test.XXXXXX";
+  assertnotnull(mkdtemp(dir));
+  CoLLVMBackend* backend = llvm_backend_create();
+  LLVMContextRef ctx = llvm_backend_context(backend);
+  char* errmsg;
+
+  // Instrument the module like --pgo-gen does, at the same opt level as it will be used
+  // with, and read the CFG hash and number of counters of "pick" off of its profile data.
+  // The profile must match them for PGOInstrumentationUse to apply it.
+  LLVMModuleRef mod = pgo_test_module(ctx);
+  LLVMTargetMachineRef tm = llvm_backend_target_machine(
+    backend, llvm_init_targets(), CoOptFast, &errmsg);
+  assertnotnull(tm);
+  Str profraw = path_join(dir, "default.profraw");
+  assert(llvm_optmod(
+    backend, mod, tm, CoOptFast, false, CoLLVMLTO_none, CoPGOGen, profraw, NULL, &errmsg));
+  LLVMValueRef profd = LLVMGetNamedGlobal(mod, "__profd_pick");
+  LLVMValueRef profc = LLVMGetNamedGlobal(mod, "__profc_pick");
+  assertnotnull(profd);
+  assertnotnull(profc);
+  // __profd_pick = { i64 NameRef, i64 FuncHash, ... }, __profc_pick = [N x i64]
+  u64 hash = LLVMConstIntGetZExtValue(LLVMGetOperand(LLVMGetInitializer(profd), 1));
+  u32 ncounters = LLVMGetArrayLength(LLVMGlobalGetValueType(profc));
+  assert(ncounters > 0);
+  LLVMDisposeModule(mod);
+
+  // a profile of "pick" in LLVM's text format, as if the program ran 1000 times
+  Str text = str_fmt(":ir\npick\n%llu\n%u\n", (unsigned long long)hash, ncounters);
+  for (u32 i = 0; i < ncounters; i++)
+    text = str_appendcstr(text, "1000\n");
+  Str proftext = write_testfile(dir, "pick.proftext", text);
+  Str profdata = path_join(dir, "pick.profdata");
+  const char* inputs[] = { proftext };
+  assert(llvm_profdata_merge(inputs, countof(inputs), profdata, &errmsg));
+  LLVMDisposeMessage(errmsg);
+
+  // an optimized module with the profile has entry counts and branch weights from it;
+  // one without the profile does not
+  Str ir1 = pgo_test_optmod(backend, CoOptFast, CoPGONone, NULL);
+  Str ir2 = pgo_test_optmod(backend, CoOptFast, CoPGOUse, profdata);
+  assertnull(strstr(ir1, "function_entry_count"));
+  assertnotnull(strstr(ir2, "function_entry_count"));
+  assert(strcmp(ir1, ir2) != 0);
+
+  llvm_backend_dispose(backend);
+  rmtree(dir);
+  str_free(ir1);
+  str_free(ir2);
+  str_free(text);
+  str_free(proftext);
+  str_free(profdata);
+  str_free(profraw);
+}
+
+// read_testfile returns the contents of the file at path; caller should str_free it
+static Str read_testfile(const char* path) {
+  FILE* fp = fopen(path, "r");
+  assertnotnull(fp);
+  Str s = str_new(4096);
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    s = str_append(s, buf, n);
+  fclose(fp);
+  return s;
+}
+
+// test_emit_ll builds text as a package with debug info of kind debuginfo and returns
+// the LLVM IR text emitted for it
+static Str test_emit_ll(const char* dir, const char* text, CoDebugInfo debuginfo) {
+  Build* b = test_build_new();
+  Node* pkg = test_pkg(b, text);
+  Str outfile = path_join(dir, "out.exe");
+  b->outfile = outfile;
+  b->emit = CoEmitLL;
+  b->debuginfo = debuginfo;
+  CoLLVMBackend* backend = llvm_backend_create();
+  Array objv;
+  ArrayInit(&objv);
+  assert(llvm_build_and_emit(backend, b, pkg, llvm_init_targets(), &objv));
+  asserteq(objv.len, 0); // no object code without CoEmitObj or CoEmitExe
+  ArrayFree(&objv, MemHeap);
+  llvm_backend_dispose(backend);
+  Str llfile = build_outpath(b, ".ll");
+  Str ll = read_testfile(llfile);
+  unlink(llfile);
+  str_free(llfile);
+  str_free(outfile);
+  test_build_free(b);
+  return ll;
+}
+
+R_TEST(llvm_debuginfo) {
+  char dir[] = "/tmp/co-llvm-debuginfo-test.XXXXXX";
+  assertnotnull(mkdtemp(dir));
+  // inc has a mutable parameter, which is stored in an alloca before mem2reg
+  const char* text =
+    "fun inc(x int) int {\n"
+    "  x = x + 1\n"
+    "  x\n"
+    "}\n"
+    "fun main() int {\n"
+    "  inc(41)\n"
+    "}\n";
+
+  // -g: a compile unit with a subprogram for each function and variables
+  Str ll = test_emit_ll(dir, text, CoDebugInfoFull);
+  assertnotnull(strstr(ll, "!DICompileUnit("));
+  assertnotnull(strstr(ll, "emissionKind: FullDebug"));
+  assertnotnull(strstr(ll, "!DISubprogram(name: \"main\""));
+  assertnotnull(strstr(ll, "!DISubprogram(name: \"inc\""));
+  assertnotnull(strstr(ll, "!DILocalVariable(name: \"x\", arg: 1"));
+  str_free(ll);
+
+  // -gline-tables-only: subprograms for line tables, but no variables
+  ll = test_emit_ll(dir, text, CoDebugInfoLineTables);
+  assertnotnull(strstr(ll, "emissionKind: LineTablesOnly"));
+  assertnotnull(strstr(ll, "!DISubprogram(name: \"main\""));
+  assertnull(strstr(ll, "!DILocalVariable("));
+  str_free(ll);
+
+  // -g0: no debug info
+  ll = test_emit_ll(dir, text, CoDebugInfoNone);
+  assertnull(strstr(ll, "!DICompileUnit("));
+  assertnull(strstr(ll, "!DISubprogram("));
+  str_free(ll);
+
+  rmdir(dir);
+}
+
+
+// llvm_bench measures the per-build overhead that a reused backend saves: builds a small
+// module many times with a new backend for each build (like a co process does) and then with
+// one backend for all builds (see co_bench_enabled.)
+
+static void bench_builds(const char* name, CoOptType opt, bool reuse, u32 nbuilds) {
+  CoLLVMBackend* backend = reuse ? llvm_backend_create() : NULL;
+  u64 starttm = nanotime();
+  for (u32 i = 0; i < nbuilds; i++) {
+    if (reuse) {
+      test_build(backend, opt, 10);
+    } else {
+      CoLLVMBackend* backend1 = llvm_backend_create();
+      test_build(backend1, opt, 10);
+      llvm_backend_dispose(backend1);
+    }
+  }
+  u64 d = nanotime() - starttm;
+  if (backend)
+    llvm_backend_dispose(backend);
+  char durstr[40];
+  auto durlen = fmtduration(durstr, countof(durstr), d / nbuilds);
+  fprintf(stderr, "llvm_bench: %-6s %-15s %u builds  %.*s/build\n",
+    name, reuse ? "reused backend" : "new backend", nbuilds, durlen, durstr);
+}
+
+R_TEST(llvm_bench) {
+  if (!co_bench_enabled())
+    return;
+  // warm up; initializes LLVM's global state
+  CoLLVMBackend* backend = llvm_backend_create();
+  test_build(backend, CoOptFast, 10);
+  llvm_backend_dispose(backend);
+
+  bench_builds("-O0", CoOptNone, false, 500);
+  bench_builds("-O0", CoOptNone, true, 500);
+  bench_builds("-O3", CoOptFast, false, 500);
+  bench_builds("-O3", CoOptFast, true, 500);
+}
+
+#endif /* R_TESTING_ENABLED */
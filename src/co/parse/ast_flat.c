@@ -0,0 +1,687 @@
+#include "../common.h"
+#include "parse.h"
+
+static_assert(_NodeKindMax <= 0xff, "NodeKind does not fit in kindv");
+static_assert(TKeywordsStart <= 0x100, "operator Tok does not fit in opv");
+static_assert(NodeFlagPartialType <= 0x8000, "NodeFlags does not fit in flagv");
+
+#define FLATAST_INITCAP 64
+
+
+static void flat_grow(FlatAST* ast) {
+  u32 cap = ast->cap ? ast->cap * 2 : FLATAST_INITCAP;
+  #define GROW(field) \
+    ast->field = memrealloc(ast->mem, ast->field, sizeof(ast->field[0]) * cap)
+  GROW(kindv);
+  GROW(opv);
+  GROW(flagv);
+  GROW(posv);
+  GROW(typev);
+  GROW(datav);
+  GROW(nodev);
+  #undef GROW
+  ast->cap = cap;
+}
+
+
+// flat_extra allocates n zeroed entries in extrav and returns the index of the first one
+static u32 flat_extra(FlatAST* ast, u32 n) {
+  if (ast->extracap - ast->extralen < n) {
+    u32 cap = MAX(ast->extracap * 2, ast->extralen + n);
+    ast->extrav = memrealloc(ast->mem, ast->extrav, sizeof(u32) * cap);
+    ast->extracap = cap;
+  }
+  u32 i = ast->extralen;
+  memset(&ast->extrav[i], 0, sizeof(u32) * n);
+  ast->extralen += n;
+  return i;
+}
+
+
+// flat_ptr returns the ptrv index of p, adding p to ptrv if needed
+static u32 flat_ptr(FlatAST* ast, const void* nullable p) {
+  if (!p)
+    return 0;
+  uintptr_t i = (uintptr_t)PtrMapGet(&ast->ptrmap, p);
+  if (i == 0) {
+    i = ast->ptrv.len;
+    ArrayPush(&ast->ptrv, (void*)p, ast->mem);
+    PtrMapSet(&ast->ptrmap, p, (void*)i);
+  }
+  return (u32)i;
+}
+
+
+// flat_list adds the nodes of a to ast and returns the extrav index of their handles
+static u32 flat_list(FlatAST* ast, const NodeArray* a) {
+  u32 start = flat_extra(ast, a->len);
+  for (u32 i = 0; i < a->len; i++) {
+    // Note: extrav may be reallocated by FlatASTAdd
+    NodeIdx n = FlatASTAdd(ast, a->v[i]);
+    ast->extrav[start + i] = n;
+  }
+  return start;
+}
+
+
+void FlatASTInit(FlatAST* ast, Mem mem) {
+  memset(ast, 0, sizeof(*ast));
+  ast->mem = mem;
+  ArrayInit(&ast->ptrv);
+  ArrayPush(&ast->ptrv, NULL, mem); // ptrv index 0 is NULL
+  PtrMapInit(&ast->ptrmap, 0, mem);
+  PtrMapInit(&ast->nodemap, FLATAST_INITCAP, mem);
+  flat_grow(ast);
+  flat_extra(ast, FLATAST_INITCAP);
+  ast->extralen = 0;
+
+  // null node
+  ast->len = 1;
+  ast->kindv[0] = NNone;
+  ast->opv[0] = 0;
+  ast->flagv[0] = 0;
+  ast->posv[0] = NoPos;
+  ast->typev[0] = 0;
+  ast->datav[0] = (FlatNodeData){0};
+  ast->nodev[0] = NULL;
+}
+
+
+void FlatASTDispose(FlatAST* ast) {
+  memfree(ast->mem, ast->kindv);
+  memfree(ast->mem, ast->opv);
+  memfree(ast->mem, ast->flagv);
+  memfree(ast->mem, ast->posv);
+  memfree(ast->mem, ast->typev);
+  memfree(ast->mem, ast->datav);
+  memfree(ast->mem, ast->nodev);
+  memfree(ast->mem, ast->extrav);
+  ArrayFree(&ast->ptrv, ast->mem);
+  PtrMapDispose(&ast->ptrmap);
+  PtrMapDispose(&ast->nodemap);
+}
+
+
+NodeIdx FlatASTIdx(const FlatAST* ast, const Node* nullable n) {
+  if (!n)
+    return 0;
+  return (NodeIdx)(uintptr_t)PtrMapGet(&ast->nodemap, n);
+}
+
+
+NodeIdx FlatASTAdd(FlatAST* ast, const Node* nullable n) {
+  NodeIdx i = FlatASTIdx(ast, n);
+  if (i || !n)
+    return i;
+
+  // Allocate and register the handle before adding any children so that cycles, like
+  // recursive functions, end here.
+  if (ast->len == ast->cap)
+    flat_grow(ast);
+  i = ast->len++;
+  PtrMapSet(&ast->nodemap, n, (void*)(uintptr_t)i);
+  ast->kindv[i] = (u8)n->kind;
+  ast->opv[i] = 0;
+  ast->flagv[i] = (u16)n->flags;
+  ast->posv[i] = n->pos;
+  ast->typev[i] = 0;
+  ast->datav[i] = (FlatNodeData){0};
+  ast->nodev[i] = n;
+
+  // Note: Node arrays may be reallocated by each call to FlatASTAdd. Results are therefore
+  // stored in locals and written to the arrays afterwards.
+  NodeIdx t = FlatASTAdd(ast, n->type);
+  ast->typev[i] = t;
+
+  FlatNodeData d = {0};
+  u32 x; // extrav index
+
+  #define ADD(child) FlatASTAdd(ast, (child))
+  #define SETX(idx, value) ({ u32 _tmp_v = (value); ast->extrav[(idx)] = _tmp_v; })
+
+  switch (n->kind) {
+
+  case NBoolLit:
+  case NIntLit:
+    d.a = (u32)n->val.i;
+    d.b = (u32)(n->val.i >> 32);
+    break;
+
+  case NFloatLit: {
+    u64 bits;
+    memcpy(&bits, &n->val.f, sizeof(bits));
+    d.a = (u32)bits;
+    d.b = (u32)(bits >> 32);
+    break;
+  }
+
+  case NStrLit:
+    d.a = flat_ptr(ast, n->val.s);
+    break;
+
+  case NId:
+    d.a = flat_ptr(ast, n->id.name);
+    d.b = ADD(n->id.target);
+    break;
+
+  case NBinOp:
+  case NPostfixOp:
+  case NPrefixOp:
+  case NAssign:
+  case NReturn:
+    assert_debug(n->op.op < 0x100); // operators are never keywords
+    ast->opv[i] = (u8)n->op.op;
+    d.a = ADD(n->op.left);
+    d.b = ADD(n->op.right);
+    break;
+
+  case NFile:
+  case NPkg:
+    d.a = flat_list(ast, &n->cunit.a);
+    d.b = n->cunit.a.len;
+    break;
+
+  case NBlock:
+  case NArray:
+  case NTuple:
+    d.a = flat_list(ast, &n->array.a);
+    d.b = n->array.a.len;
+    break;
+
+  case NTupleType:
+    d.a = flat_list(ast, &n->t.tuple.a);
+    d.b = n->t.tuple.a.len;
+    break;
+
+  case NStructType:
+    d.a = flat_list(ast, &n->t.struc.a);
+    d.b = n->t.struc.a.len;
+    break;
+
+  case NVar:
+    d.a = flat_ptr(ast, n->var.name);
+    d.b = ADD(n->var.init);
+    break;
+
+  case NField:
+    d.a = flat_ptr(ast, n->field.name);
+    d.b = ADD(n->field.init);
+    break;
+
+  case NNamedVal:
+    d.a = flat_ptr(ast, n->namedval.name);
+    d.b = ADD(n->namedval.value);
+    break;
+
+  case NRef:
+    d.a = ADD(n->ref.target);
+    break;
+
+  case NFun:
+    x = flat_extra(ast, 3);
+    SETX(x,     ADD(n->fun.params));
+    SETX(x + 1, ADD(n->fun.result));
+    SETX(x + 2, flat_ptr(ast, n->fun.name));
+    d.a = ADD(n->fun.body);
+    d.b = x;
+    break;
+
+  case NMacro:
+    x = flat_extra(ast, 2);
+    SETX(x,     ADD(n->macro.params));
+    SETX(x + 1, flat_ptr(ast, n->macro.name));
+    d.a = ADD(n->macro.template);
+    d.b = x;
+    break;
+
+  case NTypeCast:
+  case NCall:
+    d.a = ADD(n->call.receiver);
+    d.b = ADD(n->call.args);
+    break;
+
+  case NIf:
+    d.a = ADD(n->cond.cond);
+    x = flat_extra(ast, 2);
+    SETX(x,     ADD(n->cond.thenb));
+    SETX(x + 1, ADD(n->cond.elseb));
+    d.b = x;
+    break;
+
+  case NSelector:
+    d.a = ADD(n->sel.operand);
+    d.b = flat_ptr(ast, n->sel.member);
+    break;
+
+  case NIndex:
+    d.a = ADD(n->index.operand);
+    d.b = ADD(n->index.indexexpr);
+    break;
+
+  case NSlice:
+    d.a = ADD(n->slice.operand);
+    x = flat_extra(ast, 2);
+    SETX(x,     ADD(n->slice.start));
+    SETX(x + 1, ADD(n->slice.end));
+    d.b = x;
+    break;
+
+  case NBasicType:
+    d.a = (u32)n->t.basic.typeCode;
+    d.b = flat_ptr(ast, n->t.basic.name);
+    break;
+
+  case NRefType:
+    d.a = ADD(n->t.ref);
+    break;
+
+  case NArrayType:
+    d.a = ADD(n->t.array.subtype);
+    x = flat_extra(ast, 2);
+    SETX(x, ADD(n->t.array.sizeexpr));
+    SETX(x + 1, n->t.array.size);
+    d.b = x;
+    break;
+
+  case NFunType:
+    d.a = ADD(n->t.fun.params);
+    d.b = ADD(n->t.fun.result);
+    break;
+
+  case NTypeType:
+    d.a = ADD(n->t.type);
+    break;
+
+  // Remaining nodes have no operands.
+  // Note: No default case, so that the compiler warns us about missing cases.
+  case NBad:
+  case NNil:
+  case NNone:
+  case _NodeKindMax:
+    break;
+
+  } // switch(n->kind)
+
+  #undef ADD
+  #undef SETX
+
+  ast->datav[i] = d;
+  return i;
+}
+
+
+bool FlatASTVisitChildren(const FlatAST* ast, NodeIdx n, void* nullable data, FlatVisitor f) {
+  auto d = FlatASTData(ast, n);
+  const u32* x = ast->extrav;
+
+  switch (FlatASTKind(ast, n)) {
+
+  case NId:
+    return f(ast, d.b, data);
+
+  case NBinOp:
+  case NPostfixOp:
+  case NPrefixOp:
+  case NAssign:
+  case NReturn:
+    if (!f(ast, d.a, data))
+      return false;
+    if (d.b)
+      return f(ast, d.b, data);
+    break;
+
+  case NFile:
+  case NPkg:
+  case NBlock:
+  case NArray:
+  case NTuple:
+  case NTupleType:
+  case NStructType:
+    for (u32 i = 0; i < d.b; i++) {
+      if (!f(ast, x[d.a + i], data))
+        return false;
+    }
+    break;
+
+  case NVar:
+    if ((FlatASTFlags(ast, n) & NodeFlagParam) == 0 || d.b)
+      return f(ast, d.b, data);
+    break;
+
+  case NField:
+  case NNamedVal:
+    return f(ast, d.b, data);
+
+  case NRef:
+  case NRefType:
+  case NSelector:
+  case NTypeType:
+    return f(ast, d.a, data);
+
+  case NFun:
+    return f(ast, x[d.b], data) && f(ast, x[d.b + 1], data) && f(ast, d.a, data);
+
+  case NMacro:
+    return f(ast, x[d.b], data) && f(ast, d.a, data);
+
+  case NTypeCast:
+  case NCall:
+  case NIndex:
+    return f(ast, d.a, data) && f(ast, d.b, data);
+
+  case NIf:
+    if (!f(ast, d.a, data) || !f(ast, x[d.b], data))
+      return false;
+    if (x[d.b + 1])
+      return f(ast, x[d.b + 1], data);
+    break;
+
+  case NSlice:
+    return f(ast, d.a, data) && f(ast, x[d.b], data) && f(ast, x[d.b + 1], data);
+
+  case NFunType:
+    return f(ast, d.a ? FlatASTType(ast, d.a) : 0, data) && f(ast, d.b, data);
+
+  case NArrayType:
+    if (x[d.b + 1] == 0 && !f(ast, x[d.b], data))
+      return false;
+    return f(ast, d.a, data);
+
+  // Remaining nodes has no children.
+  // Note: No default case, so that the compiler warns us about missing cases.
+  case NBad:
+  case NBasicType:
+  case NBoolLit:
+  case NFloatLit:
+  case NIntLit:
+  case NNil:
+  case NNone:
+  case NStrLit:
+  case _NodeKindMax:
+    break;
+
+  } // switch(kind)
+
+  return true;
+}
+
+
+size_t FlatASTSize(const FlatAST* ast, bool compat) {
+  const size_t mapslotsize = 1 + sizeof(void*) * 2; // see hashmap.c.h
+  size_t nodesize =
+    sizeof(ast->kindv[0]) + sizeof(ast->opv[0]) + sizeof(ast->flagv[0]) +
+    sizeof(ast->posv[0]) + sizeof(ast->typev[0]) + sizeof(ast->datav[0]);
+  size_t z = sizeof(FlatAST) +
+    (size_t)ast->cap * nodesize +
+    (size_t)ast->extracap * sizeof(u32) +
+    (size_t)ast->ptrv.cap * sizeof(void*) +
+    (size_t)ast->ptrmap.cap * mapslotsize;
+  if (compat)
+    z += (size_t)ast->cap * sizeof(ast->nodev[0]) + (size_t)ast->nodemap.cap * mapslotsize;
+  return z;
+}
+
+
+// -----------------------------------------------------------------------------------------------
+// tests
+
+#if R_TESTING_ENABLED
+
+static const char* flat_test_source =
+  "fun add(x, y int) int {\n"
+  "  x + y\n"
+  "}\n"
+  "fun fact(n int) int {\n"
+  "  if n < 2 { 1 } else { n * fact(n - 1) }\n"
+  "}\n"
+  "fun main() int {\n"
+  "  const K = [10, 20, 30]\n"
+  "  v = K[1]\n"
+  "  h = &K\n"
+  "  t = (1, 2.5, \"hello\", true)\n"
+  "  s = K[1:2]\n"
+  "  a = add(v, -2)\n"
+  "  a = a + fact(v as int)\n"
+  "  a\n"
+  "}\n";
+
+// flat_test_parse parses text into a new package node
+static Node* flat_test_parse(Build* b, const char* text, size_t len) {
+  auto src = memalloct(b->mem, Source);
+  SourceInitMem(src, b->pkg, "input.co", text, len);
+  PkgAddSource(b->pkg, src);
+  Node* pkg = CreatePkgAST(b, ScopeNew(GetGlobalScope(), b->mem));
+  assert(ParsePkg(b, pkg, ParseFlagsDefault, 1));
+  asserteq(b->errcount, 0);
+  return pkg;
+}
+
+// A walk collects the nodes of an AST in depth-first order.
+// Targets of identifiers are not descended into as they lead to cycles.
+typedef struct FlatTestWalk {
+  Array nodes;
+  Mem   mem;
+} FlatTestWalk;
+
+static bool flat_test_visit_node(NodeList* nl, void* data) {
+  auto w = (FlatTestWalk*)data;
+  ArrayPush(&w->nodes, (void*)nl->n, w->mem);
+  if (nl->n->kind == NId)
+    return true;
+  return NodeVisitChildren(nl, data, flat_test_visit_node);
+}
+
+static bool flat_test_visit_flat(const FlatAST* ast, NodeIdx n, void* data) {
+  auto w = (FlatTestWalk*)data;
+  // NodeVisitChildren substitutes Const_nil for missing children
+  const Node* node = n ? FlatASTNode(ast, n) : Const_nil;
+  ArrayPush(&w->nodes, (void*)node, w->mem);
+  if (FlatASTKind(ast, n) == NId)
+    return true;
+  return FlatASTVisitChildren(ast, n, data, flat_test_visit_flat);
+}
+
+R_TEST(flatast) {
+  auto b = test_build_new();
+  Node* pkg = flat_test_parse(b, flat_test_source, strlen(flat_test_source));
+
+  FlatAST ast;
+  FlatASTInit(&ast, b->mem);
+  NodeIdx root = FlatASTAdd(&ast, pkg);
+  asserteq(root, 1);
+  asserteq(FlatASTAdd(&ast, pkg), root); // not added again
+  asserteq(FlatASTIdx(&ast, NULL), 0);
+  asserteq(FlatASTAdd(&ast, NULL), 0);
+
+  // every node maps back to the Node it was created from, with the same attributes
+  for (NodeIdx i = 1; i < ast.len; i++) {
+    const Node* n = FlatASTNode(&ast, i);
+    assertnotnull(n);
+    asserteq(FlatASTIdx(&ast, n), i);
+    asserteq(FlatASTKind(&ast, i), n->kind);
+    asserteq(FlatASTFlags(&ast, i), n->flags);
+    asserteq(FlatASTPos(&ast, i), n->pos);
+    assert(FlatASTNode(&ast, FlatASTType(&ast, i)) == n->type);
+    switch (n->kind) {
+      case NIntLit:
+        asserteq(FlatASTVal(&ast, i), n->val.i);
+        break;
+      case NBinOp:
+        asserteq(FlatASTOp(&ast, i), n->op.op);
+        break;
+      case NId:
+        assert(FlatASTPtr(&ast, FlatASTData(&ast, i).a) == n->id.name);
+        assert(FlatASTNode(&ast, FlatASTData(&ast, i).b) == n->id.target);
+        break;
+      case NFun:
+        assert(FlatASTPtr(&ast, ast.extrav[FlatASTData(&ast, i).b + 2]) == n->fun.name);
+        break;
+      case NBlock: {
+        u32 len;
+        const NodeIdx* v = FlatASTList(&ast, i, &len);
+        asserteq(len, n->array.a.len);
+        for (u32 j = 0; j < len; j++)
+          assert(FlatASTNode(&ast, v[j]) == n->array.a.v[j]);
+        break;
+      }
+      default:
+        break;
+    }
+  }
+
+  // traversal visits the same nodes in the same order as NodeVisit
+  FlatTestWalk w1 = { .mem = b->mem };
+  FlatTestWalk w2 = { .mem = b->mem };
+  NodeVisit(pkg, &w1, flat_test_visit_node);
+  flat_test_visit_flat(&ast, root, &w2);
+  asserteq(w1.nodes.len, w2.nodes.len);
+  for (u32 i = 0; i < w1.nodes.len; i++)
+    assert(w1.nodes.v[i] == w2.nodes.v[i]);
+  assert(w1.nodes.len > 50);
+
+  assert(FlatASTSize(&ast, false) < FlatASTSize(&ast, true));
+  FlatASTDispose(&ast);
+  test_build_free(b);
+}
+
+
+// flatast_bench compares memory use and traversal speed of FlatAST with that of Node
+// (see co_bench_enabled.)
+
+typedef struct FlatBenchCtx {
+  u64    nnodes;
+  u64    nids;
+  size_t nodebytes; // bytes of Node memory, including array storage outside of nodes
+  PtrMap seen;
+} FlatBenchCtx;
+
+static size_t flat_bench_array_bytes(const NodeArray* a, const void* storage) {
+  return a->v == storage ? 0 : (size_t)a->cap * sizeof(void*);
+}
+
+// flat_bench_measure adds up the memory used by the Node form of an AST
+static bool flat_bench_measure(NodeList* nl, void* data) {
+  auto ctx = (FlatBenchCtx*)data;
+  const Node* n = nl->n;
+  if (PtrMapSet(&ctx->seen, n, (void*)1))
+    return true;
+  ctx->nodebytes += sizeof(Node);
+  switch (n->kind) {
+    case NFile: case NPkg:
+      ctx->nodebytes += flat_bench_array_bytes(&n->cunit.a, n->cunit.a_storage); break;
+    case NBlock: case NArray: case NTuple:
+      ctx->nodebytes += flat_bench_array_bytes(&n->array.a, n->array.a_storage); break;
+    case NTupleType:
+      ctx->nodebytes += flat_bench_array_bytes(&n->t.tuple.a, n->t.tuple.a_storage); break;
+    case NStructType:
+      ctx->nodebytes += flat_bench_array_bytes(&n->t.struc.a, n->t.struc.a_storage); break;
+    default:
+      break;
+  }
+  if (n->type)
+    NodeVisitp(nl, n->type, data, flat_bench_measure);
+  if (n->kind == NId)
+    return true;
+  return NodeVisitChildren(nl, data, flat_bench_measure);
+}
+
+static bool flat_bench_visit_node(NodeList* nl, void* data) {
+  auto ctx = (FlatBenchCtx*)data;
+  ctx->nnodes++;
+  if (nl->n->kind == NId) {
+    ctx->nids++;
+    return true;
+  }
+  return NodeVisitChildren(nl, data, flat_bench_visit_node);
+}
+
+static bool flat_bench_visit_flat(const FlatAST* ast, NodeIdx n, void* data) {
+  auto ctx = (FlatBenchCtx*)data;
+  ctx->nnodes++;
+  if (FlatASTKind(ast, n) == NId) {
+    ctx->nids++;
+    return true;
+  }
+  return FlatASTVisitChildren(ast, n, data, flat_bench_visit_flat);
+}
+
+static void flat_bench_report(const char* name, u64 nnodes, u64 d) {
+  char durstr[40];
+  auto durlen = fmtduration(durstr, countof(durstr), d);
+  fprintf(stderr, "flatast_bench: %-24s %6.2f ns/node  %6.1f Mnodes/s  %.*s\n",
+    name, (double)d / (double)nnodes, (double)nnodes * 1000.0 / (double)d, durlen, durstr);
+}
+
+R_TEST(flatast_bench) {
+  if (!co_bench_enabled())
+    return;
+  // a package with many functions
+  Str text = str_new(0);
+  for (u32 i = 0; i < 20000; i++) {
+    text = str_appendfmt(text,
+      "fun f%u(x, y int) int {\n"
+      "  a = x * %u + y\n"
+      "  b = if a > 10 { a - 1 } else { (a, y)[0] }\n"
+      "  a + b\n"
+      "}\n",
+      i, i);
+  }
+  auto b = test_build_new();
+  Node* pkg = flat_test_parse(b, text, str_len(text));
+
+  FlatAST ast;
+  FlatASTInit(&ast, MemHeap);
+  u64 starttm = nanotime();
+  NodeIdx root = FlatASTAdd(&ast, pkg);
+  flat_bench_report("FlatASTAdd", ast.len, nanotime() - starttm);
+
+  // memory per node
+  FlatBenchCtx ctx = {0};
+  PtrMapInit(&ctx.seen, ast.len, MemHeap);
+  NodeVisit(pkg, &ctx, flat_bench_measure);
+  fprintf(stderr,
+    "flatast_bench: %u nodes; bytes/node: Node %.1f, FlatAST %.1f (%.1f with compat tables)\n",
+    ast.len - 1,
+    (double)ctx.nodebytes / (double)PtrMapLen(&ctx.seen),
+    (double)FlatASTSize(&ast, false) / (double)(ast.len - 1),
+    (double)FlatASTSize(&ast, true) / (double)(ast.len - 1));
+  PtrMapDispose(&ctx.seen);
+
+  // traversal throughput
+  const u32 reps = 20;
+  u64 d1 = 0, d2 = 0, d3 = 0, nnodes1 = 0, nnodes2 = 0, nids = 0;
+  for (u32 r = 0; r < reps; r++) {
+    memset(&ctx, 0, sizeof(ctx));
+    starttm = nanotime();
+    NodeVisit(pkg, &ctx, flat_bench_visit_node);
+    d1 += nanotime() - starttm;
+    nnodes1 += ctx.nnodes;
+    u64 nids1 = ctx.nids;
+
+    memset(&ctx, 0, sizeof(ctx));
+    starttm = nanotime();
+    flat_bench_visit_flat(&ast, root, &ctx);
+    d2 += nanotime() - starttm;
+    nnodes2 += ctx.nnodes;
+    asserteq(ctx.nids, nids1);
+
+    // passes which do not depend on tree order can scan the dense arrays directly
+    starttm = nanotime();
+    u64 n = 0;
+    for (u32 i = 1; i < ast.len; i++)
+      n += ast.kindv[i] == NId;
+    d3 += nanotime() - starttm;
+    nids += n;
+  }
+  asserteq(nnodes1, nnodes2);
+  flat_bench_report("NodeVisit", nnodes1, d1);
+  flat_bench_report("FlatASTVisitChildren", nnodes2, d2);
+  flat_bench_report("kindv scan", (u64)(ast.len - 1) * reps, d3);
+  assert(nids > 0);
+
+  FlatASTDispose(&ast);
+  test_build_free(b);
+  str_free(text);
+}
+
+#endif /* R_TESTING_ENABLED */
@@ -0,0 +1,183 @@
+#pragma once
+#include "../util/ptrmap.h"
+ASSUME_NONNULL_BEGIN
+
+// FlatAST is a compact representation of an AST. Nodes live in a flat "struct of arrays"
+// and are addressed by 32-bit NodeIdx handles rather than pointers: the kind, flags and
+// position of node i are kindv[i], flagv[i] and posv[i], and its operands are datav[i].
+// Child lists and operands which do not fit in FlatNodeData are stored in extrav.
+// A node takes up 24 bytes plus any extrav entries, compared to sizeof(Node) for a Node.
+//
+// A FlatAST is built from a Node tree with FlatASTAdd. It keeps a mapping between
+// NodeIdx handles and the Node each handle was created from so that passes can be moved
+// over to the flat form one at a time: a pass that uses FlatAST can get at the Node of a
+// handle (e.g. to hand it to a pass that has not been moved yet) with FlatASTNode and
+// find the handle of a Node with FlatASTIdx. Until all passes use FlatAST, the Node tree
+// is the primary representation; a FlatAST is a snapshot of it which does not reflect
+// changes made to the Node tree after FlatASTAdd.
+//
+// A FlatAST is not thread safe.
+
+// NodeIdx is a handle to a node in a FlatAST. 0 is the "null" node.
+typedef u32 NodeIdx;
+
+// FlatNodeData holds the operands of a node. Their meaning depends on the kind of node:
+//
+//   kind                  a                         b
+//   BoolLit               value                     -
+//   IntLit, FloatLit      low 32 bits of value      high 32 bits of value
+//   StrLit                value (ptrv index)        -
+//   Id                    name (ptrv index)         target
+//   Var, Field            name (ptrv index)         init
+//   NamedVal              name (ptrv index)         value
+//   BinOp, PrefixOp,
+//   PostfixOp, Assign,
+//   Return                left                      right (the operator is in opv)
+//   Ref                   target                    -
+//   Call, TypeCast        receiver                  args
+//   Selector              operand                   member (ptrv index)
+//   Index                 operand                   indexexpr
+//   Slice                 operand                   extra: start, end
+//   If                    cond                      extra: then, else
+//   Fun                   body                      extra: params, result, name (ptrv index)
+//   Macro                 template                  extra: params, name (ptrv index)
+//   BasicType             TypeCode                  name (ptrv index)
+//   RefType               elem                      -
+//   ArrayType             subtype                   extra: sizeexpr, size
+//   FunType               params                    result
+//   TypeType              type                      -
+//   Pkg, File, Block,
+//   Array, Tuple,
+//   TupleType, StructType first entry (extrav index) number of entries
+//
+// "extra: x, y" means that b is the index in extrav of x, followed by y.
+// "ptrv index" operands are indices in ptrv, where index 0 is NULL.
+typedef struct FlatNodeData {
+  u32 a, b;
+} FlatNodeData;
+
+typedef struct FlatAST {
+  Mem           mem;
+  u32           len;      // number of nodes, including the null node
+  u32           cap;      // capacity of node arrays
+  u8*           kindv;    // NodeKind
+  u8*           opv;      // Tok of BinOp, PrefixOp, PostfixOp, Assign and Return (else 0)
+  u16*          flagv;    // NodeFlags
+  Pos*          posv;     // source position
+  NodeIdx*      typev;    // type (0 if unknown)
+  FlatNodeData* datav;    // operands
+  u32*          extrav;   // child lists and additional operands
+  u32           extralen; // number of entries used of extrav
+  u32           extracap; // capacity of extrav
+  Array         ptrv;     // Sym and Str operands
+  PtrMap        ptrmap;   // ptrv entry => index in ptrv
+
+  // compatibility with Node
+  const Node**  nodev;    // Node each handle was created from
+  PtrMap        nodemap;  // Node => NodeIdx
+} FlatAST;
+
+// FlatASTInit initializes an empty ast which allocates memory in mem
+void FlatASTInit(FlatAST* ast, Mem mem);
+
+// FlatASTDispose frees all memory used by ast
+void FlatASTDispose(FlatAST* ast);
+
+// FlatASTAdd adds n and all nodes reachable from it, including types and targets of
+// identifiers, to ast. Nodes already in ast are not added again.
+// Returns the handle of n, or 0 if n is NULL.
+NodeIdx FlatASTAdd(FlatAST* ast, const Node* nullable n);
+
+// FlatASTIdx returns the handle of n, or 0 if n is NULL or has not been added to ast
+NodeIdx FlatASTIdx(const FlatAST* ast, const Node* nullable n);
+
+// FlatASTNode returns the Node that handle n was created from (NULL for the null node)
+static const Node* nullable FlatASTNode(const FlatAST* ast, NodeIdx n);
+
+// Accessors of node n
+static NodeKind     FlatASTKind(const FlatAST* ast, NodeIdx n);
+static NodeFlags    FlatASTFlags(const FlatAST* ast, NodeIdx n);
+static Pos          FlatASTPos(const FlatAST* ast, NodeIdx n);
+static Tok          FlatASTOp(const FlatAST* ast, NodeIdx n);
+static NodeIdx      FlatASTType(const FlatAST* ast, NodeIdx n);
+static FlatNodeData FlatASTData(const FlatAST* ast, NodeIdx n);
+
+// FlatASTVal returns the 64-bit value of a BoolLit, IntLit or FloatLit node
+static u64 FlatASTVal(const FlatAST* ast, NodeIdx n);
+
+// FlatASTPtr returns the ptrv entry of a "ptrv index" operand, e.g. the name of an Id
+static const void* nullable FlatASTPtr(const FlatAST* ast, u32 ptridx);
+
+// FlatASTList returns the entries of a list node (e.g. Block) and stores their count in len
+static const NodeIdx* FlatASTList(const FlatAST* ast, NodeIdx n, u32* len);
+
+// FlatASTSize returns the number of bytes of memory used by ast.
+// The memory of the compatibility tables nodev and nodemap is only included if compat is true.
+size_t FlatASTSize(const FlatAST* ast, bool compat);
+
+// FlatVisitor is used with FlatASTVisitChildren to traverse a FlatAST.
+// Return false to stop iteration.
+typedef bool(*FlatVisitor)(const FlatAST* ast, NodeIdx n, void* nullable data);
+
+// FlatASTVisitChildren calls f for each child of n. Children are visited in the same order
+// as NodeVisitChildren visits them. Where NodeVisitChildren passes Const_nil for a missing
+// child, f is called with the null node. f must not add nodes to ast.
+// Returns true if all calls to f returns true.
+bool FlatASTVisitChildren(const FlatAST* ast, NodeIdx n, void* nullable data, FlatVisitor f);
+
+
+// -----------------------------------------------------------------------------------------------
+// implementation
+
+inline static const Node* nullable FlatASTNode(const FlatAST* ast, NodeIdx n) {
+  assert_debug(n < ast->len);
+  return ast->nodev[n];
+}
+
+inline static NodeKind FlatASTKind(const FlatAST* ast, NodeIdx n) {
+  assert_debug(n < ast->len);
+  return (NodeKind)ast->kindv[n];
+}
+
+inline static NodeFlags FlatASTFlags(const FlatAST* ast, NodeIdx n) {
+  assert_debug(n < ast->len);
+  return (NodeFlags)ast->flagv[n];
+}
+
+inline static Pos FlatASTPos(const FlatAST* ast, NodeIdx n) {
+  assert_debug(n < ast->len);
+  return ast->posv[n];
+}
+
+inline static Tok FlatASTOp(const FlatAST* ast, NodeIdx n) {
+  assert_debug(n < ast->len);
+  return (Tok)ast->opv[n];
+}
+
+inline static NodeIdx FlatASTType(const FlatAST* ast, NodeIdx n) {
+  assert_debug(n < ast->len);
+  return ast->typev[n];
+}
+
+inline static FlatNodeData FlatASTData(const FlatAST* ast, NodeIdx n) {
+  assert_debug(n < ast->len);
+  return ast->datav[n];
+}
+
+inline static u64 FlatASTVal(const FlatAST* ast, NodeIdx n) {
+  auto d = FlatASTData(ast, n);
+  return ((u64)d.b << 32) | (u64)d.a;
+}
+
+inline static const void* nullable FlatASTPtr(const FlatAST* ast, u32 ptridx) {
+  assert_debug(ptridx < ast->ptrv.len);
+  return ast->ptrv.v[ptridx];
+}
+
+inline static const NodeIdx* FlatASTList(const FlatAST* ast, NodeIdx n, u32* len) {
+  auto d = FlatASTData(ast, n);
+  *len = d.b;
+  return &ast->extrav[d.a];
+}
+
+ASSUME_NONNULL_END
@@ -2213,4 +2213,198 @@ Node* Parse(Parser* p, Build* build, Source* src, ParseFlags fl, Scope* pkgscope
 }
 
 
+// ParsePkgJob is shared by all ParsePkg threads
+typedef struct ParsePkgJob {
+  Build*       build;
+  ParseFlags   fl;
+  Scope*       pkgscope;
+  u32          srcc;
+  Source**     srcv;   // sources in srclist order
+  Node**       filev;  // result of Parse for srcv[i]
+  Scope**      scopev; // top-level definitions of srcv[i]
+  MemArena**   arenav; // sub-arena of build->arena for each thread
+  _Atomic(u32) next;   // index of next source to parse
+  _Atomic(u32) nextarena;
+} ParsePkgJob;
+
+static int parse_pkg_thread(void* arg) {
+  ParsePkgJob* job = (ParsePkgJob*)arg;
+  // allocations in build->mem by this thread are made in a sub-arena of its own
+  u32 arenaidx = atomic_fetch_add_explicit(&job->nextarena, 1, memory_order_relaxed);
+  memarena_bind(&job->build->arena, job->arenav[arenaidx]);
+  Parser parser = {0};
+  u32 i;
+  while ((i = atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed)) < job->srcc) {
+    // Each file defines its top-level symbols in a scope of its own which is merged
+    // into pkgscope after all files are parsed; pkgscope is only read from until then.
+    // References to definitions in other files remain unresolved for ResolveSym.
+    Scope* scope = ScopeNew(job->pkgscope, job->build->mem);
+    job->scopev[i] = scope;
+    job->filev[i] = Parse(&parser, job->build, job->srcv[i], job->fl, scope);
+  }
+  if (parser.s.build)
+    ScannerDispose(&parser.s);
+  memarena_bind(&job->build->arena, NULL);
+  return 0;
+}
+
+static void parse_pkg_merge_def(Sym key, void* value, bool* stop, void* pkgscope) {
+  ScopeAssoc((Scope*)pkgscope, key, value);
+}
+
+bool ParsePkg(Build* build, Node* pkgnode, ParseFlags fl, u32 nthreads) {
+  asserteq(pkgnode->kind, NPkg);
+  Mem mem = build->mem;
+  ParsePkgJob job = { .build = build, .fl = fl, .pkgscope = pkgnode->cunit.scope };
+
+  for (Source* src = build->pkg->srclist; src; src = src->next)
+    job.srcc++;
+  if (job.srcc == 0)
+    return true;
+
+  // Allocate origins in srclist order so that Pos values do not depend on thread
+  // scheduling and so that posmap is not reallocated while threads read from it.
+  job.srcv = memalloc(mem, sizeof(void*) * job.srcc * 3);
+  job.filev = (Node**)&job.srcv[job.srcc];
+  job.scopev = (Scope**)&job.srcv[job.srcc * 2];
+  u32 n = 0;
+  for (Source* src = build->pkg->srclist; src; src = src->next) {
+    posmap_origin(&build->posmap, src);
+    job.srcv[n++] = src;
+  }
+
+  if (nthreads == 0)
+    nthreads = os_ncpu();
+  nthreads = MIN(nthreads, job.srcc);
+
+  job.arenav = memalloc(mem, sizeof(void*) * nthreads);
+  for (u32 i = 0; i < nthreads; i++)
+    job.arenav[i] = memarena_sub(&build->arena);
+
+  // The calling thread acts as one of the workers. If a thread can't be created, the
+  // threads started so far (possibly none) share the work with the calling thread.
+  thrd_t* threads = NULL;
+  u32 nstarted = 0;
+  if (nthreads > 1) {
+    threads = memalloc(mem, sizeof(thrd_t) * (nthreads - 1));
+    while (nstarted < nthreads - 1) {
+      if (thrd_create(&threads[nstarted], parse_pkg_thread, &job) != thrd_success) {
+        dlog("ParsePkg: thrd_create failed; continuing with %u threads", nstarted + 1);
+        break;
+      }
+      nstarted++;
+    }
+  }
+  parse_pkg_thread(&job);
+  for (u32 i = 0; i < nstarted; i++)
+    thrd_join(threads[i], NULL);
+
+  // merge in srclist order
+  bool ok = true;
+  for (u32 i = 0; i < job.srcc; i++) {
+    Node* file = job.filev[i];
+    Scope* scope = job.scopev[i];
+    SymMapIter(&scope->bindings, parse_pkg_merge_def, pkgnode->cunit.scope);
+    ScopeFree(scope, mem);
+    if (!file) {
+      ok = false;
+      continue;
+    }
+    NodeArrayAppend(mem, &pkgnode->cunit.a, file);
+    NodeTransferUnresolved(pkgnode, file);
+  }
+
+  if (threads)
+    memfree(mem, threads);
+  memfree(mem, job.arenav);
+  memfree(mem, job.srcv);
+  return ok;
+}
+
+
+// -----------------------------------------------------------------------------------------------
+// tests
+
+#if R_TESTING_ENABLED
+
+#define PARSE_TEST_NFILES 16
+
+// parse_test_pkg parses a package of PARSE_TEST_NFILES files using nthreads threads.
+// Functions call functions defined in other files, which ParsePkg leaves unresolved.
+static Node* parse_test_pkg(Build* b, u32 nthreads) {
+  for (u32 i = 0; i < PARSE_TEST_NFILES; i++) {
+    Str text = str_new(0);
+    for (u32 j = 0; j < 20; j++) {
+      text = str_appendfmt(text,
+        "fun f%u_%u(x, y int) int {\n"
+        "  z = x * %u + y\n"
+        "  if z > 10 { f%u_%u(z, y) } else { z }\n"
+        "}\n",
+        i, j, j, (i + 1) % PARSE_TEST_NFILES, j);
+    }
+    char name[16];
+    snprintf(name, sizeof(name), "f%u.co", i);
+    auto src = memalloct(b->mem, Source);
+    SourceInitMem(src, b->pkg, memstrdup(b->mem, name), memstrdup(b->mem, text), str_len(text));
+    PkgAddSource(b->pkg, src);
+    str_free(text);
+  }
+  Node* pkg = CreatePkgAST(b, ScopeNew(GetGlobalScope(), b->mem));
+  assert(ParsePkg(b, pkg, ParseFlagsDefault, nthreads));
+  asserteq(b->errcount, 0);
+  return pkg;
+}
+
+static bool parse_test_collect_pos(NodeList* nl, void* data) {
+  auto a = (Array*)data;
+  ArrayPush(a, (void*)(uintptr_t)nl->n->pos, MemHeap);
+  if (nl->n->kind == NId)
+    return true;
+  return NodeVisitChildren(nl, data, parse_test_collect_pos);
+}
+
+R_TEST(parse_pkg_parallel) {
+  // a parallel parse produces the same AST, positions and package scope as a serial parse
+  Build* b1 = test_build_new();
+  Build* b2 = test_build_new();
+  Node* pkg1 = parse_test_pkg(b1, 1);
+  Node* pkg2 = parse_test_pkg(b2, 4);
+
+  asserteq(pkg1->cunit.a.len, PARSE_TEST_NFILES);
+  asserteq(pkg2->cunit.a.len, PARSE_TEST_NFILES);
+  asserteq(NodeIsUnresolved(pkg1), NodeIsUnresolved(pkg2));
+
+  Str s1 = NodeRepr(pkg1, str_new(0), NodeReprNoColor);
+  Str s2 = NodeRepr(pkg2, str_new(0), NodeReprNoColor);
+  asserteq(str_len(s1), str_len(s2));
+  asserteq(strcmp(s1, s2), 0);
+  str_free(s1);
+  str_free(s2);
+
+  Array a1 = {0}, a2 = {0};
+  NodeVisit(pkg1, &a1, parse_test_collect_pos);
+  NodeVisit(pkg2, &a2, parse_test_collect_pos);
+  asserteq(a1.len, a2.len);
+  for (u32 i = 0; i < a1.len; i++)
+    asserteq((Pos)(uintptr_t)a1.v[i], (Pos)(uintptr_t)a2.v[i]);
+  ArrayFree(&a1, MemHeap);
+  ArrayFree(&a2, MemHeap);
+
+  for (u32 i = 0; i < PARSE_TEST_NFILES; i++) {
+    char name[16];
+    snprintf(name, sizeof(name), "f%u_7", i);
+    const Node* n1 = ScopeLookup(pkg1->cunit.scope, symgetcstr(b1->syms, name));
+    const Node* n2 = ScopeLookup(pkg2->cunit.scope, symgetcstr(b2->syms, name));
+    assertnotnull(n1);
+    assertnotnull(n2);
+    asserteq(n1->pos, n2->pos);
+  }
+
+  test_build_free(b1);
+  test_build_free(b2);
+}
+
+#endif /* R_TESTING_ENABLED */
+
+
 ASSUME_NONNULL_END
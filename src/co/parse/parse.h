@@ -197,6 +197,7 @@ Comment* nullable ScannerCommentPop(Scanner* s);
 ASSUME_NONNULL_END
 #include "universe.h"
 #include "ast.h"
+#include "ast_flat.h"
 ASSUME_NONNULL_BEGIN
 
 
@@ -245,6 +246,14 @@ Node* CreatePkgAST(Build*, Scope* pkgscope);
 // Returns NULL on error.
 Node* nullable Parse(Parser*, Build*, Source*, ParseFlags, Scope* pkgscope);
 
+// ParsePkg parses all sources of build->pkg using up to nthreads threads (0 = os_ncpu),
+// one Parser per thread. File nodes are added to pkgnode in srclist order and
+// top-level definitions are merged into pkgnode's scope in that same order.
+// Each thread allocates in a sub-arena of build->arena (see memarena_bind.)
+// If threads can't be created, fewer threads (possibly only the calling thread) are used.
+// Returns false if a source failed to open.
+bool ParsePkg(Build*, Node* pkgnode, ParseFlags, u32 nthreads);
+
 // ResolveSym resolves unresolved symbols in an AST. May return a new version of n.
 // For top-level AST, scope should be pkgscope.
 Node* ResolveSym(Build*, ParseFlags, Node*, Scope*);
@@ -252,18 +261,27 @@ Node* ResolveSym(Build*, ParseFlags, Node*, Scope*);
 // ResolveType resolves unresolved types in an AST. May return a new version of n.
 Node* ResolveType(Build* b, Node* n);
 
-// GetTypeID retrieves the TypeID for the type node n.
+// GetTypeID retrieves the TypeID for the type node n, a string describing the type's shape.
+// It is used to name things like functions; type equality is tested with InternASTType.
 // This function may mutate n by computing and storing id to n.t.id.
 // This function may add symbols to b->syms
 Sym GetTypeID(Build* b, Type* n);
 
-// InternASTType uses GetTypeID(t) to intern the type.
-// It returns t if newfound, or an existing type node equivalent to t.
+// InternASTType interns t and its element types in b->types by structure.
+// It returns t if newfound, or an existing type node equivalent to t. Two types are
+// equivalent if and only if InternASTType returns the same node for both.
+// Basic types are returned as-is; they are equivalent when their t.id are equal.
+// Like GetTypeID, the result is remembered for t, so t must not change shape afterwards.
 // The returned type is valid until the next call to build_dispose(b).
+// This function is thread safe.
 Type* InternASTType(Build* b, Type* t);
 
+// typetab_init initializes a type table which allocates memory in mem
+void typetab_init(TypeTable*, Mem mem);
+void typetab_dispose(TypeTable*);
+
 // TypeEquals returns true if x and y are equivalent types (i.e. identical).
-// This function may call GetTypeID which may update b->syms, may mutate x and y.
+// This function may call InternASTType which may add x and y to b->types.
 static bool TypeEquals(Build* b, Type* x, Type* y);
 
 // // TypeConv describes the effect of converting one type to another
@@ -287,7 +305,7 @@ typedef enum {
 // If n is already of type t, n is simply returned.
 // n is assumed to have no unresolved refs (expected to have gone through resolve_sym)
 // Build is used for error reporting.
-// This function may call GetTypeID which may update b->syms and mutate n.
+// This function may call InternASTType which may add types to b->types.
 Node* convlit(Build*, Node* n, Type* t, ConvlitFlags fl);
 
 
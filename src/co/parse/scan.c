@@ -1,5 +1,6 @@
 #include "../common.h"
 #include "parse.h"
+#include "scan.h"
 
 // Enable to dlog ">> TOKEN VALUE at SOURCELOC" on each call to SNext
 //#define SCANNER_DEBUG_TOKEN_PRODUCTION
@@ -48,6 +49,135 @@ static u8 charflags[256] = {
 };
 
 
+// -----------------------------------------------------------------------------------------------
+// vectorized fast paths
+//
+// The scan_* functions classify SCAN_VLEN bytes of input at a time (see scan.h for the vector
+// primitives) and scan the tail of the input (less than SCAN_VLEN bytes) one byte at a time.
+// The vector classification must agree with charflags; see test scan_fastpaths.
+//
+#ifdef SCAN_VLEN
+  // scan_mask_first returns the index of the first byte set in m (m must not be 0)
+  #define scan_mask_first(m) ((u32)__builtin_ctzll(m) / SCAN_BPB)
+  // scan_mask_last returns the index of the last byte set in m (m must not be 0)
+  #define scan_mask_last(m)  ((u32)(63 - __builtin_clzll(m)) / SCAN_BPB)
+  // scan_mask_count returns the number of bytes set in m
+  #define scan_mask_count(m) ((u32)__builtin_popcountll(m) / SCAN_BPB)
+  // scan_mask_below returns a mask of bytes [0-i)
+  #define scan_mask_below(i) ((((u64)1) << ((i) * SCAN_BPB)) - 1)
+
+  // scanv_range tests lo <= v <= hi. The comparison is signed; bytes >= 0x80 never match.
+  #define scanv_range(v, lo, hi) \
+    scanv_and(scanv_gt((v), scanv_splat((lo) - 1)), scanv_gt(scanv_splat((hi) + 1), (v)))
+
+  // scanv_isident classifies CH_IDENT bytes: 0-9 A-Z a-z _ + -
+  inline static scanvec scanv_isident(scanvec v) {
+    scanvec m = scanv_range(scanv_or(v, scanv_splat(0x20)), 'a', 'z'); // A-Z a-z
+    m = scanv_or(m, scanv_range(v, '0', '9'));
+    m = scanv_or(m, scanv_eq(v, scanv_splat('_')));
+    m = scanv_or(m, scanv_eq(v, scanv_splat('+')));
+    return scanv_or(m, scanv_eq(v, scanv_splat('-')));
+  }
+
+  // scanv_isws classifies CH_WHITESPACE bytes: SP TAB LF CR
+  inline static scanvec scanv_isws(scanvec v) {
+    scanvec m = scanv_eq(v, scanv_splat(' '));
+    m = scanv_or(m, scanv_eq(v, scanv_splat('\t')));
+    m = scanv_or(m, scanv_eq(v, scanv_splat('\n')));
+    return scanv_or(m, scanv_eq(v, scanv_splat('\r')));
+  }
+#endif
+
+
+// scan_ident_end returns the first byte in [p-end) that is not CH_IDENT, or end.
+static const u8* scan_ident_end(const u8* p, const u8* end) {
+  #ifdef SCAN_VLEN
+  while (end - p >= SCAN_VLEN) {
+    u64 m = ~scanv_mask(scanv_isident(scanv_load(p))) & SCAN_MASK_ALL;
+    if (m)
+      return p + scan_mask_first(m);
+    p += SCAN_VLEN;
+  }
+  #endif
+  while (p < end && (charflags[*p] & CH_IDENT))
+    p++;
+  return p;
+}
+
+
+// scan_ws_end returns the first byte in [p-end) that is not CH_WHITESPACE, or end.
+// The number of LF bytes skipped is added to nlines and lastnl is set to the last one.
+static const u8* scan_ws_end(const u8* p, const u8* end, u32* nlines, const u8** lastnl) {
+  #ifdef SCAN_VLEN
+  while (end - p >= SCAN_VLEN) {
+    scanvec v = scanv_load(p);
+    u64 stop = ~scanv_mask(scanv_isws(v)) & SCAN_MASK_ALL;
+    u64 nl = scanv_mask(scanv_eq(v, scanv_splat('\n')));
+    u32 n = SCAN_VLEN;
+    if (stop) {
+      n = scan_mask_first(stop);
+      nl &= scan_mask_below(n);
+    }
+    if (nl) {
+      *nlines += scan_mask_count(nl);
+      *lastnl = p + scan_mask_last(nl);
+    }
+    p += n;
+    if (stop)
+      return p;
+  }
+  #endif
+  while (p < end && (charflags[*p] & CH_WHITESPACE)) {
+    if (*p == '\n') {
+      (*nlines)++;
+      *lastnl = p;
+    }
+    p++;
+  }
+  return p;
+}
+
+
+// scan_block_comment_end returns the first "*/" in [p-end), or end if there is none.
+// Counts LF bytes like scan_ws_end.
+static const u8* scan_block_comment_end(
+  const u8* p, const u8* end, u32* nlines, const u8** lastnl)
+{
+  #ifdef SCAN_VLEN
+  // Note: "> SCAN_VLEN" rather than ">=" since we also load from p+1
+  while (end - p > SCAN_VLEN) {
+    scanvec v = scanv_load(p);
+    u64 m = scanv_mask(scanv_and(
+      scanv_eq(v, scanv_splat('*')),
+      scanv_eq(scanv_load(p + 1), scanv_splat('/')) ));
+    u64 nl = scanv_mask(scanv_eq(v, scanv_splat('\n')));
+    u32 n = SCAN_VLEN;
+    if (m) {
+      n = scan_mask_first(m);
+      nl &= scan_mask_below(n);
+    }
+    if (nl) {
+      *nlines += scan_mask_count(nl);
+      *lastnl = p + scan_mask_last(nl);
+    }
+    p += n;
+    if (m)
+      return p;
+  }
+  #endif
+  while (p < end) {
+    if (*p == '*' && p + 1 < end && p[1] == '/')
+      return p;
+    if (*p == '\n') {
+      (*nlines)++;
+      *lastnl = p;
+    }
+    p++;
+  }
+  return end;
+}
+
+
 bool ScannerInit(Scanner* s, Build* build, Source* src, ParseFlags flags) {
   if (!SourceOpenBody(src))
     return false;
@@ -157,29 +287,22 @@ static void comments_push_back(Scanner* s) {
 
 static void scomment_block(Scanner* s) {
   s->tokstart += 2; // exclude "/*"
-  u8 prevc = 0;
-  while (s->inp < s->inend) {
-    switch (*s->inp) {
-      case '/':
-        if (prevc == '*') {
-          s->tokend = s->inp - 1; // -1 to skip '*'
-          s->inp++; // consume '*'
-          if (s->flags & ParseComments)
-            comments_push_back(s);
-          return;
-        }
-        break;
-      case '\n':
-        // update line state
-        s->lineno++;
-        s->linestart = s->inp + 1;
-        break;
-      default:
-        break;
-    }
-    prevc = *s->inp;
-    s->inp++;
+  u32 nlines = 0;
+  const u8* lastnl = NULL;
+  const u8* p = scan_block_comment_end(s->inp, s->inend, &nlines, &lastnl);
+  // update line state
+  if (nlines) {
+    s->lineno += nlines;
+    s->linestart = lastnl + 1;
+  }
+  if (p == s->inend) { // unterminated
+    s->inp = p;
+    return;
   }
+  s->tokend = p;
+  s->inp = p + 2; // consume "*/"
+  if (s->flags & ParseComments)
+    comments_push_back(s);
 }
 
 
@@ -187,9 +310,8 @@ static void scomment(Scanner* s) {
   s->tokstart += 2; // exclude "//"
   // line comment
   // advance s->inp until next <LF> or EOF. Leave s->inp at \n or EOF.
-  while (s->inp < s->inend && *s->inp != '\n') {
-    s->inp++;
-  }
+  const u8* p = memchr(s->inp, '\n', (size_t)(s->inend - s->inp));
+  s->inp = p ? p : s->inend;
   s->tokend = s->inp;
   if (s->flags & ParseComments)
     comments_push_back(s);
@@ -223,8 +345,7 @@ static void snameuni(Scanner* s) {
 
 // read ASCII name (may switch over to snameuni)
 static void sname(Scanner* s) {
-  while (s->inp < s->inend && charflags[*s->inp] & CH_IDENT)
-    s->inp++;
+  s->inp = scan_ident_end(s->inp, s->inend);
 
   if (*s->inp >= RuneSelf && s->inp < s->inend) {
     // s->inp = s->tokstart;
@@ -338,13 +459,13 @@ Tok ScannerNext(Scanner* s) {
 
   // whitespace
   bool islnstart = s->inp == s->linestart;
-  while (s->inp < s->inend && (charflags[*s->inp] & CH_WHITESPACE)) {
-    if (*s->inp == '\n') {
-      s->lineno++;
-      s->linestart = s->inp + 1;
-      islnstart = true;
-    }
-    s->inp++;
+  u32 nlines = 0;
+  const u8* lastnl = NULL;
+  s->inp = scan_ws_end(s->inp, s->inend, &nlines, &lastnl);
+  if (nlines) {
+    s->lineno += nlines;
+    s->linestart = lastnl + 1;
+    islnstart = true;
   }
 
   // implicit semicolon, '{' or '}'
@@ -567,3 +688,49 @@ Tok ScannerNext(Scanner* s) {
   debug_token_production(s);
   return s->tok;
 }
+
+
+R_TEST(scan_fastpaths) {
+  // compare the scan_* fast paths to straight-forward byte-by-byte scanning of random input
+  // made up mostly of interesting bytes, at all offsets into the input.
+  const char alphabet[] = "abzAZ09_+-@[`{ \t\n\r\x0b*/.\x80\xff";
+  u8 buf[200];
+  srandom(1);
+  for (u32 iter = 0; iter < 300; iter++) {
+    u32 len = (u32)random() % countof(buf);
+    for (u32 i = 0; i < len; i++)
+      buf[i] = (u8)alphabet[(u32)random() % (countof(alphabet) - 1)];
+    for (u32 start = 0; start <= len; start++) {
+      const u8* end = buf + len;
+      const u8* p;
+
+      p = buf + start;
+      while (p < end && (charflags[*p] & CH_IDENT))
+        p++;
+      asserteq(scan_ident_end(buf + start, end), p);
+
+      u32 nlines1 = 0, nlines2 = 0;
+      const u8* lastnl1 = NULL;
+      const u8* lastnl2 = NULL;
+      p = buf + start;
+      while (p < end && (charflags[*p] & CH_WHITESPACE)) {
+        if (*p == '\n') { nlines1++; lastnl1 = p; }
+        p++;
+      }
+      asserteq(scan_ws_end(buf + start, end, &nlines2, &lastnl2), p);
+      asserteq(nlines1, nlines2);
+      asserteq(lastnl1, lastnl2);
+
+      nlines1 = 0; nlines2 = 0;
+      lastnl1 = NULL; lastnl2 = NULL;
+      p = buf + start;
+      while (p < end && !(*p == '*' && p + 1 < end && p[1] == '/')) {
+        if (*p == '\n') { nlines1++; lastnl1 = p; }
+        p++;
+      }
+      asserteq(scan_block_comment_end(buf + start, end, &nlines2, &lastnl2), p);
+      asserteq(nlines1, nlines2);
+      asserteq(lastnl1, lastnl2);
+    }
+  }
+}
@@ -0,0 +1,54 @@
+#pragma once
+// Vector primitives of the scanner's fast paths (see scan.c.)
+//
+// SCAN_SIMD names the instruction set in use and SCAN_VLEN is the number of bytes in a vector.
+// Neither is defined when the scanner only uses scalar code, which is the case when
+// CO_SCAN_NO_SIMD is defined (e.g. to compare performance) or the target has no supported
+// vector instructions. Comparisons are reduced to a bitmask with SCAN_BPB bits per input byte
+// (NEON has no movemask and uses 4 bits per byte.)
+//
+
+#if !defined(CO_SCAN_NO_SIMD) && defined(__AVX2__)
+  #include <immintrin.h>
+  #define SCAN_SIMD "avx2"
+  #define SCAN_VLEN 32
+  #define SCAN_BPB  1
+  typedef __m256i scanvec;
+  #define scanv_load(p)  _mm256_loadu_si256((const __m256i*)(p))
+  #define scanv_splat(c) _mm256_set1_epi8((char)(c))
+  #define scanv_eq(a, b) _mm256_cmpeq_epi8((a), (b))
+  #define scanv_gt(a, b) _mm256_cmpgt_epi8((a), (b)) /* signed */
+  #define scanv_or(a, b) _mm256_or_si256((a), (b))
+  #define scanv_and(a,b) _mm256_and_si256((a), (b))
+  #define scanv_mask(v)  ((u64)(u32)_mm256_movemask_epi8(v))
+  #define SCAN_MASK_ALL  ((u64)0xFFFFFFFF)
+#elif !defined(CO_SCAN_NO_SIMD) && defined(__SSE2__)
+  #include <emmintrin.h>
+  #define SCAN_SIMD "sse2"
+  #define SCAN_VLEN 16
+  #define SCAN_BPB  1
+  typedef __m128i scanvec;
+  #define scanv_load(p)  _mm_loadu_si128((const __m128i*)(p))
+  #define scanv_splat(c) _mm_set1_epi8((char)(c))
+  #define scanv_eq(a, b) _mm_cmpeq_epi8((a), (b))
+  #define scanv_gt(a, b) _mm_cmpgt_epi8((a), (b)) /* signed */
+  #define scanv_or(a, b) _mm_or_si128((a), (b))
+  #define scanv_and(a,b) _mm_and_si128((a), (b))
+  #define scanv_mask(v)  ((u64)(u32)_mm_movemask_epi8(v))
+  #define SCAN_MASK_ALL  ((u64)0xFFFF)
+#elif !defined(CO_SCAN_NO_SIMD) && defined(__ARM_NEON)
+  #include <arm_neon.h>
+  #define SCAN_SIMD "neon"
+  #define SCAN_VLEN 16
+  #define SCAN_BPB  4
+  typedef int8x16_t scanvec;
+  #define scanv_load(p)  vld1q_s8((const int8_t*)(p))
+  #define scanv_splat(c) vdupq_n_s8((int8_t)(c))
+  #define scanv_eq(a, b) vreinterpretq_s8_u8(vceqq_s8((a), (b)))
+  #define scanv_gt(a, b) vreinterpretq_s8_u8(vcgtq_s8((a), (b))) /* signed */
+  #define scanv_or(a, b) vorrq_s8((a), (b))
+  #define scanv_and(a,b) vandq_s8((a), (b))
+  #define scanv_mask(v) \
+    vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_s8(v), 4)), 0)
+  #define SCAN_MASK_ALL  (~(u64)0)
+#endif
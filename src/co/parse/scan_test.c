@@ -1,6 +1,7 @@
 #include "../common.h"
 #if R_TESTING_ENABLED
 #include "parse.h"
+#include "scan.h"
 #include "../util/tmpstr.h"
 
 typedef struct ScanTestCtx {
@@ -357,6 +358,71 @@ R_TEST(scan_pos) {
 // ScannerPos
 
 
+R_TEST(scan_comment_block_lines) {
+  // line state is updated for newlines inside block comments, which are scanned in bulk
+  auto scanner = test_scanner_new(ParseFlagsDefault,
+    "a /* 1\n 2\n\n 3 *** 4 ****/ b\n"
+    "/* unterminated\n");
+  asserteq(ScannerNext(scanner), TId);
+  asserteq(ScannerNext(scanner), TId);
+  Pos p = ScannerPos(scanner);
+  asserteq(pos_line(p), 4);
+  asserteq(pos_col(p), 16);
+  asserteq(ScannerNext(scanner), TSemi);
+  asserteq(ScannerNext(scanner), TNone);
+  asserteq(scanner->lineno, 6);
+  asserteq(test_scanner_ctx(scanner)->nerrors, 0);
+  test_scanner_free(scanner);
+}
+
+
+// scan_bench measures scanner throughput (see co_bench_enabled.)
+// Compare with a build where CO_SCAN_NO_SIMD is defined to see the effect of the fast paths.
+R_TEST(scan_bench) {
+  if (!co_bench_enabled())
+    return;
+  const char* chunk =
+    "// compute_the_thing computes the thing for a given entity\n"
+    "fun compute_the_thing(entity_index, another_argument int, flags uint) int {\n"
+    "  /* Block comments usually span multiple lines\n"
+    "     and contain prose which is skipped in bulk */\n"
+    "  some_intermediate_result = entity_index * 31 + another_argument\n"
+    "  if some_intermediate_result > 1000 {\n"
+    "    return some_intermediate_result - another_argument   // trailing comment\n"
+    "  }\n"
+    "  some_intermediate_result + flags\n"
+    "}\n"
+    "\n";
+  size_t chunklen = strlen(chunk);
+  size_t len = 32*1024*1024; // 32 MiB
+  char* text = memalloc(MemHeap, len);
+  for (size_t i = 0; i < len; i += chunklen)
+    memcpy(&text[i], chunk, MIN(chunklen, len - i));
+
+  auto scanner = test_scanner_newn(ParseFlagsDefault, text, len);
+  u64 ntokens = 0;
+  auto starttm = nanotime();
+  while (ScannerNext(scanner) != TNone)
+    ntokens++;
+  u64 duration = nanotime() - starttm;
+  asserteq(test_scanner_ctx(scanner)->nerrors, 0);
+
+  char durstr[40];
+  auto durlen = fmtduration(durstr, countof(durstr), duration);
+  fprintf(stderr, "scan_bench: %zu MiB, %llu tokens in %.*s (%.1f MB/s, %s)\n",
+    len / (1024*1024), ntokens, durlen, durstr,
+    ((double)len / 1000000.0) / ((double)duration / 1000000000.0),
+    #ifdef SCAN_SIMD
+      SCAN_SIMD
+    #else
+      "scalar"
+    #endif
+  );
+  test_scanner_free(scanner);
+  memfree(MemHeap, text);
+}
+
+
 // --------------------------------------------------------------------------------------------
 // test helper functions
 
@@ -108,18 +108,6 @@ static Str mktypestr(Str s, const Node* n) {
 }
 
 
-Type* InternASTType(Build* b, Type* t) {
-  if (t->kind == NBasicType)
-    return t;
-  auto tid = GetTypeID(b, t);
-  auto t2 = SymMapGet(&b->types, tid);
-  if (t2)
-    return t2;
-  SymMapSet(&b->types, tid, t);
-  return t;
-}
-
-
 // GetTypeID returns the type Sym identifying n
 Sym GetTypeID(Build* b, Type* n) {
   // Note: All built-in non-generic types have predefined type ids
@@ -132,6 +120,224 @@ Sym GetTypeID(Build* b, Type* n) {
 }
 
 
+// -----------------------------------------------------------------------------------------------
+// type table
+//
+// Types are interned ("hash-consed") by structure: the key of a type is its kind, sizes and
+// the keys of its element types. Element types are interned before the type itself which
+// means that the key of an element is simply the address of its canonical type node (or
+// for basic types, their type id) and that two types are equivalent if and only if they
+// have the same canonical type node. canon maps each type node seen to its canonical
+// node, making interning a type again a single lookup.
+//
+// The shape described by a type's key is the same as that of GetTypeID.
+
+#define TYPETAB_INITCAP 64 // must be a power of two
+
+// typetab_internable returns true for kinds of types which are interned by structure.
+// Other types are only equivalent to themselves.
+inline static bool typetab_internable(NodeKind kind) {
+  switch (kind) {
+    case NRefType:
+    case NArrayType:
+    case NTupleType:
+    case NStructType:
+    case NFunType:
+      return true;
+    default:
+      return false;
+  }
+}
+
+inline static Type* nullable typetab_funparams(const Type* t) {
+  return t->t.fun.params ? t->t.fun.params->type : NULL;
+}
+
+// typetab_elemkey returns the key of an element type t, which must have been interned.
+// Caller must hold tt->mu.
+static uintptr_t typetab_elemkey(const TypeTable* tt, const Type* nullable t) {
+  if (!t)
+    return 0;
+  if (t->kind == NBasicType)
+    return (uintptr_t)t->t.id;
+  if (!typetab_internable(t->kind))
+    return (uintptr_t)t;
+  Type* c = PtrMapGet(&tt->canon, t);
+  assertnotnull_debug(c);
+  return (uintptr_t)c;
+}
+
+inline static size_t typetab_mix(size_t h, uintptr_t v) {
+  return (h ^ v) * (size_t)0x9E3779B97F4A7C15llu;
+}
+
+// typetab_hash returns the hash of t's key. Caller must hold tt->mu.
+static size_t typetab_hash(const TypeTable* tt, const Type* t) {
+  size_t h = typetab_mix(0, t->kind);
+  switch (t->kind) {
+    case NRefType:
+      return typetab_mix(h, typetab_elemkey(tt, t->t.ref));
+    case NArrayType:
+      h = typetab_mix(h, t->t.array.size);
+      return typetab_mix(h, typetab_elemkey(tt, t->t.array.subtype));
+    case NTupleType:
+      h = typetab_mix(h, t->t.tuple.a.len);
+      for (u32 i = 0; i < t->t.tuple.a.len; i++)
+        h = typetab_mix(h, typetab_elemkey(tt, t->t.tuple.a.v[i]));
+      return h;
+    case NStructType:
+      h = typetab_mix(h, t->t.struc.a.len);
+      for (u32 i = 0; i < t->t.struc.a.len; i++)
+        h = typetab_mix(h, typetab_elemkey(tt, ((Node*)t->t.struc.a.v[i])->type));
+      return h;
+    case NFunType:
+      h = typetab_mix(h, typetab_elemkey(tt, typetab_funparams(t)));
+      return typetab_mix(h, typetab_elemkey(tt, t->t.fun.result));
+    default:
+      panic("unexpected %s", NodeKindName(t->kind));
+  }
+}
+
+// typetab_equal returns true if the keys of x and y are equal. Caller must hold tt->mu.
+static bool typetab_equal(const TypeTable* tt, const Type* x, const Type* y) {
+  #define EQ(x, y) (typetab_elemkey(tt, (x)) == typetab_elemkey(tt, (y)))
+  if (x->kind != y->kind)
+    return false;
+  switch (x->kind) {
+    case NRefType:
+      return EQ(x->t.ref, y->t.ref);
+    case NArrayType:
+      return x->t.array.size == y->t.array.size && EQ(x->t.array.subtype, y->t.array.subtype);
+    case NTupleType:
+      if (x->t.tuple.a.len != y->t.tuple.a.len)
+        return false;
+      for (u32 i = 0; i < x->t.tuple.a.len; i++) {
+        if (!EQ(x->t.tuple.a.v[i], y->t.tuple.a.v[i]))
+          return false;
+      }
+      return true;
+    case NStructType:
+      if (x->t.struc.a.len != y->t.struc.a.len)
+        return false;
+      for (u32 i = 0; i < x->t.struc.a.len; i++) {
+        if (!EQ(((Node*)x->t.struc.a.v[i])->type, ((Node*)y->t.struc.a.v[i])->type))
+          return false;
+      }
+      return true;
+    case NFunType:
+      return EQ(typetab_funparams(x), typetab_funparams(y)) &&
+             EQ(x->t.fun.result, y->t.fun.result);
+    default:
+      panic("unexpected %s", NodeKindName(x->kind));
+  }
+  #undef EQ
+}
+
+static void typetab_grow(TypeTable* tt) {
+  u32 cap = tt->cap * 2;
+  u32 mask = cap - 1;
+  TypeTableEntry* entries = memalloc(tt->mem, sizeof(TypeTableEntry) * cap);
+  for (u32 i = 0; i < tt->cap; i++) {
+    TypeTableEntry* e = &tt->entries[i];
+    if (!e->type)
+      continue;
+    u32 j = (u32)e->hash & mask;
+    while (entries[j].type)
+      j = (j + 1) & mask;
+    entries[j] = *e;
+  }
+  memfree(tt->mem, tt->entries);
+  tt->entries = entries;
+  tt->cap = cap;
+}
+
+// typetab_add returns the canonical type for t, making t canonical if there is none.
+// Caller must hold tt->mu exclusively.
+static Type* typetab_add(TypeTable* tt, Type* t) {
+  if (tt->len >= tt->cap / 2)
+    typetab_grow(tt);
+  size_t hash = typetab_hash(tt, t);
+  u32 mask = tt->cap - 1;
+  u32 i = (u32)hash & mask;
+  while (tt->entries[i].type) {
+    TypeTableEntry* e = &tt->entries[i];
+    if (e->hash == hash && typetab_equal(tt, e->type, t))
+      return e->type;
+    i = (i + 1) & mask;
+  }
+  tt->entries[i].hash = hash;
+  tt->entries[i].type = t;
+  tt->len++;
+  return t;
+}
+
+inline static void typetab_intern_elem(Build* b, Type* nullable t) {
+  if (t)
+    InternASTType(b, t);
+}
+
+void typetab_init(TypeTable* tt, Mem mem) {
+  memset(tt, 0, sizeof(*tt));
+  tt->mem = mem;
+  rwmtx_init(&tt->mu, mtx_plain);
+  tt->cap = TYPETAB_INITCAP;
+  tt->entries = memalloc(mem, sizeof(TypeTableEntry) * tt->cap);
+  PtrMapInit(&tt->canon, TYPETAB_INITCAP, mem);
+}
+
+void typetab_dispose(TypeTable* tt) {
+  memfree(tt->mem, tt->entries);
+  PtrMapDispose(&tt->canon);
+  rwmtx_destroy(&tt->mu);
+}
+
+
+Type* InternASTType(Build* b, Type* t) {
+  if (!typetab_internable(t->kind))
+    return t;
+  TypeTable* tt = &b->types;
+  rwmtx_rlock(&tt->mu);
+  Type* c = PtrMapGet(&tt->canon, t);
+  rwmtx_runlock(&tt->mu);
+  if (c)
+    return c;
+
+  // intern element types first so that their keys are known
+  switch (t->kind) {
+    case NRefType:
+      typetab_intern_elem(b, t->t.ref);
+      break;
+    case NArrayType:
+      typetab_intern_elem(b, t->t.array.subtype);
+      break;
+    case NTupleType:
+      for (u32 i = 0; i < t->t.tuple.a.len; i++)
+        typetab_intern_elem(b, t->t.tuple.a.v[i]);
+      break;
+    case NStructType:
+      for (u32 i = 0; i < t->t.struc.a.len; i++)
+        typetab_intern_elem(b, ((Node*)t->t.struc.a.v[i])->type);
+      break;
+    case NFunType:
+      typetab_intern_elem(b, typetab_funparams(t));
+      typetab_intern_elem(b, t->t.fun.result);
+      break;
+    default:
+      break;
+  }
+
+  rwmtx_lock(&tt->mu);
+  // another thread may have interned t while we were not holding the lock
+  c = PtrMapGet(&tt->canon, t);
+  if (!c) {
+    c = typetab_add(tt, t);
+    PtrMapSet(&tt->canon, t, c);
+  }
+  rwmtx_unlock(&tt->mu);
+  return c;
+}
+
+
 bool _TypeEquals(Build* b, Type* x, Type* y) {
   assertnotnull(x);
   assertnotnull(y);
@@ -144,7 +350,7 @@ bool _TypeEquals(Build* b, Type* x, Type* y) {
     return false;
   if (x->kind == NBasicType)
     return x->t.id == y->t.id;
-  return GetTypeID(b, x) == GetTypeID(b, y);
+  return InternASTType(b, x) == InternASTType(b, y);
 }
 
 
@@ -370,6 +576,76 @@ R_TEST(typeid) {
   // printf("--------------------------------------------------\n");
 }
 
+
+R_TEST(typetab) {
+  auto build = test_build_new();
+  auto mem = build->mem;
+
+  #define mktuple(...) ({                              \
+    Node* _tmp_elems[] = { __VA_ARGS__ };              \
+    Node* _tmp_t = NewNode(mem, NTupleType);           \
+    for (u32 i = 0; i < countof(_tmp_elems); i++)      \
+      NodeArrayAppend(mem, &_tmp_t->t.tuple.a, _tmp_elems[i]); \
+    _tmp_t; })
+  #define mkarray(size_, subtype_) ({                  \
+    Node* _tmp_t = NewNode(mem, NArrayType);           \
+    _tmp_t->t.array.size = (size_);                    \
+    _tmp_t->t.array.subtype = (subtype_);              \
+    _tmp_t; })
+
+  // basic types are not interned
+  assert(InternASTType(build, Type_int) == Type_int);
+
+  // equivalent types share a canonical type
+  Node* t1 = mktuple(mktuple(Type_int, Type_int), Type_bool);
+  Node* t2 = mktuple(mktuple(Type_int, Type_int), Type_bool);
+  Node* t3 = mktuple(mktuple(Type_int, Type_bool), Type_bool);
+  assert(InternASTType(build, t1) == t1);
+  assert(InternASTType(build, t2) == t1);
+  assert(InternASTType(build, t2) == t1); // again, from canon
+  assert(InternASTType(build, t3) == t3);
+  assert(InternASTType(build, t2->t.tuple.a.v[0]) == t1->t.tuple.a.v[0]);
+  assert(TypeEquals(build, t1, t2));
+  assert(!TypeEquals(build, t1, t3));
+
+  // type ids are not needed to compare types
+  Node* t4 = mktuple(Type_int, mkarray(3, Type_u8));
+  Node* t5 = mktuple(Type_int, mkarray(3, Type_u8));
+  assert(TypeEquals(build, t4, t5));
+  assert(t4->t.id == NULL && t5->t.id == NULL);
+
+  // sizes are part of the key
+  assert(!TypeEquals(build, mkarray(3, Type_u8), mkarray(4, Type_u8)));
+
+  // function types
+  Node* params = NewNode(mem, NTuple);
+  params->type = mktuple(Type_int, Type_bool);
+  Node* f1 = NewNode(mem, NFunType);
+  f1->t.fun.params = params;
+  f1->t.fun.result = Type_int;
+  Node* f2 = NewNode(mem, NFunType);
+  f2->t.fun.params = NewNode(mem, NTuple);
+  f2->t.fun.params->type = mktuple(Type_int, Type_bool);
+  f2->t.fun.result = Type_int;
+  Node* f3 = NewNode(mem, NFunType);
+  f3->t.fun.result = Type_int;
+  assert(TypeEquals(build, f1, f2));
+  assert(!TypeEquals(build, f1, f3));
+
+  // many distinct types grow the table
+  u32 len = build->types.len;
+  for (u32 i = 0; i < 1000; i++) {
+    Node* a = mkarray(i + 1, Type_int);
+    assert(InternASTType(build, a) == a);
+    assert(InternASTType(build, mkarray(i + 1, Type_int)) == a);
+  }
+  asserteq(build->types.len, len + 1000);
+
+  #undef mktuple
+  #undef mkarray
+  test_build_free(build);
+}
+
 #endif /* R_TESTING_ENABLED */
 
 
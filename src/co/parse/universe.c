@@ -136,45 +136,46 @@ Node* Const_true = (Node*)&_Const_true;
 Node* Const_false = (Node*)&_Const_false;
 Node* Const_nil = (Node*)&_Const_nil;
 
-static SymRBNode n_u16 = { sym_u16, true, NULL, NULL };
-static SymRBNode n_u64 = { sym_u64, false, &n_u16, NULL };
-static SymRBNode n_mut = { sym_mut, false, NULL, NULL };
-static SymRBNode n_bool = { sym_bool, true, &n_u64, &n_mut };
-static SymRBNode n_switch = { sym_switch, false, NULL, NULL };
-static SymRBNode n_for = { sym_for, false, &n_bool, &n_switch };
-static SymRBNode n_i16 = { sym_i16, true, NULL, NULL };
-static SymRBNode n_i64 = { sym_i64, true, NULL, NULL };
-static SymRBNode n_else = { sym_else, false, &n_i16, &n_i64 };
-static SymRBNode n_u8 = { sym_u8, true, NULL, NULL };
-static SymRBNode n_f64 = { sym_f64, true, NULL, NULL };
-static SymRBNode n_fun = { sym_fun, false, &n_u8, &n_f64 };
-static SymRBNode n_defer = { sym_defer, true, &n_else, &n_fun };
-static SymRBNode n_int = { sym_int, true, NULL, NULL };
-static SymRBNode n_const = { sym_const, false, &n_int, NULL };
-static SymRBNode n_return = { sym_return, false, &n_defer, &n_const };
-static SymRBNode n_struct = { sym_struct, false, &n_for, &n_return };
-static SymRBNode n_enum = { sym_enum, false, NULL, NULL };
-static SymRBNode n__ = { sym__, true, NULL, NULL };
-static SymRBNode n_u32 = { sym_u32, false, &n__, NULL };
-static SymRBNode n_if = { sym_if, true, &n_enum, &n_u32 };
-static SymRBNode n_false = { sym_false, true, NULL, NULL };
-static SymRBNode n_type = { sym_type, false, &n_false, NULL };
-static SymRBNode n_break = { sym_break, false, &n_if, &n_type };
-static SymRBNode n_true = { sym_true, true, NULL, NULL };
-static SymRBNode n_in = { sym_in, false, &n_true, NULL };
-static SymRBNode n_str = { sym_str, false, NULL, NULL };
-static SymRBNode n_i32 = { sym_i32, false, &n_in, &n_str };
-static SymRBNode n_i8 = { sym_i8, true, &n_break, &n_i32 };
-static SymRBNode n_continue = { sym_continue, false, NULL, NULL };
-static SymRBNode n_import = { sym_import, true, NULL, NULL };
-static SymRBNode n_uint = { sym_uint, false, &n_import, NULL };
-static SymRBNode n_auto = { sym_auto, true, &n_continue, &n_uint };
-static SymRBNode n_f32 = { sym_f32, false, NULL, NULL };
-static SymRBNode n_var = { sym_var, false, &n_auto, &n_f32 };
-static SymRBNode n_nil = { sym_nil, false, &n_i8, &n_var };
-static SymRBNode n_as = { sym_as, false, &n_struct, &n_nil };
-
-static SymRBNode* _symroot = &n_as;
+static SymTabEntry _symtab_entries[128] = {
+  [0] = { sym_enum, 0xCDE4E000 },
+  [7] = { sym_as, 0xCD7F3D87 },
+  [10] = { sym_const, 0xADDC540A },
+  [15] = { sym_nil, 0xEF4F7E8F },
+  [16] = { sym_f64, 0x9CEB7B90 },
+  [18] = { sym_str, 0xED4DAE12 },
+  [23] = { sym_struct, 0x5080FC97 },
+  [27] = { sym_fun, 0x8A8AD71B },
+  [29] = { sym_i8, 0xDB63E29D },
+  [30] = { sym_f32, 0xFD5E9C9E },
+  [33] = { sym_i64, 0x6CF393A1 },
+  [34] = { sym_true, 0xDB6411A2 },
+  [39] = { sym_var, 0xFD0ABE27 },
+  [44] = { sym_false, 0xD5ED1CAC },
+  [45] = { sym_auto, 0xF595F8AD },
+  [46] = { sym_defer, 0x742443AD },
+  [47] = { sym_else, 0x552A2AAD },
+  [48] = { sym_for, 0x49A4772E },
+  [52] = { sym_continue, 0xF1ABFFB4 },
+  [55] = { sym_switch, 0x4B68E037 },
+  [58] = { sym_u64, 0x2D931CBA },
+  [66] = { sym_i16, 0x524AF3C2 },
+  [74] = { sym_i32, 0xE0EC534A },
+  [77] = { sym_int, 0xA5659ECD },
+  [82] = { sym_type, 0xD6B21E52 },
+  [97] = { sym_u32, 0xD1381361 },
+  [103] = { sym__, 0xD08952E7 },
+  [107] = { sym_return, 0xA308A6EB },
+  [111] = { sym_u8, 0x76BFCAEF },
+  [112] = { sym_bool, 0x3D7D6D70 },
+  [116] = { sym_in, 0xDDDF9A74 },
+  [117] = { sym_if, 0xCF928DF5 },
+  [120] = { sym_import, 0xF84AA4F8 },
+  [121] = { sym_u16, 0x1DDE6BF8 },
+  [122] = { sym_uint, 0xFBDC0AFA },
+  [125] = { sym_mut, 0x41BC837D },
+  [127] = { sym_break, 0xD28355FF },
+};
+static SymTable _symtab = { 128, 37, NULL, _symtab_entries };
 
 Node* const _TypeCodeToTypeNodeMap[TypeCode_CONCRETE_END] = {
   (Node*)&_Type_bool,    // TypeCode_bool
@@ -210,9 +211,9 @@ __attribute__((used)) static const char* const debugSymCheck =
 
 const SymPool* universe_syms() {
   static SymPool p = {};
-  if (p.root == NULL) {
+  if (atomic_load_explicit(&p.tab, memory_order_relaxed) == NULL) {
     //init_type_nodes();
-    sympool_init(&p, NULL, MemInvalid(), _symroot);
+    sympool_init(&p, NULL, MemInvalid(), &_symtab);
   }
   return &p;
 }
@@ -233,8 +234,7 @@ const SymPool* universe_syms() {
 
 #if defined(RUN_GENERATOR)
 
-// red-black tree implementation used for interning
-// RBKEY must match that in sym.c
+// red-black tree used to detect duplicate symbol definitions
 #define RBKEY      Sym
 #define RBUSERDATA Mem _Nonnull
 #include "../util/rbtree.c.h"
@@ -261,36 +261,16 @@ static int RBCmp(Sym a, Sym b, Mem mem) {
 
 
 
-inline static Str fmt_nodes(const RBNode* n, Str s) {
-  // descent first
-  if (n->left) {
-    s = fmt_nodes(n->left, s);
-  }
-  if (n->right) {
-    s = fmt_nodes(n->right, s);
-  }
-
-  s = str_appendcstr(s, "static SymRBNode n_");
-  s = str_append(s, n->key, symlen(n->key));
-  s = str_appendcstr(s, " = { ");
-
-  // { key, isred, left, right }
-
-  s = str_appendfmt(s, "sym_%s, ", n->key);
-  // s = str_appendcstr(s, "NULL, ");
-
-  s = str_appendcstr(s, n->isred ? "true, " : "false, ");
-  if (n->left) {
-    s = str_appendfmt(s, "&n_%s, ", n->left->key);
-  } else {
-    s = str_appendcstr(s, "NULL, ");
-  }
-  if (n->right) {
-    s = str_appendfmt(s, "&n_%s ", n->right->key);
-  } else {
-    s = str_appendcstr(s, "NULL ");
+inline static Str fmt_symtab(const SymTable* t, Str s) {
+  s = str_appendfmt(s, "static SymTabEntry _symtab_entries[%u] = {\n", t->cap);
+  for (u32 i = 0; i < t->cap; i++) {
+    Sym sym = t->entries[i].sym;
+    if (sym)
+      s = str_appendfmt(s, "  [%u] = { sym_%s, 0x%08X },\n", i, sym, t->entries[i].hash);
   }
   s = str_appendcstr(s, "};\n");
+  s = str_appendfmt(s, "static SymTable _symtab = { %u, %u, NULL, _symtab_entries };\n",
+    t->cap, t->len);
   return s;
 }
 
@@ -380,7 +360,6 @@ __attribute__((constructor,used)) static void gen_constants() {
   // generate symbol constants
   Str tmpstr = str_new(512);
   RBNode* root = NULL;
-  bool added;
 
   #define SYM_GEN_NOFLAGS(name, ...)                                        \
     if (gen_append_symdef_lit(&tmpstr, &root, symgetcstr(&syms, #name), #name, 0)) \
@@ -481,22 +460,21 @@ __attribute__((constructor,used)) static void gen_constants() {
 
 
   // ---------------------------------------------------------------------------------------------
-  // generate SymPool tree
-
-
-  root = NULL;
-
-  #define RB_GEN(symname, ...) root = RBInsert(root, symgetcstr(&syms, #symname), &added, MemHeap);
-  TOKEN_KEYWORDS(RB_GEN)
-  TYPE_SYMS(RB_GEN)
+  // generate SymPool table
+
+  // Note: syms are added in the same order every time, which makes the table layout stable
+  SymPool usyms;
+  sympool_init(&usyms, NULL, MemHeap, NULL);
+  #define TAB_GEN(symname, ...) symaddcstr(&usyms, #symname);
+  TOKEN_KEYWORDS(TAB_GEN)
+  TYPE_SYMS(TAB_GEN)
   // Note: TYPE_SYMS_PRIVATE are not exported in the global namespace
-  PREDEFINED_CONSTANTS(RB_GEN)
-  PREDEFINED_IDENTS(RB_GEN)
-  #undef RB_GEN
-
-  printf("\n%s\n", fmt_nodes(root, str_new(0)));
+  PREDEFINED_CONSTANTS(TAB_GEN)
+  PREDEFINED_IDENTS(TAB_GEN)
+  #undef TAB_GEN
 
-  printf("static SymRBNode* _symroot = &n_%s;\n", root->key);
+  printf("\n%s", fmt_symtab(atomic_load(&usyms.tab), str_new(0)));
+  sympool_dispose(&usyms);
 
 
   // ---------------------------------------------------------------------------------------------
@@ -4,6 +4,8 @@
 #include "build.h"
 
 void posmap_init(PosMap* pm, Mem mem) {
+  pm->mem = mem;
+  rwmtx_init(&pm->mu, mtx_plain);
   ArrayInitWithStorage(&pm->a, pm->a_storage, countof(pm->a_storage));
   // the first slot is used to return NULL in pos_source for unknown positions
   pm->a.v[0] = NULL;
@@ -12,16 +14,33 @@ void posmap_init(PosMap* pm, Mem mem) {
 
 void posmap_dispose(PosMap* pm) {
   ArrayFree(&pm->a, pm->mem);
+  rwmtx_destroy(&pm->mu);
 }
 
-u32 posmap_origin(PosMap* pm, void* origin) {
-  assertnotnull(origin);
-  for (u32 i = 0; i < pm->a.len; i++) {
+static u32 posmap_find(const PosMap* pm, void* origin, u32 start) {
+  for (u32 i = start; i < pm->a.len; i++) {
     if (pm->a.v[i] == origin)
       return i;
   }
-  u32 i = pm->a.len;
-  ArrayPush(&pm->a, origin, pm->mem);
+  return 0;
+}
+
+u32 posmap_origin(PosMap* pm, void* origin) {
+  assertnotnull(origin);
+  rwmtx_rlock(&pm->mu);
+  u32 len = pm->a.len;
+  u32 i = posmap_find(pm, origin, 0);
+  rwmtx_runlock(&pm->mu);
+  if (i)
+    return i;
+  rwmtx_lock(&pm->mu);
+  // another thread may have allocated an origin while we were not holding the lock
+  i = posmap_find(pm, origin, len);
+  if (!i) {
+    i = pm->a.len;
+    ArrayPush(&pm->a, origin, pm->mem);
+  }
+  rwmtx_unlock(&pm->mu);
   return i;
 }
 
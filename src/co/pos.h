@@ -9,9 +9,10 @@ typedef u64 Pos;
 
 // PosMap maps sources to Pos indices
 typedef struct PosMap {
-  Mem   mem; // used to allocate extra memory for a
-  Array a;
-  void* a_storage[32]; // slot 0 is always NULL
+  Mem     mem; // used to allocate extra memory for a
+  rwmtx_t mu;  // guards a when allocating origins
+  Array   a;
+  void*   a_storage[32]; // slot 0 is always NULL
 } PosMap;
 
 // PosSpan describes a span in a source
@@ -27,11 +28,13 @@ void posmap_init(PosMap* pm, Mem mem);
 void posmap_dispose(PosMap* pm);
 
 // posmap_origin retrieves the origin for source, allocating one if needed.
-// See pos_source for the inverse function.
+// See pos_source for the inverse function. Thread safe.
 u32 posmap_origin(PosMap* pm, void* source);
 
 // pos_source looks up the source for a pos. The inverse of posmap_origin.
 // Returns NULL for unknown positions.
+// Not synchronized with posmap_origin; when origins are allocated concurrently,
+// allocate them up front (as ParsePkg does) so that a is never reallocated while read.
 static void* nullable pos_source(const PosMap* pm, Pos p);
 
 static Pos pos_make(u32 origin, u32 line, u32 col, u32 width);
@@ -0,0 +1,290 @@
+#include "../common.h"
+#include "arena.h"
+
+#define MEMARENA_DEFAULT_CHUNKSIZE (256 * 1024)
+
+// Allocations larger than this fraction of chunksize get a chunk of their own which is
+// placed after the current chunk, leaving the current chunk's free space available.
+#define MEMARENA_LARGE_DIV 4
+
+struct MemArenaChunk {
+  MemArenaChunk* nullable next;
+  size_t                  cap; // size of data
+  size_t                  len; // bytes used of data; data[len:cap] is always zero
+  u8                      data[];
+};
+
+// Each allocation is prefixed by a header holding its size, used by memrealloc
+typedef struct AllocHeader {
+  size_t size;
+} AllocHeader;
+
+static_assert(sizeof(AllocHeader) % MEMARENA_ALIGN == 0, "");
+static_assert(sizeof(MemArenaChunk) % MEMARENA_ALIGN == 0, "");
+
+// binding set by memarena_bind
+static thread_local struct {
+  MemArena* nullable a;
+  MemArena* nullable sub;
+} tls_binding = {0};
+
+// arena_get returns the arena to allocate in for Mem m
+inline static MemArena* arena_get(Mem m) {
+  MemArena* a = (MemArena*)m;
+  if (R_UNLIKELY(tls_binding.a == a))
+    return tls_binding.sub;
+  return a;
+}
+
+// footprint returns the number of bytes in a chunk used by an allocation of size bytes
+inline static size_t footprint(size_t size) {
+  return sizeof(AllocHeader) + align2(size, MEMARENA_ALIGN);
+}
+
+inline static AllocHeader* alloc_header(void* ptr) {
+  return (AllocHeader*)((u8*)ptr - sizeof(AllocHeader));
+}
+
+// is_last returns true if ptr is the most recent allocation in a's current chunk
+inline static bool is_last(MemArena* a, void* ptr) {
+  MemArenaChunk* c = a->chunks;
+  return c && (u8*)ptr + align2(alloc_header(ptr)->size, MEMARENA_ALIGN) == &c->data[c->len];
+}
+
+
+static MemArenaChunk* nullable arena_addchunk(MemArena* a, size_t minsize) {
+  bool large = minsize > a->chunksize / MEMARENA_LARGE_DIV;
+  size_t cap = large ? minsize : a->chunksize;
+  MemArenaChunk* c = memalloc(a->parent, sizeof(MemArenaChunk) + cap);
+  if (!c)
+    return NULL;
+  c->cap = cap;
+  c->len = 0;
+  if (large && a->chunks) {
+    c->next = a->chunks->next;
+    a->chunks->next = c;
+  } else {
+    c->next = a->chunks;
+    a->chunks = c;
+  }
+  a->nchunks++;
+  return c;
+}
+
+
+static void* nullable arena_alloc1(MemArena* a, size_t size) {
+  size_t n = footprint(size);
+  MemArenaChunk* c = a->chunks;
+  if (!c || c->cap - c->len < n) {
+    c = arena_addchunk(a, n);
+    if (!c)
+      return NULL;
+  }
+  auto h = (AllocHeader*)&c->data[c->len];
+  h->size = size;
+  c->len += n;
+  a->nbytes += n;
+  a->peak = MAX(a->peak, a->nbytes);
+  return (u8*)h + sizeof(AllocHeader);
+}
+
+
+static void* nullable arena_alloc(Mem m, size_t size) {
+  return arena_alloc1(arena_get(m), size);
+}
+
+
+static void arena_free(Mem m, void* ptr) {
+  MemArena* a = arena_get(m);
+  if (!is_last(a, ptr))
+    return; // released by memarena_dispose
+  MemArenaChunk* c = a->chunks;
+  size_t n = footprint(alloc_header(ptr)->size);
+  c->len -= n;
+  a->nbytes -= n;
+  memset(&c->data[c->len], 0, n);
+}
+
+
+static void* nullable arena_realloc(Mem m, void* nullable ptr, size_t newsize) {
+  MemArena* a = arena_get(m);
+  if (!ptr)
+    return arena_alloc1(a, newsize);
+  auto h = alloc_header(ptr);
+  size_t oldsize = h->size;
+
+  if (is_last(a, ptr)) {
+    // resize in place
+    MemArenaChunk* c = a->chunks;
+    size_t oldn = footprint(oldsize);
+    size_t newn = footprint(newsize);
+    if (newn <= oldn) {
+      c->len -= oldn - newn;
+      a->nbytes -= oldn - newn;
+      memset(&c->data[c->len], 0, oldn - newn);
+      h->size = newsize;
+      return ptr;
+    }
+    if (c->cap - c->len >= newn - oldn) {
+      c->len += newn - oldn;
+      a->nbytes += newn - oldn;
+      a->peak = MAX(a->peak, a->nbytes);
+      h->size = newsize;
+      return ptr;
+    }
+  } else if (newsize <= oldsize) {
+    // Shrink in place. The allocation keeps its footprint (h->size), which is only reclaimed
+    // by memarena_dispose, but bytes past newsize are cleared so that growing it later
+    // yields zeroed memory just like a new allocation does.
+    memset((u8*)ptr + newsize, 0, oldsize - newsize);
+    return ptr;
+  }
+
+  void* newptr = arena_alloc1(a, newsize);
+  if (newptr)
+    memcpy(newptr, ptr, MIN(oldsize, newsize));
+  return newptr;
+}
+
+
+Mem memarena_init(MemArena* a, Mem parent, u32 chunksize) {
+  memset(a, 0, sizeof(*a));
+  a->mem = (Mem_){
+    .alloc   = arena_alloc,
+    .realloc = arena_realloc,
+    .free    = arena_free,
+  };
+  a->parent = parent;
+  a->chunksize = chunksize ? (u32)align2(chunksize, MEMARENA_ALIGN) : MEMARENA_DEFAULT_CHUNKSIZE;
+  return memarena_mem(a);
+}
+
+
+void memarena_dispose(MemArena* a) {
+  // sub-arenas are allocated in a's chunks
+  for (MemArena* sub = a->subs; sub; sub = sub->nextsub)
+    memarena_dispose(sub);
+  MemArenaChunk* c = a->chunks;
+  while (c) {
+    MemArenaChunk* next = c->next;
+    memfree(a->parent, c);
+    c = next;
+  }
+  a->chunks = NULL;
+  a->subs = NULL;
+  a->nchunks = 0;
+  a->nbytes = 0;
+}
+
+
+MemArena* memarena_sub(MemArena* a) {
+  auto sub = (MemArena*)memalloc(memarena_mem(a), sizeof(MemArena));
+  memarena_init(sub, a->parent, a->chunksize);
+  sub->nextsub = a->subs;
+  a->subs = sub;
+  return sub;
+}
+
+
+void memarena_bind(MemArena* a, MemArena* nullable sub) {
+  assert(sub == NULL || tls_binding.a == NULL || tls_binding.a == a);
+  tls_binding.a = sub ? a : NULL;
+  tls_binding.sub = sub;
+}
+
+
+static void memarena_stats_add(const MemArena* a, MemArenaStats* stats) {
+  stats->nbytes += a->nbytes;
+  stats->peak += a->peak;
+  stats->nchunks += a->nchunks;
+  for (MemArenaChunk* c = a->chunks; c; c = c->next)
+    stats->chunkbytes += sizeof(MemArenaChunk) + c->cap;
+  for (MemArena* sub = a->subs; sub; sub = sub->nextsub) {
+    stats->nsubs++;
+    memarena_stats_add(sub, stats);
+  }
+}
+
+void memarena_stats(const MemArena* a, MemArenaStats* stats) {
+  memset(stats, 0, sizeof(*stats));
+  memarena_stats_add(a, stats);
+}
+
+
+R_TEST(memarena) {
+  MemArena a;
+  Mem mem = memarena_init(&a, MemHeap, 1024);
+
+  // allocations are zeroed and aligned
+  u8* p1 = memalloc(mem, 3);
+  u8* p2 = memalloc(mem, 10);
+  assert((uintptr_t)p1 % MEMARENA_ALIGN == 0);
+  assert((uintptr_t)p2 % MEMARENA_ALIGN == 0);
+  for (u32 i = 0; i < 10; i++)
+    asserteq(p2[i], 0);
+  asserteq(a.nchunks, 1);
+
+  // the last allocation is freed and resized in place
+  memset(p2, 0xff, 10);
+  memfree(mem, p2);
+  u8* p3 = memalloc(mem, 16);
+  assert(p3 == p2);
+  for (u32 i = 0; i < 16; i++)
+    asserteq(p3[i], 0);
+  p3[0] = 1;
+  assert(memrealloc(mem, p3, 100) == p3);
+  assert(memrealloc(mem, p3, 8) == p3);
+
+  // other allocations are shrunk in place, with the bytes past the new size cleared
+  u8* p4 = memalloc(mem, 8);
+  memset(p3, 0xff, 8);
+  p3[0] = 1;
+  size_t nbytes1 = a.nbytes;
+  assert(memrealloc(mem, p3, 4) == p3);
+  asserteq(a.nbytes, nbytes1);
+  asserteq(p3[0], 1);
+  for (u32 i = 4; i < 8; i++)
+    asserteq(p3[i], 0);
+
+  // other allocations are copied when grown
+  u8* p5 = memrealloc(mem, p3, 32);
+  assert(p5 != p3);
+  asserteq(p5[0], 1);
+  for (u32 i = 4; i < 32; i++)
+    asserteq(p5[i], 0);
+  memfree(mem, p4); // not the last allocation; no effect
+  asserteq(p4[0], 0);
+
+  // large allocations get their own chunk, placed after the current chunk
+  MemArenaChunk* c = a.chunks;
+  u8* p6 = memalloc(mem, 4096);
+  assertnotnull(p6);
+  asserteq(a.nchunks, 2);
+  assert(a.chunks == c);
+
+  // filling the current chunk adds a new one
+  for (u32 i = 0; i < 100; i++)
+    memalloc(mem, 32);
+  assert(a.nchunks > 2);
+  assert(a.chunks != c);
+
+  MemArena* sub = memarena_sub(&a);
+  memalloc(memarena_mem(sub), 100);
+  MemArenaStats st;
+  memarena_stats(&a, &st);
+  asserteq(st.nsubs, 1);
+  asserteq(st.nchunks, a.nchunks + 1);
+  asserteq(st.nbytes, a.nbytes + sub->nbytes);
+  assert(st.peak >= st.nbytes);
+
+  // allocations in a by this thread go to sub while bound
+  size_t nbytes = a.nbytes;
+  size_t subnbytes = sub->nbytes;
+  memarena_bind(&a, sub);
+  memalloc(mem, 100);
+  memarena_bind(&a, NULL);
+  asserteq(a.nbytes, nbytes);
+  assert(sub->nbytes > subnbytes);
+
+  memarena_dispose(&a);
+}
@@ -0,0 +1,71 @@
+#pragma once
+ASSUME_NONNULL_BEGIN
+
+typedef struct MemArena      MemArena;
+typedef struct MemArenaChunk MemArenaChunk;
+typedef struct MemArenaStats MemArenaStats;
+
+// MemArena is an allocator which hands out memory from large chunks that are allocated
+// in a parent allocator. All memory is freed at once by memarena_dispose.
+//
+// Memory returned is zeroed and aligned to MEMARENA_ALIGN. memfree only reclaims the most
+// recent allocation and memrealloc of the most recent allocation grows or shrinks it in
+// place. memrealloc shrinks any other allocation in place too, but only grows it by copying.
+// Memory of other allocations is released when the arena is disposed.
+//
+// A MemArena is not thread safe. Threads that allocate in parallel should each use a
+// sub-arena created with memarena_sub, either directly or by binding it with memarena_bind
+// so that code which allocates in the arena transparently uses the sub-arena.
+struct MemArena {
+  Mem_                     mem;       // allocator interface (see memarena_mem)
+  Mem                      parent;    // allocator of chunks
+  u32                      chunksize; // size of regular chunks
+  u32                      nchunks;   // number of chunks
+  MemArenaChunk* nullable  chunks;    // list of chunks, current chunk first
+  size_t                   nbytes;    // bytes allocated, including headers and padding
+  size_t                   peak;      // largest value of nbytes
+  MemArena* nullable       subs;      // list of sub-arenas
+  MemArena* nullable       nextsub;   // next sibling in the parent arena's list of subs
+};
+
+// MemArenaStats holds counters of an arena, including its sub-arenas
+struct MemArenaStats {
+  size_t nbytes;     // bytes allocated
+  size_t peak;       // sum of the largest value of nbytes of each arena
+  size_t chunkbytes; // bytes of chunk memory held, including unused space
+  u32    nchunks;    // number of chunks
+  u32    nsubs;      // number of sub-arenas
+};
+
+#define MEMARENA_ALIGN 8
+
+// memarena_init initializes an arena which allocates chunks of chunksize bytes in parent.
+// chunksize may be 0 to use a default size. Returns memarena_mem(a).
+Mem memarena_init(MemArena* a, Mem parent, u32 chunksize);
+
+// memarena_dispose frees all memory of the arena and its sub-arenas
+void memarena_dispose(MemArena* a);
+
+// memarena_sub creates a sub-arena of a which is disposed of along with a.
+// The sub-arena is independent of a and can be used by another thread; memarena_sub itself
+// modifies a and must not be called while a is in use by another thread.
+MemArena* memarena_sub(MemArena* a);
+
+// memarena_bind redirects allocations in a made by the calling thread to sub, until
+// memarena_bind(a, NULL) is called. A thread can only have one arena bound at a time.
+void memarena_bind(MemArena* a, MemArena* nullable sub);
+
+// memarena_stats sums up the counters of a and its sub-arenas
+void memarena_stats(const MemArena* a, MemArenaStats* stats);
+
+// memarena_mem returns the Mem allocator interface of an arena
+static Mem memarena_mem(MemArena* a);
+
+// -----------------------------------------------------------------------------------------------
+// implementation
+
+inline static Mem memarena_mem(MemArena* a) {
+  return (Mem)&a->mem;
+}
+
+ASSUME_NONNULL_END
@@ -1,3 +1,19 @@
+// Open-addressing hash map in the style of "Swiss tables".
+//
+// Storage is one array of cap control bytes followed by cap entries, where cap is a power
+// of two. A control byte is either EMPTY, DELETED (a tombstone) or, for a used slot, H2: the
+// 7 low bits of the key's hash. Slots are probed a group at a time: all control bytes of a
+// group are compared against H2 in one SIMD (or SWAR) operation and only the entries whose
+// control byte match are compared by key. Groups are visited in triangular order starting
+// at the group selected by H1 (the remaining bits of the hash) which visits every group.
+//
+// The map is rehashed when the number of used slots and tombstones reach 7/8 of cap,
+// into a table of the same size if more than half of them are tombstones, otherwise into
+// a table twice the size. Deleting an entry only leaves a tombstone when its group has
+// no empty slot (a lookup might have probed past the group.)
+//
+// Define CO_HASHMAP_NO_SIMD to use the portable 8-byte group implementation.
+//
 // example:
 // #define HASHMAP_NAME     FooMap
 // #define HASHMAP_KEY      Foo
@@ -16,48 +32,167 @@
   #error "please define HASHMAP_VALUE"
 #endif
 
-// entries per bucket
-#ifndef HASHMAP_BUCKET_ENTRIES
-#define HASHMAP_BUCKET_ENTRIES 8
+// group implementation, shared by all maps in a translation unit
+#ifndef HASHMAP_GROUP_DEFINED
+#define HASHMAP_GROUP_DEFINED
+
+#define HM_CTRL_EMPTY   ((u8)0x80)
+#define HM_CTRL_DELETED ((u8)0xFE)
+#define HM_CTRL_ISFULL(c) (((c) & 0x80) == 0)
+
+// hm_group_* functions return a mask with HM_GROUP_BPB bits per slot for slots matching
+// a condition. hm_group_match may report false positives for used slots (SWAR) but never
+// for EMPTY or DELETED slots.
+#if !defined(CO_HASHMAP_NO_SIMD) && defined(__SSE2__)
+  #include <emmintrin.h>
+  #define HM_GROUP_WIDTH 16
+  #define HM_GROUP_BPB   1
+  typedef __m128i hm_group;
+  inline static hm_group hm_group_load(const u8* ctrl) {
+    return _mm_loadu_si128((const __m128i*)ctrl);
+  }
+  inline static u64 hm_group_match(hm_group g, u8 h2) {
+    return (u64)(u32)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)h2)));
+  }
+  inline static u64 hm_group_match_empty(hm_group g) {
+    return hm_group_match(g, HM_CTRL_EMPTY);
+  }
+  inline static u64 hm_group_match_free(hm_group g) { // EMPTY or DELETED
+    return (u64)(u32)_mm_movemask_epi8(g);
+  }
+#elif !defined(CO_HASHMAP_NO_SIMD) && defined(__ARM_NEON)
+  #include <arm_neon.h>
+  #define HM_GROUP_WIDTH 8
+  #define HM_GROUP_BPB   8
+  typedef uint8x8_t hm_group;
+  inline static hm_group hm_group_load(const u8* ctrl) {
+    return vld1_u8(ctrl);
+  }
+  inline static u64 hm_group_match(hm_group g, u8 h2) {
+    return vget_lane_u64(vreinterpret_u64_u8(vceq_u8(g, vdup_n_u8(h2))), 0)
+           & 0x8080808080808080llu;
+  }
+  inline static u64 hm_group_match_empty(hm_group g) {
+    return hm_group_match(g, HM_CTRL_EMPTY);
+  }
+  inline static u64 hm_group_match_free(hm_group g) { // EMPTY or DELETED
+    return vget_lane_u64(vreinterpret_u64_u8(g), 0) & 0x8080808080808080llu;
+  }
+#else
+  #define HM_GROUP_WIDTH 8
+  #define HM_GROUP_BPB   8
+  typedef u64 hm_group;
+  #define HM_LSBS 0x0101010101010101llu
+  #define HM_MSBS 0x8080808080808080llu
+  inline static hm_group hm_group_load(const u8* ctrl) {
+    u64 g;
+    memcpy(&g, ctrl, sizeof(g));
+    #if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    g = __builtin_bswap64(g);
+    #endif
+    return g;
+  }
+  inline static u64 hm_group_match(hm_group g, u8 h2) {
+    // bytes which are zero in x. A borrow may cause a false positive for the byte
+    // following a match, which then has the value h2^1 and is thus a used slot.
+    u64 x = g ^ (HM_LSBS * h2);
+    return (x - HM_LSBS) & ~x & HM_MSBS;
+  }
+  inline static u64 hm_group_match_empty(hm_group g) {
+    // EMPTY has the high bit set and bit 1 cleared; DELETED has both set
+    return g & ~(g << 6) & HM_MSBS;
+  }
+  inline static u64 hm_group_match_free(hm_group g) { // EMPTY or DELETED
+    return g & HM_MSBS;
+  }
 #endif
 
+// hm_mask_first returns the slot index of the lowest bit set in m (m must not be 0)
+#define hm_mask_first(m) ((u32)__builtin_ctzll(m) / HM_GROUP_BPB)
+
+// hm_hash improves the distribution of a key's hash, as the low bits of pointer hashes
+// are often all zero.
+inline static u64 hm_hash(u64 h) {
+  h *= 0x9E3779B97F4A7C15llu;
+  return h ^ (h >> 32);
+}
+#define hm_h1(h) ((u32)((h) >> 7))
+#define hm_h2(h) ((u8)((h) & 0x7F))
+
+// hm_maxload returns the number of slots of a table with cap slots that can be used
+inline static u32 hm_maxload(u32 cap) {
+  return cap - cap / 8;
+}
+
+// hm_cap_for returns the number of slots needed to hold at least n entries
+inline static u32 hm_cap_for(u32 n) {
+  u32 cap = HM_GROUP_WIDTH;
+  while (hm_maxload(cap) < n)
+    cap *= 2;
+  return cap;
+}
+
+// hm_find_free returns the index of the first EMPTY or DELETED slot in the probe
+// sequence of hash h
+static u32 hm_find_free(const u8* ctrl, u32 cap, u64 h) {
+  u32 gmask = cap / HM_GROUP_WIDTH - 1;
+  u32 g = hm_h1(h) & gmask;
+  for (u32 i = 1; ; i++) {
+    u64 m = hm_group_match_free(hm_group_load(&ctrl[g * HM_GROUP_WIDTH]));
+    if (m)
+      return g * HM_GROUP_WIDTH + hm_mask_first(m);
+    g = (g + i) & gmask;
+  }
+}
+
+#endif /* HASHMAP_GROUP_DEFINED */
+
+
 #define _HM_MAKE_FN_NAME(a, b) a ## b
 #define _HM_FUN(prefix, name) _HM_MAKE_FN_NAME(prefix, name)
 #define HM_FUN(name) _HM_FUN(HASHMAP_NAME, name)
 
-typedef enum HMFlag {
-  HMFlagNone = 0,
-  HMFlagBucketMemoryDense = 1 << 0,  // bucket memory is inside map memory. used by Free
-} HMFlag;
-
 typedef struct {
-  struct {
-    HASHMAP_KEY   key;
-    HASHMAP_VALUE value;
-  } entries[HASHMAP_BUCKET_ENTRIES];
-} Bucket;
+  HASHMAP_KEY   key;
+  HASHMAP_VALUE value;
+} HM_FUN(Entry);
+
+// HM_ENTRIES returns the entries of a table with control bytes ctrl
+#define HM_ENTRIES(ctrl, cap) ((HM_FUN(Entry)*)((u8*)(ctrl) + (cap)))
+
+// table memory is cap control bytes followed by cap entries.
+// cap is a multiple of 8 which keeps the entries pointer aligned.
+#define HM_TABLE_SIZE(cap) ((size_t)(cap) * (1 + sizeof(HM_FUN(Entry))))
 
 
-void HM_FUN(Init)(HASHMAP_NAME* m, u32 initbuckets, Mem mem) {
-  m->cap = initbuckets;
+static void HM_FUN(_reset)(HASHMAP_NAME* m) {
+  memset(m->buckets, HM_CTRL_EMPTY, m->cap);
   m->len = 0;
+  m->growth = hm_maxload(m->cap);
+}
+
+
+void HM_FUN(Init)(HASHMAP_NAME* m, u32 initcap, Mem mem) {
+  m->cap = hm_cap_for(initcap);
   m->flags = HMFlagNone;
   m->mem = mem;
-  m->buckets = memalloc(mem, m->cap * sizeof(Bucket));
+  m->buckets = memalloc(mem, HM_TABLE_SIZE(m->cap));
+  HM_FUN(_reset)(m);
 }
 
-HASHMAP_NAME* HM_FUN(New)(u32 initbuckets, Mem mem) {
+HASHMAP_NAME* HM_FUN(New)(u32 initcap, Mem mem) {
   // new differs from Init in that it allocates space for itself and the initial
-  // buckets in one go. This is usually a little bit faster and reduces memory
+  // table in one go. This is usually a little bit faster and reduces memory
   // fragmentation in cases where many hashmaps are created.
-  size_t bucketSize = initbuckets * sizeof(Bucket);
-  char* ptr = memalloc(mem, sizeof(HASHMAP_NAME) + bucketSize);
+  u32 cap = hm_cap_for(initcap);
+  size_t hsize = align2(sizeof(HASHMAP_NAME), sizeof(void*));
+  char* ptr = memalloc(mem, hsize + HM_TABLE_SIZE(cap));
   auto m = (HASHMAP_NAME*)ptr;
-  m->cap = initbuckets;
+  m->cap = cap;
   m->mem = mem;
   m->flags = HMFlagBucketMemoryDense;
-  if (bucketSize > 0)
-    m->buckets = ptr + sizeof(HASHMAP_NAME);
+  m->buckets = ptr + hsize;
+  HM_FUN(_reset)(m);
   return m;
 }
 
@@ -78,55 +213,55 @@ void HM_FUN(Free)(HASHMAP_NAME* m) {
     memfree(m->mem, m->buckets);
   }
   memfree(m->mem, m);
-  #if DEBUG
-  m->buckets = NULL;
-  m->len = 0;
-  m->cap = 0;
-  #endif
 }
 
 
-static void mapGrow(HASHMAP_NAME* m) {
-  size_t cap = m->cap * 2;
-  rehash: {
-    auto newbuckets = (Bucket*)memalloc(m->mem, cap * sizeof(Bucket));
-    for (u32 bi = 0; bi < m->cap; bi++) {
-      auto b = &((Bucket*)m->buckets)[bi];
-      for (u32 i = 0; i < HASHMAP_BUCKET_ENTRIES; i++) {
-        auto e = &b->entries[i];
-        if (e->key == NULL) {
-          break;
-        }
-        if (e->value == NULL) {
-          // skip deleted entry (compactation)
-          continue;
-        }
-        size_t index = ((size_t)HASHMAP_KEY_HASH(e->key)) % cap;
-        auto newb = &newbuckets[index];
-        bool fit = false;
-        for (u32 i2 = 0; i2 < HASHMAP_BUCKET_ENTRIES; i2++) {
-          auto e2 = &newb->entries[i2];
-          if (e2->key == NULL) {
-            // found a free slot in newb
-            *e2 = *e;
-            fit = true;
-            break;
-          }
-        }
-        if (!fit) {
-          // no free slot found in newb; need to grow further.
-          memfree(m->mem, newbuckets);
-          cap = cap * 2;
-          goto rehash;
-        }
-      }
-    }
-    if (!(m->flags & HMFlagBucketMemoryDense)) {
-      memfree(m->mem, m->buckets);
+// HM_FUN(_rehash) moves all entries into a new table of newcap slots, dropping tombstones
+static void HM_FUN(_rehash)(HASHMAP_NAME* m, u32 newcap) {
+  assert(newcap >= m->cap); // no overflow
+  u8* ctrl = m->buckets;
+  auto entries = HM_ENTRIES(ctrl, m->cap);
+  u8* newctrl = memalloc(m->mem, HM_TABLE_SIZE(newcap));
+  auto newentries = HM_ENTRIES(newctrl, newcap);
+  memset(newctrl, HM_CTRL_EMPTY, newcap);
+
+  for (u32 i = 0; i < m->cap; i++) {
+    if (!HM_CTRL_ISFULL(ctrl[i]))
+      continue;
+    u64 h = hm_hash((u64)HASHMAP_KEY_HASH(entries[i].key));
+    u32 j = hm_find_free(newctrl, newcap, h);
+    newctrl[j] = ctrl[i];
+    newentries[j] = entries[i];
+  }
+
+  if (!(m->flags & HMFlagBucketMemoryDense))
+    memfree(m->mem, m->buckets);
+  m->buckets = newctrl;
+  m->cap = newcap;
+  m->growth = hm_maxload(newcap) - m->len;
+  m->flags &= ~HMFlagBucketMemoryDense;
+}
+
+
+// HM_FUN(_find) returns the slot index of key, or -1 if key is not in m
+inline static i32 HM_FUN(_find)(const HASHMAP_NAME* m, HASHMAP_KEY key, u64 h) {
+  const u8* ctrl = m->buckets;
+  auto entries = HM_ENTRIES(ctrl, m->cap);
+  u8 h2 = hm_h2(h);
+  u32 gmask = m->cap / HM_GROUP_WIDTH - 1;
+  u32 g = hm_h1(h) & gmask;
+  for (u32 i = 1; ; i++) {
+    hm_group grp = hm_group_load(&ctrl[g * HM_GROUP_WIDTH]);
+    for (u64 match = hm_group_match(grp, h2); match; match &= match - 1) {
+      u32 slot = g * HM_GROUP_WIDTH + hm_mask_first(match);
+      if (entries[slot].key == key)
+        return (i32)slot;
     }
-    m->buckets = newbuckets;
-    m->cap = cap;
-    m->flags &= ~HMFlagBucketMemoryDense;
+    // an empty slot in the group means that key was never inserted past it.
+    // There's always at least one empty slot since growth < cap.
+    if (hm_group_match_empty(grp))
+      return -1;
+    g = (g + i) & gmask;
   }
 }
 
@@ -135,115 +270,85 @@ static void mapGrow(HASHMAP_NAME* m) {
 // Returns replaced value or NULL if key did not exist in map.
 HASHMAP_VALUE HM_FUN(Set)(HASHMAP_NAME* m, HASHMAP_KEY key, HASHMAP_VALUE value) {
   assert(value != NULL);
-  while (1) { // grow loop
-    size_t index = ((size_t)HASHMAP_KEY_HASH(key)) % m->cap;
-    auto b = &((Bucket*)m->buckets)[index];
-    // dlog("bucket(key=\"%s\") #%u  b=%p e=%p", key, index, b, &b->entries[0]);
-    for (u32 i = 0; i < HASHMAP_BUCKET_ENTRIES; i++) {
-      auto e = &b->entries[i];
-      if (e->value == NULL) {
-        // free slot
-        e->key = key;
-        e->value = value;
-        m->len++;
-        return NULL;
-      }
-      if (e->key == key) {
-        // key already in map -- replace value
-        auto oldval = e->value;
-        e->value = value;
-        return oldval;
-      }
-      // dlog("collision key=\"%s\" <> e->key=\"%s\"", key, e->key);
-    }
-    // overloaded -- grow buckets
-    // dlog("grow & rehash");
-    mapGrow(m);
+  u64 h = hm_hash((u64)HASHMAP_KEY_HASH(key));
+  i32 slot = HM_FUN(_find)(m, key, h);
+  if (slot > -1) {
+    // key already in map -- replace value
+    auto e = &HM_ENTRIES(m->buckets, m->cap)[slot];
+    auto oldval = e->value;
+    e->value = value;
+    return oldval;
   }
+
+  u8* ctrl = m->buckets;
+  u32 i = hm_find_free(ctrl, m->cap, h);
+  if (m->growth == 0 && ctrl[i] == HM_CTRL_EMPTY) {
+    // out of empty slots. Rehash in place if at least half of the used slots are
+    // tombstones, else grow.
+    u32 newcap = m->len < hm_maxload(m->cap) / 2 ? m->cap : m->cap * 2;
+    HM_FUN(_rehash)(m, newcap);
+    ctrl = m->buckets;
+    i = hm_find_free(ctrl, m->cap, h);
+  }
+  if (ctrl[i] == HM_CTRL_EMPTY)
+    m->growth--; // reusing a tombstone does not use up an empty slot
+  ctrl[i] = hm_h2(h);
+  auto e = &HM_ENTRIES(ctrl, m->cap)[i];
+  e->key = key;
+  e->value = value;
+  m->len++;
+  return NULL;
 }
 
 
 HASHMAP_VALUE HM_FUN(Del)(HASHMAP_NAME* m, HASHMAP_KEY key) {
-  size_t index = ((size_t)HASHMAP_KEY_HASH(key)) % m->cap;
-  auto b = &((Bucket*)m->buckets)[index];
-  for (u32 i = 0; i < HASHMAP_BUCKET_ENTRIES; i++) {
-    auto e = &b->entries[i];
-    if (e->key == key) {
-      if (!e->value) {
-        break;
-      }
-      // mark as deleted
-      auto value = e->value;
-      e->value = NULL;
-      m->len--;
-      return value;
-    }
+  u64 h = hm_hash((u64)HASHMAP_KEY_HASH(key));
+  i32 slot = HM_FUN(_find)(m, key, h);
+  if (slot < 0)
+    return NULL;
+  u8* ctrl = m->buckets;
+  u32 g = (u32)slot & ~(u32)(HM_GROUP_WIDTH - 1);
+  if (hm_group_match_empty(hm_group_load(&ctrl[g]))) {
+    // no lookup has probed past this group
+    ctrl[slot] = HM_CTRL_EMPTY;
+    m->growth++;
+  } else {
+    ctrl[slot] = HM_CTRL_DELETED;
   }
-  return NULL;
+  m->len--;
+  return HM_ENTRIES(ctrl, m->cap)[slot].value;
 }
 
 
 HASHMAP_VALUE HM_FUN(Get)(const HASHMAP_NAME* m, HASHMAP_KEY key) {
-  size_t index = ((u32)HASHMAP_KEY_HASH(key)) % m->cap;
-  auto b = &((Bucket*)m->buckets)[index];
-  for (u32 i = 0; i < HASHMAP_BUCKET_ENTRIES; i++) {
-    auto e = &b->entries[i];
-    if (e->key == key) {
-      return e->value;
-    }
-    if (e->key == NULL) {
-      break;
-    }
-  }
-  return NULL;
+  u64 h = hm_hash((u64)HASHMAP_KEY_HASH(key));
+  i32 slot = HM_FUN(_find)(m, key, h);
+  if (slot < 0)
+    return NULL;
+  return HM_ENTRIES(m->buckets, m->cap)[slot].value;
 }
 
 
 void HM_FUN(Clear)(HASHMAP_NAME* m) {
-  memset(m->buckets, 0, sizeof(Bucket) * m->cap);
-  m->len = 0;
+  HM_FUN(_reset)(m);
 }
 
 
 void HM_FUN(Iter)(const HASHMAP_NAME* m, HM_FUN(Iterator) it, void* userdata) {
   bool stop = false;
-  for (u32 bi = 0; bi < m->cap; bi++) {
-    auto b = &((Bucket*)m->buckets)[bi];
-    for (u32 i = 0; i < HASHMAP_BUCKET_ENTRIES; i++) {
-      auto e = &b->entries[i];
-      if (e->key == NULL) {
-        break;
-      }
-      if (e->value != NULL) {
-        it(e->key, e->value, &stop, userdata);
-        if (stop) {
-          return;
-        }
-      }
+  const u8* ctrl = m->buckets;
+  auto entries = HM_ENTRIES(ctrl, m->cap);
+  for (u32 i = 0; i < m->cap; i++) {
+    if (HM_CTRL_ISFULL(ctrl[i])) {
+      it(entries[i].key, entries[i].value, &stop, userdata);
+      if (stop)
+        return;
     }
   }
 }
 
-// static u32* hashmapDebugDistr(const HASHMAP_NAME* m) {
-//   u32 valindex = 0;
-//   u32* vals = (u32*)memalloc(m->mem, m->cap * sizeof(u32));
-//   for (u32 bi = 0; bi < m->cap; bi++) {
-//     auto b = &((Bucket*)m->buckets)[bi];
-//     u32 depth = 0;
-//     for (u32 i = 0; i < HASHMAP_BUCKET_ENTRIES; i++) {
-//       auto e = &b->entries[i];
-//       if (e->key == NULL) {
-//         break;
-//       }
-//       if (e->value != NULL) {
-//         depth++;
-//       }
-//     }
-//     vals[valindex++] = depth;
-//   }
-//   return vals;
-// }
-
+#undef HM_ENTRIES
+#undef HM_TABLE_SIZE
 #undef _HM_MAKE_FN_NAME
 #undef _HM_FUN
 #undef HM_FUN
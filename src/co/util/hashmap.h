@@ -11,13 +11,22 @@ ASSUME_NONNULL_BEGIN
 
 // HASHMAP_NAME defines a hash map
 typedef struct {
-  u32   cap;     // number of buckets
+  u32   cap;     // number of slots
   u32   len;     // number of key-value entries
   u32   flags;   // internal
+  u32   growth;  // internal: number of empty slots that can be used before rehashing
   Mem   mem;     // memory allocator
   void* buckets; // internal
 } HASHMAP_NAME;
 
+#ifndef HASHMAP_HMFLAG_DEFINED
+#define HASHMAP_HMFLAG_DEFINED
+typedef enum HMFlag {
+  HMFlagNone = 0,
+  HMFlagBucketMemoryDense = 1 << 0,  // bucket memory is inside map memory. used by Free
+} HMFlag;
+#endif
+
 
 #define _HM_MAKE_FN_NAME(a, b) a ## b
 #define _HM_FUN(prefix, name) _HM_MAKE_FN_NAME(prefix, name)
@@ -38,16 +47,16 @@ typedef struct {
 #endif
 
 
-// New creates a new map with initbuckets intial buckets.
-HASHMAP_NAME* HM_FUN(New)(u32 initbuckets, Mem)
+// New creates a new map with room for at least initcap entries.
+HASHMAP_NAME* HM_FUN(New)(u32 initcap, Mem)
 
 // Free frees all memory of a map, including the map's memory.
 // Use Free when you created a map with New.
 // Use Dispose when you manage the memory of the map yourself and used Init.
 void HM_FUN(Free)(HASHMAP_NAME*);
 
-// Init initializes a map structure. initbuckets is the number of initial buckets.
-void HM_FUN(Init)(HASHMAP_NAME*, u32 initbuckets, Mem mem);
+// Init initializes a map structure with room for at least initcap entries.
+void HM_FUN(Init)(HASHMAP_NAME*, u32 initcap, Mem mem);
 
 // Dispose frees buckets data (but not the hashmap itself.)
 // The hashmap is invalid after this call. Call Init to reuse.
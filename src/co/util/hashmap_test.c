@@ -0,0 +1,237 @@
+#include "../common.h"
+#if R_TESTING_ENABLED
+#include "ptrmap.h"
+
+#define TEST_NKEYS 2000
+
+
+R_TEST(hashmap_churn) {
+  // random sets, gets and deletes, checked against a plain array
+  void** expect = memalloc(MemHeap, sizeof(void*) * TEST_NKEYS);
+  PtrMap m;
+  PtrMapInit(&m, 0, MemHeap);
+  u32 len = 0;
+  srandom(1);
+  for (u32 i = 0; i < 100000; i++) {
+    u32 k = (u32)random() % TEST_NKEYS;
+    const void* key = (const void*)(uintptr_t)((k + 1) * 16);
+    switch (random() % 3) {
+      case 0: {
+        void* value = (void*)(uintptr_t)(i + 1);
+        asserteq(PtrMapSet(&m, key, value), expect[k]);
+        if (!expect[k])
+          len++;
+        expect[k] = value;
+        break;
+      }
+      case 1:
+        asserteq(PtrMapDel(&m, key), expect[k]);
+        if (expect[k])
+          len--;
+        expect[k] = NULL;
+        break;
+      default:
+        asserteq(PtrMapGet(&m, key), expect[k]);
+    }
+    asserteq(m.len, len);
+  }
+  // tombstones are reclaimed; the table never grew past what TEST_NKEYS needs
+  assert(m.cap <= 4096);
+  PtrMapClear(&m);
+  asserteq(m.len, 0);
+  assert(PtrMapGet(&m, (const void*)16) == NULL);
+  PtrMapDispose(&m);
+  memfree(MemHeap, expect);
+}
+
+
+R_TEST(hashmap_clustered) {
+  // keys which only differ in high bits must not make the table grow beyond its load factor
+  PtrMap* m = PtrMapNew(0, MemHeap);
+  for (uintptr_t i = 1; i <= TEST_NKEYS; i++)
+    PtrMapSet(m, (const void*)(i << 24), (void*)i);
+  asserteq(m->len, TEST_NKEYS);
+  assert(m->cap <= 4096);
+  for (uintptr_t i = 1; i <= TEST_NKEYS; i++)
+    asserteq(PtrMapGet(m, (const void*)(i << 24)), (void*)i);
+  PtrMapFree(m);
+}
+
+
+// hashmap_bench compares PtrMap with BucketPtrMap, the bucketed engine which SymMap and
+// PtrMap used before hashmap.c.h (see co_bench_enabled.)
+
+// BucketPtrMap is the previous PtrMap: fixed-size buckets of BUCKET_ENTRIES entries, indexed by
+// hash % cap, which double in number when the bucket of a new key is full.
+// Deleted entries keep their key and have a NULL value until the map grows. Set reuses the
+// first deleted entry of a bucket without looking for key further on, which is fine for the
+// benchmark as it only re-inserts keys it deleted.
+#define BUCKET_ENTRIES 8
+#define bucket_ptrhash(p) (size_t)((13*((uintptr_t)(p))) ^ (((uintptr_t)(p)) >> 15)) // ptrmap.c
+
+typedef struct {
+  struct {
+    const void* key;
+    void*       value;
+  } entries[BUCKET_ENTRIES];
+} Bucket;
+
+typedef struct {
+  u32     cap; // number of buckets
+  u32     len;
+  Mem     mem;
+  Bucket* buckets;
+} BucketPtrMap;
+
+static void BucketPtrMapInit(BucketPtrMap* m, u32 initbuckets, Mem mem) {
+  m->cap = initbuckets;
+  m->len = 0;
+  m->mem = mem;
+  m->buckets = memalloc(mem, m->cap * sizeof(Bucket));
+}
+
+static void BucketPtrMapDispose(BucketPtrMap* m) {
+  memfree(m->mem, m->buckets);
+}
+
+static void BucketPtrMapGrow(BucketPtrMap* m) {
+  size_t cap = m->cap * 2;
+  rehash: {
+    Bucket* newbuckets = memalloc(m->mem, cap * sizeof(Bucket));
+    for (u32 bi = 0; bi < m->cap; bi++) {
+      Bucket* b = &m->buckets[bi];
+      for (u32 i = 0; i < BUCKET_ENTRIES && b->entries[i].key; i++) {
+        if (b->entries[i].value == NULL)
+          continue; // skip deleted entry (compaction)
+        Bucket* newb = &newbuckets[bucket_ptrhash(b->entries[i].key) % cap];
+        u32 i2 = 0;
+        while (i2 < BUCKET_ENTRIES && newb->entries[i2].key)
+          i2++;
+        if (i2 == BUCKET_ENTRIES) {
+          // no free slot in newb; need to grow further
+          memfree(m->mem, newbuckets);
+          cap = cap * 2;
+          goto rehash;
+        }
+        newb->entries[i2] = b->entries[i];
+      }
+    }
+    memfree(m->mem, m->buckets);
+    m->buckets = newbuckets;
+    m->cap = cap;
+  }
+}
+
+static void* BucketPtrMapSet(BucketPtrMap* m, const void* key, void* value) {
+  while (1) { // grow loop
+    Bucket* b = &m->buckets[bucket_ptrhash(key) % m->cap];
+    for (u32 i = 0; i < BUCKET_ENTRIES; i++) {
+      if (b->entries[i].value == NULL) {
+        // free slot
+        b->entries[i].key = key;
+        b->entries[i].value = value;
+        m->len++;
+        return NULL;
+      }
+      if (b->entries[i].key == key) {
+        void* oldval = b->entries[i].value;
+        b->entries[i].value = value;
+        return oldval;
+      }
+    }
+    BucketPtrMapGrow(m); // bucket is full
+  }
+}
+
+static void* BucketPtrMapDel(BucketPtrMap* m, const void* key) {
+  Bucket* b = &m->buckets[bucket_ptrhash(key) % m->cap];
+  for (u32 i = 0; i < BUCKET_ENTRIES; i++) {
+    if (b->entries[i].key == key) {
+      void* value = b->entries[i].value;
+      if (value) {
+        b->entries[i].value = NULL; // mark as deleted
+        m->len--;
+      }
+      return value;
+    }
+  }
+  return NULL;
+}
+
+static void* BucketPtrMapGet(const BucketPtrMap* m, const void* key) {
+  const Bucket* b = &m->buckets[(u32)bucket_ptrhash(key) % m->cap];
+  for (u32 i = 0; i < BUCKET_ENTRIES && b->entries[i].key; i++) {
+    if (b->entries[i].key == key)
+      return b->entries[i].value;
+  }
+  return NULL;
+}
+
+// DEF_HASHMAP_BENCH defines a function which inserts keys into a new map, looks up each key
+// a few times, looks up as many missing keys and finally deletes and re-inserts half of
+// the keys. Returns the duration in nanoseconds and the size of the map's table in *size.
+#define DEF_HASHMAP_BENCH(NAME, SLOTSIZE)                                          \
+  static u64 bench_##NAME(const void** keys, u32 nkeys, size_t* size) {             \
+    NAME m;                                                                          \
+    NAME##Init(&m, 8, MemHeap);                                                      \
+    u64 starttm = nanotime();                                                        \
+    for (u32 i = 0; i < nkeys; i++)                                                  \
+      NAME##Set(&m, keys[i], (void*)keys[i]);                                        \
+    for (u32 n = 0; n < 4; n++) {                                                    \
+      for (u32 i = 0; i < nkeys; i++) {                                              \
+        if (R_UNLIKELY(NAME##Get(&m, keys[i]) != keys[i]))                          \
+          panic(#NAME "Get");                                                        \
+      }                                                                              \
+    }                                                                                \
+    for (u32 i = 0; i < nkeys; i++) {                                                \
+      if (R_UNLIKELY(NAME##Get(&m, (const u8*)keys[i] + 8) != NULL))                \
+        panic(#NAME "Get");                                                          \
+    }                                                                                \
+    for (u32 i = 0; i < nkeys; i += 2)                                               \
+      NAME##Del(&m, keys[i]);                                                        \
+    for (u32 i = 0; i < nkeys; i += 2)                                               \
+      NAME##Set(&m, keys[i], (void*)keys[i]);                                        \
+    u64 duration = nanotime() - starttm;                                             \
+    *size = (size_t)m.cap * (SLOTSIZE);                                              \
+    NAME##Dispose(&m);                                                               \
+    return duration;                                                                 \
+  }
+
+DEF_HASHMAP_BENCH(BucketPtrMap, sizeof(Bucket))
+DEF_HASHMAP_BENCH(PtrMap, 1 + sizeof(void*) * 2)
+
+static void bench_report(const char* name, const char* keykind, u32 nkeys, u64 d, size_t size) {
+  char durstr[40];
+  auto durlen = fmtduration(durstr, countof(durstr), d);
+  fprintf(stderr, "hashmap_bench: %-6s %-10s %7u keys  %6.1f ns/op  %.*s  table %zu kB\n",
+    name, keykind, nkeys, (double)d / (double)(nkeys * 7), durlen, durstr, size / 1024);
+}
+
+R_TEST(hashmap_bench) {
+  if (!co_bench_enabled())
+    return;
+  const u32 nkeysv[] = { 16, 1000, 100000 };
+  for (u32 clustered = 0; clustered < 2; clustered++) {
+    const char* keykind = clustered ? "clustered" : "sequential";
+    for (u32 j = 0; j < countof(nkeysv); j++) {
+      u32 nkeys = nkeysv[j];
+      // sequential keys look like small allocations from the same arena while
+      // clustered keys only differ in their high bits, like large aligned allocations.
+      const void** keys = memalloc(MemHeap, sizeof(void*) * nkeys);
+      for (u32 i = 0; i < nkeys; i++)
+        keys[i] = (const void*)(clustered ? (uintptr_t)(i + 1) << 20 : (uintptr_t)(i + 1) * 32);
+      u32 reps = MAX(1, 1000000 / nkeys);
+      u64 d1 = 0, d2 = 0;
+      size_t size1 = 0, size2 = 0;
+      for (u32 r = 0; r < reps; r++) {
+        d1 += bench_BucketPtrMap(keys, nkeys, &size1);
+        d2 += bench_PtrMap(keys, nkeys, &size2);
+      }
+      bench_report("bucket", keykind, nkeys, d1 / reps, size1);
+      bench_report("swiss",  keykind, nkeys, d2 / reps, size2);
+      memfree(MemHeap, keys);
+    }
+  }
+}
+
+#endif /* R_TESTING_ENABLED */
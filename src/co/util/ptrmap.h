@@ -8,8 +8,8 @@
 
 ASSUME_NONNULL_BEGIN
 
-// PtrMapInit initializes a map structure. initbuckets is the number of initial buckets.
-void PtrMapInit(PtrMap*, u32 initbuckets, Mem mem);
+// PtrMapInit initializes a map structure with room for at least initcap entries.
+void PtrMapInit(PtrMap*, u32 initcap, Mem mem);
 
 static bool PtrMapIsInit(const PtrMap*);
 
@@ -17,7 +17,7 @@ static bool PtrMapIsInit(const PtrMap*);
 void PtrMapDispose(PtrMap*);
 
 // Creates and initializes a new PtrMap in mem, or global memory if mem is NULL.
-PtrMap* PtrMapNew(u32 initbuckets, Mem mem);
+PtrMap* PtrMapNew(u32 initcap, Mem mem);
 
 // PtrMapFree frees PtrMap along with its data.
 void PtrMapFree(PtrMap*);
@@ -1,4 +1,4 @@
-#include <rbase/rbase.h>
+#include "../common.h"
 #include "tmpstr.h"
 #include "tstyle.h"
 #include "rtimer.h"
@@ -55,6 +55,15 @@ void rtimer_log(RTimer* rt, const char* fmt, ...) {
 
   va_list ap;
   va_start(ap, fmt);
+  if (rt->records) {
+    RTimerRecord* r = memalloc(MemHeap, sizeof(RTimerRecord));
+    r->duration = duration;
+    va_list ap2;
+    va_copy(ap2, ap);
+    r->message = str_appendfmtv(str_new(32), fmt, ap2);
+    va_end(ap2);
+    ArrayPush(rt->records, r, MemHeap);
+  }
   s = str_appendfmtv(s, fmt, ap);
   va_end(ap);
 
@@ -63,3 +72,8 @@ void rtimer_log(RTimer* rt, const char* fmt, ...) {
   fwrite(s, str_len(s), 1, stderr);
   *sp = s; // store back
 }
+
+void rtimer_record_free(RTimerRecord* r) {
+  str_free(r->message);
+  memfree(MemHeap, r);
+}
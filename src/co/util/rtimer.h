@@ -1,14 +1,24 @@
 #pragma once
+#include "array.h"
 ASSUME_NONNULL_BEGIN
 
 typedef struct RTimer {
-  struct rusage ru;
-  u64           nstime;
+  struct rusage   ru;
+  u64             nstime;
+  Array* nullable records; // if set, rtimer_log appends a RTimerRecord* to it
 } RTimer;
 
+// RTimerRecord is a duration logged with rtimer_log.
+// Allocated in MemHeap; free with rtimer_record_free.
+typedef struct RTimerRecord {
+  u64 duration; // nanoseconds
+  Str message;
+} RTimerRecord;
+
 void rtimer_start(RTimer* rt);
 u64 rtimer_duration(RTimer* rt);
 Str rtimer_duration_str(RTimer* rt, Str s);
 void rtimer_log(RTimer* rt, const char* fmt, ...);
+void rtimer_record_free(RTimerRecord*);
 
 ASSUME_NONNULL_END
@@ -12,99 +12,125 @@
 #include <xxhash/xxhash.h>
 #pragma GCC diagnostic pop
 
-// red-black tree implementation used for interning
-#define RBKEY      Sym
-#define RBUSERDATA Mem
-#define RBNODETYPE SymRBNode
-#include "rbtree.c.h"
-
 // sym_xxhash32_seed is the xxHash seed used for hashing sym data
 static const u32 sym_xxhash32_seed = 578;
 
 #define HASH_SYM_DATA(data, len) XXH32((const void*)(data), (len), sym_xxhash32_seed)
 
-inline static SymRBNode* RBAllocNode(Mem mem) {
-  return memalloct(mem, SymRBNode);
+// SYMTAB_INITCAP is the number of entries of a pool's first table. Must be pow2.
+#define SYMTAB_INITCAP 64
+
+// symtab_isfull returns true if a table has reached its max load factor (1/2).
+// Linear probing degrades quickly with higher loads.
+#define symtab_isfull(t) ((t)->len >= (t)->cap / 2)
+
+
+static SymTable* symtab_new(Mem mem, u32 cap) {
+  assert(cap == POW2_CEIL(cap));
+  auto t = (SymTable*)memalloc(mem, sizeof(SymTable) + sizeof(SymTabEntry) * cap);
+  t->cap = cap;
+  t->len = 0;
+  t->prev = NULL;
+  t->entries = (SymTabEntry*)&t[1];
+  memset(t->entries, 0, sizeof(SymTabEntry) * cap);
+  return t;
 }
 
-// syms are never removed from the interning tree
-inline static void RBFreeNode(SymRBNode* node, Mem mem) {
-  memfree(mem, (void*)_SYM_HEADER(node->key));
-  memfree(mem, node);
+
+// symtab_lookup finds a sym in t. Safe to call concurrently with symtab_insert.
+inline static Sym nullable symtab_lookup(
+  const SymTable* t, const char* data, size_t len, u32 hash)
+{
+  u32 mask = t->cap - 1;
+  u32 i = hash & mask;
+  while (1) {
+    const SymTabEntry* e = &t->entries[i];
+    Sym s = atomic_load_explicit(&e->sym, memory_order_acquire);
+    if (s == NULL)
+      return NULL;
+    if (e->hash == hash && symlen(s) == len && memcmp(data, s, len) == 0)
+      return s;
+    i = (i + 1) & mask;
+  }
 }
 
-static int RBCmp(Sym a, Sym b, Mem mem) {
-  if (symhash(a) < symhash(b))
-    return -1;
-  if (symhash(a) > symhash(b))
-    return 1;
-  int cmp = (int)symlen(a) - (int)symlen(b);
-  if (cmp == 0) {
-    // hash is identical and length is identical; compare bytes
-    cmp = memcmp(a, b, symlen(a));
+
+// symtab_insert adds s to t. t must have a free entry.
+// Caller must hold SymPool.mu (or otherwise have exclusive write access to t.)
+static void symtab_insert(SymTable* t, Sym s, u32 hash) {
+  u32 mask = t->cap - 1;
+  u32 i = hash & mask;
+  while (atomic_load_explicit(&t->entries[i].sym, memory_order_relaxed) != NULL)
+    i = (i + 1) & mask;
+  t->entries[i].hash = hash;
+  // publish; readers loading sym with acquire semantics also observe hash
+  atomic_store_explicit(&t->entries[i].sym, s, memory_order_release);
+  t->len++;
+}
+
+
+// symtab_grow returns a new table with twice the capacity of t, containing all syms of t.
+static SymTable* symtab_grow(SymTable* t, Mem mem) {
+  auto t2 = symtab_new(mem, t->cap * 2);
+  for (u32 i = 0; i < t->cap; i++) {
+    Sym s = atomic_load_explicit(&t->entries[i].sym, memory_order_relaxed);
+    if (s)
+      symtab_insert(t2, s, t->entries[i].hash);
   }
-  return cmp;
+  t2->prev = t;
+  return t2;
 }
 
 
-void sympool_init(SymPool* p, const SymPool* base, Mem mem, SymRBNode* root) {
-  p->root = root;
+void sympool_init(SymPool* p, const SymPool* base, Mem mem, SymTable* tab) {
+  atomic_init(&p->tab, tab);
   p->base = base;
   p->mem = mem;
-  rwmtx_init(&p->mu, mtx_plain);
+  mtx_init(&p->mu, mtx_plain);
 }
 
 void sympool_dispose(SymPool* p) {
-  if (p->root)
-    RBClear(p->root, p->mem);
-  rwmtx_destroy(&p->mu);
+  SymTable* t = atomic_load_explicit(&p->tab, memory_order_acquire);
+  if (t) {
+    // syms are never removed; the current table has all of them
+    for (u32 i = 0; i < t->cap; i++) {
+      Sym s = atomic_load_explicit(&t->entries[i].sym, memory_order_relaxed);
+      if (s)
+        memfree(p->mem, (void*)_SYM_HEADER(s));
+    }
+    while (t) {
+      auto prev = t->prev;
+      memfree(p->mem, t);
+      t = prev;
+    }
+  }
+  mtx_destroy(&p->mu);
 }
 
 
-// static bool debug_0x11_iter(const SymRBNode* n, void* userdata) {
-//   dlog("  node key %p (%s)", n->key, (uintptr_t)n->key > 0xff ? n->key : "");
-//   return true; // keep going
-// }
-
-// static void debug_0x11_dump(const SymPool* p) {
-//   dlog("sympool:");
-//   if (p->root) {
-//     RBIter(p->root, debug_0x11_iter, NULL);
-//   } else {
-//     dlog("null root");
-//   }
-// }
-
-
-// Caller must hold read lock on rp->mu
 inline static Sym nullable symlookup(
-  const SymRBNode* node, const char* data, size_t len, u32 hash)
+  const SymPool* p, const char* data, size_t len, u32 hash)
 {
-  while (node) {
-    // IMPORTANT: The comparison here MUST match the comparison used for other
-    // operations on the tree. I.e. it must match RBCmp.
-    Sym b = (RBKEY)node->key;
-    if (hash < symhash(b)) {
-      node = node->left;
-    } else if (hash > symhash(b)) {
-      node = node->right;
-    } else {
-      int cmp = (int)len - (int)symlen(b);
-      if (cmp == 0) {
-        cmp = memcmp(data, b, len);
-        if (cmp == 0)
-          return b;
-      }
-      node = cmp < 0 ? node->left : node->right;
-    }
-  }
-  return NULL;
+  const SymTable* t = atomic_load_explicit(&p->tab, memory_order_acquire);
+  return t ? symtab_lookup(t, data, len, hash) : NULL;
 }
 
 
 static Sym symaddh(SymPool* p, const char* data, size_t len, u32 hash) {
   assert(len <= 0xFFFFFFFF);
 
+  mtx_lock(&p->mu);
+
+  // It's possible that an equivalent symbol is already in the pool.
+  // Either the caller made the wrong assumption thinking the symbol did not exist,
+  // or another thread raced us and added the same symbol just before we got the lock.
+  SymTable* t = atomic_load_explicit(&p->tab, memory_order_relaxed);
+  Sym s = t ? symtab_lookup(t, data, len, hash) : NULL;
+  if (s) {
+    mtx_unlock(&p->mu);
+    return s;
+  }
+
   // allocate a new Sym
   auto hp = (SymHeader*)memalloc(p->mem, sizeof(SymHeader) + (size_t)len + 1);
   hp->hash = hash;
@@ -112,32 +138,21 @@ static Sym symaddh(SymPool* p, const char* data, size_t len, u32 hash) {
   auto sp = &hp->p[0];
   memcpy(sp, data, len);
   sp[len] = 0;
-  auto s = (Sym)sp;
-
-  // It's possible that an equivalent symbol is already in the tree.
-  // Either the caller made the wrong assumption thinking the symbol did not exist,
-  // or another thread raced us and managed to get a write lock just before we did
-  // and added the same symbol. Either way, we store the success result of RBInsert
-  // at `added` which we later check.
-  bool added;
-  Sym s2 = NULL;
-
-  // attempt to insert into tree
-  rwmtx_lock(&p->mu);
-  p->root = RBInsert(p->root, s, &added, p->mem);
-  if (!added)
-    s2 = symlookup(p->root, data, len, hash);
-  rwmtx_unlock(&p->mu);
-
-  if (!added) {
-    // Another thread managed to insert the same symbol before we did.
-    // Free the symbol we allocated
-    memfree(p->mem, hp);
-    // return the equivalent symbol
-    assert(s2 != NULL);
-    s = s2;
+  s = (Sym)sp;
+
+  if (t == NULL) {
+    t = symtab_new(p->mem, SYMTAB_INITCAP);
+    atomic_store_explicit(&p->tab, t, memory_order_release);
+  } else if (symtab_isfull(t)) {
+    // Readers may still be probing the old table. It stays valid (and never changes)
+    // until sympool_dispose. A reader which misses a sym because it's looking at the old
+    // table ends up here and finds the sym in the new table.
+    t = symtab_grow(t, p->mem);
+    atomic_store_explicit(&p->tab, t, memory_order_release);
   }
+  symtab_insert(t, s, hash);
 
+  mtx_unlock(&p->mu);
   return s;
 }
 
@@ -146,9 +161,7 @@ Sym nullable symfind(SymPool* p, const char* data, size_t len) {
   u32 hash = HASH_SYM_DATA(data, len);
   const SymPool* rp = p;
   while (rp) {
-    rwmtx_rlock((rwmtx_t*)&rp->mu);
-    auto s = symlookup(rp->root, data, len, hash);
-    rwmtx_runlock((rwmtx_t*)&rp->mu);
+    auto s = symlookup(rp, data, len, hash);
     if (s)
       return s;
     // look in base pool
@@ -163,9 +176,7 @@ Sym symget(SymPool* p, const char* data, size_t len) {
   u32 hash = HASH_SYM_DATA(data, len);
   const SymPool* rp = p;
   while (rp) {
-    rwmtx_rlock((rwmtx_t*)&rp->mu);
-    auto s = symlookup(rp->root, data, len, hash);
-    rwmtx_runlock((rwmtx_t*)&rp->mu);
+    auto s = symlookup(rp, data, len, hash);
     if (s)
       return s;
     // look in base pool
@@ -180,16 +191,18 @@ Sym symadd(SymPool* p, const char* data, size_t len) {
   return symaddh(p, data, len, h);
 }
 
-static bool sym_rb_iter1(const SymRBNode* n, void* userdata) {
-  auto sp = (Str*)userdata;
-  *sp = str_append(*sp, n->key, symlen(n->key));
-  *sp = str_appendcstr(*sp, ", ");
-  return true; // keep going
-}
-
 Str sympool_repr_unsorted(const SymPool* p, Str s) {
+  const SymTable* t = atomic_load_explicit(&p->tab, memory_order_acquire);
+  if (!t)
+    return s;
   u32 len1 = str_len(s);
-  RBIter(p->root, sym_rb_iter1, &s);
+  for (u32 i = 0; i < t->cap; i++) {
+    Sym sym = atomic_load_explicit(&t->entries[i].sym, memory_order_acquire);
+    if (sym) {
+      s = str_append(s, sym, symlen(sym));
+      s = str_appendcstr(s, ", ");
+    }
+  }
   if (str_len(s) != len1)
     str_setlen(s, str_len(s) - 2); // undo last ", "
   return s;
@@ -201,12 +214,6 @@ typedef struct ReprCtx {
   void* astorage[64];
 } ReprCtx;
 
-static bool sym_rb_iter(const SymRBNode* n, void* userdata) {
-  auto rctx = (ReprCtx*)userdata;
-  ArrayPush(&rctx->a, (void*)n->key, rctx->mem);
-  return true; // keep going
-}
-
 static int str_sortf(ConstStr a, ConstStr b, void* userdata) {
   return a == b ? 0 : strcmp(a, b);
 }
@@ -215,7 +222,12 @@ Str sympool_repr(const SymPool* p, Str s) {
   ReprCtx rctx;
   rctx.mem = p->mem;
   ArrayInitWithStorage(&rctx.a, rctx.astorage, countof(rctx.astorage));
-  RBIter(p->root, sym_rb_iter, &rctx);
+  const SymTable* t = atomic_load_explicit(&p->tab, memory_order_acquire);
+  for (u32 i = 0; t && i < t->cap; i++) {
+    Sym sym = atomic_load_explicit(&t->entries[i].sym, memory_order_acquire);
+    if (sym)
+      ArrayPush(&rctx.a, (void*)sym, rctx.mem);
+  }
   ArraySort(&rctx.a, (ArraySortFun)str_sortf, NULL);
   bool first = true;
   s = str_appendc(s, '{');
@@ -321,11 +333,6 @@ R_TEST(sym_hash) {
   }
 }
 
-__attribute__((used))
-inline static Str rbkeyfmt(Str s, RBKEY k) {
-  return str_appendfmt(s, "Sym(\"%s\" %x)", k, symhash(k));
-}
-
 R_TEST(sympool) {
   auto mem = MemLinearAlloc(1);
   SymPool syms1;
@@ -344,15 +351,6 @@ R_TEST(sympool) {
 
   auto C3 = symadd(&syms3, "C", 1);
 
-  // auto s = str_new(0);
-  // s = RBRepr(syms1.root, s, 0, rbkeyfmt);
-  // dlog("syms1: %s", s);
-  // s = RBRepr(syms2.root, str_setlen(s, 0), 0, rbkeyfmt);
-  // dlog("syms2: %s", s);
-  // s = RBRepr(syms3.root, str_setlen(s, 0), 0, rbkeyfmt);
-  // dlog("syms3: %s", s);
-  // str_free(s);
-
   asserteq(C3, symget(&syms3, "C", 1)); // found in syms3
   asserteq(B2, symget(&syms3, "B", 1)); // not found in syms3, but found in syms2
   asserteq(A1, symget(&syms3, "A", 1)); // not found in syms3 or syms2, but found in syms1
@@ -362,3 +360,61 @@ R_TEST(sympool) {
   sympool_dispose(&syms3);
   MemLinearFree(mem);
 }
+
+
+R_TEST(sympool_grow) {
+  auto mem = MemLinearAlloc(1);
+  SymPool syms;
+  sympool_init(&syms, NULL, mem, NULL);
+  char buf[16];
+  Sym symv[1000];
+  for (u32 i = 0; i < countof(symv); i++) {
+    int n = snprintf(buf, sizeof(buf), "sym%u", i);
+    symv[i] = symget(&syms, buf, (size_t)n);
+  }
+  // all syms should still be found after the table has grown several times
+  for (u32 i = 0; i < countof(symv); i++) {
+    int n = snprintf(buf, sizeof(buf), "sym%u", i);
+    asserteq(symv[i], symfind(&syms, buf, (size_t)n));
+  }
+  const SymTable* t = atomic_load(&syms.tab);
+  asserteq(t->len, countof(symv));
+  assert(!symtab_isfull(t));
+  sympool_dispose(&syms);
+  MemLinearFree(mem);
+}
+
+
+typedef struct SymTestThread {
+  SymPool* syms;
+  Sym      symv[500];
+} SymTestThread;
+
+static int sympool_test_thread(void* arg) {
+  SymTestThread* tt = (SymTestThread*)arg;
+  char buf[16];
+  for (u32 i = 0; i < countof(tt->symv); i++) {
+    int n = snprintf(buf, sizeof(buf), "sym%u", i);
+    tt->symv[i] = symget(tt->syms, buf, (size_t)n);
+  }
+  return 0;
+}
+
+R_TEST(sympool_concurrent) {
+  // many threads interning the same names must all get the same syms
+  SymPool syms;
+  sympool_init(&syms, NULL, MemHeap, NULL);
+  SymTestThread tv[4];
+  thrd_t threads[countof(tv)];
+  for (u32 i = 0; i < countof(tv); i++) {
+    tv[i].syms = &syms;
+    asserteq(thrd_create(&threads[i], sympool_test_thread, &tv[i]), thrd_success);
+  }
+  for (u32 i = 0; i < countof(tv); i++)
+    thrd_join(threads[i], NULL);
+  for (u32 i = 1; i < countof(tv); i++) {
+    for (u32 j = 0; j < countof(tv[0].symv); j++)
+      asserteq(tv[0].symv[j], tv[i].symv[j]);
+  }
+  sympool_dispose(&syms);
+}
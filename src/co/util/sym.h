@@ -13,31 +13,39 @@ typedef const char* Sym;
 // SYM_LEN_MAX defines the largest possible length of a symbol
 #define SYM_LEN_MAX 0x7ffffff /* 134 217 727 (27 bits) */
 
-// SymRBNode is a red-black tree node
-typedef struct SymRBNode SymRBNode;
-typedef struct SymRBNode {
-  Sym                 key;
-  bool                isred;
-  SymRBNode* nullable left;
-  SymRBNode* nullable right;
-} SymRBNode;
-
-// SymPool holds a set of syms unique to the pool
+// SymTabEntry is a slot in a SymTable
+typedef struct SymTabEntry {
+  _Atomic(Sym) sym;  // NULL for an empty slot. Set once, never changed.
+  u32          hash; // symhash(sym); stored inline to avoid dereferencing sym when probing
+} SymTabEntry;
+
+// SymTable is an open-addressing hash table of syms with linear probing
+typedef struct SymTable SymTable;
+typedef struct SymTable {
+  u32                 cap;     // number of entries (power of two)
+  u32                 len;     // number of syms in entries
+  SymTable* nullable  prev;    // smaller table this one replaced; kept alive for readers
+  SymTabEntry*        entries;
+} SymTable;
+
+// SymPool holds a set of syms unique to the pool.
+// Lookups are lock free. Additions are serialized by mu and, when the table grows, publish
+// a new table; old tables are kept until sympool_dispose so concurrent readers stay valid.
 typedef struct SymPool SymPool;
 typedef struct SymPool {
-  SymRBNode*              root;
+  _Atomic(SymTable*)      tab;
   const SymPool* nullable base;
   Mem                     mem;
-  rwmtx_t                 mu;
+  mtx_t                   mu;
 } SymPool;
 
 // sympool_init initialized a SymPool
 // base is an optional "parent" or "outer" read-only symbol pool to use for secondary lookups
 //   when a symbol is not found in the pool.
-// mem is the memory to use for SymRBNodes.
-// root may be a preallocated red-black tree. Be mindful of interactions with sympool_dispose.
+// mem is the memory to use for syms and tables.
+// tab may be a preallocated table. Be mindful of interactions with sympool_dispose.
 void sympool_init(
-  SymPool* p, const SymPool* nullable base, Mem mem, SymRBNode* nullable root);
+  SymPool* p, const SymPool* nullable base, Mem mem, SymTable* nullable tab);
 
 // sympool_dispose frees up memory used by p (but does not free p itself)
 // When a SymPool has been disposed, all symbols in it becomes invalid.
@@ -0,0 +1,123 @@
+#include <rbase/rbase.h>
+#include <rt/sched.h>
+
+// Channel benchmark.
+// 1. Ping-pong: two coroutines pass a value back and forth over two channels nmsgs times.
+//    Reports round trips per second.
+// 2. Fan-out/fan-in: a producer sends nmsgs values on one channel to nworkers workers, which
+//    send them on to a single collector over another channel. Reports values per second.
+// Each is run with unbuffered channels and with buffered channels.
+//
+// usage: co-rt-bench-chan [<nworkers> [<nmsgs>]]
+
+ASSUME_NONNULL_BEGIN
+
+static u32 nworkers = 8;
+static u32 nmsgs    = 1000000;
+
+static Chan* done; // workers and ponger signal completion
+
+
+static void print_rate(const char* name, u64 n, u64 ns) {
+  double secs = (double)ns / 1e9;
+  printf("  %-10s %8.3f s  %10.0f /s  %6.1f ns/op\n", name, secs, (double)n / secs,
+    (double)ns / (double)n);
+}
+
+static Chan* ping;
+static Chan* pong;
+
+static void ponger(uintptr_t _) {
+  u64 v;
+  while (chan_recv(ping, &v))
+    chan_send(pong, &v);
+  chan_send(done, &v);
+}
+
+static void bench_pingpong(const char* name, u32 cap) {
+  ping = chan_new(sizeof(u64), cap);
+  pong = chan_new(sizeof(u64), cap);
+  if (sched_spawn(ponger, 0, NULL, 0) != 0)
+    panic("sched_spawn: %s", strerror(errno));
+  u64 start = nanotime();
+  for (u64 i = 0; i < nmsgs; i++) {
+    u64 v = i;
+    chan_send(ping, &v);
+    if (!chan_recv(pong, &v) || v != i)
+      panic("ping-pong: bad value");
+  }
+  u64 d = nanotime() - start;
+  chan_close(ping);
+  chan_recv(done, NULL);
+  print_rate(name, nmsgs, d);
+  chan_free(ping);
+  chan_free(pong);
+}
+
+static Chan* work;
+static Chan* results;
+
+static void worker(uintptr_t _) {
+  u64 v;
+  while (chan_recv(work, &v))
+    chan_send(results, &v);
+  chan_send(done, &v);
+}
+
+static void producer(uintptr_t _) {
+  for (u64 i = 0; i < nmsgs; i++)
+    chan_send(work, &i);
+  chan_close(work);
+}
+
+static void bench_fan(const char* name, u32 cap) {
+  work = chan_new(sizeof(u64), cap);
+  results = chan_new(sizeof(u64), cap);
+  for (u32 i = 0; i < nworkers; i++) {
+    if (sched_spawn(worker, 0, NULL, 0) != 0)
+      panic("sched_spawn: %s", strerror(errno));
+  }
+  u64 start = nanotime();
+  if (sched_spawn(producer, 0, NULL, 0) != 0)
+    panic("sched_spawn: %s", strerror(errno));
+  u64 sum = 0, v;
+  for (u32 i = 0; i < nmsgs; i++) {
+    chan_recv(results, &v);
+    sum += v;
+  }
+  u64 d = nanotime() - start;
+  if (sum != (u64)nmsgs * (nmsgs - 1) / 2)
+    panic("fan-out/fan-in: bad sum");
+  for (u32 i = 0; i < nworkers; i++)
+    chan_recv(done, NULL);
+  print_rate(name, nmsgs, d);
+  chan_free(work);
+  chan_free(results);
+}
+
+static void bench_main(uintptr_t _) {
+  done = chan_new(sizeof(u64), 0);
+
+  printf("ping-pong: %u round trips\n", nmsgs);
+  bench_pingpong("unbuffered", 0);
+  bench_pingpong("buffered", 1);
+
+  printf("fan-out/fan-in: %u values, 1 -> %u -> 1 coroutines\n", nmsgs, nworkers);
+  bench_fan("unbuffered", 0);
+  bench_fan("buffered", 128);
+  // returning from the main coroutine ends the program
+}
+
+int main(int argc, const char** argv) {
+  u32* params[] = { &nworkers, &nmsgs };
+  for (int i = 1; i < argc && i <= (int)countof(params); i++) {
+    if (!parseu32(argv[i], strlen(argv[i]), 10, params[i - 1]) || *params[i - 1] == 0) {
+      fprintf(stderr, "usage: %s [<nworkers> [<nmsgs>]]\n", argv[0]);
+      return 1;
+    }
+  }
+  sched_main(bench_main, 0); // never returns
+  return 0;
+}
+
+ASSUME_NONNULL_END
@@ -0,0 +1,215 @@
+#include <rbase/rbase.h>
+#include <rt/sched.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+
+// Echo server benchmark for the network poller.
+// Runs an echo server and nclients client coroutines in one process, talking over loopback.
+// All clients run concurrently. Each client makes nconns connections, one after another,
+// and does nmsgs request-response round trips of MSGSIZE bytes on each connection.
+// Reports connections/sec, round trips/sec and round-trip latency percentiles.
+// The default number of clients fits in the common default RLIMIT_NOFILE soft limit of 1024
+// (each client uses two file descriptors.) More clients raise the soft limit, which fails if
+// the hard limit is too low; see ulimit -Hn.
+//
+// usage: co-rt-bench-echo [<nclients> [<nconns> [<nmsgs>]]]
+
+ASSUME_NONNULL_BEGIN
+
+#define MSGSIZE 64
+
+static u32 nclients = 400;
+static u32 nconns   = 4;  // connections per client
+static u32 nmsgs    = 16; // round trips per connection
+
+static struct sockaddr_in server_addr;
+static u64*               latencies; // round-trip times in nanoseconds
+static atomic_u32         nlatencies;
+static atomic_u32         nerrors;
+static atomic_u32         nclients_done;
+static int                donefd[2]; // pipe written to by the last client to finish
+
+
+static void serve_conn(uintptr_t fd) {
+  PollDesc* pd = sched_pollopen((int)fd);
+  if (!pd)
+    panic("sched_pollopen: %s", strerror(errno));
+  u8 buf[MSGSIZE];
+  ssize_t n;
+  while ((n = t_read(pd, buf, sizeof(buf))) > 0) {
+    if (t_write(pd, buf, (size_t)n) < 0)
+      break;
+  }
+  sched_pollclose(pd);
+  close((int)fd);
+}
+
+static void server(uintptr_t lnfd) {
+  PollDesc* pd = sched_pollopen((int)lnfd);
+  if (!pd)
+    panic("sched_pollopen: %s", strerror(errno));
+  while (1) {
+    int fd = t_accept(pd, NULL, NULL);
+    if (fd < 0)
+      panic("accept: %s", strerror(t_errno()));
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (sched_spawn(serve_conn, (uintptr_t)fd, NULL, 0) != 0)
+      panic("sched_spawn: %s", strerror(errno));
+  }
+}
+
+// client_conn connects to the server and does nmsgs round trips.
+// Returns false on error.
+static bool client_conn(u8 msg[MSGSIZE]) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    panic("socket: %s", strerror(errno));
+  PollDesc* pd = sched_pollopen(fd);
+  if (!pd)
+    panic("sched_pollopen: %s", strerror(errno));
+  bool ok = false;
+  if (t_connect(pd, (struct sockaddr*)&server_addr, sizeof(server_addr)) != 0)
+    goto end;
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  u8 buf[MSGSIZE];
+  for (u32 i = 0; i < nmsgs; i++) {
+    u64 start = nanotime();
+    if (t_write(pd, msg, MSGSIZE) != MSGSIZE)
+      goto end;
+    for (size_t nread = 0; nread < MSGSIZE; ) {
+      ssize_t n = t_read(pd, &buf[nread], MSGSIZE - nread);
+      if (n <= 0)
+        goto end;
+      nread += (size_t)n;
+    }
+    latencies[AtomicAdd(&nlatencies, 1)] = nanotime() - start;
+  }
+  ok = memcmp(buf, msg, MSGSIZE) == 0;
+
+  // Wait for the server to close its end so that a client uses at most two file
+  // descriptors at any time (its own and the server's.)
+  shutdown(fd, SHUT_WR);
+  while (t_read(pd, buf, MSGSIZE) > 0) {}
+
+end:
+  {
+    // Close with RST instead of FIN so that connections don't linger in TIME_WAIT,
+    // which would exhaust ephemeral ports.
+    struct linger lg = { .l_onoff = 1, .l_linger = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+  }
+  sched_pollclose(pd);
+  close(fd);
+  return ok;
+}
+
+static void client(uintptr_t id) {
+  u8 msg[MSGSIZE];
+  memset(msg, (int)('A' + id % 26), sizeof(msg));
+  for (u32 i = 0; i < nconns; i++) {
+    if (!client_conn(msg))
+      AtomicAdd(&nerrors, 1);
+  }
+  if (AtomicAdd(&nclients_done, 1) + 1 == nclients) {
+    if (write(donefd[1], "", 1) != 1)
+      panic("write: %s", strerror(errno));
+  }
+}
+
+static int cmp_u64(const void* a, const void* b) {
+  u64 x = *(const u64*)a;
+  u64 y = *(const u64*)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static void print_latency(const char* name, u64 ns) {
+  printf("  %-6s %8.1f us\n", name, (double)ns / 1000.0);
+}
+
+static void bench_main(uintptr_t _) {
+  // each client and its server-side connection use a file descriptor
+  struct rlimit rl;
+  getrlimit(RLIMIT_NOFILE, &rl);
+  rlim_t nfiles = (rlim_t)nclients*2 + 64;
+  if (rl.rlim_cur < nfiles) {
+    rl.rlim_cur = MIN(nfiles, rl.rlim_max);
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < nfiles)
+      panic("need %lu open files but RLIMIT_NOFILE is %lu", (unsigned long)nfiles,
+        (unsigned long)rl.rlim_cur);
+  }
+
+  int lnfd = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(lnfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  server_addr.sin_port = 0;
+  socklen_t addrlen = sizeof(server_addr);
+  if (bind(lnfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) != 0 ||
+      listen(lnfd, 65535) != 0 ||
+      getsockname(lnfd, (struct sockaddr*)&server_addr, &addrlen) != 0)
+  {
+    panic("listen: %s", strerror(errno));
+  }
+  if (sched_spawn(server, (uintptr_t)lnfd, NULL, 0) != 0)
+    panic("sched_spawn: %s", strerror(errno));
+
+  if (pipe(donefd) != 0)
+    panic("pipe: %s", strerror(errno));
+  PollDesc* donepd = sched_pollopen(donefd[0]);
+  if (!donepd)
+    panic("sched_pollopen: %s", strerror(errno));
+
+  u32 nroundtrips = nclients * nconns * nmsgs;
+  latencies = memalloc(MemLibC(), sizeof(u64) * nroundtrips);
+
+  printf("echo: %u clients x %u connections x %u round trips of %u B over loopback\n",
+    nclients, nconns, nmsgs, MSGSIZE);
+  u64 start = nanotime();
+  for (u32 i = 0; i < nclients; i++) {
+    if (sched_spawn(client, (uintptr_t)i, NULL, 0) != 0)
+      panic("sched_spawn: %s", strerror(errno));
+  }
+  u8 b;
+  if (t_read(donepd, &b, 1) != 1)
+    panic("read: %s", strerror(t_errno()));
+  u64 elapsed = nanotime() - start;
+
+  u32 nlat = AtomicLoad(&nlatencies);
+  qsort(latencies, nlat, sizeof(u64), cmp_u64);
+  double secs = (double)elapsed / 1e9;
+  printf("  time   %8.3f s\n", secs);
+  printf("  conn/s %8.0f\n", (double)(nclients * nconns) / secs);
+  printf("  rtt/s  %8.0f\n", (double)nlat / secs);
+  if (nlat > 0) {
+    print_latency("p50", latencies[nlat / 2]);
+    print_latency("p99", latencies[(u32)((u64)nlat * 99 / 100)]);
+    print_latency("p99.9", latencies[(u32)((u64)nlat * 999 / 1000)]);
+    print_latency("max", latencies[nlat - 1]);
+  }
+  u32 errors = AtomicLoad(&nerrors);
+  if (errors > 0)
+    printf("  errors %u\n", errors);
+  // returning from the main coroutine ends the program
+}
+
+int main(int argc, const char** argv) {
+  u32* params[] = { &nclients, &nconns, &nmsgs };
+  for (int i = 1; i < argc && i <= (int)countof(params); i++) {
+    if (!parseu32(argv[i], strlen(argv[i]), 10, params[i - 1]) || *params[i - 1] == 0) {
+      fprintf(stderr, "usage: %s [<nclients> [<nconns> [<nmsgs>]]]\n", argv[0]);
+      return 1;
+    }
+  }
+  sched_main(bench_main, 0); // never returns
+  return 0;
+}
+
+ASSUME_NONNULL_END
@@ -0,0 +1,109 @@
+#include <rbase/rbase.h>
+#include <rt/sched.h>
+
+// Fairness benchmark.
+// nhogs coroutines run a CPU-bound loop which never calls into the scheduler, while nprobes
+// coroutines repeatedly sleep for 1 ms, like short tasks waiting for timeouts or I/O.
+// Reports how much later than requested the short tasks woke up, and the total amount of
+// work done by the hogs (to show what preemption costs them.)
+//
+// Without preemption (COASYNCPREEMPTOFF=1) the short tasks don't get to run until the hogs
+// are done when there are no more processors (COMAXPROCS) than hogs.
+//
+// usage: co-rt-bench-fairness [<nhogs> [<duration_ms>]]
+
+ASSUME_NONNULL_BEGIN
+
+#define NPROBES 10
+
+static u32 nhogs;             // defaults to os_ncpu(), the default COMAXPROCS
+static u32 duration_ms = 2000;
+
+static i64        deadline; // when hogs and probes stop
+static atomic_u32 ndone;
+static atomic_u64 hogwork;  // number of hog loop iterations
+static u64*       latencies; // oversleep in nanoseconds
+static atomic_u32 nlatencies;
+static u32        maxlatencies;
+
+
+static void hog(uintptr_t id) {
+  u64 x = id + 1;
+  u64 n = 0;
+  while ((i64)nanotime() < deadline) {
+    for (u32 i = 0; i < 1000; i++)
+      x = x * 6364136223846793005ull + 1442695040888963407ull;
+    n++;
+  }
+  AtomicAdd(&hogwork, n + (x & 1)); // use x so the loop isn't optimized away
+  AtomicAdd(&ndone, 1);
+}
+
+static void probe(uintptr_t _) {
+  const u64 d = 1000000; // 1 ms
+  while ((i64)nanotime() < deadline) {
+    u64 start = nanotime();
+    t_sleep(d);
+    u32 i = AtomicAdd(&nlatencies, 1);
+    if (i < maxlatencies)
+      latencies[i] = nanotime() - start - d;
+  }
+  AtomicAdd(&ndone, 1);
+}
+
+static int cmp_u64(const void* a, const void* b) {
+  u64 x = *(const u64*)a;
+  u64 y = *(const u64*)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static void print_latency(const char* name, u64 ns) {
+  printf("  %-6s %10.1f us\n", name, (double)ns / 1000.0);
+}
+
+static void bench_main(uintptr_t _) {
+  printf("fairness: %u hogs, %u short tasks sleeping 1 ms, for %u ms\n",
+    nhogs, NPROBES, duration_ms);
+  maxlatencies = NPROBES * duration_ms;
+  latencies = memalloc(MemLibC(), sizeof(u64) * maxlatencies);
+  u64 start = nanotime();
+  deadline = (i64)start + (i64)duration_ms * 1000000;
+  for (u32 i = 0; i < NPROBES; i++) {
+    if (sched_spawn(probe, i, NULL, 0) != 0)
+      panic("sched_spawn: %s", strerror(errno));
+  }
+  for (u32 i = 0; i < nhogs; i++) {
+    if (sched_spawn(hog, i, NULL, 0) != 0)
+      panic("sched_spawn: %s", strerror(errno));
+  }
+  while (AtomicLoad(&ndone) < nhogs + NPROBES)
+    t_sleep(10000000);
+  double secs = (double)(nanotime() - start) / 1e9;
+
+  u32 nlat = MIN(AtomicLoad(&nlatencies), maxlatencies);
+  printf("  wakeups %u\n", nlat);
+  if (nlat > 0) {
+    qsort(latencies, nlat, sizeof(u64), cmp_u64);
+    printf("  oversleep:\n");
+    print_latency("p50", latencies[nlat / 2]);
+    print_latency("p99", latencies[(u32)((u64)nlat * 99 / 100)]);
+    print_latency("max", latencies[nlat - 1]);
+  }
+  printf("  hog work %.0f Miter/s\n", (double)AtomicLoad(&hogwork) / secs / 1000.0);
+  // returning from the main coroutine ends the program
+}
+
+int main(int argc, const char** argv) {
+  nhogs = os_ncpu();
+  u32* params[] = { &nhogs, &duration_ms };
+  for (int i = 1; i < argc && i <= (int)countof(params); i++) {
+    if (!parseu32(argv[i], strlen(argv[i]), 10, params[i - 1]) || *params[i - 1] == 0) {
+      fprintf(stderr, "usage: %s [<nhogs> [<duration_ms>]]\n", argv[0]);
+      return 1;
+    }
+  }
+  sched_main(bench_main, 0); // never returns
+  return 0;
+}
+
+ASSUME_NONNULL_END
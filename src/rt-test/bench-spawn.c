@@ -0,0 +1,92 @@
+#include <rbase/rbase.h>
+#include <rt/sched.h>
+
+// Spawn benchmark.
+// Spawns short-lived coroutines, nconc at a time, until nspawns have run, like a server that
+// spawns a coroutine per request. Each coroutine touches some of its stack and exits.
+// Reports spawns per second and the process's resident memory size afterwards.
+// Runs with the default stack size and with a few custom stack sizes.
+//
+// usage: co-rt-bench-spawn [<nconc> [<nspawns>]]
+
+ASSUME_NONNULL_BEGIN
+
+static u32 nconc   = 64;
+static u32 nspawns = 1000000;
+
+static Chan* done; // coroutines signal completion
+
+
+// rss_kib returns the resident set size of the process in KiB, or 0 if unknown
+static u64 rss_kib() {
+  u64 rss = 0;
+  #if R_TARGET_OS_LINUX
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f) {
+      unsigned long size, resident;
+      if (fscanf(f, "%lu %lu", &size, &resident) == 2)
+        rss = (u64)resident * mem_pagesize() / 1024;
+      fclose(f);
+    }
+  #endif
+  return rss;
+}
+
+static void worker(uintptr_t stackuse) {
+  // touch stackuse bytes of stack, like a request handler would
+  volatile u8* buf = alloca(stackuse);
+  for (uintptr_t i = 0; i < stackuse; i += 512)
+    buf[i] = (u8)i;
+  chan_send(done, NULL);
+}
+
+static void bench_spawn(size_t stacksize, uintptr_t stackuse) {
+  u64 start = nanotime();
+  u32 nrunning = 0;
+  for (u32 i = 0; i < nspawns; i++) {
+    if (nrunning == nconc) {
+      chan_recv(done, NULL);
+      nrunning--;
+    }
+    if (sched_spawn(worker, stackuse, NULL, stacksize) != 0)
+      panic("sched_spawn: %s", strerror(errno));
+    nrunning++;
+  }
+  for (; nrunning > 0; nrunning--)
+    chan_recv(done, NULL);
+  u64 ns = nanotime() - start;
+
+  double secs = (double)ns / 1e9;
+  char name[32];
+  if (stacksize == 0) {
+    snprintf(name, sizeof(name), "default");
+  } else {
+    snprintf(name, sizeof(name), "%zu KiB", stacksize / 1024);
+  }
+  printf("  %-10s %8.3f s  %10.0f /s  %6.1f ns/op  rss %llu KiB\n",
+    name, secs, (double)nspawns / secs, (double)ns / (double)nspawns, rss_kib());
+}
+
+static void bench_main(uintptr_t _) {
+  done = chan_new(0, nconc);
+  printf("spawn: %u coroutines, %u at a time\n", nspawns, nconc);
+  bench_spawn(0, 16*1024);
+  bench_spawn(16*1024, 4*1024);
+  bench_spawn(100*1024, 16*1024);
+  bench_spawn(512*1024, 64*1024);
+  // returning from the main coroutine ends the program
+}
+
+int main(int argc, const char** argv) {
+  u32* params[] = { &nconc, &nspawns };
+  for (int i = 1; i < argc && i <= (int)countof(params); i++) {
+    if (!parseu32(argv[i], strlen(argv[i]), 10, params[i - 1]) || *params[i - 1] == 0) {
+      fprintf(stderr, "usage: %s [<nconc> [<nspawns>]]\n", argv[0]);
+      return 1;
+    }
+  }
+  sched_main(bench_main, 0); // never returns
+  return 0;
+}
+
+ASSUME_NONNULL_END
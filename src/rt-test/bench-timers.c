@@ -0,0 +1,134 @@
+#include <rbase/rbase.h>
+#include <rt/sched.h>
+
+// Timer benchmark.
+// 1. Arm and cancel: ncoroutines coroutines each keep a window of 1000 pending timeouts
+//    (like requests in flight), arming a new timer and cancelling the oldest one nops times.
+//    Reports arm+cancel pairs per second.
+// 2. Sleep: ncoroutines coroutines each sleep 10 times for 1-10 ms.
+//    Reports how much later than requested the coroutines woke up.
+//
+// usage: co-rt-bench-timers [<ncoroutines> [<nops>]]
+
+ASSUME_NONNULL_BEGIN
+
+#define WINDOW  1000 // pending timers per coroutine
+#define NSLEEPS 10   // sleeps per coroutine
+
+static u32 ncoroutines = 1000;
+static u32 nops        = 10000; // arm+cancel pairs per coroutine
+
+static atomic_u32 ndone;
+static int        donefd[2]; // pipe written to by the last coroutine to finish
+static PollDesc*  donepd;
+static u64*       latencies; // oversleep in nanoseconds
+static atomic_u32 nlatencies;
+
+
+static void timeout_fired(uintptr_t arg, uintptr_t seq) {
+  panic("timer fired");
+}
+
+static void finish() {
+  if (AtomicAdd(&ndone, 1) + 1 == ncoroutines) {
+    if (write(donefd[1], "", 1) != 1)
+      panic("write: %s", strerror(errno));
+  }
+}
+
+static void wait_all() {
+  u8 b;
+  if (t_read(donepd, &b, 1) != 1)
+    panic("read: %s", strerror(errno));
+  AtomicStore(&ndone, 0);
+}
+
+static void armcancel(uintptr_t _) {
+  Timer* timers = memalloc(MemLibC(), sizeof(Timer) * WINDOW);
+  memset(timers, 0, sizeof(Timer) * WINDOW);
+  i64 timeout = 30 * 1000000000ll; // never expires during the benchmark
+  for (u32 i = 0; i < nops; i++) {
+    Timer* t = &timers[i % WINDOW];
+    if (i >= WINDOW && !timer_stop(t))
+      panic("timer_stop: timer not active");
+    t->f = timeout_fired;
+    timer_start(t, (i64)nanotime() + timeout);
+    if ((i & 0xff) == 0)
+      t_yield();
+  }
+  for (u32 i = 0; i < MIN(nops, WINDOW); i++)
+    timer_stop(&timers[i]);
+  memfree(MemLibC(), timers);
+  finish();
+}
+
+static void sleeper(uintptr_t id) {
+  u32 r = (u32)id * 2654435761u;
+  for (u32 i = 0; i < NSLEEPS; i++) {
+    r = r * 1103515245 + 12345;
+    u64 d = (1 + (r >> 16) % 10) * 1000000; // 1-10 ms
+    u64 start = nanotime();
+    t_sleep(d);
+    latencies[AtomicAdd(&nlatencies, 1)] = nanotime() - start - d;
+  }
+  finish();
+}
+
+static int cmp_u64(const void* a, const void* b) {
+  u64 x = *(const u64*)a;
+  u64 y = *(const u64*)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static void print_latency(const char* name, u64 ns) {
+  printf("  %-6s %8.1f us\n", name, (double)ns / 1000.0);
+}
+
+static void bench_main(uintptr_t _) {
+  if (pipe(donefd) != 0)
+    panic("pipe: %s", strerror(errno));
+  donepd = sched_pollopen(donefd[0]);
+  if (!donepd)
+    panic("sched_pollopen: %s", strerror(errno));
+
+  printf("arm+cancel: %u coroutines x %u timers, %u pending per coroutine\n",
+    ncoroutines, nops, WINDOW);
+  u64 start = nanotime();
+  for (u32 i = 0; i < ncoroutines; i++) {
+    if (sched_spawn(armcancel, 0, NULL, 0) != 0)
+      panic("sched_spawn: %s", strerror(errno));
+  }
+  wait_all();
+  double secs = (double)(nanotime() - start) / 1e9;
+  printf("  time   %8.3f s\n", secs);
+  printf("  ops/s  %8.0f\n", (double)ncoroutines * (double)nops / secs);
+
+  printf("sleep: %u coroutines x %u sleeps of 1-10 ms\n", ncoroutines, NSLEEPS);
+  latencies = memalloc(MemLibC(), sizeof(u64) * ncoroutines * NSLEEPS);
+  for (u32 i = 0; i < ncoroutines; i++) {
+    if (sched_spawn(sleeper, i, NULL, 0) != 0)
+      panic("sched_spawn: %s", strerror(errno));
+  }
+  wait_all();
+  u32 nlat = AtomicLoad(&nlatencies);
+  qsort(latencies, nlat, sizeof(u64), cmp_u64);
+  printf("  oversleep:\n");
+  print_latency("p50", latencies[nlat / 2]);
+  print_latency("p99", latencies[(u32)((u64)nlat * 99 / 100)]);
+  print_latency("max", latencies[nlat - 1]);
+  // returning from the main coroutine ends the program
+}
+
+int main(int argc, const char** argv) {
+  u32* params[] = { &ncoroutines, &nops };
+  for (int i = 1; i < argc && i <= (int)countof(params); i++) {
+    if (!parseu32(argv[i], strlen(argv[i]), 10, params[i - 1]) || *params[i - 1] == 0) {
+      fprintf(stderr, "usage: %s [<ncoroutines> [<nops>]]\n", argv[0]);
+      return 1;
+    }
+  }
+  sched_main(bench_main, 0); // never returns
+  return 0;
+}
+
+ASSUME_NONNULL_END
@@ -0,0 +1,383 @@
+#include <rbase/rbase.h>
+#include <rt/sched.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Channel tests.
+// Tests handoff on unbuffered channels, the buffered fast path and the locked fallback taken
+// when the buffer is full or a coroutine is parked, chan_close, and chan_select.
+// Operations which must panic are run in a child process each, which must die from abort.
+//
+// usage: co-rt-chan-test
+
+ASSUME_NONNULL_BEGIN
+
+#define check(cond) if (!(cond)) panic("check failed: %s", #cond)
+
+static Chan* done; // spawned coroutines signal completion
+
+static void done_send() {
+  u8 b = 0;
+  chan_send(done, &b);
+}
+
+static void done_wait(u32 n) {
+  for (u32 i = 0; i < n; i++)
+    check(chan_recv(done, NULL));
+}
+
+// park gives coroutines which are about to park on a channel time to do so.
+// Results must not depend on it; it only makes it likely that the parking paths are taken.
+static void park() {
+  t_sleep(5000000); // 5ms
+}
+
+
+// ---- unbuffered channel
+
+static Chan*      hc;
+static atomic_u32 hsent;
+
+static void handoff_sender(uintptr_t n) {
+  for (u64 i = 0; i < n; i++)
+    chan_send(hc, &i);
+  AtomicStore(&hsent, 1);
+  done_send();
+}
+
+static void test_handoff() {
+  hc = chan_new(sizeof(u64), 0);
+  u64 v = 1;
+  bool ok;
+
+  // nothing can be sent or received without a coroutine on the other end
+  check(!chan_trysend(hc, &v));
+  check(!chan_tryrecv(hc, &v, &ok));
+  check(chan_len(hc) == 0 && chan_cap(hc) == 0);
+
+  // a sender stays parked until a receiver has taken its value
+  AtomicStore(&hsent, 0);
+  t_spawn(handoff_sender, 1);
+  park();
+  check(AtomicLoad(&hsent) == 0);
+  check(chan_len(hc) == 0);
+  check(chan_recv(hc, &v) && v == 0);
+  done_wait(1);
+  check(AtomicLoad(&hsent) == 1);
+
+  // a parked sender can be received from without parking
+  t_spawn(handoff_sender, 1);
+  park();
+  v = 99;
+  check(chan_tryrecv(hc, &v, &ok) && ok && v == 0);
+  done_wait(1);
+
+  // values are handed off in order
+  u32 n = 10000;
+  t_spawn(handoff_sender, n);
+  for (u64 i = 0; i < n; i++)
+    check(chan_recv(hc, &v) && v == i);
+  done_wait(1);
+
+  chan_free(hc);
+  printf("  handoff ok\n");
+}
+
+
+// ---- buffered channel
+
+static Chan* bc;
+
+static void buf_sender(uintptr_t start) {
+  for (u64 i = start; i < start + 4; i++)
+    chan_send(bc, &i);
+  done_send();
+}
+
+static void buf_producer(uintptr_t n) {
+  for (u64 i = 0; i < n; i++)
+    chan_send(bc, &i);
+  done_send();
+}
+
+static void test_buffered() {
+  bc = chan_new(sizeof(u64), 4);
+  u64 v;
+  bool ok;
+
+  // fill the buffer without parking (fast path)
+  for (u64 i = 0; i < 4; i++)
+    check(chan_trysend(bc, &i));
+  check(chan_len(bc) == 4 && chan_cap(bc) == 4);
+  v = 4;
+  check(!chan_trysend(bc, &v));
+
+  // a sender parks while the buffer is full (locked path.) Receiving from a full buffer with a
+  // parked sender takes the value at the head and moves the sender's value to the tail.
+  t_spawn(buf_sender, 4);
+  park();
+  check(chan_len(bc) == 4);
+  for (u64 i = 0; i < 8; i++)
+    check(chan_recv(bc, &v) && v == i);
+  done_wait(1);
+  check(chan_len(bc) == 0);
+  check(!chan_tryrecv(bc, &v, &ok));
+
+  // a receiver parks while the buffer is empty and is handed the next value directly
+  t_spawn(buf_producer, 1);
+  check(chan_recv(bc, &v) && v == 0);
+  done_wait(1);
+
+  // values stay in order when the fast path races with parked senders and receivers
+  u32 n = 100000;
+  t_spawn(buf_producer, n);
+  for (u64 i = 0; i < n; i++) {
+    if ((i & 0xff) == 0)
+      park();
+    check(chan_recv(bc, &v) && v == i);
+  }
+  done_wait(1);
+
+  chan_free(bc);
+  printf("  buffered ok\n");
+}
+
+
+// ---- close
+
+static Chan*      cc;
+static atomic_u32 nclosewoken;
+
+static void close_receiver(uintptr_t _) {
+  u64 v = 123;
+  check(!chan_recv(cc, &v));
+  check(v == 0);
+  AtomicAdd(&nclosewoken, 1);
+  done_send();
+}
+
+static void close_selector(uintptr_t _) {
+  u64 v = 123;
+  bool ok = true;
+  ChanCase cases[2] = { { .c = NULL }, { .c = cc, .elem = &v } };
+  check(chan_select(cases, 2, true, &ok) == 1);
+  check(!ok && v == 0);
+  AtomicAdd(&nclosewoken, 1);
+  done_send();
+}
+
+static void test_close(u32 cap) {
+  cc = chan_new(sizeof(u64), cap);
+  u64 v;
+  bool ok;
+
+  // chan_close wakes every parked receiver, which receives a zero value
+  u32 n = 16;
+  AtomicStore(&nclosewoken, 0);
+  for (u32 i = 0; i < n; i++)
+    t_spawn((i & 1) ? close_selector : close_receiver, 0);
+  park();
+  check(AtomicLoad(&nclosewoken) == 0);
+  chan_close(cc);
+  done_wait(n);
+  check(AtomicLoad(&nclosewoken) == n);
+
+  // after close, receiving never parks and yields zero values
+  v = 123;
+  check(!chan_recv(cc, &v) && v == 0);
+  v = 123;
+  check(chan_tryrecv(cc, &v, &ok) && !ok && v == 0);
+  check(!chan_recv(cc, NULL));
+  chan_free(cc);
+
+  // values buffered before close are received before the zero values
+  if (cap > 0) {
+    cc = chan_new(sizeof(u64), cap);
+    for (u64 i = 0; i < cap; i++)
+      chan_send(cc, &i);
+    chan_close(cc);
+    for (u64 i = 0; i < cap; i++)
+      check(chan_recv(cc, &v) && v == i);
+    v = 123;
+    check(!chan_recv(cc, &v) && v == 0);
+    chan_free(cc);
+  }
+
+  printf("  close cap=%u ok\n", cap);
+}
+
+
+// ---- select
+
+static Chan* sc[3];
+
+static void select_sender(uintptr_t i) {
+  u64 v = 100 + i;
+  chan_send(sc[i], &v);
+  done_send();
+}
+
+static void test_select() {
+  for (u32 i = 0; i < 3; i++)
+    sc[i] = chan_new(sizeof(u64), i); // caps 0, 1 and 2
+  u64 v[3] = {0};
+  u64 sv = 7;
+  bool ok;
+  ChanCase cases[3];
+  for (u32 i = 0; i < 3; i++)
+    cases[i] = (ChanCase){ .c = sc[i], .elem = &v[i] };
+
+  // default case: returns -1 if no case can proceed
+  check(chan_select(cases, 3, false, &ok) == -1);
+  check(chan_select(NULL, 0, false, NULL) == -1);
+  ChanCase nullcases[2] = { { .c = NULL }, { .c = NULL, .send = true } };
+  check(chan_select(nullcases, 2, false, NULL) == -1);
+  ChanCase sendcase = { .c = sc[1], .elem = &sv, .send = true };
+  check(chan_select(&sendcase, 1, false, NULL) == 0);
+  check(chan_select(&sendcase, 1, false, NULL) == -1); // buffer is full
+  check(chan_select(cases, 3, false, &ok) == 1 && ok && v[1] == 7);
+
+  // several ready cases: each one is chosen at random
+  u32 nchosen[3] = {0};
+  u32 n = 3000;
+  for (u32 i = 0; i < n; i++) {
+    for (u32 j = 1; j < 3; j++) {
+      if (chan_len(sc[j]) == 0)
+        check(chan_trysend(sc[j], &sv));
+    }
+    int k = chan_select(&cases[1], 2, false, &ok);
+    check(k == 0 || k == 1);
+    check(ok && v[1 + k] == 7);
+    nchosen[k]++;
+  }
+  for (u32 j = 0; j < 2; j++) {
+    if (nchosen[j] < n / 4)
+      panic("select case %u chosen only %u of %u times", j, nchosen[j], n);
+    chan_tryrecv(sc[1 + j], NULL, NULL);
+  }
+
+  // blocking select is woken by a send on any of its channels and leaves no waiters behind
+  // on the others (a trysend on them fails since no receiver is parked.)
+  for (u32 i = 0; i < 3; i++) {
+    memset(v, 0, sizeof(v));
+    t_spawn(select_sender, i);
+    check(chan_select(cases, 3, true, &ok) == (int)i);
+    check(ok && v[i] == 100 + i);
+    done_wait(1);
+    check(!chan_trysend(sc[0], &sv));
+  }
+
+  // a closed channel is always ready to receive from
+  chan_close(sc[2]);
+  for (u32 i = 0; i < 100; i++) {
+    v[2] = 123;
+    check(chan_select(cases, 3, true, &ok) == 2);
+    check(!ok && v[2] == 0);
+  }
+  // ... and is chosen at random among other ready cases
+  memset(nchosen, 0, sizeof(nchosen));
+  for (u32 i = 0; i < n; i++) {
+    if (chan_len(sc[1]) == 0)
+      check(chan_trysend(sc[1], &sv));
+    int k = chan_select(cases, 3, false, &ok);
+    check(k == 1 || k == 2);
+    check(ok == (k == 1));
+    nchosen[k]++;
+  }
+  if (nchosen[1] < n / 4 || nchosen[2] < n / 4)
+    panic("select cases chosen %u and %u of %u times", nchosen[1], nchosen[2], n);
+
+  for (u32 i = 0; i < 3; i++)
+    chan_free(sc[i]);
+  printf("  select ok\n");
+}
+
+
+// ---- operations which must panic
+
+static Chan* pc;
+
+static void panic_sender(uintptr_t _) {
+  u64 v = 1;
+  chan_send(pc, &v);
+}
+
+static void panic_send_closed(uintptr_t _) {
+  pc = chan_new(sizeof(u64), 1);
+  chan_close(pc);
+  u64 v = 1;
+  chan_send(pc, &v);
+}
+
+static void panic_close_closed(uintptr_t _) {
+  pc = chan_new(sizeof(u64), 1);
+  chan_close(pc);
+  chan_close(pc);
+}
+
+static void panic_select_send_closed(uintptr_t _) {
+  pc = chan_new(sizeof(u64), 1);
+  chan_close(pc);
+  u64 v = 1;
+  ChanCase cases[1] = { { .c = pc, .elem = &v, .send = true } };
+  chan_select(cases, 1, true, NULL);
+}
+
+static void panic_close_parked_senders(uintptr_t _) {
+  // senders parked on a channel being closed are woken up and panic
+  pc = chan_new(sizeof(u64), 0);
+  for (u32 i = 0; i < 4; i++)
+    t_spawn(panic_sender, 0);
+  park();
+  chan_close(pc);
+  t_sleep(1000000000); // 1s; must not get here
+}
+
+// expect_panic runs fn as the main coroutine of a child process, which must panic
+static void expect_panic(const char* name, EntryFun fn) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1)
+    panic("fork: %s", strerror(errno));
+  if (pid == 0) {
+    // child: silence the expected panic message
+    int fd = open("/dev/null", O_WRONLY);
+    if (fd != -1)
+      dup2(fd, STDERR_FILENO);
+    sched_main(fn, 0); // returns (exits) only if fn did not panic
+  }
+  int status;
+  if (waitpid(pid, &status, 0) == -1)
+    panic("waitpid: %s", strerror(errno));
+  if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGABRT)
+    panic("%s: expected panic", name);
+  printf("  %s panics ok\n", name);
+}
+
+
+static void main_co(uintptr_t _) {
+  done = chan_new(1, 0);
+  test_handoff();
+  test_buffered();
+  test_close(0);
+  test_close(4);
+  test_select();
+  chan_free(done);
+  printf("chan-test: OK\n");
+  // returning from the main coroutine ends the program
+}
+
+int main(int argc, const char** argv) {
+  setvbuf(stdout, NULL, _IONBF, 0);
+  // run these before sched_main, while this is the only thread of the process
+  expect_panic("send on closed channel", panic_send_closed);
+  expect_panic("close of closed channel", panic_close_closed);
+  expect_panic("select send on closed channel", panic_select_send_closed);
+  expect_panic("close with parked senders", panic_close_parked_senders);
+  sched_main(main_co, 0); // never returns
+  return 0;
+}
+
+ASSUME_NONNULL_END
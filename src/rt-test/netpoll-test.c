@@ -0,0 +1,332 @@
+#include <rbase/rbase.h>
+#include <rt/sched.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Network poller tests.
+// Tests that coroutines doing I/O park until their file descriptor is ready for reading or
+// writing, read deadlines, t_connect, waking up parked coroutines with sched_pollunblock
+// before closing, and reuse of closed PollDescs. Runs once with a single P in a child process
+// and then with the default number of P's.
+//
+// usage: co-rt-netpoll-test
+
+ASSUME_NONNULL_BEGIN
+
+#define check(cond) if (!(cond)) panic("check failed: %s", #cond)
+
+#define MS 1000000ll // nanoseconds per millisecond
+
+static Chan* done; // spawned coroutines signal completion
+
+static void done_send() {
+  u8 b = 0;
+  chan_send(done, &b);
+}
+
+static void done_wait(u32 n) {
+  for (u32 i = 0; i < n; i++)
+    check(chan_recv(done, NULL));
+}
+
+// park gives coroutines which are about to park in the poller time to do so.
+// Results must not depend on it; it only makes it likely that the parking paths are taken.
+static void park() {
+  t_sleep(5*MS);
+}
+
+typedef struct Pair {
+  int       fd[2];
+  PollDesc* pd[2];
+} Pair;
+
+static Pair pair_open() {
+  Pair p;
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, p.fd) != 0)
+    panic("socketpair: %s", strerror(errno));
+  for (u32 i = 0; i < 2; i++) {
+    p.pd[i] = sched_pollopen(p.fd[i]);
+    if (!p.pd[i])
+      panic("sched_pollopen: %s", strerror(errno));
+  }
+  return p;
+}
+
+static void pair_close(Pair* p) {
+  for (u32 i = 0; i < 2; i++) {
+    sched_pollclose(p->pd[i]);
+    close(p->fd[i]);
+  }
+}
+
+
+// ---- readiness
+
+static Pair       rp;
+static atomic_u32 rdone;
+
+static void ready_reader(uintptr_t _) {
+  char buf[16];
+  check(t_read(rp.pd[0], buf, sizeof(buf)) == 5);
+  check(memcmp(buf, "hello", 5) == 0);
+  AtomicStore(&rdone, 1);
+  done_send();
+}
+
+#define WSIZE (4*1024*1024) // much larger than a socket buffer
+
+static u8* wbuf;
+
+static void ready_writer(uintptr_t _) {
+  check(t_write(rp.pd[1], wbuf, WSIZE) == WSIZE);
+  AtomicStore(&rdone, 1);
+  done_send();
+}
+
+static void test_readiness() {
+  rp = pair_open();
+
+  // a reader stays parked until there's something to read
+  AtomicStore(&rdone, 0);
+  t_spawn(ready_reader, 0);
+  park();
+  check(AtomicLoad(&rdone) == 0);
+  check(t_write(rp.pd[1], "hello", 5) == 5);
+  done_wait(1);
+
+  // a writer stays parked while the socket buffer is full and resumes as it drains
+  wbuf = memalloc(MemLibC(), WSIZE);
+  for (u32 i = 0; i < WSIZE; i++)
+    wbuf[i] = (u8)(i * 7);
+  AtomicStore(&rdone, 0);
+  t_spawn(ready_writer, 0);
+  park();
+  check(AtomicLoad(&rdone) == 0);
+  u8 buf[4096];
+  size_t nr = 0;
+  while (nr < WSIZE) {
+    ssize_t n = t_read(rp.pd[0], buf, sizeof(buf));
+    check(n > 0);
+    for (ssize_t i = 0; i < n; i++) {
+      if (buf[i] != (u8)((nr + (size_t)i) * 7))
+        panic("wrong byte at offset %zu", nr + (size_t)i);
+    }
+    nr += (size_t)n;
+  }
+  done_wait(1);
+  memfree(MemLibC(), wbuf);
+
+  pair_close(&rp);
+  printf("  readiness ok\n");
+}
+
+
+// ---- many connections at once (exercises the poller from several P's)
+
+#define NPAIRS 64
+#define NPINGS 500
+
+static Pair ppairs[NPAIRS];
+
+static void pinger(uintptr_t i) {
+  PollDesc* pd = ppairs[i].pd[0];
+  for (u32 n = 0; n < NPINGS; n++) {
+    u32 v = n, r;
+    check(t_write(pd, &v, sizeof(v)) == sizeof(v));
+    check(t_read(pd, &r, sizeof(r)) == sizeof(r));
+    check(r == n + 1);
+  }
+  done_send();
+}
+
+static void ponger(uintptr_t i) {
+  PollDesc* pd = ppairs[i].pd[1];
+  for (u32 n = 0; n < NPINGS; n++) {
+    u32 v;
+    check(t_read(pd, &v, sizeof(v)) == sizeof(v));
+    check(v == n);
+    v++;
+    check(t_write(pd, &v, sizeof(v)) == sizeof(v));
+  }
+  done_send();
+}
+
+static void test_pingpong() {
+  for (u32 i = 0; i < NPAIRS; i++)
+    ppairs[i] = pair_open();
+  for (u32 i = 0; i < NPAIRS; i++) {
+    t_spawn(ponger, i);
+    t_spawn(pinger, i);
+  }
+  done_wait(NPAIRS*2);
+  for (u32 i = 0; i < NPAIRS; i++)
+    pair_close(&ppairs[i]);
+  printf("  ping-pong ok\n");
+}
+
+
+// ---- read deadline
+
+static void test_deadline() {
+  Pair p = pair_open();
+  char buf[16];
+  i64 now = (i64)nanotime();
+  check(sched_pollsetdeadline(p.pd[0], (u64)(now + 10*MS), 'r') == 0);
+  check(t_read(p.pd[0], buf, sizeof(buf)) == -1 && t_errno() == ETIMEDOUT);
+  check((i64)nanotime() >= now + 10*MS);
+  // the write side is not affected
+  check(t_write(p.pd[0], "x", 1) == 1);
+  check(t_read(p.pd[1], buf, sizeof(buf)) == 1);
+  pair_close(&p);
+  printf("  deadline ok\n");
+}
+
+
+// ---- t_connect
+
+static void test_connect() {
+  int lnfd = socket(AF_INET, SOCK_STREAM, 0);
+  check(lnfd != -1);
+  struct sockaddr_in addr = { .sin_family = AF_INET };
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addrlen = sizeof(addr);
+  if (bind(lnfd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(lnfd, 16) != 0 ||
+      getsockname(lnfd, (struct sockaddr*)&addr, &addrlen) != 0)
+  {
+    panic("listen: %s", strerror(errno));
+  }
+
+  // connecting to a listening socket succeeds
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  PollDesc* pd = sched_pollopen(fd);
+  check(pd != NULL);
+  check(t_connect(pd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+  sched_pollclose(pd);
+  close(fd);
+
+  // connecting to a port which nothing listens on fails with ECONNREFUSED, either right away
+  // or after parking
+  close(lnfd);
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  pd = sched_pollopen(fd);
+  check(pd != NULL);
+  check(t_connect(pd, (struct sockaddr*)&addr, sizeof(addr)) == -1);
+  check(t_errno() == ECONNREFUSED);
+  sched_pollclose(pd);
+  close(fd);
+  printf("  connect ok\n");
+}
+
+
+// ---- closing with parked coroutines
+
+static Pair       up;
+static atomic_u32 nunblocked;
+
+static void unblock_reader(uintptr_t _) {
+  char buf[16];
+  check(t_read(up.pd[0], buf, sizeof(buf)) == -1 && t_errno() == EBADF);
+  AtomicAdd(&nunblocked, 1);
+  done_send();
+}
+
+static void unblock_writer(uintptr_t _) {
+  u8 buf[4096] = {0};
+  ssize_t n;
+  while ((n = t_write(up.pd[0], buf, sizeof(buf))) > 0) {}
+  check(n == -1 && t_errno() == EBADF);
+  AtomicAdd(&nunblocked, 1);
+  done_send();
+}
+
+static void test_unblock() {
+  up = pair_open();
+  AtomicStore(&nunblocked, 0);
+  t_spawn(unblock_reader, 0);
+  t_spawn(unblock_writer, 0);
+  park();
+  check(AtomicLoad(&nunblocked) == 0);
+
+  // sched_pollunblock wakes up the reader and the writer, which is parked on a full buffer
+  sched_pollunblock(up.pd[0]);
+  done_wait(2);
+  check(AtomicLoad(&nunblocked) == 2);
+
+  // new I/O and deadlines fail right away
+  char buf[16];
+  check(t_read(up.pd[0], buf, sizeof(buf)) == -1 && t_errno() == EBADF);
+  check(sched_pollsetdeadline(up.pd[0], nanotime() + 10*MS, 'r') == -1 && errno == EBADF);
+
+  pair_close(&up);
+  printf("  unblock ok\n");
+}
+
+
+// ---- reuse of closed PollDescs
+
+static void test_reuse() {
+  // A closed PollDesc is reused by the next sched_pollopen. Readiness of its previous fd
+  // does not carry over to the new one.
+  Pair p = pair_open();
+  check(t_write(p.pd[1], "x", 1) == 1);
+  park(); // let the poller see p.fd[0] as readable
+  PollDesc* oldpd = p.pd[0];
+  sched_pollclose(p.pd[0]);
+  close(p.fd[0]);
+
+  Pair q = pair_open();
+  check(q.pd[0] == oldpd || q.pd[1] == oldpd);
+  PollDesc* pd = q.pd[0] == oldpd ? q.pd[0] : q.pd[1];
+  PollDesc* peer = q.pd[0] == oldpd ? q.pd[1] : q.pd[0];
+  i64 now = (i64)nanotime();
+  check(sched_pollsetdeadline(pd, (u64)(now + 10*MS), 'r') == 0);
+  char buf[16];
+  check(t_read(pd, buf, sizeof(buf)) == -1 && t_errno() == ETIMEDOUT);
+  check(sched_pollsetdeadline(pd, 0, 'r') == 0);
+  check(t_write(peer, "y", 1) == 1);
+  check(t_read(pd, buf, sizeof(buf)) == 1 && buf[0] == 'y');
+
+  sched_pollclose(p.pd[1]);
+  close(p.fd[1]);
+  pair_close(&q);
+  printf("  reuse ok\n");
+}
+
+
+static void main_co(uintptr_t _) {
+  done = chan_new(1, 0);
+  test_readiness();
+  test_pingpong();
+  test_deadline();
+  test_connect();
+  test_unblock();
+  test_reuse();
+  chan_free(done);
+  printf("netpoll-test: OK\n");
+  // returning from the main coroutine ends the program
+}
+
+int main(int argc, const char** argv) {
+  setvbuf(stdout, NULL, _IONBF, 0);
+  // run with a single P in a child process, before sched_main while this is the only thread
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1)
+    panic("fork: %s", strerror(errno));
+  if (pid == 0) {
+    setenv("COMAXPROCS", "1", 1);
+    sched_main(main_co, 0); // exits when main_co returns
+  }
+  int status;
+  if (waitpid(pid, &status, 0) == -1)
+    panic("waitpid: %s", strerror(errno));
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    panic("netpoll-test with a single P failed");
+  sched_main(main_co, 0); // never returns
+  return 0;
+}
+
+ASSUME_NONNULL_END
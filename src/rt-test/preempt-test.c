@@ -0,0 +1,103 @@
+#include <rbase/rbase.h>
+#include <rt/sched.h>
+
+// Preemption stress test.
+// Hog coroutines run a CPU-bound loop which never calls into the scheduler, so that sysmon
+// keeps preempting them. Meanwhile a few chains of short-lived coroutines run, where each
+// coroutine spawns the next one and exits. The next one runs in the same time slice (runnext),
+// so a P running a chain looks busy to sysmon and is preempted too, at any point, including
+// while the scheduler switches to a new coroutine. Fails (crashes or panics) if a coroutine is
+// resumed in a bad state, if a coroutine is lost or if the hogs are not preempted.
+//
+// usage: co-rt-preempt-test [<duration_ms>]
+
+ASSUME_NONNULL_BEGIN
+
+#define NCHAINS 4
+
+static u32 duration_ms = 1000;
+
+static i64        deadline;  // when hogs and chains stop
+static atomic_u32 nhogsdone;
+static atomic_u32 nchainsdone;
+static atomic_u64 nstarted;  // chain coroutines started
+static atomic_u64 nfinished; // chain coroutines finished
+static atomic_u64 nspawned;  // chain coroutines spawned
+
+
+static void hog(uintptr_t id) {
+  u64 x = id + 1;
+  while ((i64)nanotime() < deadline) {
+    for (u32 i = 0; i < 1000; i++)
+      x = x * 6364136223846793005ull + 1442695040888963407ull;
+  }
+  if (x == 0) // use x so the loop isn't optimized away
+    dlog("x=0");
+  AtomicAdd(&nhogsdone, 1);
+}
+
+static void chainlink(uintptr_t n) {
+  AtomicAdd(&nstarted, 1);
+  // do a little work with values in callee-saved registers, which are restored by exectx
+  u64 a = n, b = n * 3, c = n * 7;
+  for (u32 i = 0; i < (n & 63); i++) {
+    a = a * 31 + b;
+    b = b ^ (c >> 3);
+    c = c + a;
+  }
+  if (a + b + c == 1)
+    dlog("unlikely");
+  if ((i64)nanotime() < deadline) {
+    // every fourth coroutine has a small custom stack
+    size_t stacksize = (n & 3) == 0 ? 16*1024 : 0;
+    if (sched_spawn(chainlink, (uintptr_t)n + NCHAINS, NULL, stacksize) != 0)
+      panic("sched_spawn: %s", strerror(errno));
+    AtomicAdd(&nspawned, 1);
+  } else {
+    AtomicAdd(&nchainsdone, 1);
+  }
+  AtomicAdd(&nfinished, 1);
+}
+
+static void main_co(uintptr_t _) {
+  // more hogs than P's, so that the chains only get to run when a hog is preempted
+  u32 nhogs = os_ncpu() * 2;
+  deadline = (i64)nanotime() + (i64)duration_ms * 1000000;
+  for (u32 i = 0; i < nhogs; i++)
+    t_spawn(hog, i);
+  for (u32 i = 0; i < NCHAINS; i++)
+    t_spawn(chainlink, i);
+  AtomicAdd(&nspawned, NCHAINS);
+
+  while (AtomicLoad(&nhogsdone) < nhogs || AtomicLoad(&nchainsdone) < NCHAINS)
+    t_sleep(10000000); // 10ms
+
+  u64 n = AtomicLoad(&nspawned);
+  if (AtomicLoad(&nstarted) != n || AtomicLoad(&nfinished) != n) {
+    panic("spawned %llu coroutines but %llu started and %llu finished",
+      n, AtomicLoad(&nstarted), AtomicLoad(&nfinished));
+  }
+  // the hogs occupy all P's, so the chains only made progress if they were preempted
+  if (n < 1000)
+    panic("only %llu coroutines spawned; hogs not preempted?", n);
+  printf("preempt-test: OK (%u hogs, %llu coroutines spawned)\n", nhogs, n);
+  // returning from the main coroutine ends the program
+}
+
+int main(int argc, const char** argv) {
+  if (argc > 1 &&
+      (!parseu32(argv[1], strlen(argv[1]), 10, &duration_ms) || duration_ms == 0))
+  {
+    fprintf(stderr, "usage: %s [<duration_ms>]\n", argv[0]);
+    return 1;
+  }
+  const char* preemptoff = getenv("COASYNCPREEMPTOFF");
+  if (preemptoff && strcmp(preemptoff, "1") == 0) {
+    fprintf(stderr, "preempt-test: unset COASYNCPREEMPTOFF to run this test\n");
+    return 1;
+  }
+  sched_main(main_co, 0); // never returns
+  return 0;
+}
+
+ASSUME_NONNULL_END
@@ -60,6 +60,11 @@ static void fn1(uintptr_t arg1) {
   t_yield();
   dlog(GREEN "back from yield");
 
+  // the program ends when this coroutine returns; give the others time to finish
+  dlog(GREEN "calling t_sleep(10ms)");
+  t_sleep(10000000);
+  dlog(GREEN "back from sleep");
+
   dlog(GREEN "EXIT");
 }
 
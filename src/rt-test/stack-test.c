@@ -0,0 +1,186 @@
+#include <rbase/rbase.h>
+#include <rt/schedimpl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+// Stack cache tests.
+// Tests that the stack of a dead coroutine is reused for a new coroutine with a stack of the
+// same size class, that stacks which are not of a size class are freed, that the caches of
+// dead T's stay within their limits and that stacks released to the OS work when reused.
+// Runs with a single P so that it's known which stacks are reused.
+//
+// usage: co-rt-stack-test
+
+ASSUME_NONNULL_BEGIN
+
+#define check(cond) if (!(cond)) panic("check failed: %s", #cond)
+
+#define KiB ((size_t)1024)
+#define MiB ((size_t)1024*1024)
+
+static Chan* done; // coroutines signal that they have started or are about to exit
+
+static void done_send() {
+  u8 b = 0;
+  chan_send(done, &b);
+}
+
+static void done_wait(u32 n) {
+  for (u32 i = 0; i < n; i++)
+    check(chan_recv(done, NULL));
+}
+
+// ismapped returns true if the page at addr is mapped
+static bool ismapped(uintptr_t addr) {
+  uintptr_t page = addr & ~(uintptr_t)(mem_pagesize() - 1);
+  return msync((void*)page, mem_pagesize(), MS_ASYNC) == 0;
+}
+
+static StackCacheStats stats() {
+  StackCacheStats st;
+  sched_stackcachestats(&st);
+  return st;
+}
+
+// spawn spawns fn with a stack of stacksize bytes
+static void spawn(EntryFun fn, uintptr_t arg, size_t stacksize) {
+  if (sched_spawn(fn, arg, NULL, stacksize) != 0)
+    panic("sched_spawn: %s", strerror(errno));
+}
+
+
+// ---- size classes
+
+static uintptr_t probeaddr; // address of probe's stack frame
+
+static void probe(uintptr_t _) {
+  volatile u8 buf[1024];
+  buf[0] = 1;
+  probeaddr = (uintptr_t)&buf[0];
+  // With a single P, the receiver runs after this coroutine has exited
+  done_send();
+}
+
+// run_probe runs probe with a stack of stacksize bytes and returns the address of its frame
+static uintptr_t run_probe(size_t stacksize) {
+  spawn(probe, 0, stacksize);
+  done_wait(1);
+  return probeaddr;
+}
+
+static void test_sizeclass() {
+  // 100 KiB and 120 KiB both round up to the 128 KiB class; the second coroutine gets the
+  // stack of the first one, which stays mapped in between
+  size_t pbytes = stats().pbytes;
+  uintptr_t addr1 = run_probe(100*KiB);
+  check(ismapped(addr1));
+  check(stats().pbytes == pbytes + 128*KiB);
+  uintptr_t addr2 = run_probe(120*KiB);
+  check(addr2 == addr1);
+  check(stats().pbytes == pbytes + 128*KiB);
+
+  // a stack of a different class is not reused for it
+  uintptr_t addr3 = run_probe(50*KiB);
+  check(addr3 != addr1);
+  check(stats().pbytes == pbytes + 128*KiB + 64*KiB);
+
+  // stacks larger than the largest class are not a power of two and are not cached
+  size_t bigsize = STACK_CLASS_MAX + 100*KiB;
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_max != RLIM_INFINITY &&
+      limit.rlim_max < bigsize + MiB)
+  {
+    printf("  (skipping uncached stack size; RLIMIT_STACK too low)\n");
+  } else {
+    uintptr_t addr = run_probe(bigsize);
+    if (ismapped(addr))
+      panic("stack of %zu bytes was not freed", bigsize);
+    check(stats().pbytes == pbytes + 128*KiB + 64*KiB);
+  }
+
+  printf("  size classes ok\n");
+}
+
+
+// ---- cache limits and released stacks
+
+#define NBATCH 320 // NBATCH * 4 MiB is more than STACK_CACHE_MAX
+
+static Chan*  release; // closed to let batch coroutines exit
+static size_t usesize; // bytes of stack each batch coroutine uses
+
+static void batch_co(uintptr_t id) {
+  // Use stack memory which must keep its contents while the coroutine is parked
+  u8 buf[usesize];
+  for (size_t i = 0; i < usesize; i++)
+    buf[i] = (u8)(id + i);
+  done_send();
+  chan_recv(release, NULL);
+  for (size_t i = 0; i < usesize; i++) {
+    if (buf[i] != (u8)(id + i))
+      panic("stack memory of coroutine %zu changed at %zu", id, i);
+  }
+  done_send();
+}
+
+// run_batch runs NBATCH coroutines with 4 MiB stacks at the same time and waits until they
+// have all exited. Returns the stats of the caches while the coroutines were running.
+static StackCacheStats run_batch(size_t use) {
+  usesize = use;
+  release = chan_new(0, 0);
+  for (u32 i = 0; i < NBATCH; i++)
+    spawn(batch_co, i, 3*MiB); // rounds up to the 4 MiB class
+  done_wait(NBATCH); // all started
+  StackCacheStats st = stats();
+  chan_close(release);
+  done_wait(NBATCH); // all about to exit
+  t_sleep(1000000);  // let them exit
+  chan_free(release);
+  return st;
+}
+
+static void check_limits(StackCacheStats st) {
+  check(st.pbytesmax <= P_TFREE_MAXBYTES);
+  check(st.bytes <= STACK_CACHE_MAX);
+  check(st.dirtybytes <= STACK_CACHE_DIRTY_MAX);
+  check(st.dirtybytes <= st.bytes);
+}
+
+static void test_limits() {
+  run_batch(64*KiB);
+  StackCacheStats st = stats();
+  check_limits(st);
+  // more stacks than the caches can hold exited, so the caches are full and most stacks in the
+  // global cache have been released
+  check(st.pbytes + st.bytes >= STACK_CACHE_MAX);
+  check(st.dirtybytes < st.bytes);
+
+  // A new batch takes all cached stacks, including released ones, which must work just like
+  // fresh ones (see stackreuse.) Only the stacks of test_sizeclass are left in the caches.
+  st = run_batch(256*KiB);
+  check(st.pbytes + st.bytes < 4*MiB);
+  st = stats();
+  check_limits(st);
+  check(st.pbytes + st.bytes >= STACK_CACHE_MAX);
+
+  printf("  cache limits and released stacks ok\n");
+}
+
+
+static void main_co(uintptr_t _) {
+  done = chan_new(1, 0);
+  test_sizeclass();
+  test_limits();
+  chan_free(done);
+  printf("stack-test: OK\n");
+  // returning from the main coroutine ends the program
+}
+
+int main(int argc, const char** argv) {
+  setvbuf(stdout, NULL, _IONBF, 0);
+  setenv("COMAXPROCS", "1", 1);
+  sched_main(main_co, 0); // never returns
+  return 0;
+}
+
+ASSUME_NONNULL_END
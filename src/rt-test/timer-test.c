@@ -0,0 +1,286 @@
+#include <rbase/rbase.h>
+#include <rt/sched.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Timer tests.
+// Tests that timers expire in order of their expiry time (the per-P timer heap), stopping and
+// resetting pending timers, timers of a P which is busy being run by another P, and deadlines
+// of the network poller. Tests which need a certain number of P's run in a child process.
+//
+// usage: co-rt-timer-test
+
+ASSUME_NONNULL_BEGIN
+
+#define check(cond) if (!(cond)) panic("check failed: %s", #cond)
+
+#define MS 1000000ll // nanoseconds per millisecond
+
+static u32 nextrand = 1;
+
+static u32 randn(u32 n) {
+  nextrand = nextrand * 1103515245 + 12345;
+  return (nextrand >> 8) % n;
+}
+
+// wait_until sleeps until *flag is at least n. Panics if that takes longer than timeout.
+static void wait_until(atomic_u32* flag, u32 n, i64 timeout) {
+  i64 deadline = (i64)nanotime() + timeout;
+  while (AtomicLoad(flag) < n) {
+    if ((i64)nanotime() > deadline)
+      panic("timed out waiting (%u < %u)", AtomicLoad(flag), n);
+    t_sleep(1*MS);
+  }
+}
+
+
+// ---- order (runs with a single P, so that timer functions are called one at a time)
+
+#define NTIMERS 2000
+
+static Timer      otimers[NTIMERS];
+static i64        owhen[NTIMERS]; // current expiry time of otimers[i]
+static u32        ofired[NTIMERS];
+static u32        olog[NTIMERS];  // indices of otimers in the order they expired
+static atomic_u32 nfired;
+
+static void order_f(uintptr_t i, uintptr_t seq) {
+  if ((i64)nanotime() < owhen[i])
+    panic("timer %zu expired %lld ns early", i, owhen[i] - (i64)nanotime());
+  ofired[i]++;
+  olog[AtomicAdd(&nfired, 1)] = (u32)i;
+}
+
+static void test_order(uintptr_t _) {
+  // Start many timers within a short time span so that the heap is deep and the P finds
+  // many expired timers at once
+  i64 now = (i64)nanotime();
+  for (u32 i = 0; i < NTIMERS; i++) {
+    otimers[i].f = order_f;
+    otimers[i].arg = i;
+    owhen[i] = now + 10*MS + (i64)randn(20*MS);
+    timer_start(&otimers[i], owhen[i]);
+  }
+  // stop every third timer and move every third timer to a new time, which changes the
+  // heap at random positions
+  u32 nstopped = 0;
+  for (u32 i = 0; i < NTIMERS; i++) {
+    if (i % 3 == 0) {
+      check(timer_stop(&otimers[i]));
+      nstopped++;
+    } else if (i % 3 == 1) {
+      owhen[i] = now + 10*MS + (i64)randn(20*MS);
+      check(timer_reset(&otimers[i], owhen[i]));
+    }
+  }
+
+  wait_until(&nfired, NTIMERS - nstopped, 1000*MS);
+  t_sleep(10*MS); // give stopped timers a chance to (wrongly) expire
+  check(AtomicLoad(&nfired) == NTIMERS - nstopped);
+
+  for (u32 i = 0; i < NTIMERS; i++) {
+    if (ofired[i] != (i % 3 == 0 ? 0 : 1))
+      panic("timer %u expired %u times", i, ofired[i]);
+    if (i % 3 != 0)
+      check(!timer_stop(&otimers[i])); // expired
+  }
+  for (u32 i = 1; i < NTIMERS - nstopped; i++) {
+    if (owhen[olog[i]] < owhen[olog[i - 1]])
+      panic("timer %u (when %lld) expired after timer %u (when %lld)",
+        olog[i - 1], owhen[olog[i - 1]], olog[i], owhen[olog[i]]);
+  }
+  printf("  order ok\n");
+}
+
+
+// ---- stop and reset
+
+static atomic_u32 nf;
+static i64        firedat;
+
+static void record_f(uintptr_t arg, uintptr_t seq) {
+  firedat = (i64)nanotime();
+  AtomicAdd(&nf, 1);
+}
+
+static void test_stop_reset() {
+  Timer t = { .f = record_f };
+  AtomicStore(&nf, 0);
+
+  // stopping a timer which was never started, or has expired, does nothing
+  check(!timer_stop(&t));
+  timer_start(&t, (i64)nanotime() + 1*MS);
+  wait_until(&nf, 1, 1000*MS);
+  check(!timer_stop(&t));
+
+  // a stopped timer does not expire
+  timer_start(&t, (i64)nanotime() + 5*MS);
+  check(timer_stop(&t));
+  t_sleep(20*MS);
+  check(AtomicLoad(&nf) == 1);
+
+  // resetting a pending timer to a later time
+  i64 now = (i64)nanotime();
+  timer_start(&t, now + 5*MS);
+  check(timer_reset(&t, now + 40*MS));
+  t_sleep(20*MS);
+  check(AtomicLoad(&nf) == 1);
+  wait_until(&nf, 2, 1000*MS);
+  check(firedat >= now + 40*MS);
+
+  // resetting a pending timer to an earlier time
+  now = (i64)nanotime();
+  timer_start(&t, now + 10000*MS);
+  check(timer_reset(&t, now + 5*MS));
+  wait_until(&nf, 3, 1000*MS);
+  check(firedat >= now + 5*MS);
+
+  // resetting an expired timer starts it again
+  now = (i64)nanotime();
+  check(!timer_reset(&t, now + 1*MS));
+  wait_until(&nf, 4, 1000*MS);
+  check(firedat >= now + 1*MS);
+
+  // a periodic timer expires until stopped
+  Timer pt = { .f = record_f, .period = 2*MS };
+  timer_start(&pt, (i64)nanotime() + 2*MS);
+  wait_until(&nf, 8, 1000*MS);
+  check(timer_stop(&pt));
+  t_sleep(5*MS); // let a call to record_f which was running when we stopped pt finish
+  u32 n = AtomicLoad(&nf);
+  t_sleep(10*MS);
+  check(AtomicLoad(&nf) == n);
+
+  printf("  stop and reset ok\n");
+}
+
+
+// ---- stealing (runs with several P's and without preemption)
+
+static atomic_u32 stolen;
+
+static void steal_f(uintptr_t arg, uintptr_t seq) {
+  AtomicStore(&stolen, 1);
+}
+
+static void steal_hog(uintptr_t _) {
+  // This coroutine never calls into the scheduler, so its P can't run the timer.
+  // Another P has to steal it or the loop never ends.
+  Timer t = { .f = steal_f };
+  i64 deadline = (i64)nanotime() + 5000*MS;
+  timer_start(&t, (i64)nanotime() + 5*MS);
+  while (AtomicLoad(&stolen) == 0) {
+    if ((i64)nanotime() > deadline)
+      panic("timer of a busy P was not run by another P");
+  }
+  check(!timer_stop(&t));
+}
+
+static void test_steal(uintptr_t _) {
+  for (u32 i = 0; i < 10; i++) {
+    AtomicStore(&stolen, 0);
+    t_spawn(steal_hog, 0);
+    wait_until(&stolen, 1, 10000*MS);
+    t_sleep(1*MS); // let steal_hog return
+  }
+  printf("  steal ok\n");
+}
+
+
+// ---- network poller deadlines
+
+static PollDesc* dpd;
+static i64       dextendto;
+
+static void deadline_extender(uintptr_t _) {
+  t_sleep(5*MS);
+  check(sched_pollsetdeadline(dpd, (u64)dextendto, 'r') == 0);
+}
+
+static void test_polldeadline() {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    panic("socketpair: %s", strerror(errno));
+  dpd = sched_pollopen(fds[0]);
+  PollDesc* wpd = sched_pollopen(fds[1]);
+  check(dpd != NULL && wpd != NULL);
+  char buf[4096];
+
+  // a read deadline expires while the reader is parked
+  i64 now = (i64)nanotime();
+  check(sched_pollsetdeadline(dpd, (u64)(now + 10*MS), 'r') == 0);
+  check(t_read(dpd, buf, sizeof(buf)) == -1 && t_errno() == ETIMEDOUT);
+  check((i64)nanotime() >= now + 10*MS);
+
+  // I/O fails right away while the deadline is in the past, until a new one is set
+  check(t_read(dpd, buf, sizeof(buf)) == -1 && t_errno() == ETIMEDOUT);
+  check(sched_pollsetdeadline(dpd, 0, 'r') == 0);
+  check(t_write(wpd, "hello", 5) == 5);
+  check(t_read(dpd, buf, sizeof(buf)) == 5);
+
+  // a deadline moved later while the reader is parked
+  now = (i64)nanotime();
+  dextendto = now + 30*MS;
+  check(sched_pollsetdeadline(dpd, (u64)(now + 10*MS), 'r') == 0);
+  t_spawn(deadline_extender, 0);
+  check(t_read(dpd, buf, sizeof(buf)) == -1 && t_errno() == ETIMEDOUT);
+  check((i64)nanotime() >= dextendto);
+  check(sched_pollsetdeadline(dpd, 0, 'r') == 0);
+
+  // a write deadline expires while the writer is parked on a full socket buffer
+  now = (i64)nanotime();
+  check(sched_pollsetdeadline(wpd, (u64)(now + 10*MS), 'w') == 0);
+  memset(buf, 'x', sizeof(buf));
+  ssize_t n;
+  while ((n = t_write(wpd, buf, sizeof(buf))) > 0) {}
+  check(n == -1 && t_errno() == ETIMEDOUT);
+  check((i64)nanotime() >= now + 10*MS);
+
+  sched_pollclose(dpd);
+  sched_pollclose(wpd);
+  close(fds[0]);
+  close(fds[1]);
+  printf("  poll deadlines ok\n");
+}
+
+
+static void main_co(uintptr_t _) {
+  test_stop_reset();
+  test_polldeadline();
+  printf("timer-test: OK\n");
+  // returning from the main coroutine ends the program
+}
+
+// run_child runs fn as the main coroutine of a child process with nprocs P's.
+// If preemptoff is true, asynchronous preemption is disabled.
+static void run_child(const char* name, EntryFun fn, u32 nprocs, bool preemptoff) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1)
+    panic("fork: %s", strerror(errno));
+  if (pid == 0) {
+    char str[16];
+    snprintf(str, sizeof(str), "%u", nprocs);
+    setenv("COMAXPROCS", str, 1);
+    if (preemptoff)
+      setenv("COASYNCPREEMPTOFF", "1", 1);
+    sched_main(fn, 0); // exits when fn returns
+  }
+  int status;
+  if (waitpid(pid, &status, 0) == -1)
+    panic("waitpid: %s", strerror(errno));
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    panic("%s failed", name);
+}
+
+int main(int argc, const char** argv) {
+  setvbuf(stdout, NULL, _IONBF, 0);
+  // run these before sched_main, while this is the only thread of the process
+  run_child("order", test_order, 1, false);
+  run_child("steal", test_steal, 4, true);
+  sched_main(main_co, 0); // never returns
+  return 0;
+}
+
+ASSUME_NONNULL_END
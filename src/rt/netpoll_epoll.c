@@ -0,0 +1,119 @@
+#include <rbase/rbase.h>
+#include "schedimpl.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+// Network poller for Linux, using epoll. [go: netpoll_epoll.go]
+
+static int        epfd = -1;            // epoll descriptor
+static int        netpoll_breakfd = -1; // eventfd for waking up a blocked netpoll
+static atomic_u32 netpoll_wakesig;      // used to avoid duplicate calls of netpoll_break
+
+
+void netpoll_init() {
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0)
+    panic("netpoll_init: epoll_create1 failed (errno %d)", errno);
+  netpoll_breakfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (netpoll_breakfd < 0)
+    panic("netpoll_init: eventfd failed (errno %d)", errno);
+  // data.ptr=NULL identifies netpoll_breakfd; all other events carry a PollDesc
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, netpoll_breakfd, &ev) != 0)
+    panic("netpoll_init: epoll_ctl failed (errno %d)", errno);
+}
+
+
+int netpoll_open(int fd, PollDesc* pd) {
+  // Edge-triggered: an event is reported when fd becomes ready, so a coroutine must read
+  // or write until EAGAIN before waiting (t_read and t_write do.) This means we never need
+  // to modify the registration as coroutines come and go.
+  struct epoll_event ev = {
+    .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+    .data.ptr = pd,
+  };
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0 ? 0 : errno;
+}
+
+
+int netpoll_close(int fd) {
+  struct epoll_event ev = {0}; // ignored, but must be non-NULL on Linux < 2.6.9
+  return epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &ev) == 0 ? 0 : errno;
+}
+
+
+void netpoll_break() {
+  u32 expect = 0;
+  if (!AtomicCAS(&netpoll_wakesig, &expect, 1))
+    return; // already pending
+  u64 one = 1;
+  while (write(netpoll_breakfd, &one, sizeof(one)) != sizeof(one)) {
+    if (errno == EAGAIN) // counter is full; netpoll will wake up anyway
+      return;
+    if (errno != EINTR)
+      panic("netpoll_break: write failed (errno %d)", errno);
+  }
+}
+
+
+TList netpoll(i64 delay) {
+  TList toRun = {0};
+  if (epfd == -1)
+    return toRun;
+
+  int waitms;
+  if (delay < 0) {
+    waitms = -1;
+  } else if (delay == 0) {
+    waitms = 0;
+  } else if (delay < 1000000) {
+    // An arbitrary cap on how long to wait for a timer: 1ms is the smallest non-zero
+    // timeout epoll supports.
+    waitms = 1;
+  } else if (delay < 1000000000000000) {
+    waitms = (int)(delay / 1000000);
+  } else {
+    // An arbitrary cap on how long to wait for a timer. 1e9 ms == ~11.5 days.
+    waitms = 1000000000;
+  }
+
+  // Ts readied by one epoll_wait are returned together, so that the scheduler can put
+  // them on run queues in batches (see s_injectlist.)
+  struct epoll_event events[128];
+  int n;
+  while ((n = epoll_wait(epfd, events, countof(events), waitms)) < 0) {
+    if (errno != EINTR)
+      panic("netpoll: epoll_wait failed (errno %d)", errno);
+    // If a timed sleep was interrupted, just return to recalculate how long we should sleep
+    if (waitms > 0)
+      return toRun;
+  }
+
+  for (int i = 0; i < n; i++) {
+    struct epoll_event* ev = &events[i];
+    if (ev->events == 0)
+      continue;
+
+    if (ev->data.ptr == NULL) { // netpoll_breakfd
+      if (delay != 0) {
+        // netpoll_break could be picked up by a nonblocking poll.
+        // Only consume the wakeup if blocking.
+        u64 tmp;
+        ssize_t _ = read(netpoll_breakfd, &tmp, sizeof(tmp));
+        (void)_;
+        AtomicStore(&netpoll_wakesig, 0);
+      }
+      continue;
+    }
+
+    i32 mode = 0;
+    if (ev->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+      mode += 'r';
+    if (ev->events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+      mode += 'w';
+    if (mode != 0)
+      netpoll_ready(&toRun, (PollDesc*)ev->data.ptr, mode);
+  }
+  return toRun;
+}
@@ -0,0 +1,82 @@
+#include <rbase/rbase.h>
+#include "schedimpl.h"
+
+#include <poll.h>
+
+// Network poller for platforms without a poller implementation.
+// File descriptors can't be registered (sched_pollopen fails with ENOSYS) but netpoll
+// sleeps until the next timer or netpoll_break, using poll(2) on a pipe.
+// [go: netpoll_stub.go]
+
+static int        netpoll_breakrd = -1; // read end of pipe for waking up a blocked netpoll
+static int        netpoll_breakwr = -1; // write end of the pipe
+static atomic_u32 netpoll_wakesig;      // used to avoid duplicate calls of netpoll_break
+
+
+void netpoll_init() {
+  int fds[2];
+  if (pipe(fds) != 0)
+    panic("netpoll_init: pipe failed (errno %d)", errno);
+  for (int i = 0; i < 2; i++) {
+    if (fcntl(fds[i], F_SETFL, O_NONBLOCK) != 0 || fcntl(fds[i], F_SETFD, FD_CLOEXEC) != 0)
+      panic("netpoll_init: fcntl failed (errno %d)", errno);
+  }
+  netpoll_breakrd = fds[0];
+  netpoll_breakwr = fds[1];
+}
+
+
+int netpoll_open(int fd, PollDesc* pd) {
+  return ENOSYS;
+}
+
+
+int netpoll_close(int fd) {
+  return ENOSYS;
+}
+
+
+void netpoll_break() {
+  u32 expect = 0;
+  if (!AtomicCAS(&netpoll_wakesig, &expect, 1))
+    return; // already pending
+  while (write(netpoll_breakwr, "", 1) != 1) {
+    if (errno == EAGAIN) // pipe is full; netpoll will wake up anyway
+      return;
+    if (errno != EINTR)
+      panic("netpoll_break: write failed (errno %d)", errno);
+  }
+}
+
+
+TList netpoll(i64 delay) {
+  TList toRun = {0};
+  if (netpoll_breakrd == -1)
+    return toRun;
+
+  int waitms;
+  if (delay < 0) {
+    waitms = -1;
+  } else if (delay == 0) {
+    waitms = 0;
+  } else if (delay < 1000000) {
+    waitms = 1; // 1ms is the smallest non-zero timeout poll supports
+  } else if (delay < 1000000000000000) {
+    waitms = (int)(delay / 1000000);
+  } else {
+    waitms = 1000000000; // ~11.5 days
+  }
+
+  struct pollfd pfd = { .fd = netpoll_breakrd, .events = POLLIN };
+  int n = poll(&pfd, 1, waitms);
+  if (n < 0 && errno != EINTR)
+    panic("netpoll: poll failed (errno %d)", errno);
+  if (n > 0 && delay != 0) {
+    // netpoll_break could be picked up by a nonblocking poll.
+    // Only consume the wakeup if blocking.
+    u8 buf[16];
+    while (read(netpoll_breakrd, buf, sizeof(buf)) > 0) {}
+    AtomicStore(&netpoll_wakesig, 0);
+  }
+  return toRun;
+}
@@ -3,12 +3,22 @@
 #include "schedimpl.h"
 #include "exectx/exectx.h"
 #include <pthread.h>
+#include <sys/socket.h>
+#if R_TARGET_OS_DARWIN
+  #include <sys/ucontext.h>
+  #include <mach-o/getsect.h>
+  #include <mach-o/ldsyms.h>
+#elif defined(__linux__)
+  #include <ucontext.h>
+#endif
 
 _Pragma("GCC diagnostic ignored \"-Wunused-function\"")
 
 // SCHED_TRACE: when defined, verbose log tracing on stderr is enabled.
 // The value is used as a prefix for log messages.
-#define SCHED_TRACE "♻ "
+#ifndef NDEBUG
+  #define SCHED_TRACE "♻ "
+#endif
 
 // Array is a generic mutable array
 typedef struct Array {
@@ -42,6 +52,13 @@ typedef struct RandomEnum {
 
 #define PTR_SIZE sizeof(void*)
 
+// SIGPREEMPT is the signal sysmon sends to an M to preempt the coroutine it's running.
+// Like Go, we use SIGURG: it's ignored by default and in practice not used by programs.
+#define SIGPREEMPT SIGURG
+
+// FORCE_PREEMPT_NS is the time slice after which sysmon preempts a running coroutine
+#define FORCE_PREEMPT_NS (10*1000*1000) // 10ms
+
 // global state
 static struct S     S = {0};                // global scheduler
 static M            m0;                     // main OS thread
@@ -52,6 +69,8 @@ static uintptr_t    fastrandseed;           // initialized by fastrandinit
 static uintptr_t    hashkey[4] = {1,2,3,4}; // initialized by fastrandinit
 static SigSet       initSigmask;            // signal mask for newly created M's
 static RandomOrder  stealOrder; // steal order of P's in allp
+static atomic_u32   netpoll_waiters; // number of Ts parked in the network poller
+static bool         asyncpreemptoff; // disables asynchronous preemption (COASYNCPREEMPTOFF=1)
 
 // execLock serializes exec and clone to avoid bugs or unspecified behaviour
 // around exec'ing while creating/destroying threads.  See issue #19546.
@@ -88,6 +107,10 @@ static void m_release(M* m);
 static void NORETURN m_call(T* _t_, void(*fn)(T*));
 static void NORETURN m_exit(bool osStack);
 static void NORETURN schedule();
+static void NORETURN exitprog(int status);
+static void NORETURN t_execute(T* t, bool inheritTime);
+static void p_wake();
+static void s_runqputbatch(TQueue* batch, u32 n);
 static void p_runqput(P* p, T* t, bool next);
 static void p_tfree_put(P* _p_, T* t);
 static void* t_switch(T* t);
@@ -98,9 +121,21 @@ static void s_midleput(M* m);
 static i64 s_reserve_mid();
 static void s_newm(P* _p_, void(*fn)(void), i64 id);
 static bool p_runqempty(P* p);
+static void p_startm(P* _p_, bool spinning);
 static void s_checkdeadlock();
+static void s_injectlist(TList* list);
+static bool netpoll_inited();
+static void netpoll_lazyinit();
+static i64 p_checktimers(P* p, i64 now, i64* pollUntil, bool* ran);
+static void p_timer_add(P* p, Timer* t, i64 when);
 static void m_park();
+static void m_semacreate(M* mp);
+static bool m_semasleep(i64 ns);
 static void m_semawakeup(M* mp);
+static void s_wakenetpoller(i64 when);
+static bool sig_textrange_init();
+static void sig_preempt(int sig, siginfo_t* info, void* ucp);
+static void sysmon();
 
 
 // trace(const char* fmt, ...) -- debug tracing
@@ -241,22 +276,65 @@ static void note_clear(Note* n) {
   n->key = 0;
 }
 
-// note_sleep waits for notification, potentially putting M to sleep until note_wake is called
-// for the same note.
-static void note_sleep(Note* n) {
+// note_tsleep waits for notification for at most ns nanoseconds (no timeout if ns < 0),
+// potentially putting M to sleep until note_wake is called for the same note.
+// Returns true if the note was notified, false if it timed out.
+static bool note_tsleep(Note* n, i64 ns) {
   T* t = t_get();
   assert(t == &t->m->t0 /* must only wait on a note in M scheduling context */);
+  M* m = t->m;
+  m_semacreate(m);
+
+  uintptr_t expect = 0;
+  if (!AtomicCasRelAcq(&n->key, &expect, (uintptr_t)m)) {
+    // Must be locked (got note_wakeup).
+    if (expect != NOTE_LOCKED)
+      panic("note_sleep out of sync");
+    return true;
+  }
 
-  TODO_IMPL;
+  // queued; sleep until note_wakeup wakes us up
+  if (ns < 0) {
+    m->blocked = true;
+    m_semasleep(-1);
+    m->blocked = false;
+    return true;
+  }
+  i64 deadline = (i64)nanotime() + ns;
+  while (1) {
+    m->blocked = true;
+    bool woken = m_semasleep(ns);
+    m->blocked = false;
+    if (woken)
+      return true;
+    ns = deadline - (i64)nanotime();
+    if (ns <= 0)
+      break;
+  }
+  // Deadline arrived. Unregister ourselves unless note_wakeup got to the note first.
+  while (1) {
+    uintptr_t v = AtomicLoad(&n->key);
+    if (v == (uintptr_t)m) {
+      // No wakeup yet; unregister.
+      if (AtomicCAS(&n->key, &v, 0))
+        return false;
+    } else if (v == NOTE_LOCKED) {
+      // Wakeup happened so semaphore is available.
+      // Grab it to avoid getting out of sync.
+      m->blocked = true;
+      m_semasleep(-1);
+      m->blocked = false;
+      return true;
+    } else {
+      panic("note_tsleep out of sync");
+    }
+  }
+}
 
-  // uintptr_t expect = 0;
-  // if (!AtomicCasRelAcq(&n.key, &expect, (uintptr_t)&m)) {
-  //   // Must be locked (got sema_wake).
-  //   if (expect != kLocked) {
-  //     panic("m_wait out of sync");
-  //   }
-  //   return;
-  // }
+// note_sleep waits for notification, potentially putting M to sleep until note_wake is called
+// for the same note.
+static void note_sleep(Note* n) {
+  note_tsleep(n, -1);
 }
 
 // note_wakeup notifies callers to note_sleep
@@ -480,6 +558,13 @@ static u32 fastrand() {
   return m_fastrand(t_get()->m);
 }
 
+// fastrandn returns a random number in [0,n)
+static inline u32 fastrandn(u32 n) {
+  // This is similar to fastrand() % n, but faster.
+  // See https://lemire.me/blog/2016/06/27/a-fast-alternative-to-the-modulo-reduction/
+  return (u32)(((u64)fastrand() * (u64)n) >> 32);
+}
+
 
 // m_semacreate creates a semaphore for mp, if it does not already have one.
 static void m_semacreate(M* mp) {
@@ -557,6 +642,25 @@ u8* stackalloc(size_t reqsize, size_t* size_outsize_t, size_t* guardsize_out);
 // stackfree free stack memory at lo (low stack address) of size.
 bool stackfree(void* lo, size_t size); // implemented in stack_*.c
 
+// stackroundsize returns the actual size of a stack that stackalloc allocates for reqsize.
+// Sizes up to STACK_CLASS_MAX are rounded up to a power of two.
+size_t stackroundsize(size_t reqsize); // implemented in stack_*.c
+
+// stackrelease releases the memory pages of the stack at lo of size bytes to the OS, except for
+// the top keepsize bytes, without unmapping them. Used for stacks of cached dead T's.
+void stackrelease(void* lo, size_t size, size_t keepsize); // implemented in stack_*.c
+
+// stackreuse must be called before memory released with stackrelease is used again
+void stackreuse(void* lo, size_t size, size_t keepsize); // implemented in stack_*.c
+
+// stack_class returns the size class of a stack of size bytes, or -1 if stacks of that size
+// are not cached (not a power of two between STACK_CLASS_MIN and STACK_CLASS_MAX.)
+static int stack_class(size_t size) {
+  if (size < STACK_CLASS_MIN || size > STACK_CLASS_MAX || (size & (size - 1)) != 0)
+    return -1;
+  return (int)__builtin_ctzll((u64)size) - STACK_CLASS_MIN_SHIFT;
+}
+
 
 // ===============================================================================================
 // T
@@ -585,6 +689,41 @@ static ALWAYS_INLINE T* t_get() {
   return _tlt;
 }
 
+// t_errno returns errno and t_seterrno sets errno of the calling OS thread.
+// A coroutine may be resumed on a different OS thread after it parks, but compilers may reuse
+// an address of errno (a thread-local variable) loaded before parking. Runtime code accesses
+// errno with these functions after parking; they are not inlined so that the address of
+// errno is loaded anew.
+int NO_INLINE t_errno() {
+  __asm__ volatile("" ::: "memory"); // not a pure function; don't reuse results
+  return errno;
+}
+
+static void NO_INLINE t_seterrno(int err) {
+  errno = err;
+}
+
+// t_preemptoff increments the current T's preemptoff count. Usually, use PREEMPTOFF instead.
+static inline T* t_preemptoff() {
+  T* t = t_get();
+  t->preemptoff++;
+  // the signal handler runs on the same thread; order the increment before what follows
+  atomic_signal_fence(memory_order_seq_cst);
+  return t;
+}
+
+static inline void t_preempton(T** tp) {
+  atomic_signal_fence(memory_order_seq_cst);
+  (*tp)->preemptoff--;
+}
+
+// PREEMPTOFF disables asynchronous preemption of the calling coroutine until the end of the
+// enclosing scope. Every public function which coroutines call into the runtime with starts
+// with PREEMPTOFF, since runtime code must not be preempted.
+// Unlike m_acquire, it stays in effect while the coroutine is parked and resumed on another M.
+#define PREEMPTOFF() \
+  T* _preemptoff_t_ __attribute__((cleanup(t_preempton))) = t_preemptoff()
+
 // t_stacksize returns T's stack size
 static inline size_t t_stacksize(T* t) {
   return (size_t)(t->stack.hi - t->stack.lo);
@@ -663,6 +802,10 @@ static void NORETURN t_exit(T* t) {
 
   t_casstatus(t, TRunning, TDead);
 
+  // the program ends when its main coroutine returns
+  if (t == t1)
+    exitprog(0);
+
   bool locked = t->lockedm != NULL;
   t->m = NULL;
   t->lockedm = NULL;
@@ -688,12 +831,26 @@ static void NORETURN t_exit(T* t) {
   UNREACHABLE;
 }
 
+// t_start is the entry point of a new coroutine t.
+// t starts out with preemption disabled so that it can't be preempted while t_execute switches
+// to it. Preemption is enabled here, now that t runs on its own stack with all of its registers
+// loaded. When fn returns, the coroutine exits (_t_exit0.)
+static void t_start(uintptr_t arg) {
+  T* t = (T*)arg;
+  atomic_signal_fence(memory_order_seq_cst);
+  t->preemptoff--;
+  t->fn(t->arg1);
+}
+
 // _t_exit0 finishes execution of the current coroutine.
 // It is called when the coroutine's function returns.
 // This function is link exported because it's called from assembly.
 void NORETURN _t_exit0() {
   trace("");
-  m_call(t_get(), t_exit); // never returns
+  // t must not be preempted in m_call, after it has loaded the t0 of the M t is running on.
+  // t is dead so preemption stays disabled (sched_spawn resets preemptoff when t is reused.)
+  T* t = t_preemptoff();
+  m_call(t, t_exit); // never returns
 }
 
 static void NORETURN exitprog(int status) {
@@ -704,65 +861,66 @@ static void NORETURN exitprog(int status) {
 }
 
 
-// // Mark gp ready to run.
-// func ready(gp *g, traceskip int, next bool) {
-//   if trace.enabled {
-//     traceGoUnpark(gp, traceskip)
-//   }
-
-//   status := readgstatus(gp)
-
-//   // Mark runnable.
-//   _g_ := getg()
-//   mp := acquirem() // disable preemption because it can be holding p in a local var
-//   if status&^_Gscan != _Gwaiting {
-//     dumpgstatus(gp)
-//     throw("bad g->status in ready")
-//   }
+// t_ready marks t, which is parked in TWaiting, runnable and puts it on the current P's
+// run queue. If next is true, t runs next on the P (see P.runnext.)
+static void t_ready(T* t, bool next) {
+  trace("T#%llu", t->id);
+  TStatus status = t_readstatus(t);
+  // disable preemption because it can be holding p in a local var
+  M* mp = m_acquire();
+  if (status != TWaiting)
+    panic("t_ready: bad T status %s", TStatusName(status));
+  t_casstatus(t, TWaiting, TRunnable);
+  p_runqput(mp->p, t, next);
+  p_wake();
+  m_release(mp);
+}
 
-//   // status is Gwaiting or Gscanwaiting, make Grunnable and put on runq
-//   casgstatus(gp, _Gwaiting, _Grunnable)
-//   runqput(_g_.m.p.ptr(), gp, next)
-//   wakep()
-//   releasem(mp)
-// }
+static void NORETURN t_park1(T* t) {
+  M* m = t->m;
+  trace("T#%llu", t->id);
+  t_casstatus(t, TRunning, TWaiting);
+  m_dropt();
+  TUnlockFun unlockf = m->waitunlockf;
+  if (unlockf) {
+    bool ok = unlockf(t, m->waitunlockv);
+    m->waitunlockf = NULL;
+    m->waitunlockv = 0;
+    if (!ok) {
+      trace("unlockf returned false; resume T#%llu", t->id);
+      t_casstatus(t, TWaiting, TRunnable);
+      t_execute(t, /*inheritTime*/true); // Schedule it back, never returns.
+    }
+  }
+  schedule();
+}
 
-// // Puts the current goroutine into a waiting state and calls unlockf on the
-// // system stack.
-// //
-// // If unlockf returns false, the goroutine is resumed.
-// //
-// // unlockf must not access this G's stack, as it may be moved between
-// // the call to gopark and the call to unlockf.
-// //
-// // Note that because unlockf is called after putting the G into a waiting
-// // state, the G may have already been readied by the time unlockf is called
-// // unless there is external synchronization preventing the G from being
-// // readied. If unlockf returns false, it must guarantee that the G cannot be
-// // externally readied.
-// //
-// // Reason explains why the goroutine has been parked. It is displayed in stack
-// // traces and heap dumps. Reasons should be unique and descriptive. Do not
-// // re-use reasons, add new ones.
-// func gopark(unlockf func(*g, unsafe.Pointer) bool, lock unsafe.Pointer, reason waitReason, traceEv byte, traceskip int) {
-//   if reason != waitReasonSleep {
-//     checkTimeouts() // timeouts may expire while two goroutines keep the scheduler busy
-//   }
-//   mp := acquirem()
-//   gp := mp.curg
-//   status := readgstatus(gp)
-//   if status != _Grunning && status != _Gscanrunning {
-//     throw("gopark: bad g status")
-//   }
-//   mp.waitlock = lock
-//   mp.waitunlockf = unlockf
-//   gp.waitreason = reason
-//   mp.waittraceev = traceEv
-//   mp.waittraceskip = traceskip
-//   releasem(mp)
-//   // can't do anything that might move the G between Ms here.
-//   mcall(park_m)
-// }
+// t_park puts the current coroutine into a waiting state and calls unlockf(T, unlockv)
+// on the M's scheduling stack (t0.)
+// If unlockf returns false, the coroutine is resumed.
+// If unlockf is NULL or returns true, the coroutine stays parked until some other coroutine
+// (or the network poller) calls t_ready for it.
+//
+// unlockf must not access T's stack.
+// Note that because unlockf is called after putting T into a waiting state, T may have
+// already been readied by the time unlockf is called unless there is external
+// synchronization preventing T from being readied. If unlockf returns false, it must
+// guarantee that T cannot be externally readied.
+static void t_park(TUnlockFun nullable unlockf, intptr_t unlockv) {
+  PREEMPTOFF();
+  T* _t_ = t_get();
+  M* mp = m_acquire();
+  TStatus status = t_readstatus(_t_);
+  if (status != TRunning)
+    panic("t_park: bad T status %s", TStatusName(status));
+  mp->waitunlockf = unlockf;
+  mp->waitunlockv = unlockv;
+  m_release(mp);
+  // can't do anything that might move T between Ms here
+  if (exectx_save(_t_->exectx) == 0)
+    m_call(_t_, t_park1);
+  trace("resumed");
+}
 
 // // sched_sched yields the processor, allowing other coroutines to run.
 // // It does not suspend the current coroutine, so execution resumes automatically.
@@ -783,6 +941,7 @@ static void t_yield1(T* t) {
 // t_yield puts the current T on the runq of the current P
 // (instead of the globrunq, as sched_sched does)
 void t_yield() {
+  PREEMPTOFF();
   // checkTimeouts()
   T* _t_ = t_get();
   trace("exectx_save");
@@ -837,6 +996,11 @@ static void NORETURN t_execute(T* t, bool inheritTime) {
   // gogo switches stacks in Go. It's implemented in runtime/asm_ARCH.s
   // gogo(&t->sched)
 
+  // t must not be preempted while switching to it, in the middle of exectx_resume.
+  // A parked coroutine is always in the runtime (PREEMPTOFF) and a new one has preemption
+  // disabled until it enters its function (t_start.)
+  assert(t->preemptoff > 0);
+
   trace("exectx_resume");
   _tlt = t;
   exectx_resume(t->exectx, (uintptr_t)t);
@@ -877,6 +1041,15 @@ static T* t_init(u8* lo, size_t stacksize) {
   return newt;
 }
 
+// t_stackreqsize returns the stack size to request from stackalloc for a new T which needs a
+// stack of requested_stacksize bytes. The result is always large enough to fit T.
+static size_t t_stackreqsize(size_t requested_stacksize) {
+  // Make sure stack fits T and is at least STACK_MIN
+  if (requested_stacksize == 0)
+    return STACK_SIZE_DEFAULT;
+  return MAX(requested_stacksize, STACK_MIN + sizeof(T));
+}
+
 // t_alloc allocates a new T, with a stack big enough for requested_stacksize bytes.
 // If requested_stacksize == 0, an sufficiently large, implementation-varying stack size is used.
 static T* t_alloc(size_t requested_stacksize) {
@@ -893,17 +1066,10 @@ static T* t_alloc(size_t requested_stacksize) {
   // 0x2000  beginning of stack (T.hi)
   //
 
-  // Make sure stack fits T and is at least STACK_MIN
-  if (requested_stacksize == 0) {
-    requested_stacksize = STACK_SIZE_DEFAULT;
-  } else if (requested_stacksize < STACK_MIN + sizeof(T)) {
-    requested_stacksize = STACK_MIN + sizeof(T);
-  }
-
   // allocate memory
   size_t stacksize = 0;
   size_t guardsize = 0;
-  u8* lo = (u8*)stackalloc(requested_stacksize, &stacksize, &guardsize);
+  u8* lo = (u8*)stackalloc(t_stackreqsize(requested_stacksize), &stacksize, &guardsize);
   if (lo == NULL)
     return NULL; // most likely out of memory (see errno)
 
@@ -934,7 +1100,7 @@ static void allt_add(T* t) {
   if (allt.len == allt.cap) {
     trace("grow array");
     allt.cap = allt.cap + 64;
-    allt.ptr = memrealloc(MemLibC(), allt.ptr, allt.cap);
+    allt.ptr = memrealloc(MemLibC(), allt.ptr, allt.cap * sizeof(T*));
     AtomicStore(&allt.ptr, allt.ptr);
   }
   trace("add");
@@ -948,31 +1114,48 @@ static void allt_add(T* t) {
 // P
 
 
-// p_tfree_get gets a T from tfree list. Returns NULL if no free T was available.
-static T* nullable p_tfree_get(P* _p_) {
+// p_tfree_get gets a T with a stack of size class sc from the tfree list.
+// Returns NULL if no free T was available or if sc is not a valid size class (-1.)
+static T* nullable p_tfree_get(P* _p_, int sc) {
+  if (sc < 0)
+    return NULL;
+  const size_t size = STACK_CLASS_MIN << sc;
+
   while (1) { // loop for retrying
 
-    if (TListEmpty(&_p_->tfree) && !TListEmpty(&S.tfree.l)) {
+    if (TListEmpty(&_p_->tfree[sc]) && !TListEmpty(&S.tfree.l[sc])) {
       mtx_lock(&S.tfree.lock);
-      // Move a batch of free Gs to the P.
-      while (_p_->tfreecount < 32) {
-        // Prefer Gs with stacks
-        T* t = TListPop(&S.tfree.l);
+      // Move a batch of free Gs to the P (at least one.)
+      // Ts with dirty stacks are first on the global list; keep them first on the P's list.
+      TQueue q = {0};
+      do {
+        T* t = TListPop(&S.tfree.l[sc]);
         if (t == NULL)
           break;
         S.tfree.n--;
-        TListPush(&_p_->tfree, t);
-        _p_->tfreecount++;
-      }
+        S.tfree.bytes -= size;
+        if ((t->fl & TFlStackReleased) == 0)
+          S.tfree.dirtybytes -= size;
+        TQueuePushBack(&q, t);
+        _p_->tfreecount[sc]++;
+        _p_->tfreebytes += size;
+      } while (_p_->tfreecount[sc] < 32 && _p_->tfreebytes + size <= P_TFREE_MAXBYTES/2);
       mtx_unlock(&S.tfree.lock);
+      TListPushAll(&_p_->tfree[sc], &q);
       continue; // retry
     }
 
-    T* t = TListPop(&_p_->tfree);
+    T* t = TListPop(&_p_->tfree[sc]);
     if (t == NULL)
       return NULL;
 
-    _p_->tfreecount--;
+    _p_->tfreecount[sc]--;
+    _p_->tfreebytes -= size;
+
+    if (t->fl & TFlStackReleased) {
+      t->fl &= ~TFlStackReleased;
+      stackreuse((void*)t->stack.lo, size, STACK_TSIZE);
+    }
 
     // Note: Go implementation allocates a task separately from its stack.
     // However we use the bottom of a task's stack for the task state (T) itself, so tasks
@@ -995,6 +1178,89 @@ static T* nullable p_tfree_get(P* _p_) {
   }
 }
 
+// s_tfree_evict removes a T with a stack of a larger size class than sc from S.tfree and adds it
+// to freeq, to make room for a T of size class sc. Returns false if there's no such T.
+// S.tfree.lock must be held.
+static bool s_tfree_evict(int sc, TQueue* freeq) {
+  for (int c = STACK_NCLASSES - 1; c > sc; c--) {
+    T* t = TListPop(&S.tfree.l[c]);
+    if (t == NULL)
+      continue;
+    const size_t size = STACK_CLASS_MIN << c;
+    S.tfree.n--;
+    S.tfree.bytes -= size;
+    if ((t->fl & TFlStackReleased) == 0)
+      S.tfree.dirtybytes -= size;
+    TQueuePushBack(freeq, t);
+    return true;
+  }
+  return false;
+}
+
+// s_tfree_put moves all Ts in q, which have stacks of size class sc, to the global list S.tfree.
+// Ts which don't fit in STACK_CACHE_MAX are freed, unless Ts of a larger size class can be
+// freed instead. Ts which don't fit in STACK_CACHE_DIRTY_MAX have their stack memory released
+// to the OS (see stackrelease.)
+static void s_tfree_put(TQueue* q, int sc) {
+  const size_t size = STACK_CLASS_MIN << sc;
+  TQueue dirtyq = {0}; // Ts to cache as-is
+  TQueue cleanq = {0}; // Ts to cache with released stacks
+  TQueue freeq = {0};  // Ts to free
+  u32 inc = 0;
+
+  // reserve space in the cache
+  mtx_lock(&S.tfree.lock);
+  T* t;
+  while ((t = TQueuePop(q))) {
+    if (S.tfree.bytes + size > STACK_CACHE_MAX && !s_tfree_evict(sc, &freeq)) {
+      TQueuePushBack(&freeq, t);
+      continue;
+    }
+    S.tfree.bytes += size;
+    inc++;
+    if ((t->fl & TFlStackReleased) == 0 && S.tfree.dirtybytes + size <= STACK_CACHE_DIRTY_MAX) {
+      S.tfree.dirtybytes += size;
+      TQueuePushBack(&dirtyq, t);
+    } else {
+      TQueuePushBack(&cleanq, t);
+    }
+  }
+  mtx_unlock(&S.tfree.lock);
+
+  // free and release memory without holding the lock (syscalls)
+  while ((t = TQueuePop(&freeq)))
+    t_free(t);
+  for (t = cleanq.head; t != NULL; t = t->schedlink) {
+    if ((t->fl & TFlStackReleased) == 0) {
+      stackrelease((void*)t->stack.lo, size, STACK_TSIZE);
+      t->fl |= TFlStackReleased;
+    }
+  }
+
+  // put dirty stacks first so that they are reused before released ones
+  mtx_lock(&S.tfree.lock);
+  TListPushAll(&S.tfree.l[sc], &cleanq);
+  TListPushAll(&S.tfree.l[sc], &dirtyq);
+  S.tfree.n += inc;
+  mtx_unlock(&S.tfree.lock);
+}
+
+// p_tfree_flush transfers T's of size class sc from P's tfree list to the global list S.tfree
+// until keep T's remain on P's list
+static void p_tfree_flush(P* _p_, int sc, u32 keep) {
+  if (_p_->tfreecount[sc] <= keep)
+    return;
+  const size_t size = STACK_CLASS_MIN << sc;
+  TQueue q = {0};
+  while (_p_->tfreecount[sc] > keep) {
+    T* t = TListPop(&_p_->tfree[sc]);
+    _p_->tfreecount[sc]--;
+    _p_->tfreebytes -= size;
+    TQueuePushBack(&q, t);
+  }
+  s_tfree_put(&q, sc);
+}
+
 // p_tfree_put reclaims dead T, to be reused for new tasks. Puts on tfree list.
 // If local list is too long, transfer a batch to the global list.
 static void p_tfree_put(P* _p_, T* t) {
@@ -1011,48 +1277,51 @@ static void p_tfree_put(P* _p_, T* t) {
   //  t->stack.hi = 0;
   //  t->stackguard0 = 0;
   //}
-  if (stacksize != STACK_SIZE_DEFAULT) {
-    // don't keep tasks with non-default stack sizes
-    trace("non-standard stack size (%zu != %zu)", stacksize, (size_t)STACK_SIZE_DEFAULT);
+  int sc = stack_class(stacksize);
+  if (sc < 0) {
+    // don't keep tasks with stack sizes that are not a size class
+    trace("uncached stack size %zu", stacksize);
     t_free(t);
     return;
   }
 
   // t->fn = NULL;
 
-  TListPush(&_p_->tfree, t);
-  _p_->tfreecount++;
-
-  // If local list is too long, transfer a batch to the global list
-  if (_p_->tfreecount >= 64) {
-    u32 inc = 0;
-    TQueue q = {0};
-    while (_p_->tfreecount >= 32) {
-      t = TListPop(&_p_->tfree);
-      _p_->tfreecount--;
-      TQueuePush(&q, t);
-      inc++;
-    }
-    mtx_lock(&S.tfree.lock);
-    TListPushAll(&S.tfree.l, &q);
-    S.tfree.n += inc;
-    mtx_unlock(&S.tfree.lock);
+  TListPush(&_p_->tfree[sc], t);
+  _p_->tfreecount[sc]++;
+  _p_->tfreebytes += stacksize;
+
+  // If local list is too long, transfer a batch to the global list.
+  // If the local cache holds too much stack memory, transfer half of every size class.
+  if (_p_->tfreecount[sc] >= 64)
+    p_tfree_flush(_p_, sc, 31);
+  if (_p_->tfreebytes > P_TFREE_MAXBYTES) {
+    for (int c = 0; c < STACK_NCLASSES; c++)
+      p_tfree_flush(_p_, c, _p_->tfreecount[c] / 2);
   }
 }
 
 // p_tfree_purge purges all cached T's from P's tfree list to the global list S.tfree
 static void p_tfree_purge(P* _p_) {
-  u32 inc = 0;
-  TQueue q = {0};
-  while (!TListEmpty(&_p_->tfree)) {
-    T* t = TListPop(&_p_->tfree);
-    _p_->tfreecount--;
-    TQueuePush(&q, t);
-    inc++;
+  for (int sc = 0; sc < STACK_NCLASSES; sc++)
+    p_tfree_flush(_p_, sc, 0);
+  assert(_p_->tfreebytes == 0);
+}
+
+void sched_stackcachestats(StackCacheStats* st) {
+  PREEMPTOFF();
+  memset(st, 0, sizeof(*st));
+  mtx_lock(&S.allplock);
+  for (u32 i = 0; i < AtomicLoad(&S.maxprocs); i++) {
+    size_t n = S.allp[i]->tfreebytes;
+    st->pbytes += n;
+    st->pbytesmax = MAX(st->pbytesmax, n);
   }
+  mtx_unlock(&S.allplock);
   mtx_lock(&S.tfree.lock);
-  TListPushAll(&S.tfree.l, &q);
-  S.tfree.n += inc;
+  st->n = S.tfree.n;
+  st->bytes = S.tfree.bytes;
+  st->dirtybytes = S.tfree.dirtybytes;
   mtx_unlock(&S.tfree.lock);
 }
 
@@ -1215,8 +1484,53 @@ static bool p_runqempty(P* p) {
 // Put t and a batch of work from local runnable queue on global queue.
 // Executed only by the owner P.
 static bool p_runqputslow(P* p, T* t, u32 head, u32 tail) {
-  // TODO
-  return false;
+  T* batch[P_RUNQSIZE/2 + 1];
+
+  // First, grab a batch from local queue.
+  u32 n = tail - head;
+  n = n / 2;
+  if (n != P_RUNQSIZE/2)
+    panic("p_runqputslow: queue is not full");
+  for (u32 i = 0; i < n; i++)
+    batch[i] = p->runq[(head + i) % P_RUNQSIZE];
+  if (!AtomicCASRel(&p->runqhead, &head, head + n)) // cas-release, commits consume
+    return false;
+  batch[n] = t;
+
+  // Link the Ts
+  for (u32 i = 0; i < n; i++)
+    batch[i]->schedlink = batch[i + 1];
+  TQueue q = { batch[0], batch[n] };
+  trace("move %u Ts to global runq", n + 1);
+
+  // Now put the batch on global queue
+  mtx_lock(&S.lock);
+  s_runqputbatch(&q, n + 1);
+  mtx_unlock(&S.lock);
+  return true;
+}
+
+// p_runqputbatch tries to put all the Ts in q on the local runnable queue.
+// If the local queue is full, the rest are put on the global queue.
+// qsize is the number of Ts in q.
+// Executed only by the owner P.
+static void p_runqputbatch(P* p, TQueue* q, u32 qsize) {
+  u32 h = AtomicLoadAcq(&p->runqhead);
+  u32 t = p->runqtail;
+  u32 n = 0;
+  while (!TQueueEmpty(q) && t - h < P_RUNQSIZE) {
+    T* tp = TQueuePop(q);
+    p->runq[t % P_RUNQSIZE] = tp;
+    t++;
+    n++;
+  }
+  qsize -= n;
+  AtomicStoreRel(&p->runqtail, t); // store-release, makes the items available for consumption
+  if (!TQueueEmpty(q)) {
+    mtx_lock(&S.lock);
+    s_runqputbatch(q, qsize);
+    mtx_unlock(&S.lock);
+  }
 }
 
 // p_runqput tries to put t on the local runnable queue.
@@ -1409,11 +1723,15 @@ static void m_init(M* m, i64 id) {
   mtx_unlock(&S.lock);
 }
 
-// Returns M for the current T, with +1 refcount
+// Returns M for the current T, with +1 refcount.
+// T can't be preempted while it holds an M (see t_asyncsafepoint.)
 static inline M* m_acquire() {
-  T* _t_ = t_get();
-  _t_->m->locks++;
-  return _t_->m;
+  // disable preemption until locks is incremented so that T can't move to another M
+  T* _t_ = t_preemptoff();
+  M* m = _t_->m;
+  m->locks++;
+  t_preempton(&_t_);
+  return m;
 }
 
 // Release m previosuly m_acquire()'d
@@ -1439,8 +1757,23 @@ static u32 m_fastrand(M* _m_) {
 
 // initsig implements part of m_start1 that only runs on the m0, to initialize signal handlers
 static void m0_initsig() {
-  trace("TODO");
-  // TODO: install signal handlers
+  // Only the preemption signal is handled by the runtime; other signals keep their
+  // dispositions. Unlike Go, we don't forward SIGURG to a handler installed before us.
+  if (asyncpreemptoff)
+    return;
+  if (!sig_textrange_init()) {
+    asyncpreemptoff = true; // not supported on this target
+    return;
+  }
+  struct sigaction sa = {0};
+  sa.sa_sigaction = sig_preempt;
+  // The handler runs on the interrupted coroutine's stack (no SA_ONSTACK) since it may
+  // switch away from it; see t_asyncpreempt.
+  sa.sa_flags = SA_SIGINFO | SA_RESTART | SA_NODEFER;
+  sigfillset(&sa.sa_mask);
+  sigdelset(&sa.sa_mask, SIGPREEMPT);
+  if (sigaction(SIGPREEMPT, &sa, NULL) != 0)
+    panic("sigaction: %s", strerror(errno));
 }
 
 // m_init_sigstack is called when initializing a new m to set the
@@ -1477,14 +1810,9 @@ static void m_init_sigstack(M* _m_) {
 // After this is called the thread can receive signals.
 // [go: minitSignalMask]
 static void m_init_sigmask(M* _m_) {
-  // TODO
-  // nmask := _m_->sigmask
-  // for i := range sigtable {
-  //   if !blockableSig(uint32(i)) {
-  //     sigdelset(&nmask, i)
-  //   }
-  // }
-  // sigprocmask(SIG_SETMASK, &nmask, NULL);
+  SigSet nmask = _m_->sigmask;
+  sigdelset(&nmask, SIGPREEMPT);
+  pthread_sigmask(SIG_SETMASK, &nmask, NULL);
 }
 
 // m_start1 is called by m_start
@@ -1496,6 +1824,7 @@ static void NORETURN NO_INLINE m_start1(M* _m_) {
   #endif
   m_init_sigmask(_m_);
   _m_->procid = (u64)thrd_current();
+  _m_->thread = pthread_self();
 
   // Install signal handlers after m_init so that m_init can
   // prepare the thread to be able to handle the signals.
@@ -1513,6 +1842,8 @@ static void NORETURN NO_INLINE m_start1(M* _m_) {
   } else {
     // Allow sched_spawn to start new Ms.
     mainStarted = true;
+    // sysmon runs on its own M, without a P
+    s_newm(NULL, sysmon, -1);
   }
 
   schedule();
@@ -1538,6 +1869,8 @@ static void NORETURN NO_INLINE m_start(M* _m_) { // [go: runtime.mstart0]
     if (size == 0) // main thread:
       size = 8192 * STACK_GUARD_MULTIPLIER;
     t0->stack.hi = (uintptr_t)&size; // uintptr(noescape(unsafe.Pointer(&size)))
+    // m_call uses hi as the SP for calls on t0; it must be aligned like any other SP
+    t0->stack.hi &= ~(uintptr_t)(STACK_ALIGN - 1);
     t0->stack.lo = t0->stack.hi - size + 1024;
   }
 
@@ -1557,8 +1890,48 @@ static void NORETURN NO_INLINE m_start(M* _m_) { // [go: runtime.mstart0]
 
 // p_handoff hands off P from syscall or locked M.
 // Always runs without a current P (_t_->m->p==NULL)
-static void p_handoff(P* _p_) {
-  trace("TODO");
+static void p_handoff(P* _p_) { // [go: handoffp]
+  trace("P#%u", _p_->id);
+  // p_handoff must start an M in any situation where s_findrunnable would return a T
+  // to run on _p_.
+
+  // if it has local work, start it straight away
+  if (!p_runqempty(_p_) || S.runqsize != 0) {
+    p_startm(_p_, false);
+    return;
+  }
+
+  // no local work, check that there are no spinning/idle M's,
+  // otherwise our help is not required
+  i32 zero = 0;
+  if (AtomicLoad(&S.nmspinning) + (i32)AtomicLoad(&S.npidle) == 0 &&
+      AtomicCAS(&S.nmspinning, &zero, 1))
+  {
+    p_startm(_p_, true);
+    return;
+  }
+
+  mtx_lock(&S.lock);
+  if (S.runqsize != 0) {
+    mtx_unlock(&S.lock);
+    p_startm(_p_, false);
+    return;
+  }
+  // If this is the last running P and nobody is polling network,
+  // need to wakeup another M to poll network.
+  if (AtomicLoad(&S.npidle) == AtomicLoad(&S.maxprocs) - 1 && AtomicLoad(&S.lastpoll) != 0) {
+    mtx_unlock(&S.lock);
+    p_startm(_p_, false);
+    return;
+  }
+
+  // S.lock must not be held when calling s_wakenetpoller below since it may call p_wake
+  i64 when = AtomicLoad(&_p_->timer0When);
+  s_pidleput(_p_);
+  mtx_unlock(&S.lock);
+
+  if (when != 0)
+    s_wakenetpoller(when);
 }
 
 // m_exit tears down and exits the current thread.
@@ -1726,10 +2099,88 @@ void s_runqputhead(T* t) {
   S.runqsize++;
 }
 
+// s_runqputbatch puts a batch of n Ts on the global runnable queue. S must be locked.
+// After this batch must not be used.
+static void s_runqputbatch(TQueue* batch, u32 n) {
+  TQueuePushBackAll(&S.runq, batch);
+  S.runqsize += n;
+  *batch = (TQueue){0};
+}
+
+// s_startidle starts up to n Ms for idle Ps
+static void s_startidle(u32 n) {
+  for (; n != 0 && AtomicLoad(&S.npidle) != 0; n--)
+    p_startm(NULL, /*spinning*/false);
+}
+
+// s_injectlist adds each runnable T on list to some run queue, and clears list.
+// If there is no current P, they are added to the global queue, and up to npidle Ms are
+// started to run them.
+// Otherwise, for each idle P, this adds a T to the global queue and starts an M.
+// Any remaining Ts are added to the current P's local run queue.
+// This may temporarily acquire S.lock.
+// Can run concurrently with GC.
+static void s_injectlist(TList* list) {
+  if (TListEmpty(list))
+    return;
+
+  // Mark all the Ts as runnable before we put them on the run queues
+  TQueue q = { .head = list->head };
+  u32 n = 0;
+  for (T* t = list->head; t != NULL; t = t->schedlink) {
+    q.tail = t;
+    n++;
+    t_casstatus(t, TWaiting, TRunnable);
+  }
+  *list = (TList){0};
+  trace("%u Ts", n);
+
+  P* pp = t_get()->m->p;
+  if (pp == NULL) {
+    mtx_lock(&S.lock);
+    s_runqputbatch(&q, n);
+    mtx_unlock(&S.lock);
+    s_startidle(n);
+    return;
+  }
+
+  u32 npidle = AtomicLoad(&S.npidle);
+  TQueue globq = {0};
+  u32 n2 = 0;
+  for (; n2 < npidle && !TQueueEmpty(&q); n2++)
+    TQueuePushBack(&globq, TQueuePop(&q));
+  if (n2 > 0) {
+    mtx_lock(&S.lock);
+    s_runqputbatch(&globq, n2);
+    mtx_unlock(&S.lock);
+    s_startidle(n2);
+    n -= n2;
+  }
+
+  if (!TQueueEmpty(&q))
+    p_runqputbatch(pp, &q, n);
+}
+
 // s_checkdeadlock checks for deadlock situation.
 // The check is based on number of running M's, if 0 -> deadlock.
+// S.lock must be held.
 static void s_checkdeadlock() { // [go checkdead()]
-  TODO_IMPL;
+  i32 run = (i32)s_mcount() - (i32)S.nmsys - (i32)S.midlecount - (i32)S.nmidlelocked;
+  if (run > 0)
+    return;
+  if (run < 0) {
+    errlog("runtime: checkdead: nmidle=%u nmidlelocked=%u mcount=%u nmsys=%u",
+      S.midlecount, S.nmidlelocked, s_mcount(), S.nmsys);
+    panic("checkdead: inconsistent counts");
+  }
+  // No M is running. Coroutines waiting for I/O are woken up by an M polling the network,
+  // which is not idle. Check for pending timers, which an M must wake up for.
+  for (u32 i = 0; i < S.maxprocs; i++) {
+    if (AtomicLoad(&S.allp[i]->numTimers) > 0)
+      return;
+  }
+  // No coroutine can ever be woken up
+  panic("all coroutines are asleep - deadlock!");
 }
 
 // s_pidleget tries to get a P from S.pidle list. S must be locked.
@@ -1740,6 +2191,11 @@ static P* nullable s_pidleget() {
     vbm_clear(&idlepMask, p->id);
     S.pidle = p->link;
     AtomicSub(&S.npidle, 1);
+    // wake sysmon, which sleeps while all Ps are idle
+    if (AtomicLoad(&S.sysmonwait) != 0) {
+      AtomicStore(&S.sysmonwait, 0);
+      note_wakeup(&S.sysmonnote);
+    }
   }
   return p;
 }
@@ -1772,9 +2228,9 @@ static P* nullable s_pidleget() {
 static void p_update_timerpMask(P* p) {
   if (AtomicLoad(&p->numTimers) > 0)
     return;
-  // Looks like there are no timers, however another P may transiently
-  // decrement numTimers when handling a timerModified timer in
-  // checkTimers. We must take timersLock to serialize with these changes.
+  // Looks like there are no timers, however another P may concurrently
+  // add or remove a timer (e.g. timer_stop of a timer on this P.)
+  // We must take timersLock to serialize with these changes.
   mtx_lock(&p->timersLock);
   if (AtomicLoad(&p->numTimers) == 0) {
     vbm_clear(&timerpMask, p->id);
@@ -2008,6 +2464,21 @@ static P* s_procresize(u32 nprocs) {
       s_runqputhead(p->runnext);
       p->runnext = NULL;
     }
+    // move timers to the current P
+    if (AtomicLoad(&p->numTimers) > 0) {
+      // This is the only case where we hold the timersLock of more than one P,
+      // so there are no deadlock concerns.
+      P* plocal = _m_->p;
+      mtx_lock(&plocal->timersLock);
+      mtx_lock(&p->timersLock);
+      u32 n = AtomicLoad(&p->numTimers);
+      for (u32 i = 0; i < n; i++)
+        p_timer_add(plocal, p->timers[i].t, p->timers[i].when);
+      AtomicStore(&p->numTimers, 0);
+      AtomicStore(&p->timer0When, 0);
+      mtx_unlock(&p->timersLock);
+      mtx_unlock(&plocal->timersLock);
+    }
     // move p.tfree to S.tfree
     p_tfree_purge(p);
     p->status = PDead;
@@ -2059,6 +2530,7 @@ static P* s_procresize(u32 nprocs) {
 // Put it on the queue of T's waiting to run.
 // The compiler turns a go statement into a call to this.
 int sched_spawn(EntryFun fn, uintptr_t arg1, void* stackmem, size_t stacksize) {
+  PREEMPTOFF();
   T* _t_ = t_get();
   assert(fn != NULL);
 
@@ -2073,6 +2545,7 @@ int sched_spawn(EntryFun fn, uintptr_t arg1, void* stackmem, size_t stacksize) {
     lo = align2(lo, STACK_ALIGN);
     stacksize = stacksize - (lo - (uintptr_t)stackmem);
     if (stacksize < STACK_MIN) {
+      m_release(_t_->m);
       errno = EINVAL; // "Invalid argument"
       return -1;
     }
@@ -2080,13 +2553,11 @@ int sched_spawn(EntryFun fn, uintptr_t arg1, void* stackmem, size_t stacksize) {
     newt->fl |= TFlUserStack;
     allt_add(newt);
   } else {
-    // managed memory
-    if (stacksize == 0 || stacksize == STACK_SIZE_DEFAULT) {
-      // default stack size
-      newt = p_tfree_get(_p_);
-      if (newt != NULL)
-        trace("got a spare task from p_tfree_get(_p_) => %p", newt);
-    } // else: custom stacksize (the T won't end up on tfree)
+    // managed memory. Reuse a dead T with a stack of the same size class, if one is cached.
+    // (stacks larger than STACK_CLASS_MAX have no size class and won't end up on tfree)
+    newt = p_tfree_get(_p_, stack_class(stackroundsize(t_stackreqsize(stacksize))));
+    if (newt != NULL)
+      trace("got a spare task from p_tfree_get(_p_) => %p", newt);
     if (newt == NULL) {
       newt = t_alloc(stacksize);
       t_setstatus(newt, TDead); // t_casstatus(newt, TIdle, TDead);
@@ -2096,7 +2567,10 @@ int sched_spawn(EntryFun fn, uintptr_t arg1, void* stackmem, size_t stacksize) {
 
   void* sp = (void*)newt; // T is allocated at the top of the stack
   // trace("setup sp %p (T %p)", sp, newt);
-  exectx_setup(newt->exectx, fn, arg1, sp);
+  newt->fn = fn;
+  newt->arg1 = arg1;
+  newt->preemptoff = 1; // until t_start
+  exectx_setup(newt->exectx, t_start, (uintptr_t)newt, sp);
 
   assert(newt->stack.hi != 0 /* else: newt missing stack */);
   assert(t_readstatus(newt) == TDead);
@@ -2116,8 +2590,12 @@ int sched_spawn(EntryFun fn, uintptr_t arg1, void* stackmem, size_t stacksize) {
   return 0;
 }
 
-// s_stealwork attempts to steal work from other P's
-static inline T* s_stealwork(T* _t_, bool* inheritTime, bool* ranTimer) {
+// s_stealwork attempts to steal work from other P's, or run timers of other P's.
+// *now is the current time or 0, and is updated if the current time was read.
+// *pollUntil is lowered to the time when the earliest of the checked timers expires.
+static inline T* s_stealwork(
+  T* _t_, bool* inheritTime, i64* now, i64* pollUntil, bool* ranTimer)
+{
   M* m = _t_->m;
   if (!m->spinning) {
     trace("marking M#%llu spinning", m->id);
@@ -2151,26 +2629,21 @@ static inline T* s_stealwork(T* _t_, bool* inheritTime, bool* ranTimer) {
       // timerpMask tells us whether the P may have timers at all. If it
       // can't, no need to check at all.
       if (stealTimersOrRunNextT && vbm_read(&timerpMask, randenum_pos(&e))) {
-        trace("TODO: checkTimers");
-        // tnow, w, ran := checkTimers(p2, now)
-        // now = tnow
-        // if w != 0 && (pollUntil == 0 || w < pollUntil) {
-        //   pollUntil = w
-        // }
-        // if ran {
-        //   // Running the timers may have
-        //   // made an arbitrary number of G's
-        //   // ready and added them to this P's
-        //   // local run queue. That invalidates
-        //   // the assumption of runqsteal
-        //   // that is always has room to add
-        //   // stolen G's. So check now if there
-        //   // is a local G to run.
-        //   if gp, inheritTime := runqget(_p_); gp != nil {
-        //     return gp, inheritTime
-        //   }
-        //   ranTimer = true
-        // }
+        i64 w;
+        bool ran = false;
+        *now = p_checktimers(p2, *now, &w, &ran);
+        if (w != 0 && (*pollUntil == 0 || w < *pollUntil))
+          *pollUntil = w;
+        if (ran) {
+          // Running the timers may have made an arbitrary number of Ts ready and added
+          // them to this P's local run queue. That invalidates the assumption of
+          // p_runqsteal that it always has room to add stolen Ts. So check now if there
+          // is a local T to run.
+          T* t = p_runqget(_p_, inheritTime);
+          if (t)
+            return t;
+          *ranTimer = true;
+        }
       }
 
       // Don't bother to attempt to steal if p2 is idle.
@@ -2200,10 +2673,10 @@ static T* s_findrunnable(bool* inheritTime) {
 
 top: {}
   P* _p_ = _t_->m->p;
-  // timers
-  // TODO: now, pollUntil, _ := checkTimers(_p_, 0)
-  u64 now = 0; // second arg to checkTimers returned when there are no timers
-  i64 pollUntil = 0;
+  // run expired timers; note when the next timer expires
+  i64 pollUntil;
+  bool ranTimer = false;
+  i64 now = p_checktimers(_p_, 0, &pollUntil, &ranTimer);
 
   // local runq
   trace("try local runq");
@@ -2223,7 +2696,24 @@ top: {}
     }
   }
 
-  trace("TODO: netpoll");
+  // Poll network.
+  // This netpoll is only an optimization before we resort to stealing.
+  // We can safely skip it if there are no waiters or a thread is blocked in netpoll already.
+  // If there is any kind of logical race with that blocked thread (e.g. it has already
+  // returned from netpoll, but does not set lastpoll yet), this thread will do blocking
+  // netpoll below anyway.
+  if (netpoll_inited() && AtomicLoad(&netpoll_waiters) > 0 && AtomicLoad(&S.lastpoll) != 0) {
+    trace("try netpoll");
+    TList list = netpoll(0); // non-blocking
+    T* t = TListPop(&list);
+    if (t) {
+      s_injectlist(&list);
+      t_casstatus(t, TWaiting, TRunnable);
+      *inheritTime = false;
+      trace("found T#%llu with netpoll", t->id);
+      return t;
+    }
+  }
 
   // Steal work from other P's
   trace("try steal from other P's");
@@ -2236,8 +2726,8 @@ top: {}
   {
     goto stop;
   }
-  bool ranTimer = false;
-  T* t = s_stealwork(_t_, inheritTime, &ranTimer);
+  ranTimer = false;
+  T* t = s_stealwork(_t_, inheritTime, &now, &pollUntil, &ranTimer);
   if (t != NULL)
     return t;
   // Running a timer may have made some goroutine ready
@@ -2249,8 +2739,8 @@ stop: {}
 
   i64 delta = -1;
   if (pollUntil != 0) {
-    // checkTimers ensures that polluntil > now.
-    delta = pollUntil - (i64)now;
+    // p_checktimers ensures that pollUntil > now.
+    delta = pollUntil - now;
   }
 
   // Before we drop our P, make a snapshot of the allp slice, which can change underfoot
@@ -2319,34 +2809,62 @@ stop: {}
 
   // Similar to above, check for timer creation or expiry concurrently with
   // transitioning from spinning to non-spinning. Note that we cannot use
-  // checkTimers here because it calls adjusttimers which may need to allocate
-  // memory, and that isn't allowed when we don't have an active P.
+  // p_checktimers here because timer functions may need a P (e.g. to ready a T.)
   for (u32 id = 0; id < allpLenSnapshot; id++) {
-    // P* _p_ = S.allp[id];
     if (vbm_read(&timerpMaskSnapshot, id)) {
-      TODO_IMPL;
-      //w := nobarrierWakeTime(_p_)
-      //if w != 0 && (pollUntil == 0 || w < pollUntil) {
-      //  pollUntil = w
-      //}
+      i64 w = AtomicLoad(&S.allp[id]->timer0When);
+      if (w != 0 && (pollUntil == 0 || w < pollUntil))
+        pollUntil = w;
     }
   }
   if (pollUntil != 0) {
     if (now == 0)
-      now = nanotime();
-    delta = pollUntil - (i64)now;
+      now = (i64)nanotime();
+    delta = pollUntil - now;
     if (delta < 0)
       delta = 0;
   }
 
-  // // TODO: poll network
-  // if (netpollinited() &&
-  //     (atomic.Load(&netpollWaiters) > 0 || pollUntil != 0) &&
-  //     atomic.Xchg64(&sched.lastpoll, 0) != 0)
-  // {
-  //   // atomic.Store64(&sched.pollUntil, uint64(pollUntil))
-  //   // ...
-  // }
+  // Poll network until next timer.
+  // Only one M blocks in netpoll at a time; S.lastpoll is 0 while an M is polling.
+  if (netpoll_inited() &&
+      (AtomicLoad(&netpoll_waiters) > 0 || pollUntil != 0) &&
+      AtomicSwap(&S.lastpoll, 0) != 0)
+  {
+    AtomicStore(&S.pollUntil, (u64)pollUntil);
+    assert(_t_->m->p == NULL /* netpoll with P */);
+    assert(!_t_->m->spinning /* netpoll with spinning */);
+    trace("block in netpoll (delta %lld)", delta);
+    TList list = netpoll(delta); // block until new work is available
+    AtomicStore(&S.pollUntil, 0);
+    AtomicStore(&S.lastpoll, nanotime());
+    mtx_lock(&S.lock);
+    _p_ = s_pidleget();
+    mtx_unlock(&S.lock);
+    if (_p_ == NULL) {
+      s_injectlist(&list);
+    } else {
+      p_acquire(_p_);
+      T* t = TListPop(&list);
+      if (t) {
+        s_injectlist(&list);
+        t_casstatus(t, TWaiting, TRunnable);
+        *inheritTime = false;
+        trace("found T#%llu with netpoll", t->id);
+        return t;
+      }
+      if (wasSpinning) {
+        _t_->m->spinning = true;
+        AtomicAdd(&S.nmspinning, 1);
+      }
+      goto top;
+    }
+  } else if (pollUntil != 0 && netpoll_inited()) {
+    // Another M is blocked in netpoll; wake it up if it's going to sleep past pollUntil
+    u64 pollerPollUntil = AtomicLoad(&S.pollUntil);
+    if (pollerPollUntil == 0 || pollerPollUntil > (u64)pollUntil)
+      netpoll_break();
+  }
 
   m_stop();
   goto top;
@@ -2395,7 +2913,9 @@ static void NORETURN schedule() {
   if (m->spinning && (pp->runnext != NULL || pp->runqhead != pp->runqtail))
     panic("schedule: spinning with local work");
 
-  // TODO: checkTimers(pp, 0);
+  i64 pollUntil;
+  bool ranTimer = false;
+  p_checktimers(pp, 0, &pollUntil, &ranTimer);
 
   T* t = NULL;
   bool inheritTime = false;
@@ -2447,42 +2967,1931 @@ static void NORETURN schedule() {
 }
 
 
-// sigsave saves the current thread's signal mask into *p.
-// This is used to preserve the non-Go signal mask when a non-Go thread calls a Go function.
-// This is called by needm which may be called on a non-Go thread with no T available.
-static void sigsave(SigSet* p);
+// ===============================================================================================
+// preemption
 //
-// sigrestore sets the current thread's signal mask to sigmask.
-// This is used to restore the non-Go signal mask when a non-Go thread calls a Go function.
-// This is called by s_dropm after T has been cleared.
-static void sigrestore(const SigSet* sigmask);
+// sysmon asks a coroutine that has been running for longer than FORCE_PREEMPT_NS to stop
+// by setting P.preempt and sending its M a SIGPREEMPT signal (m_preempt.)
+// The signal handler runs on the interrupted coroutine's stack. If the coroutine is at an
+// asynchronous safe point (t_asyncsafepoint) the handler saves its execution context and
+// switches to the scheduler, like t_yield does. The interrupted register state stays in the
+// signal frame on the coroutine's stack. When the coroutine is resumed, possibly by another M,
+// the handler returns and the kernel restores the interrupted state.
+//
+// A coroutine is at an async safe point when it's running code of the executable (not libc
+// or other shared libraries, which may be holding locks) on its own stack and is not in the
+// runtime (M.locks and T.preemptoff.) Note that libc linked statically into the executable
+// is not distinguished from user code; set COASYNCPREEMPTOFF=1 for such programs.
+//
+// Since a preempted coroutine may be resumed on a different OS thread, coroutines must not
+// hold on to addresses of thread-local variables. errno is carried over by the handler.
+
+// sig_textrange is the address range of the executable's code
+static struct { uintptr_t lo, hi; } sig_textrange;
+
+// sig_textrange_init initializes sig_textrange.
+// Returns false if asynchronous preemption is not supported on the target.
+static bool sig_textrange_init() {
+  #if R_TARGET_OS_DARWIN
+    unsigned long size = 0;
+    u8* p = getsectiondata(&_mh_execute_header, "__TEXT", "__text", &size);
+    if (!p)
+      return false;
+    sig_textrange.lo = (uintptr_t)p;
+    sig_textrange.hi = (uintptr_t)p + size;
+    return true;
+  #elif defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+    // defined by the linker
+    extern char __executable_start[];
+    extern char etext[];
+    sig_textrange.lo = (uintptr_t)__executable_start;
+    sig_textrange.hi = (uintptr_t)etext;
+    return true;
+  #else
+    return false;
+  #endif
+}
 
-#if R_TARGET_OS_POSIX
-  static void sigsave(SigSet* p) {
-    sigprocmask(SIG_SETMASK, NULL, p);
-  }
-  static void sigrestore(const SigSet* sigmask) {
-    sigprocmask(SIG_SETMASK, sigmask, NULL);
-  }
-#else
-  #error "TODO signal functions for this target"
-#endif
+// sig_ctxpcsp reads the program counter and stack pointer of the interrupted code from
+// the context of a signal handler
+static void sig_ctxpcsp(void* ucp, uintptr_t* pc, uintptr_t* sp) {
+  ucontext_t* uc = ucp;
+  #if R_TARGET_OS_DARWIN && defined(__x86_64__)
+    *pc = (uintptr_t)uc->uc_mcontext->__ss.__rip;
+    *sp = (uintptr_t)uc->uc_mcontext->__ss.__rsp;
+  #elif R_TARGET_OS_DARWIN
+    *pc = (uintptr_t)__darwin_arm_thread_state64_get_pc(uc->uc_mcontext->__ss);
+    *sp = (uintptr_t)__darwin_arm_thread_state64_get_sp(uc->uc_mcontext->__ss);
+  #elif defined(__linux__) && defined(__x86_64__)
+    // REG_RIP (16) and REG_RSP (15) are only defined with _GNU_SOURCE
+    *pc = (uintptr_t)uc->uc_mcontext.gregs[16];
+    *sp = (uintptr_t)uc->uc_mcontext.gregs[15];
+  #elif defined(__linux__) && defined(__aarch64__)
+    *pc = (uintptr_t)uc->uc_mcontext.pc;
+    *sp = (uintptr_t)uc->uc_mcontext.sp;
+  #else
+    *pc = 0;
+    *sp = 0;
+  #endif
+}
 
+// t_preempt1 is called on t0 by t_asyncpreempt
+static void NORETURN t_preempt1(T* t) { // [go: gopreempt_m]
+  trace("T#%llu", t->id);
+  t_casstatus(t, TRunning, TRunnable);
+  m_dropt();
+  // Put t on the global run queue, behind the coroutines waiting on the P's local queue
+  TQueue q = {0};
+  TQueuePushBack(&q, t);
+  mtx_lock(&S.lock);
+  s_runqputbatch(&q, 1);
+  mtx_unlock(&S.lock);
+  schedule();
+}
 
-// void fctx_test();
+// t_asyncpreempt is called by the signal handler to preempt the current coroutine t.
+// Returns when t has been resumed, possibly on a different M.
+static void NO_INLINE t_asyncpreempt(T* t) { // [go: asyncPreempt]
+  int err = errno; // errno of the interrupted code, from the OS thread it ran on
+  // guard against a nested signal preempting t again before we have switched
+  t->preemptoff++;
+  atomic_signal_fence(memory_order_seq_cst);
+  if (exectx_save(t->exectx) == 0)
+    m_call(t, t_preempt1);
+  atomic_signal_fence(memory_order_seq_cst);
+  t->preemptoff--;
+  t_seterrno(err);
+}
 
-// sched_init bootstraps the scheduler.
-// The OS thread it is called on will be bound to m0
-static void sched_init() {
-  // The Go bootstrap sequence is:
-  //  call osinit
-  //  call schedinit
-  //  make & queue new G
-  //    this happens in asm_ARCH.s runtime·rt0_go
-  //    CALL runtime·newproc(runtime·main)
-  //  call runtime·mstart
-  //    CALL runtime·mstart()
-  //
+// t_asyncsafepoint returns true if preemption was requested for the coroutine t,
+// interrupted by a signal with context ucp, and t can be preempted.
+// [go: wantAsyncPreempt, isAsyncSafePoint]
+static bool t_asyncsafepoint(T* t, void* ucp) {
+  M* m = t->m;
+  if (t == &m->t0 || m->curt != t || m->locks > 0 || t->preemptoff > 0)
+    return false;
+  P* p = m->p;
+  if (p == NULL || !AtomicLoad(&p->preempt) || AtomicLoad(&p->status) != PRunning)
+    return false;
+  if (t_readstatus(t) != TRunning)
+    return false;
+  // t must be running code of the executable, on its own stack
+  // (not on t0's stack, as in t_execute just before switching to t)
+  uintptr_t pc, sp;
+  sig_ctxpcsp(ucp, &pc, &sp);
+  return pc >= sig_textrange.lo && pc < sig_textrange.hi &&
+         sp > t->stack.lo && sp <= (uintptr_t)t;
+}
+
+// sig_preempt is the SIGPREEMPT handler
+static void sig_preempt(int sig, siginfo_t* info, void* ucp) { // [go: doSigPreempt]
+  T* t = t_get();
+  if (t == NULL) // not an M (a thread created by the program)
+    return;
+  AtomicStore(&t->m->signalPending, 0); // acknowledge the preemption request
+  if (t_asyncsafepoint(t, ucp))
+    t_asyncpreempt(t);
+}
+
+// m_preempt sends a preemption request to mp [go: preemptM]
+static void m_preempt(M* mp) {
+  // Avoid sending redundant signals to an M that has not yet handled the previous one
+  u32 expect = 0;
+  if (AtomicCAS(&mp->signalPending, &expect, 1))
+    pthread_kill(mp->thread, SIGPREEMPT);
+}
+
+// p_preemptone requests the coroutine running on p to stop.
+// Returns false if no coroutine is running on p. [go: preemptone]
+static bool p_preemptone(P* p) {
+  M* mp = p->m;
+  if (mp == NULL || mp == t_get()->m)
+    return false;
+  T* t = mp->curt;
+  if (t == NULL || t == &mp->t0)
+    return false;
+  AtomicStore(&p->preempt, true);
+  if (!asyncpreemptoff)
+    m_preempt(mp);
+  return true;
+}
+
+
+// ===============================================================================================
+// syscalls
+
+void t_entersyscall() { // [go: reentersyscall]
+  PREEMPTOFF();
+  T* _t_ = t_get();
+  M* m = m_acquire();
+  assert(_t_ != &m->t0 /* must only be called from a coroutine */);
+  trace("T#%llu", _t_->id);
+  t_casstatus(_t_, TRunning, TSyscall);
+  // Leave the P in PSyscall, for the M to take back in t_exitsyscall, unless sysmon retakes
+  // it before then (s_retake)
+  P* p = m->p;
+  m->syscalltick = p->syscalltick;
+  p->m = NULL;
+  m->oldp = p;
+  m->p = NULL;
+  AtomicStore(&p->status, PSyscall);
+  m_release(m);
+}
+
+// m_exitsyscallfast tries to acquire a P for m, returning from a syscall, without
+// involving the scheduler. Prefers oldp, the P m had before the syscall.
+static bool m_exitsyscallfast(M* m, P* nullable oldp) { // [go: exitsyscallfast]
+  // Try to re-acquire the last P
+  PStatus s = PSyscall;
+  if (oldp && AtomicLoad(&oldp->status) == PSyscall &&
+      AtomicCAS(&oldp->status, &s, PIdle))
+  {
+    p_acquire(oldp);
+    return true;
+  }
+  // Try to get any other idle P
+  if (AtomicLoad(&S.npidle) > 0) {
+    mtx_lock(&S.lock);
+    P* p = s_pidleget();
+    mtx_unlock(&S.lock);
+    if (p) {
+      p_acquire(p);
+      return true;
+    }
+  }
+  return false;
+}
+
+// t_exitsyscall0 is called on t0 by t_exitsyscall when no P was available.
+// Puts t on the global run queue and stops the M. [go: exitsyscall0]
+static void NORETURN t_exitsyscall0(T* t) {
+  trace("T#%llu", t->id);
+  t_casstatus(t, TSyscall, TRunnable);
+  m_dropt();
+  mtx_lock(&S.lock);
+  P* p = s_pidleget();
+  if (p == NULL) {
+    TQueue q = {0};
+    TQueuePushBack(&q, t);
+    s_runqputbatch(&q, 1);
+  }
+  mtx_unlock(&S.lock);
+  if (p) {
+    p_acquire(p);
+    t_execute(t, /*inheritTime*/false); // Never returns
+  }
+  m_stop();
+  schedule(); // Never returns
+}
+
+void t_exitsyscall() { // [go: exitsyscall]
+  PREEMPTOFF();
+  T* _t_ = t_get();
+  M* m = m_acquire();
+  if (t_readstatus(_t_) != TSyscall)
+    panic("t_exitsyscall: not in a syscall");
+  P* oldp = m->oldp;
+  m->oldp = NULL;
+  if (m_exitsyscallfast(m, oldp)) {
+    // There's a P for us, so we can run
+    m->p->syscalltick++;
+    t_casstatus(_t_, TSyscall, TRunning);
+    m_release(m);
+    return;
+  }
+  m_release(m);
+  // Let the scheduler run us when there's a P for us
+  if (exectx_save(_t_->exectx) == 0)
+    m_call(_t_, t_exitsyscall0);
+  _t_->m->p->syscalltick++;
+}
+
+
+// ===============================================================================================
+// sysmon
+
+// s_incidlelocked adds v to the number of idle locked Ms.
+// sysmon decrements it while it may make Ts runnable, pretending that one more M is running,
+// so that another M doesn't observe no work and no running Ms and report a deadlock.
+static void s_incidlelocked(i32 v) { // [go: incidlelocked]
+  mtx_lock(&S.lock);
+  S.nmidlelocked += (u32)v;
+  if (v > 0)
+    s_checkdeadlock();
+  mtx_unlock(&S.lock);
+}
+
+// s_timesleepuntil returns the time when the earliest timer of all Ps expires,
+// or INT64_MAX if there are no timers. [go: timeSleepUntil]
+static i64 s_timesleepuntil() {
+  i64 next = INT64_MAX;
+  mtx_lock(&S.allplock);
+  for (u32 i = 0; i < AtomicLoad(&S.maxprocs); i++) {
+    i64 when = AtomicLoad(&S.allp[i]->timer0When);
+    if (when != 0 && when < next)
+      next = when;
+  }
+  mtx_unlock(&S.allplock);
+  return next;
+}
+
+// s_retake retakes Ps blocked in syscalls and preempts coroutines that have been running
+// for longer than FORCE_PREEMPT_NS, or that keep their P from running its expired timers.
+// Returns the number of Ps retaken or preempted.
+// Sets *next to the time when a running coroutine is due to be preempted. [go: retake]
+static u32 s_retake(i64 now, i64* next) {
+  u32 n = 0;
+  *next = INT64_MAX;
+  mtx_lock(&S.allplock);
+  for (u32 i = 0; i < AtomicLoad(&S.maxprocs); i++) {
+    P* p = S.allp[i];
+    PStatus s = AtomicLoad(&p->status);
+    bool sysretake = false;
+    if (s == PRunning || s == PSyscall) {
+      // Preempt T if it's running for too long.
+      // schedtick is incremented whenever a T starts a new time slice (t_execute.)
+      u32 t = p->schedtick;
+      if (p->sysmontick.schedtick != t) {
+        p->sysmontick.schedtick = t;
+        p->sysmontick.schedwhen = now;
+      } else if (p->sysmontick.schedwhen + FORCE_PREEMPT_NS <= now) {
+        if (p_preemptone(p))
+          n++;
+        // In case of syscall, p_preemptone doesn't work, because there is no M wired to P
+        sysretake = true;
+      }
+      if (s == PRunning && !sysretake) {
+        // A P only runs its timers when it schedules. Rather than having the timers wait
+        // for the end of the time slice, preempt T when they expire.
+        i64 due = p->sysmontick.schedwhen + FORCE_PREEMPT_NS;
+        i64 when = AtomicLoad(&p->timer0When);
+        if (when != 0 && when < due)
+          due = when;
+        if (due > now) {
+          *next = MIN(*next, due);
+        } else if (p->sysmontick.schedwhen < now && p_preemptone(p)) {
+          n++;
+        }
+      }
+    }
+    if (s == PSyscall) {
+      // Retake P from syscall if it's there for more than 1 sysmon tick (at least 20us)
+      u32 t = p->syscalltick;
+      if (!sysretake && p->sysmontick.syscalltick != t) {
+        p->sysmontick.syscalltick = t;
+        p->sysmontick.syscallwhen = now;
+        continue;
+      }
+      // On the one hand we don't want to retake Ps if there is no other work to do,
+      // but on the other hand we want to retake them eventually
+      // because they can prevent sysmon from sleeping.
+      if (p_runqempty(p) &&
+          (u32)AtomicLoad(&S.nmspinning) + AtomicLoad(&S.npidle) > 0 &&
+          p->sysmontick.syscallwhen + 10*1000*1000 > now)
+      {
+        continue;
+      }
+      // Drop allplock so we can take S.lock
+      mtx_unlock(&S.allplock);
+      // Need to decrement number of idle locked M's (pretending that one more is running)
+      // before the CAS. Otherwise the M from which we retake can exit the syscall,
+      // increment nmidle and report deadlock.
+      s_incidlelocked(-1);
+      if (AtomicCAS(&p->status, &s, PIdle)) {
+        n++;
+        p->syscalltick++;
+        p_handoff(p);
+      }
+      s_incidlelocked(1);
+      mtx_lock(&S.allplock);
+    }
+  }
+  mtx_unlock(&S.allplock);
+  return n;
+}
+
+// sysmon runs on a dedicated M without a P, so it keeps running when all Ps are busy.
+// It polls the network if no M has done so for a while, starts an M for overdue timers,
+// retakes Ps from Ms blocked in syscalls and preempts long-running coroutines.
+// While all Ps are idle it sleeps until a P is taken off the idle list (s_pidleget) or the
+// next timer is due. [go: sysmon]
+static void sysmon() {
+  mtx_lock(&S.lock);
+  S.nmsys++;
+  s_checkdeadlock();
+  mtx_unlock(&S.lock);
+
+  u32 idle = 0;  // how many cycles in succession we had not woken somebody up
+  u32 delay = 0; // microseconds
+  i64 next = INT64_MAX; // when a coroutine is due to be preempted (s_retake)
+  while (1) {
+    if (idle == 0) { // start with 20us sleep...
+      delay = 20;
+    } else if (idle > 50) { // start doubling the sleep after 1ms...
+      delay *= 2;
+    }
+    if (delay > 10*1000) // up to 10ms
+      delay = 10*1000;
+    // don't sleep past the next preemption
+    i64 now = (i64)nanotime();
+    u32 sleep = delay;
+    if (next != INT64_MAX)
+      sleep = (u32)MAX(20, MIN((i64)delay, (next - now) / 1000));
+    usleep(sleep);
+
+    now = (i64)nanotime();
+    if (AtomicLoad(&S.npidle) == AtomicLoad(&S.maxprocs)) {
+      mtx_lock(&S.lock);
+      if (AtomicLoad(&S.npidle) == AtomicLoad(&S.maxprocs)) {
+        i64 next = s_timesleepuntil();
+        if (next > now) {
+          AtomicStore(&S.sysmonwait, 1);
+          mtx_unlock(&S.lock);
+          bool woken = note_tsleep(&S.sysmonnote, next == INT64_MAX ? -1 : next - now);
+          mtx_lock(&S.lock);
+          AtomicStore(&S.sysmonwait, 0);
+          note_clear(&S.sysmonnote);
+          if (woken) {
+            idle = 0;
+            delay = 20;
+          }
+        }
+      }
+      mtx_unlock(&S.lock);
+      now = (i64)nanotime();
+    }
+
+    // poll network if not polled for more than 10ms
+    u64 lastpoll = AtomicLoad(&S.lastpoll);
+    if (netpoll_inited() && lastpoll != 0 && (i64)lastpoll + 10*1000*1000 < now) {
+      AtomicCAS(&S.lastpoll, &lastpoll, (u64)now);
+      TList list = netpoll(0); // non-blocking
+      if (!TListEmpty(&list)) {
+        s_incidlelocked(-1);
+        s_injectlist(&list);
+        s_incidlelocked(1);
+      }
+    }
+
+    if (s_timesleepuntil() < now) {
+      // There are timers that should have already run, perhaps because there is an
+      // unpreemptible P. Try to start an M to run them.
+      p_startm(NULL, false);
+    }
+
+    // retake Ps blocked in syscalls and preempt long running coroutines
+    if (s_retake(now, &next) != 0) {
+      idle = 0;
+    } else {
+      idle++;
+    }
+  }
+}
+
+
+// ===============================================================================================
+// timers
+//
+// Each P has a 4-ary min-heap of active timers, P.timers, protected by P.timersLock.
+// A 4-ary heap is shallower than a binary heap, so sifting touches fewer cache lines, and
+// heap entries carry a copy of the timer's expiry time so that sifting doesn't need to
+// dereference the timers. A timer records its P and heap index, so timer_stop removes it
+// from the heap right away. (Go instead marks stopped timers as deleted and removes them
+// lazily, which relies on a garbage collector to keep them alive until then.)
+//
+// Timers run when their P schedules (p_checktimers in schedule and s_findrunnable), when
+// another P steals them (s_stealwork) and a P which has nothing to do sleeps in netpoll
+// no longer than until the earliest timer of all Ps. [go: time.go]
+
+// p_timer_siftup moves the heap entry at index i up toward the root of p's timer heap
+static void p_timer_siftup(P* p, u32 i) {
+  TimerWhen* h = p->timers;
+  TimerWhen tw = h[i];
+  while (i > 0) {
+    u32 parent = (i - 1) / 4;
+    if (tw.when >= h[parent].when)
+      break;
+    h[i] = h[parent];
+    h[i].t->i = i;
+    i = parent;
+  }
+  h[i] = tw;
+  tw.t->i = i;
+}
+
+// p_timer_siftdown moves the heap entry at index i down toward the leaves of p's timer heap
+static void p_timer_siftdown(P* p, u32 i) {
+  TimerWhen* h = p->timers;
+  u32 n = AtomicLoad(&p->numTimers);
+  TimerWhen tw = h[i];
+  while (1) {
+    u32 c = i*4 + 1; // leftmost child
+    if (c >= n)
+      break;
+    // find the child which expires first
+    u32 end = MIN(c + 4, n);
+    u32 minc = c;
+    for (u32 j = c + 1; j < end; j++) {
+      if (h[j].when < h[minc].when)
+        minc = j;
+    }
+    if (h[minc].when >= tw.when)
+      break;
+    h[i] = h[minc];
+    h[i].t->i = i;
+    i = minc;
+  }
+  h[i] = tw;
+  tw.t->i = i;
+}
+
+// p_timer_update0 sets p->timer0When to the expiry time of the first timer on p's heap.
+// p->timersLock must be held.
+static void p_timer_update0(P* p) {
+  AtomicStore(&p->timer0When, AtomicLoad(&p->numTimers) == 0 ? 0 : p->timers[0].when);
+}
+
+// p_timer_add adds t to p's timer heap, to expire at when.
+// p->timersLock must be held.
+static void p_timer_add(P* p, Timer* t, i64 when) {
+  u32 n = AtomicLoad(&p->numTimers);
+  if (n == p->timerscap) {
+    p->timerscap = p->timerscap == 0 ? 64 : p->timerscap * 2;
+    p->timers = memrealloc(MemLibC(), p->timers, p->timerscap * sizeof(TimerWhen));
+  }
+  p->timers[n] = (TimerWhen){ .when = when, .t = t };
+  AtomicStore(&p->numTimers, n + 1);
+  AtomicStore(&t->p, p);
+  p_timer_siftup(p, n);
+  p_timer_update0(p);
+}
+
+// p_timer_remove removes the timer at index i from p's timer heap.
+// p->timersLock must be held.
+static void p_timer_remove(P* p, u32 i) {
+  Timer* t = p->timers[i].t;
+  u32 last = AtomicLoad(&p->numTimers) - 1;
+  if (i != last) {
+    p->timers[i] = p->timers[last];
+    p->timers[i].t->i = i;
+  }
+  AtomicStore(&p->numTimers, last);
+  if (i != last) {
+    // the moved entry may belong either above or below i
+    p_timer_siftup(p, i);
+    p_timer_siftdown(p, i);
+  }
+  p_timer_update0(p);
+  AtomicStore(&t->p, NULL);
+}
+
+// p_timer_run runs the first timer on p's heap if it has expired.
+// Returns 0 if it ran a timer, -1 if there are no timers, or the time when the first timer
+// expires. p->timersLock must be held; it is released while the timer function runs.
+// [go: runtimer]
+static i64 p_timer_run(P* p, i64 now) {
+  if (AtomicLoad(&p->numTimers) == 0)
+    return -1;
+  TimerWhen tw = p->timers[0];
+  if (tw.when > now)
+    return tw.when;
+
+  // The owner may reuse t as soon as it's off the heap, so copy what we need to call f
+  Timer* t = tw.t;
+  TimerFun f = t->f;
+  uintptr_t arg = t->arg;
+  uintptr_t seq = t->seq;
+
+  if (t->period > 0) {
+    // Leave in heap but adjust next time to fire
+    i64 when = tw.when + t->period * (1 + (now - tw.when) / t->period);
+    p->timers[0].when = when < 0 ? INT64_MAX : when; // overflow
+    p_timer_siftdown(p, 0);
+    p_timer_update0(p);
+  } else {
+    p_timer_remove(p, 0);
+  }
+
+  mtx_unlock(&p->timersLock);
+  f(arg, seq);
+  mtx_lock(&p->timersLock);
+  return 0;
+}
+
+// p_checktimers runs any timers for p that are ready.
+// If now is not 0 it is the current time.
+// Returns the passed time or the current time if now was 0.
+// Sets *pollUntil to the time when the next timer should run, or 0 if there is no next
+// timer, and sets *ran to true if it ran any timers.
+// Called by the M which owns p, or by another M stealing p's timers. Timers readied by
+// timer functions are put on the run queue of the calling M's P. [go: checkTimers]
+static i64 p_checktimers(P* p, i64 now, i64* pollUntil, bool* ran) {
+  *pollUntil = 0;
+  i64 next = AtomicLoad(&p->timer0When);
+  if (next == 0) // no timers to run
+    return now;
+  if (now == 0)
+    now = (i64)nanotime();
+  if (now < next) {
+    // Next timer is not ready to run
+    *pollUntil = next;
+    return now;
+  }
+
+  mtx_lock(&p->timersLock);
+  while (1) {
+    i64 tw = p_timer_run(p, now);
+    if (tw != 0) {
+      if (tw > 0)
+        *pollUntil = tw;
+      break;
+    }
+    *ran = true;
+  }
+  mtx_unlock(&p->timersLock);
+  return now;
+}
+
+// s_wakenetpoller wakes up the M sleeping in the network poller if it isn't going to wake up
+// before when, or wakes an idle P to service timers and the network poller if there isn't
+// an M in the poller already. [go: wakeNetPoller]
+static void s_wakenetpoller(i64 when) {
+  if (AtomicLoad(&S.lastpoll) == 0) {
+    // In s_findrunnable we ensure that when polling the pollUntil field is either zero or
+    // the time to which the current poll is expected to run. This can have a spurious
+    // wakeup but should never miss a wakeup.
+    u64 pollerPollUntil = AtomicLoad(&S.pollUntil);
+    if (pollerPollUntil == 0 || (i64)pollerPollUntil > when)
+      netpoll_break();
+  } else {
+    // There are no Ms in the network poller; try to get one there so it can handle new
+    // timers.
+    p_wake();
+  }
+}
+
+void timer_start(Timer* t, i64 when) {
+  PREEMPTOFF();
+  if (t->f == NULL)
+    panic("timer_start: timer without function");
+  if (AtomicLoad(&t->p) != NULL)
+    panic("timer_start: timer already active");
+  if (when < 0) {
+    when = INT64_MAX; // nanotime + duration overflowed
+  } else if (when == 0) {
+    when = 1; // P.timer0When uses 0 for "no timers"
+  }
+
+  // Timers rely on the network poller for sleeping; make sure the poller has started
+  netpoll_lazyinit();
+
+  M* mp = m_acquire();
+  P* p = mp->p;
+  mtx_lock(&p->timersLock);
+  p_timer_add(p, t, when);
+  bool first = t->i == 0;
+  mtx_unlock(&p->timersLock);
+  m_release(mp);
+
+  // only a timer which expires before all others on p can make the poller sleep too long
+  if (first)
+    s_wakenetpoller(when);
+}
+
+bool timer_stop(Timer* t) {
+  PREEMPTOFF();
+  while (1) {
+    P* p = AtomicLoad(&t->p);
+    if (p == NULL)
+      return false;
+    mtx_lock(&p->timersLock);
+    // t may have expired or moved to another P while we were waiting for the lock
+    if (AtomicLoad(&t->p) == p) {
+      p_timer_remove(p, t->i);
+      mtx_unlock(&p->timersLock);
+      return true;
+    }
+    mtx_unlock(&p->timersLock);
+  }
+}
+
+bool timer_reset(Timer* t, i64 when) {
+  PREEMPTOFF();
+  bool wasActive = timer_stop(t);
+  timer_start(t, when);
+  return wasActive;
+}
+
+// t_sleep_ready is the timer function of t_sleep
+static void t_sleep_ready(uintptr_t arg, uintptr_t seq) {
+  t_ready((T*)arg, /*next*/true);
+}
+
+// t_sleep_commit is the t_park unlock function of t_sleep.
+// Starts the timer once T is parked, so that it can't be readied before it's waiting.
+static bool t_sleep_commit(T* t, intptr_t when) {
+  timer_start(&t->timer, (i64)when);
+  return true;
+}
+
+void t_sleep(u64 ns) {
+  PREEMPTOFF();
+  if (ns == 0)
+    return;
+  T* _t_ = t_get();
+  i64 when = (i64)(nanotime() + ns);
+  if (when < 0)
+    when = INT64_MAX; // overflow
+  _t_->timer.f = t_sleep_ready;
+  _t_->timer.arg = (uintptr_t)_t_;
+  _t_->timer.seq = 0;
+  _t_->timer.period = 0;
+  t_park(t_sleep_commit, (intptr_t)when);
+}
+
+
+// ===============================================================================================
+// netpoll
+//
+// The network poller parks coroutines waiting for I/O on file descriptors and makes them
+// runnable again when the OS reports readiness. A PollDesc has two binary semaphores, rt and
+// wt, for a reading and a writing coroutine respectively. Each semaphore can be in one of
+// these states:
+//
+//   PD_READY  I/O readiness notification is pending;
+//             a coroutine consumes the notification by changing the state to 0.
+//   PD_WAIT   a coroutine prepares to park on the semaphore, but is not yet parked;
+//             the coroutine commits to park by changing the state to T pointer,
+//             or, alternatively, concurrent I/O notification changes the state to PD_READY,
+//             or, alternatively, concurrent close changes the state to 0.
+//   T*        the coroutine is blocked on the semaphore;
+//             I/O notification or close changes the state to PD_READY or 0 respectively
+//             and unparks the coroutine.
+//   0         none of the above.
+//
+// The poller itself is implemented per OS in netpoll_*.c. [go: netpoll.go]
+
+#define PD_READY ((uintptr_t)1)
+#define PD_WAIT  ((uintptr_t)2)
+
+// pollcache holds free PollDescs.
+// PollDescs are never freed: sched_pollclose puts them here and sched_pollopen reuses them.
+// The OS poller reports events with a pointer to the PollDesc (see netpoll_open) and an event
+// collected just before sched_pollclose unregistered the fd may be handed to netpoll_ready
+// after the PollDesc was closed, or even reused for another fd. Since the memory is always a
+// valid PollDesc, such a stale event can at worst set PD_READY or wake a coroutine waiting on
+// the reused PollDesc. That is a spurious wakeup and harmless: t_read & co retry their I/O,
+// which fails with EAGAIN, and wait again, and sched_pollwait waits again when woken up
+// without readiness or error. Deadline timers tell uses apart by rseq and wseq instead.
+static struct {
+  mtx_t     lock;
+  PollDesc* first;
+} pollcache;
+
+static mtx_t      netpoll_initlock;
+static atomic_u32 netpoll_initstate; // 1 when netpoll_init has completed
+
+// netpoll_inited reports whether the network poller has been initialized
+static inline bool netpoll_inited() {
+  return AtomicLoadAcq(&netpoll_initstate) != 0;
+}
+
+static void netpoll_lazyinit() {
+  if (netpoll_inited())
+    return;
+  mtx_lock(&netpoll_initlock);
+  if (AtomicLoad(&netpoll_initstate) == 0) {
+    netpoll_init();
+    AtomicStoreRel(&netpoll_initstate, 1);
+  }
+  mtx_unlock(&netpoll_initlock);
+}
+
+static PollDesc* pollcache_alloc() {
+  mtx_lock(&pollcache.lock);
+  if (pollcache.first == NULL) {
+    // allocate a page worth of PollDescs at a time
+    u32 n = (u32)(mem_pagesize() / sizeof(PollDesc));
+    if (n == 0)
+      n = 1;
+    PollDesc* mem = (PollDesc*)memalloc(MemLibC(), sizeof(PollDesc) * n);
+    memset(mem, 0, sizeof(PollDesc) * n);
+    for (u32 i = 0; i < n; i++) {
+      mtx_init(&mem[i].lock, mtx_plain);
+      mem[i].link = pollcache.first;
+      pollcache.first = &mem[i];
+    }
+  }
+  PollDesc* pd = pollcache.first;
+  pollcache.first = pd->link;
+  mtx_unlock(&pollcache.lock);
+  return pd;
+}
+
+static void pollcache_free(PollDesc* pd) {
+  mtx_lock(&pollcache.lock);
+  pd->link = pollcache.first;
+  pollcache.first = pd;
+  mtx_unlock(&pollcache.lock);
+}
+
+// netpoll_checkerr returns an errno value for an unusable pd, or 0 if pd is usable
+static int netpoll_checkerr(PollDesc* pd, i32 mode) {
+  if (pd->closing)
+    return EBADF;
+  if ((mode == 'r' && AtomicLoad(&pd->rd) < 0) || (mode == 'w' && AtomicLoad(&pd->wd) < 0))
+    return ETIMEDOUT;
+  return 0;
+}
+
+// netpoll_blockcommit is the t_park unlock function of netpoll_block
+static bool netpoll_blockcommit(T* t, intptr_t tpp) {
+  uintptr_t expect = PD_WAIT;
+  if (!AtomicCAS((_Atomic(uintptr_t)*)tpp, &expect, (uintptr_t)t))
+    return false;
+  // Bump the count of coroutines waiting for the poller.
+  // The scheduler uses this to decide whether to block waiting for the poller if there
+  // is nothing else for it to do.
+  AtomicAdd(&netpoll_waiters, 1);
+  return true;
+}
+
+// netpoll_block returns true if I/O is ready, or false if timed out or closed.
+// waitio: wait only for completed I/O, ignore errors.
+static bool netpoll_block(PollDesc* pd, i32 mode, bool waitio) {
+  _Atomic(uintptr_t)* tpp = mode == 'w' ? &pd->wt : &pd->rt;
+
+  // set the semaphore to PD_WAIT
+  while (1) {
+    // Consume notification if already ready
+    uintptr_t v = PD_READY;
+    if (AtomicCAS(tpp, &v, 0))
+      return true;
+    v = 0;
+    if (AtomicCAS(tpp, &v, PD_WAIT))
+      break;
+    // Double check that this isn't corrupt; otherwise we'd loop forever.
+    if (v != PD_READY && v != 0)
+      panic("netpoll_block: double wait");
+  }
+
+  // need to recheck error states after setting the semaphore to PD_WAIT.
+  // This is necessary because sched_pollclose does the opposite: store to closing,
+  // then load of rt/wt.
+  if (waitio || netpoll_checkerr(pd, mode) == 0)
+    t_park(netpoll_blockcommit, (intptr_t)tpp);
+
+  // be careful to not lose concurrent PD_READY notification
+  uintptr_t old = AtomicSwap(tpp, 0);
+  if (old > PD_WAIT)
+    panic("netpoll_block: corrupted PollDesc");
+  return old == PD_READY;
+}
+
+// netpoll_unblock updates the semaphore of pd for mode and returns the T which is parked
+// on it, if any.
+static T* nullable netpoll_unblock(PollDesc* pd, i32 mode, bool ioready) {
+  _Atomic(uintptr_t)* tpp = mode == 'w' ? &pd->wt : &pd->rt;
+  while (1) {
+    uintptr_t old = AtomicLoad(tpp);
+    if (old == PD_READY)
+      return NULL;
+    if (old == 0 && !ioready) {
+      // Only set PD_READY for ioready. sched_pollwait will check for closing before
+      // waiting.
+      return NULL;
+    }
+    uintptr_t new = ioready ? PD_READY : 0;
+    if (AtomicCAS(tpp, &old, new)) {
+      if (old <= PD_WAIT)
+        return NULL;
+      AtomicSub(&netpoll_waiters, 1);
+      return (T*)old;
+    }
+  }
+}
+
+// netpoll_ready is called by the platform-specific netpoll code when pd is ready.
+// mode is 'r', 'w', or 'r'+'w' to indicate whether the fd is ready for reading or writing
+// or both. Ts made runnable are added to toRun.
+void netpoll_ready(TList* toRun, PollDesc* pd, i32 mode) {
+  T* rt = NULL;
+  T* wt = NULL;
+  if (mode == 'r' || mode == 'r'+'w')
+    rt = netpoll_unblock(pd, 'r', true);
+  if (mode == 'w' || mode == 'r'+'w')
+    wt = netpoll_unblock(pd, 'w', true);
+  if (rt)
+    TListPush(toRun, rt);
+  if (wt)
+    TListPush(toRun, wt);
+}
+
+
+PollDesc* sched_pollopen(int fd) {
+  PREEMPTOFF();
+  netpoll_lazyinit();
+
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    return NULL;
+
+  PollDesc* pd = pollcache_alloc();
+  mtx_lock(&pd->lock);
+  uintptr_t rt = AtomicLoad(&pd->rt);
+  uintptr_t wt = AtomicLoad(&pd->wt);
+  if (rt > PD_WAIT || wt > PD_WAIT)
+    panic("sched_pollopen: blocked read or write on free PollDesc");
+  pd->fd = fd;
+  pd->closing = false;
+  AtomicStore(&pd->rt, 0);
+  AtomicStore(&pd->wt, 0);
+  AtomicStore(&pd->rd, 0);
+  AtomicStore(&pd->wd, 0);
+  // rseq and wseq are not reset; they tell timers of a previous use of pd apart
+  mtx_unlock(&pd->lock);
+
+  int err = netpoll_open(fd, pd);
+  if (err != 0) {
+    pollcache_free(pd);
+    errno = err;
+    return NULL;
+  }
+  trace("fd %d", fd);
+  return pd;
+}
+
+void sched_pollunblock(PollDesc* pd) {
+  PREEMPTOFF();
+  trace("fd %d", pd->fd);
+  mtx_lock(&pd->lock);
+  if (pd->closing)
+    panic("sched_pollunblock: already closing fd %d", pd->fd);
+  pd->closing = true;
+  pd->rseq++;
+  pd->wseq++;
+  atomic_thread_fence(memory_order_seq_cst); // store closing before loading rt & wt
+  T* rt = netpoll_unblock(pd, 'r', false);
+  T* wt = netpoll_unblock(pd, 'w', false);
+  timer_stop(&pd->rtimer);
+  timer_stop(&pd->wtimer);
+  mtx_unlock(&pd->lock);
+  if (rt)
+    t_ready(rt, /*next*/true);
+  if (wt)
+    t_ready(wt, /*next*/true);
+}
+
+void sched_pollclose(PollDesc* pd) {
+  PREEMPTOFF();
+  trace("fd %d", pd->fd);
+  mtx_lock(&pd->lock);
+  pd->closing = true;
+  pd->rseq++;
+  pd->wseq++;
+  atomic_thread_fence(memory_order_seq_cst); // store closing before loading rt & wt
+  uintptr_t rt = AtomicLoad(&pd->rt);
+  uintptr_t wt = AtomicLoad(&pd->wt);
+  if (rt > PD_WAIT || wt > PD_WAIT)
+    panic("sched_pollclose: coroutine waiting on fd %d", pd->fd);
+  timer_stop(&pd->rtimer);
+  timer_stop(&pd->wtimer);
+  mtx_unlock(&pd->lock);
+  netpoll_close(pd->fd);
+  pollcache_free(pd);
+}
+
+int sched_pollwait(PollDesc* pd, int mode) {
+  PREEMPTOFF();
+  assert(mode == 'r' || mode == 'w');
+  int err = netpoll_checkerr(pd, mode);
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  while (!netpoll_block(pd, mode, false)) {
+    err = netpoll_checkerr(pd, mode);
+    if (err != 0) {
+      t_seterrno(err);
+      return -1;
+    }
+    // Can happen if a stale notification for a closed & reused PollDesc woke us up.
+    // Pretend it has not happened and retry.
+  }
+  return 0;
+}
+
+// netpoll_deadline is the timer function of pd's read and write deadline timers.
+// arg is the PollDesc and seq the value of pd->rseq or pd->wseq when the timer was started.
+// [go: netpolldeadlineimpl]
+static void netpoll_deadline(PollDesc* pd, uintptr_t seq, i32 mode) {
+  mtx_lock(&pd->lock);
+  // The PollDesc may have been closed and reused, or the deadline changed, after the
+  // timer expired and before we got the lock
+  if (seq != (mode == 'r' ? pd->rseq : pd->wseq)) {
+    mtx_unlock(&pd->lock);
+    return;
+  }
+  // Note: AtomicStore is a full memory barrier between the store to rd/wd and the
+  // load of rt/wt in netpoll_unblock
+  AtomicStore(mode == 'r' ? &pd->rd : &pd->wd, -1);
+  T* t = netpoll_unblock(pd, mode, false);
+  mtx_unlock(&pd->lock);
+  if (t)
+    t_ready(t, /*next*/true);
+}
+
+static void netpoll_readdeadline(uintptr_t arg, uintptr_t seq) {
+  netpoll_deadline((PollDesc*)arg, seq, 'r');
+}
+
+static void netpoll_writedeadline(uintptr_t arg, uintptr_t seq) {
+  netpoll_deadline((PollDesc*)arg, seq, 'w');
+}
+
+// netpoll_setdeadline1 sets pd's deadline for mode ('r' or 'w') to d, which is an absolute
+// time, 0 for "no deadline" or -1 for "expired."
+// pd->lock must be held.
+static void netpoll_setdeadline1(PollDesc* pd, i64 d, i32 mode) {
+  _Atomic(i64)* dp = mode == 'r' ? &pd->rd : &pd->wd;
+  uintptr_t* seqp = mode == 'r' ? &pd->rseq : &pd->wseq;
+  Timer* timer = mode == 'r' ? &pd->rtimer : &pd->wtimer;
+  if (AtomicLoad(dp) == d)
+    return;
+  AtomicStore(dp, d);
+  // Invalidate the current timer, in case it has expired and is about to run
+  (*seqp)++;
+  timer_stop(timer);
+  if (d > 0) {
+    timer->f = mode == 'r' ? netpoll_readdeadline : netpoll_writedeadline;
+    timer->arg = (uintptr_t)pd;
+    timer->seq = *seqp;
+    timer->period = 0;
+    timer_start(timer, d);
+  }
+}
+
+int sched_pollsetdeadline(PollDesc* pd, u64 deadline, int mode) {
+  PREEMPTOFF();
+  assert(mode == 'r' || mode == 'w' || mode == 'r'+'w');
+  mtx_lock(&pd->lock);
+  if (pd->closing) {
+    mtx_unlock(&pd->lock);
+    errno = EBADF;
+    return -1;
+  }
+  i64 d = (i64)deadline;
+  if (deadline > (u64)INT64_MAX) {
+    d = INT64_MAX;
+  } else if (d != 0 && d <= (i64)nanotime()) {
+    d = -1; // already expired
+  }
+  if (mode == 'r' || mode == 'r'+'w')
+    netpoll_setdeadline1(pd, d, 'r');
+  if (mode == 'w' || mode == 'r'+'w')
+    netpoll_setdeadline1(pd, d, 'w');
+
+  // If we set the new deadline in the past, unblock currently pending I/O if any
+  T* rt = NULL;
+  T* wt = NULL;
+  if (AtomicLoad(&pd->rd) < 0)
+    rt = netpoll_unblock(pd, 'r', false);
+  if (AtomicLoad(&pd->wd) < 0)
+    wt = netpoll_unblock(pd, 'w', false);
+  mtx_unlock(&pd->lock);
+  if (rt)
+    t_ready(rt, /*next*/true);
+  if (wt)
+    t_ready(wt, /*next*/true);
+  return 0;
+}
+
+// netpoll_prepare checks that pd can be used for I/O in mode before trying the I/O.
+// Returns 0 if it can, or -1 with errno set (see netpoll_checkerr.)
+static int netpoll_prepare(PollDesc* pd, i32 mode) {
+  int err = netpoll_checkerr(pd, mode);
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+ssize_t t_read(PollDesc* pd, void* buf, size_t nbyte) {
+  PREEMPTOFF();
+  if (netpoll_prepare(pd, 'r') != 0)
+    return -1;
+  while (1) {
+    ssize_t n = read(pd->fd, buf, nbyte);
+    if (n >= 0)
+      return n;
+    int err = t_errno();
+    if (err == EINTR)
+      continue;
+    if (err != EAGAIN && err != EWOULDBLOCK)
+      return -1;
+    if (sched_pollwait(pd, 'r') != 0)
+      return -1;
+  }
+}
+
+ssize_t t_write(PollDesc* pd, const void* buf, size_t nbyte) {
+  PREEMPTOFF();
+  if (netpoll_prepare(pd, 'w') != 0)
+    return -1;
+  size_t nw = 0;
+  while (nw < nbyte) {
+    ssize_t n = write(pd->fd, (const u8*)buf + nw, nbyte - nw);
+    if (n >= 0) {
+      nw += (size_t)n;
+      continue;
+    }
+    int err = t_errno();
+    if (err == EINTR)
+      continue;
+    if (err != EAGAIN && err != EWOULDBLOCK)
+      return -1;
+    if (sched_pollwait(pd, 'w') != 0)
+      return -1;
+  }
+  return (ssize_t)nw;
+}
+
+int t_accept(PollDesc* pd, struct sockaddr* addr, socklen_t* addrlen) {
+  PREEMPTOFF();
+  if (netpoll_prepare(pd, 'r') != 0)
+    return -1;
+  while (1) {
+    int fd = accept(pd->fd, addr, addrlen);
+    if (fd >= 0)
+      return fd;
+    int err = t_errno();
+    if (err == EINTR || err == ECONNABORTED)
+      continue;
+    if (err != EAGAIN && err != EWOULDBLOCK)
+      return -1;
+    if (sched_pollwait(pd, 'r') != 0)
+      return -1;
+  }
+}
+
+int t_connect(PollDesc* pd, const struct sockaddr* addr, socklen_t addrlen) {
+  PREEMPTOFF();
+  if (netpoll_prepare(pd, 'w') != 0)
+    return -1;
+  if (connect(pd->fd, addr, addrlen) == 0)
+    return 0;
+  int err = t_errno();
+  if (err != EINPROGRESS && err != EINTR)
+    return -1;
+  // connection is being established; the socket becomes writable when it's done
+  if (sched_pollwait(pd, 'w') != 0)
+    return -1;
+  err = 0;
+  socklen_t errlen = sizeof(err);
+  if (getsockopt(pd->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) != 0)
+    return -1;
+  if (err != 0) {
+    t_seterrno(err);
+    return -1;
+  }
+  return 0;
+}
+
+
+// ===============================================================================================
+// channels
+//
+// A T blocked on a channel is represented by a Waiter on the channel's send or receive
+// wait queue. The T which later communicates with it copies the value directly to or from
+// the Waiter's elem, then readies the blocked T to run next on its own P (t_ready with next.)
+// chan_select enqueues one Waiter per case and parks until one of them is chosen; T.selectDone
+// makes sure that only one waker wins. [go: chan.go, select.go]
+//
+// Invariants:
+//   At least one of c.sendq and c.recvq is empty, except for an unbuffered channel with
+//   a single T blocked on it for both sending and receiving using chan_select.
+//   For buffered channels, also:
+//     chan_qcount(c) > 0 implies that c.recvq is empty.
+//     chan_qcount(c) < c.dataqsiz implies that c.sendq is empty.
+//
+// Buffered channels have a fast path for the common case of one sender and one receiver.
+// A sender which can take c.sendtok, finds no receiver waiting and finds space in the buffer
+// puts its value in the buffer without locking c; a receiver does the same with c.recvtok.
+// While the tokens are held the buffer is a single-producer single-consumer ring: a sender and
+// a receiver only synchronize through nsent and nrecv. Locked code holds both tokens, so the
+// fast path never runs concurrently with code that parks or readies Ts. When a token is taken
+// (by another sender or receiver, or by locked code) or a T must be readied or parked, the
+// operation falls back to locking c.
+
+// WaitQEnqueue adds w to the tail of q
+static void WaitQEnqueue(WaitQ* q, Waiter* w) {
+  w->next = NULL;
+  Waiter* x = q->last;
+  if (x == NULL) {
+    w->prev = NULL;
+    q->first = w;
+    q->last = w;
+    return;
+  }
+  w->prev = x;
+  x->next = w;
+  q->last = w;
+}
+
+// WaitQDequeue removes and returns the first Waiter in q whose T can be woken up.
+// Returns NULL if q is empty.
+static Waiter* nullable WaitQDequeue(WaitQ* q) {
+  while (1) {
+    Waiter* w = q->first;
+    if (w == NULL)
+      return NULL;
+    Waiter* y = w->next;
+    if (y == NULL) {
+      q->first = NULL;
+      q->last = NULL;
+    } else {
+      y->prev = NULL;
+      q->first = y;
+      w->next = NULL; // mark as removed (see WaitQRemove)
+    }
+    // If a T was put on this queue because of a select, there is a small window between the
+    // T being woken up by a different case and it grabbing the channel locks. Once it has the
+    // lock it removes itself from the queue, so we won't see it after that. T.selectDone tells
+    // us when someone else has won the race to signal the T but it hasn't removed itself from
+    // the queue yet.
+    u32 zero = 0;
+    if (w->isSelect && !AtomicCAS(&w->t->selectDone, &zero, 1))
+      continue;
+    return w;
+  }
+}
+
+// WaitQRemove removes w from q, unless w has already been removed
+static void WaitQRemove(WaitQ* q, Waiter* w) {
+  Waiter* x = w->prev;
+  Waiter* y = w->next;
+  if (x != NULL) {
+    if (y != NULL) { // middle of queue
+      x->next = y;
+      y->prev = x;
+      w->next = NULL;
+      w->prev = NULL;
+      return;
+    }
+    // end of queue
+    x->next = NULL;
+    q->last = x;
+    w->prev = NULL;
+    return;
+  }
+  if (y != NULL) { // start of queue
+    y->prev = NULL;
+    q->first = y;
+    w->next = NULL;
+    return;
+  }
+  // x==y==NULL. Either w is the only element in the queue, or it has already been removed.
+  // Use q.first to disambiguate.
+  if (q->first == w) {
+    q->first = NULL;
+    q->last = NULL;
+  }
+}
+
+// chanbuf returns a pointer to the i'th slot in c's buffer
+static inline void* chanbuf(Chan* c, u32 i) {
+  return c->buf + (uintptr_t)i * c->elemsize;
+}
+
+// chan_qcount returns the number of values in c's buffer
+static inline u32 chan_qcount(const Chan* c) {
+  return AtomicLoad(&c->nsent) - AtomicLoad(&c->nrecv);
+}
+
+// chan_bufput adds the value at elem to the tail of c's buffer, which must not be full.
+// The caller must hold c.sendtok.
+static void chan_bufput(Chan* c, const void* elem) {
+  memcpy(chanbuf(c, c->sendx), elem, c->elemsize);
+  if (++c->sendx == c->dataqsiz)
+    c->sendx = 0;
+  AtomicStoreRel(&c->nsent, AtomicLoad(&c->nsent) + 1); // publish the value to receivers
+}
+
+// chan_bufget removes the value at the head of c's buffer, which must not be empty, and
+// stores it at elem unless elem is NULL. The caller must hold c.recvtok.
+static void chan_bufget(Chan* c, void* nullable elem) {
+  if (elem)
+    memcpy(elem, chanbuf(c, c->recvx), c->elemsize);
+  if (++c->recvx == c->dataqsiz)
+    c->recvx = 0;
+  AtomicStoreRel(&c->nrecv, AtomicLoad(&c->nrecv) + 1); // hand the slot back to senders
+}
+
+// chan_tokacquire takes token tok (c.sendtok or c.recvtok) for code which has locked c
+static void chan_tokacquire(atomic_u32* tok) {
+  // The fast path only holds a token while copying a value, so spin before backing off
+  for (u32 i = 0; ; i++) {
+    u32 free = 0;
+    if (AtomicLoad(tok) == 0 && AtomicCAS(tok, &free, 1))
+      return;
+    if (i >= 100)
+      usleep(3); // the token holder is probably not running
+  }
+}
+
+// chan_lock locks c. For a buffered channel this also waits for the fast path to finish.
+static void chan_lock(Chan* c) {
+  mtx_lock(&c->lock);
+  if (c->dataqsiz > 0) {
+    chan_tokacquire(&c->sendtok);
+    chan_tokacquire(&c->recvtok);
+  }
+}
+
+static void chan_unlock(Chan* c) {
+  if (c->dataqsiz > 0) {
+    AtomicStoreRel(&c->recvtok, 0);
+    AtomicStoreRel(&c->sendtok, 0);
+  }
+  mtx_unlock(&c->lock);
+}
+
+// chan_sendfast tries to put the value at elem in the buffer of buffered channel c without
+// locking c. Returns false if the send needs to lock c.
+static bool chan_sendfast(Chan* c, const void* elem) {
+  u32 free = 0;
+  if (!AtomicCAS(&c->sendtok, &free, 1))
+    return false;
+  // While we hold c.sendtok no locked code is running; c.recvq and c.closed are stable.
+  // Load nrecv with acquire to order our write to the slot after the receiver's read of it.
+  bool ok = c->recvq.first == NULL && AtomicLoad(&c->closed) == 0 &&
+            AtomicLoad(&c->nsent) - AtomicLoadAcq(&c->nrecv) < c->dataqsiz;
+  if (ok)
+    chan_bufput(c, elem);
+  AtomicStoreRel(&c->sendtok, 0);
+  return ok;
+}
+
+// chan_recvfast tries to take a value from the buffer of buffered channel c without locking c.
+// Returns false if the receive needs to lock c.
+static bool chan_recvfast(Chan* c, void* nullable elem) {
+  u32 free = 0;
+  if (!AtomicCAS(&c->recvtok, &free, 1))
+    return false;
+  // While we hold c.recvtok no locked code is running; c.sendq is stable.
+  // Load nsent with acquire to order our read of the slot after the sender's write to it.
+  bool ok = c->sendq.first == NULL && AtomicLoadAcq(&c->nsent) != AtomicLoad(&c->nrecv);
+  if (ok)
+    chan_bufget(c, elem);
+  AtomicStoreRel(&c->recvtok, 0);
+  return ok;
+}
+
+// chan_full reports whether a send on c would block (that is, the channel is full).
+// It uses a single word-sized read of mutable state, so although the answer is instantaneously
+// true, the correct answer may have changed by the time the calling function receives the
+// return value.
+static bool chan_full(Chan* c) {
+  // c.dataqsiz is immutable (never written after the channel is created) so it is safe to
+  // read at any time during channel operation.
+  if (c->dataqsiz == 0) {
+    // Assumes that a pointer read is relaxed-atomic.
+    return __atomic_load_n(&c->recvq.first, __ATOMIC_RELAXED) == NULL;
+  }
+  return chan_qcount(c) == c->dataqsiz;
+}
+
+// chan_empty reports whether a read from c would block (that is, the channel is empty).
+// It uses a single atomic read of mutable state.
+static bool chan_empty(Chan* c) {
+  if (c->dataqsiz == 0)
+    return __atomic_load_n(&c->sendq.first, __ATOMIC_RELAXED) == NULL;
+  return chan_qcount(c) == 0;
+}
+
+// chan_parkcommit is the t_park unlock function of a T blocked on channel c
+static bool chan_parkcommit(T* t, intptr_t c) {
+  chan_unlock((Chan*)c);
+  return true;
+}
+
+// chan_sendto completes a send to receiver w, which the caller has dequeued from c.recvq while
+// holding c's lock: the value at elem is copied directly to the receiver, bypassing the buffer.
+// The caller must then unlock c and ready w.t with t_ready(w.t, true).
+static void chan_sendto(Chan* c, Waiter* w, const void* elem) {
+  if (w->elem) {
+    memcpy(w->elem, elem, c->elemsize);
+    w->elem = NULL;
+  }
+  w->success = true;
+  w->t->param = w;
+}
+
+// chan_recvfrom completes a receive from sender w, which the caller has dequeued from c.sendq
+// while holding c's lock. For an unbuffered channel the value is copied directly from the
+// sender. Otherwise the buffer is full: we take the value at its head and the sender's value
+// goes to its tail, which is the same slot.
+// The caller must then unlock c and ready w.t with t_ready(w.t, true).
+static void chan_recvfrom(Chan* c, Waiter* w, void* nullable elem) {
+  if (c->dataqsiz == 0) {
+    if (elem)
+      memcpy(elem, w->elem, c->elemsize);
+  } else {
+    chan_bufget(c, elem);
+    chan_bufput(c, w->elem);
+  }
+  w->elem = NULL;
+  w->success = true;
+  w->t->param = w;
+}
+
+// chansend sends the value at elem on c.
+// If block is false and the value can't be sent without parking, returns false.
+static bool chansend(Chan* c, const void* elem, bool block) {
+  if (c->dataqsiz > 0 && chan_sendfast(c, elem))
+    return true;
+
+  // Fast path: check for failed non-blocking operation without acquiring the lock.
+  //
+  // After observing that the channel is not closed, we observe that the channel is not
+  // ready for sending. Each of these observations is a single word-sized read (first c.closed
+  // and second chan_full). Because a closed channel cannot transition from 'ready for sending'
+  // to 'not ready for sending', even if the channel is closed between the two observations,
+  // they imply a moment between the two when the channel was both not yet closed and not
+  // ready for sending. We behave as if we observed the channel at that moment, and report
+  // that the send cannot proceed.
+  if (!block && AtomicLoad(&c->closed) == 0 && chan_full(c))
+    return false;
+
+  chan_lock(c);
+
+  if (AtomicLoad(&c->closed) != 0) {
+    chan_unlock(c);
+    panic("send on closed channel");
+  }
+
+  Waiter* w = WaitQDequeue(&c->recvq);
+  if (w) {
+    // Found a waiting receiver. We pass the value we want to send directly to the receiver,
+    // bypassing the channel buffer (if any).
+    T* t = w->t;
+    chan_sendto(c, w, elem);
+    chan_unlock(c);
+    t_ready(t, /*next*/true);
+    return true;
+  }
+
+  if (chan_qcount(c) < c->dataqsiz) {
+    // Space is available in the channel buffer. Enqueue the value to send.
+    chan_bufput(c, elem);
+    chan_unlock(c);
+    return true;
+  }
+
+  if (!block) {
+    chan_unlock(c);
+    return false;
+  }
+
+  // Block on the channel. Some receiver will complete our operation for us.
+  T* t = t_get();
+  Waiter mw = { .t = t, .elem = (void*)elem, .c = c };
+  t->param = NULL;
+  WaitQEnqueue(&c->sendq, &mw);
+  t_park(chan_parkcommit, (intptr_t)c);
+
+  // someone woke us up
+  t->param = NULL;
+  if (!mw.success) {
+    if (AtomicLoad(&c->closed) == 0)
+      panic("chansend: spurious wakeup");
+    panic("send on closed channel");
+  }
+  return true;
+}
+
+// chanrecv receives on c and stores the received value at elem, unless elem is NULL.
+// If block is false and no value is available without parking, returns false.
+// Otherwise, if c is closed, zeroes *elem and returns true with *received set to false.
+// Otherwise, fills in *elem with a value and returns true with *received set to true.
+static bool chanrecv(Chan* c, void* nullable elem, bool block, bool* received) {
+  if (c->dataqsiz > 0 && chan_recvfast(c, elem)) {
+    *received = true;
+    return true;
+  }
+
+  // Fast path: check for failed non-blocking operation without acquiring the lock.
+  if (!block && chan_empty(c)) {
+    // After observing that the channel is not ready for receiving, we observe whether the
+    // channel is closed.
+    //
+    // Reordering of these checks could lead to incorrect behavior when racing with a close.
+    // For example, if the channel was open and not empty, was closed, and then drained,
+    // reordered reads could incorrectly indicate "open and empty". To prevent reordering,
+    // we use acquire loads for both checks, and rely on emptying and closing to happen in
+    // separate critical sections under the same lock. This assumption fails when closing
+    // an unbuffered channel with a blocked send, but that is an error condition anyway.
+    if (AtomicLoadAcq(&c->closed) == 0) {
+      // Because a channel cannot be reopened, the later observation of the channel being
+      // not closed implies that it was also not closed at the moment of the first
+      // observation. We behave as if we observed the channel at that moment and report
+      // that the receive cannot proceed.
+      return false;
+    }
+    // The channel is irreversibly closed. Re-check whether the channel has any pending data
+    // to receive, which could have arrived between the empty and closed checks above.
+    if (chan_empty(c)) {
+      if (elem)
+        memset(elem, 0, c->elemsize);
+      *received = false;
+      return true;
+    }
+  }
+
+  chan_lock(c);
+
+  if (AtomicLoad(&c->closed) != 0) {
+    if (chan_qcount(c) == 0) {
+      chan_unlock(c);
+      if (elem)
+        memset(elem, 0, c->elemsize);
+      *received = false;
+      return true;
+    }
+    // The channel has been closed, but the channel's buffer has data
+  } else {
+    Waiter* w = WaitQDequeue(&c->sendq);
+    if (w) {
+      // Found a waiting sender. If the buffer is size 0, receive the value directly from
+      // the sender. Otherwise, receive from the head of the queue and add the sender's value
+      // to the tail of the queue (both map to the same buffer slot because the queue is full).
+      T* t = w->t;
+      chan_recvfrom(c, w, elem);
+      chan_unlock(c);
+      t_ready(t, /*next*/true);
+      *received = true;
+      return true;
+    }
+  }
+
+  if (chan_qcount(c) > 0) {
+    // Receive directly from queue
+    chan_bufget(c, elem);
+    chan_unlock(c);
+    *received = true;
+    return true;
+  }
+
+  if (!block) {
+    chan_unlock(c);
+    return false;
+  }
+
+  // no sender available: block on this channel
+  T* t = t_get();
+  Waiter mw = { .t = t, .elem = elem, .c = c };
+  t->param = NULL;
+  WaitQEnqueue(&c->recvq, &mw);
+  t_park(chan_parkcommit, (intptr_t)c);
+
+  // someone woke us up
+  t->param = NULL;
+  *received = mw.success;
+  return true;
+}
+
+Chan* chan_new(size_t elemsize, u32 cap) {
+  if (elemsize > 0xFFFF)
+    panic("chan_new: elemsize too large");
+  // the buffer follows Chan in memory
+  size_t bufsize = (size_t)cap * elemsize;
+  Chan* c = (Chan*)memalloc(MemLibC(), sizeof(Chan) + bufsize);
+  memset(c, 0, sizeof(Chan));
+  c->dataqsiz = cap;
+  c->elemsize = (u16)elemsize;
+  c->buf = (u8*)&c[1];
+  mtx_init(&c->lock, mtx_plain);
+  return c;
+}
+
+void chan_free(Chan* c) {
+  assert(c->recvq.first == NULL && c->sendq.first == NULL /* chan_free of channel in use */);
+  mtx_destroy(&c->lock);
+  memfree(MemLibC(), c);
+}
+
+void chan_close(Chan* c) {
+  PREEMPTOFF();
+  chan_lock(c);
+  if (AtomicLoad(&c->closed) != 0) {
+    chan_unlock(c);
+    panic("close of closed channel");
+  }
+  AtomicStoreRel(&c->closed, 1);
+
+  TList tlist = {0};
+
+  // release all readers
+  Waiter* w;
+  while ((w = WaitQDequeue(&c->recvq))) {
+    if (w->elem) {
+      memset(w->elem, 0, c->elemsize);
+      w->elem = NULL;
+    }
+    w->success = false;
+    w->t->param = w;
+    TListPush(&tlist, w->t);
+  }
+
+  // release all writers (they will panic)
+  while ((w = WaitQDequeue(&c->sendq))) {
+    w->elem = NULL;
+    w->success = false;
+    w->t->param = w;
+    TListPush(&tlist, w->t);
+  }
+  chan_unlock(c);
+
+  // Ready all Ts now that we've dropped the channel lock
+  T* t;
+  while ((t = TListPop(&tlist))) {
+    t->schedlink = NULL;
+    t_ready(t, /*next*/true);
+  }
+}
+
+void chan_send(Chan* c, const void* elem) {
+  PREEMPTOFF();
+  chansend(c, elem, /*block*/true);
+}
+
+bool chan_recv(Chan* c, void* elem) {
+  PREEMPTOFF();
+  bool received;
+  chanrecv(c, elem, /*block*/true, &received);
+  return received;
+}
+
+bool chan_trysend(Chan* c, const void* elem) {
+  PREEMPTOFF();
+  return chansend(c, elem, /*block*/false);
+}
+
+bool chan_tryrecv(Chan* c, void* elem, bool* ok) {
+  PREEMPTOFF();
+  bool received = false;
+  bool selected = chanrecv(c, elem, /*block*/false, &received);
+  if (ok)
+    *ok = received;
+  return selected;
+}
+
+u32 chan_len(const Chan* c) {
+  return chan_qcount(c);
+}
+
+u32 chan_cap(const Chan* c) {
+  return c->dataqsiz;
+}
+
+// sellock locks all channels of cases, in lockorder
+static void sellock(ChanCase* cases, const u16* lockorder, u32 n) {
+  Chan* c = NULL;
+  for (u32 i = 0; i < n; i++) {
+    Chan* c0 = cases[lockorder[i]].c;
+    if (c0 != c) {
+      c = c0;
+      chan_lock(c);
+    }
+  }
+}
+
+// selunlock unlocks all channels of cases, in reverse lockorder
+static void selunlock(ChanCase* cases, const u16* lockorder, u32 n) {
+  // We must be very careful here to not touch cases after we have unlocked the last lock,
+  // because cases can be freed right after the last unlock.
+  for (u32 i = n; i-- > 0; ) {
+    Chan* c = cases[lockorder[i]].c;
+    if (i > 0 && c == cases[lockorder[i - 1]].c)
+      continue; // will unlock it on the next iteration
+    chan_unlock(c);
+  }
+}
+
+// selparkcommit is the t_park unlock function of a T blocked in chan_select
+static bool selparkcommit(T* t, intptr_t _) {
+  // This must not access t's stack (see t_park), however the Waiters on t.waiting live on
+  // t's stack. This is fine since t can't be readied before we have unlocked all channels.
+  // Waiters are in lock order on t.waiting; unlock each channel once, after its last Waiter.
+  Chan* lastc = NULL;
+  for (Waiter* w = t->waiting; w != NULL; w = w->waitlink) {
+    if (w->c != lastc && lastc != NULL) {
+      // As soon as we unlock the channel, fields in any Waiter with that channel may change,
+      // including c and waitlink. Since multiple Waiters may have the same channel, we unlock
+      // only after we've passed the last instance of a channel.
+      chan_unlock(lastc);
+    }
+    lastc = w->c;
+  }
+  if (lastc != NULL)
+    chan_unlock(lastc);
+  return true;
+}
+
+int chan_select(ChanCase* cases, u32 ncases, bool block, bool* recvok) {
+  PREEMPTOFF();
+  if (ncases > 0xFFFF)
+    panic("chan_select: too many cases");
+
+  // pollorder is the random order in which cases are tried; lockorder is the order of
+  // channels by address, in which they are locked
+  u16 pollorder[ncases + 1];
+  u16 lockorder[ncases + 1];
+  Waiter waiters[ncases + 1];
+  // The first permutation step below reads pollorder[0] and there may be no cases to order;
+  // initialize so that neither order is ever read uninitialized.
+  pollorder[0] = 0;
+  lockorder[0] = 0;
+
+  // generate permuted order
+  u32 norder = 0;
+  for (u32 i = 0; i < ncases; i++) {
+    // Omit cases without channels from the poll and lock orders
+    if (cases[i].c == NULL)
+      continue;
+    u32 j = fastrandn(norder + 1);
+    pollorder[norder] = pollorder[j];
+    pollorder[j] = (u16)i;
+    norder++;
+  }
+
+  // Sort the cases by channel address to get the locking order.
+  // Simple heap sort, to guarantee n log n time and constant stack footprint.
+  #define SORTKEY(i) ((uintptr_t)cases[(i)].c)
+  for (u32 i = 0; i < norder; i++) {
+    u32 j = i;
+    // Start with the pollorder to permute cases on the same channel
+    uintptr_t c = SORTKEY(pollorder[i]);
+    while (j > 0 && SORTKEY(lockorder[(j - 1) / 2]) < c) {
+      u32 k = (j - 1) / 2;
+      lockorder[j] = lockorder[k];
+      j = k;
+    }
+    lockorder[j] = pollorder[i];
+  }
+  for (u32 i = norder; i-- > 0; ) {
+    u16 o = lockorder[i];
+    uintptr_t c = SORTKEY(o);
+    lockorder[i] = lockorder[0];
+    u32 j = 0;
+    while (1) {
+      u32 k = j*2 + 1;
+      if (k >= i)
+        break;
+      if (k + 1 < i && SORTKEY(lockorder[k]) < SORTKEY(lockorder[k + 1]))
+        k++;
+      if (c < SORTKEY(lockorder[k])) {
+        lockorder[j] = lockorder[k];
+        j = k;
+        continue;
+      }
+      break;
+    }
+    lockorder[j] = o;
+  }
+  #undef SORTKEY
+
+  // lock all the channels involved in the select
+  sellock(cases, lockorder, norder);
+
+  T*        t = t_get();
+  ChanCase* cas;
+  Chan*     c;
+  Waiter*   w;
+  int       casi;
+  bool      recvOK = false;
+
+  // pass 1 - look for something already waiting
+  for (u32 i = 0; i < norder; i++) {
+    casi = (int)pollorder[i];
+    cas = &cases[casi];
+    c = cas->c;
+    if (!cas->send) {
+      w = WaitQDequeue(&c->sendq);
+      if (w)
+        goto recv;
+      if (chan_qcount(c) > 0)
+        goto bufrecv;
+      if (AtomicLoad(&c->closed) != 0)
+        goto rclose;
+    } else {
+      if (AtomicLoad(&c->closed) != 0)
+        goto sclose;
+      w = WaitQDequeue(&c->recvq);
+      if (w)
+        goto send;
+      if (chan_qcount(c) < c->dataqsiz)
+        goto bufsend;
+    }
+  }
+
+  if (!block) {
+    selunlock(cases, lockorder, norder);
+    casi = -1;
+    goto retc;
+  }
+
+  // pass 2 - enqueue on all chans
+  assert(t->waiting == NULL);
+  Waiter** nextp = &t->waiting;
+  for (u32 i = 0; i < norder; i++) {
+    casi = (int)lockorder[i];
+    cas = &cases[casi];
+    w = &waiters[i];
+    *w = (Waiter){ .t = t, .isSelect = true, .elem = cas->elem, .c = cas->c };
+    // Construct waiting list in lock order
+    *nextp = w;
+    nextp = &w->waitlink;
+    if (cas->send) {
+      WaitQEnqueue(&cas->c->sendq, w);
+    } else {
+      WaitQEnqueue(&cas->c->recvq, w);
+    }
+  }
+
+  // wait for someone to wake us up
+  t->param = NULL;
+  t_park(selparkcommit, 0);
+
+  sellock(cases, lockorder, norder);
+
+  AtomicStore(&t->selectDone, 0);
+  Waiter* wokenw = t->param;
+  t->param = NULL;
+
+  // pass 3 - dequeue from unsuccessful chans, otherwise they stack up on quiet channels.
+  // Record the successful case, if any. Waiters on t.waiting are in lock order.
+  casi = -1;
+  cas = NULL;
+  bool caseSuccess = false;
+  t->waiting = NULL;
+  for (u32 i = 0; i < norder; i++) {
+    w = &waiters[i];
+    ChanCase* k = &cases[lockorder[i]];
+    if (w == wokenw) {
+      // w has already been dequeued by the T that woke us up
+      casi = (int)lockorder[i];
+      cas = k;
+      caseSuccess = w->success;
+    } else if (k->send) {
+      WaitQRemove(&k->c->sendq, w);
+    } else {
+      WaitQRemove(&k->c->recvq, w);
+    }
+  }
+
+  if (cas == NULL)
+    panic("chan_select: bad wakeup");
+
+  c = cas->c;
+  if (cas->send) {
+    if (!caseSuccess)
+      goto sclose;
+  } else {
+    recvOK = caseSuccess;
+  }
+  selunlock(cases, lockorder, norder);
+  goto retc;
+
+bufrecv:
+  // can receive from buffer
+  recvOK = true;
+  chan_bufget(c, cas->elem);
+  selunlock(cases, lockorder, norder);
+  goto retc;
+
+bufsend:
+  // can send to buffer
+  chan_bufput(c, cas->elem);
+  selunlock(cases, lockorder, norder);
+  goto retc;
+
+recv: {
+  // can receive from sleeping sender (w)
+  T* wt = w->t;
+  chan_recvfrom(c, w, cas->elem);
+  selunlock(cases, lockorder, norder);
+  t_ready(wt, /*next*/true);
+  recvOK = true;
+  goto retc;
+}
+
+rclose:
+  // read at end of closed channel
+  selunlock(cases, lockorder, norder);
+  recvOK = false;
+  if (cas->elem)
+    memset(cas->elem, 0, c->elemsize);
+  goto retc;
+
+send: {
+  // can send to a sleeping receiver (w)
+  T* wt = w->t;
+  chan_sendto(c, w, cas->elem);
+  selunlock(cases, lockorder, norder);
+  t_ready(wt, /*next*/true);
+  goto retc;
+}
+
+retc:
+  if (recvok)
+    *recvok = recvOK;
+  return casi;
+
+sclose:
+  // send on closed channel
+  selunlock(cases, lockorder, norder);
+  panic("send on closed channel");
+}
+
+
+// sigsave saves the current thread's signal mask into *p.
+// This is used to preserve the non-Go signal mask when a non-Go thread calls a Go function.
+// This is called by needm which may be called on a non-Go thread with no T available.
+static void sigsave(SigSet* p);
+//
+// sigrestore sets the current thread's signal mask to sigmask.
+// This is used to restore the non-Go signal mask when a non-Go thread calls a Go function.
+// This is called by s_dropm after T has been cleared.
+static void sigrestore(const SigSet* sigmask);
+
+#if R_TARGET_OS_POSIX
+  static void sigsave(SigSet* p) {
+    sigprocmask(SIG_SETMASK, NULL, p);
+  }
+  static void sigrestore(const SigSet* sigmask) {
+    sigprocmask(SIG_SETMASK, sigmask, NULL);
+  }
+#else
+  #error "TODO signal functions for this target"
+#endif
+
+
+// void fctx_test();
+
+// sched_init bootstraps the scheduler.
+// The OS thread it is called on will be bound to m0
+static void sched_init() {
+  // The Go bootstrap sequence is:
+  //  call osinit
+  //  call schedinit
+  //  make & queue new G
+  //    this happens in asm_ARCH.s runtime·rt0_go
+  //    CALL runtime·newproc(runtime·main)
+  //  call runtime·mstart
+  //    CALL runtime·mstart()
+  //
 
   memset(&allt, 0, sizeof(allt));
   mtx_init(&allt.lock, mtx_plain);
@@ -2490,6 +4899,8 @@ static void sched_init() {
   mtx_init(&S.lock, mtx_plain);
   mtx_init(&S.allplock, mtx_plain);
   mtx_init(&S.tfree.lock, mtx_plain);
+  mtx_init(&pollcache.lock, mtx_plain);
+  mtx_init(&netpoll_initlock, mtx_plain);
 
   fastrandinit(); // must be done before m_init
   randord_init(&stealOrder);
@@ -2513,6 +4924,10 @@ static void sched_init() {
 
   trace("COMAXPROCS=%u", nprocs);
 
+  // COASYNCPREEMPTOFF=1 disables preemption of long-running coroutines by signals
+  str = getenv("COASYNCPREEMPTOFF");
+  asyncpreemptoff = str && strcmp(str, "1") == 0;
+
   S.lastpoll = nanotime();
 
   mtx_lock(&S.lock);
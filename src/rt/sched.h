@@ -1,4 +1,5 @@
 #pragma once
+#include <sys/socket.h> // socklen_t, struct sockaddr
 ASSUME_NONNULL_BEGIN
 
 // Main scheduling concepts:
@@ -25,5 +26,168 @@ int sched_spawn(EntryFun fn, uintptr_t arg1, void* nullable stackmem, size_t sta
 
 void t_yield();
 
+// Preemption.
+// A coroutine that runs for longer than 10ms without calling into the scheduler is preempted
+// by a signal (SIGURG) so that other coroutines get to run. Runtime functions, libc and other
+// shared libraries are never interrupted by preemption. A preempted coroutine may be resumed
+// on a different OS thread, so coroutines must not keep addresses of thread-local variables
+// across code that may be preempted. Set the environment variable COASYNCPREEMPTOFF=1 to
+// disable preemption.
+
+// t_entersyscall and t_exitsyscall surround a call that may block the OS thread, like a
+// system call or a call into a library doing blocking I/O. While the calling coroutine is
+// blocked, the scheduler may hand its processor to another thread so that other coroutines
+// can run. Calls to the runtime are not allowed in between.
+void t_entersyscall();
+void t_exitsyscall();
+
+// t_sleep parks the calling coroutine for at least ns nanoseconds
+void t_sleep(u64 ns);
+
+// t_errno returns errno of the OS thread the calling coroutine is running on.
+// A coroutine may be resumed on a different OS thread after it parks, and compilers may reuse
+// an address of errno loaded before. Use t_errno to read errno after a call which may park,
+// like t_read.
+int t_errno();
+
+// Timers.
+// A timer calls a function on the scheduler at a certain time (monotonic, see nanotime.)
+// Each P keeps its active timers on a heap; timers are checked whenever a P schedules and
+// the scheduler sleeps no longer than until the earliest timer.
+typedef struct Timer Timer;
+
+// TimerFun is called when a timer expires, with the timer's arg and seq.
+// It runs on the scheduler (not in a coroutine) and must not block.
+typedef void(*TimerFun)(uintptr_t arg, uintptr_t seq);
+
+struct Timer {
+  // set by the owner before calling timer_start:
+  TimerFun  f;
+  uintptr_t arg;
+  uintptr_t seq;
+  i64       period; // if > 0, f is called again every period nanoseconds
+
+  // managed by the scheduler:
+  _Atomic(P*) p; // P whose heap holds the timer, or NULL if the timer is not active
+  u32         i; // index in p's timer heap
+};
+
+// timer_start activates a timer that is not active, to expire at time when (nanotime)
+void timer_start(Timer* t, i64 when);
+
+// timer_stop deactivates t, preventing it from expiring.
+// Returns true if t was active, false if it has already expired (or was never started.)
+// Does not wait for f to complete. The owner may free t after timer_stop returns unless
+// t is periodic and f may be running.
+bool timer_stop(Timer* t);
+
+// timer_reset stops t and starts it again to expire at time when.
+// Returns true if t was active.
+bool timer_reset(Timer* t, i64 when);
+
+// Network poller.
+// A coroutine doing I/O on a file descriptor registered with the poller is parked while the
+// file descriptor is not ready, instead of blocking its OS thread. The scheduler polls for
+// readiness when it looks for work to do.
+typedef struct PollDesc PollDesc;
+
+// sched_pollopen registers fd with the network poller and puts it in non-blocking mode.
+// Returns NULL on error, in which case errno is set.
+PollDesc* nullable sched_pollopen(int fd);
+
+// sched_pollclose unregisters pd's file descriptor from the network poller and frees pd.
+// Does not close the file descriptor. No coroutine may be waiting on pd or use it afterwards;
+// use sched_pollunblock first if other coroutines may be using pd.
+void sched_pollclose(PollDesc* pd);
+
+// sched_pollunblock marks pd as being closed and wakes up coroutines waiting on it.
+// Their I/O, and any I/O on pd started afterwards, fails with EBADF. Once the coroutines
+// using pd are done with it, call sched_pollclose.
+void sched_pollunblock(PollDesc* pd);
+
+// sched_pollwait parks the calling coroutine until pd's file descriptor is ready for reading
+// (mode 'r') or writing (mode 'w').
+// Returns 0 when ready, or -1 with errno set on error (EBADF when pd is being closed,
+// ETIMEDOUT when pd's deadline for mode has passed.)
+int sched_pollwait(PollDesc* pd, int mode);
+
+// sched_pollsetdeadline sets the deadline for reading (mode 'r'), writing ('w') or both
+// ('r'+'w') on pd. deadline is an absolute time (nanotime); 0 means no deadline.
+// Once the deadline has passed, waiting I/O and new I/O on pd for mode fails with ETIMEDOUT,
+// until a new deadline is set.
+// Returns 0 on success, or -1 with errno set to EBADF if pd is being closed.
+int sched_pollsetdeadline(PollDesc* pd, u64 deadline, int mode);
+
+// t_read is like read(2) but parks the calling coroutine until pd is readable
+ssize_t t_read(PollDesc* pd, void* buf, size_t nbyte);
+
+// t_write is like write(2) but parks the calling coroutine until pd is writable.
+// Unlike write(2), t_write writes all of buf unless there's an error.
+ssize_t t_write(PollDesc* pd, const void* buf, size_t nbyte);
+
+// t_accept is like accept(2) but parks the calling coroutine until a connection arrives.
+// The returned file descriptor is not registered with the poller (see sched_pollopen.)
+int t_accept(PollDesc* pd, struct sockaddr* nullable addr, socklen_t* nullable addrlen);
+
+// t_connect is like connect(2) but parks the calling coroutine until the connection
+// is established
+int t_connect(PollDesc* pd, const struct sockaddr* addr, socklen_t addrlen);
+
+// Channels.
+// A channel passes values of a fixed size between coroutines, in the order they were sent.
+// A channel with a buffer (cap > 0) parks a sender only while the buffer is full; an unbuffered
+// channel parks a sender until a receiver has taken the value. A coroutine made runnable by a
+// channel operation runs next on the P of the coroutine that performed the operation, so that
+// coroutines which take turns communicating run back to back.
+typedef struct Chan Chan;
+
+// chan_new creates a channel for values of elemsize bytes with a buffer of cap values
+Chan* chan_new(size_t elemsize, u32 cap);
+
+// chan_free frees c. No coroutine may be using c.
+void chan_free(Chan* c);
+
+// chan_close closes c. Values already sent can still be received; after that, receiving
+// from c yields zeroed values. Coroutines parked sending on c panic. Sending on a closed
+// channel or closing it again panics.
+void chan_close(Chan* c);
+
+// chan_send sends the value at elem on c, parking the calling coroutine until the value has
+// been received or buffered
+void chan_send(Chan* c, const void* elem);
+
+// chan_recv receives a value from c, storing it at elem unless elem is NULL. Parks the
+// calling coroutine until a value is available. Returns false if c is closed and has no
+// values left, in which case elem is zeroed.
+bool chan_recv(Chan* c, void* nullable elem);
+
+// chan_trysend is like chan_send but never parks.
+// Returns false if the value could not be sent right away.
+bool chan_trysend(Chan* c, const void* elem);
+
+// chan_tryrecv is like chan_recv but never parks.
+// Returns false if no value could be received right away; otherwise returns true and sets
+// *ok to what chan_recv would have returned.
+bool chan_tryrecv(Chan* c, void* nullable elem, bool* nullable ok);
+
+// chan_len returns the number of values in c's buffer
+u32 chan_len(const Chan* c);
+
+// chan_cap returns the size of c's buffer
+u32 chan_cap(const Chan* c);
+
+// ChanCase is a send or receive operation for chan_select
+typedef struct ChanCase {
+  Chan* nullable c;    // the case is ignored if c is NULL
+  void* nullable elem; // value to send, or where to store a received value (may be NULL)
+  bool           send; // send on c (rather than receive)
+} ChanCase;
+
+// chan_select performs one of the cases which can proceed, chosen at random, and returns its
+// index. If no case can proceed, parks the calling coroutine until one can. If block is false,
+// returns -1 instead of parking. For a receive case, *recvok is set to what chan_recv would
+// have returned.
+int chan_select(ChanCase* cases, u32 ncases, bool block, bool* nullable recvok);
+
 
 ASSUME_NONNULL_END
@@ -1,10 +1,12 @@
 #pragma once
 
+#include "sched.h"
 #include "exectx/exectx.h"
 
 #include <setjmp.h>
 #if R_TARGET_OS_POSIX
   #include <signal.h> // sigset_t
+  #include <pthread.h> // pthread_t
 #endif
 
 ASSUME_NONNULL_BEGIN
@@ -96,10 +98,32 @@ ASSUME_NONNULL_BEGIN
 // is requested when creating a new coroutine.
 #define STACK_SIZE_DEFAULT 1024*1024 // 1 MiB
 
+// Managed stacks up to STACK_CLASS_MAX are sized in powers of two ("size classes"), including
+// the guard page. Dead T's are cached per size class and reused for new coroutines with a stack
+// of the same class. Larger stacks are not cached.
+#define STACK_CLASS_MIN_SHIFT 13 // 8 KiB
+#define STACK_NCLASSES        11 // 8 KiB ... 8 MiB
+#define STACK_CLASS_MIN       ((size_t)1 << STACK_CLASS_MIN_SHIFT)
+#define STACK_CLASS_MAX       (STACK_CLASS_MIN << (STACK_NCLASSES - 1))
+
+// P_TFREE_MAXBYTES limits the total stack size of T's in a P's local cache of dead T's
+#define P_TFREE_MAXBYTES ((size_t)64*1024*1024) // 64 MiB
+
+// STACK_CACHE_MAX limits the total stack size of T's in the global cache of dead T's (S.tfree).
+// T's beyond this limit are freed (unmapped.) Stacks are allocated lazily, so this is mostly
+// a limit on address space and memory mappings.
+#define STACK_CACHE_MAX ((size_t)1024*1024*1024) // 1 GiB
+
+// STACK_CACHE_DIRTY_MAX limits the total stack size of T's in S.tfree whose memory has not been
+// released to the OS. Beyond this limit, stack memory is released with stackrelease.
+#define STACK_CACHE_DIRTY_MAX ((size_t)64*1024*1024) // 64 MiB
+
 
 typedef struct T T; // Task      (coroutine; "g" in Go parlance)
 typedef struct M M; // Machine   (OS thread)
 typedef struct P P; // Processor (execution resource required to execute a T)
+typedef struct PollDesc PollDesc; // file descriptor registered with the network poller
+typedef struct Waiter   Waiter;   // T waiting on a channel
 
 typedef void(*TFun)(void);
 typedef bool(*TUnlockFun)(T*,intptr_t);
@@ -147,7 +171,8 @@ typedef enum TStatus {
 } TStatus;
 
 typedef enum TFlag {
-  TFlUserStack = 1 << 0, // allocated in user-provided stack memory
+  TFlUserStack     = 1 << 0, // allocated in user-provided stack memory
+  TFlStackReleased = 1 << 1, // stack memory released to the OS while cached (see stackrelease)
 } TFlag;
 
 typedef enum PStatus {
@@ -185,6 +210,13 @@ typedef struct TList {
   T* head;
 } TList;
 
+// TimerWhen is an entry in a P's timer heap.
+// when is a copy of the time the timer expires, kept in the heap for cache locality.
+typedef struct TimerWhen {
+  i64    when;
+  Timer* t;
+} TimerWhen;
+
 typedef struct Note {
   // key holds:
   // a) nullptr when unused.
@@ -212,6 +244,22 @@ typedef struct T {
 
   TFlag fl; // flags (immutable during T life)
 
+  Timer timer; // used by t_sleep
+
+  // preemptoff disables asynchronous preemption of the coroutine while > 0.
+  // Incremented by runtime functions called from the coroutine (see PREEMPTOFF in sched.c.)
+  // Only accessed by the coroutine itself and the signal handler interrupting it.
+  // A T that is not running always has preemptoff > 0 (see t_execute.)
+  u32 preemptoff;
+
+  EntryFun  fn;   // entry function of a new coroutine (see t_start)
+  uintptr_t arg1; // argument to fn
+
+  // channels (see "channels" in sched.c)
+  Waiter*    waiting;    // Waiters of a T blocked in chan_select, in lock order
+  Waiter*    param;      // Waiter which communication woke the T up, set by the waker
+  atomic_u32 selectDone; // 1 when a waker has won the race to wake a T blocked in chan_select
+
   struct { uintptr_t lo, hi; } stack;  // stack addresses
   exectx_state_t               exectx; // execution context state
 } __attribute__((__aligned__(STACK_ALIGN))) T;
@@ -235,6 +283,12 @@ typedef struct M {
   Note       park;
   bool       doespark; // non-P running threads: sysmon and newmHandoff never use .park
   SigSet     sigmask;  // storage for saved signal mask
+  pthread_t  thread;   // OS thread, for signalling the M (m_preempt)
+  P*         oldp;     // the P that was attached before executing a syscall
+  u32        syscalltick; // P.syscalltick at the time of entering a syscall
+
+  // signalPending is 1 while a preemption signal sent to the M has not been handled yet
+  atomic_u32 signalPending;
 
   // mstartfn, if set, runs in m_start1 on the OS thread stack
   void(*mstartfn)(void);
@@ -254,11 +308,20 @@ typedef struct M {
 } M;
 
 struct P {
-  u32      schedtick; // incremented on every scheduler call
-  u32      id;        // corresponds to offset in S.allp
-  PStatus  status;
-  M*       m;         // back-link to associated m (nil if idle)
-  P*       link;
+  u32              schedtick;   // incremented on every scheduler call
+  u32              syscalltick; // incremented on every system call
+  u32              id;          // corresponds to offset in S.allp
+  _Atomic(PStatus) status;
+  M*               m;           // back-link to associated m (nil if idle)
+  P*               link;
+
+  // sysmontick holds the ticks last observed by sysmon (see s_retake)
+  struct {
+    u32 schedtick;
+    i64 schedwhen;
+    u32 syscalltick;
+    i64 syscallwhen;
+  } sysmontick;
 
   // Queue of runnable tasks. Accessed without lock.
   atomic_u32 runqhead;
@@ -275,26 +338,32 @@ struct P {
   // coroutines to the end of the run queue.
   _Atomic(T*) runnext;
 
-  // Ts – local cache of dead T's
-  TList tfree;
-  u32   tfreecount;
+  // Ts – local cache of dead T's, per stack size class
+  TList  tfree[STACK_NCLASSES];
+  u32    tfreecount[STACK_NCLASSES];
+  size_t tfreebytes; // total stack size of T's in tfree
 
   Note park;
 
   // preempt is set to indicate that this P should be enter the
-  // scheduler ASAP (regardless of what G is running on it).
-  bool preempt;
+  // scheduler ASAP (regardless of what T is running on it).
+  // Set by sysmon, cleared by schedule.
+  _Atomic(bool) preempt;
 
   // timers
-  atomic_u32 numTimers; // Number of timers in P's heap
+  TimerWhen*   timers;     // 4-ary min-heap of active timers, ordered by when
+  u32          timerscap;  // capacity of timers
+  atomic_u32   numTimers;  // Number of timers in P's heap
+  _Atomic(i64) timer0When; // when of the first entry on the timer heap, or 0 if empty
   // timersLock is the lock for timers. We normally access the timers while running
   // on this P, but the scheduler can also do it from a different P.
   mtx_t timersLock;
 };
 
 struct S {
-  atomic_u64 tidgen;   // next T.ident
-  atomic_u64 lastpoll; // time of last poll, or 0 if never polled
+  atomic_u64 tidgen;    // next T.ident
+  atomic_u64 lastpoll;  // time of last poll, or 0 if an M is blocked in netpoll
+  atomic_u64 pollUntil; // time to which current poll is sleeping
 
   mtx_t lock; // protects access to runq et al
 
@@ -304,6 +373,7 @@ struct S {
   u32 nmidlelocked; // number of locked m's waiting for work
   i64 mnext;        // number of m's that have been created and next M ID
   u32 maxmcount;    // maximum number of m's allowed (or die)
+  u32 nmsys;        // number of system m's not counted for deadlock
   i64 nmfreed;      // cumulative number of freed m's
 
   // freem is the list of m's waiting to be freed when their
@@ -318,18 +388,131 @@ struct S {
   atomic_u32  npidle;     // number of idling P's at pidle
   atomic_i32  nmspinning; // See "Worker thread parking/unparking" in docs
 
-  // tfree is the global cache of dead T's
+  // tfree is the global cache of dead T's, per stack size class.
+  // Within each list, T's with dirty stacks come before T's with released stacks.
   struct {
-    mtx_t lock;
-    TList l;
-    u32   n;   // total count of Ts
+    mtx_t  lock;
+    TList  l[STACK_NCLASSES];
+    u32    n;          // total count of Ts
+    size_t bytes;      // total stack size of Ts (<= STACK_CACHE_MAX)
+    size_t dirtybytes; // total stack size of Ts without TFlStackReleased
   } tfree;
 
   // runnable queue
   TQueue runq;
   u32    runqsize; // number of T's in runq
 
+  // sysmon sleeps on sysmonnote while all Ps are idle, with sysmonwait set
+  atomic_u32 sysmonwait;
+  Note       sysmonnote;
+
   // TODO: T freelist
 };
 
+// PollDesc is a file descriptor registered with the network poller (sched_pollopen).
+// PollDescs are never freed but recycled through pollcache, so the poller may report stale
+// events for them (see pollcache in sched.c.)
+struct PollDesc {
+  PollDesc* link;    // in pollcache, protected by pollcache.lock
+  int       fd;
+  bool      closing; // set by sched_pollunblock and sched_pollclose
+
+  // rt and wt are semaphores for the T waiting to read and write, respectively.
+  // PD_READY, PD_WAIT, a T* or 0. See "netpoll" in sched.c
+  _Atomic(uintptr_t) rt;
+  _Atomic(uintptr_t) wt;
+
+  // deadlines (sched_pollsetdeadline)
+  mtx_t        lock;   // protects the following fields
+  _Atomic(i64) rd;     // read deadline (nanotime), 0 if none or -1 if expired
+  _Atomic(i64) wd;     // write deadline (nanotime), 0 if none or -1 if expired
+  uintptr_t    rseq;   // protects from stale read timers
+  uintptr_t    wseq;   // protects from stale write timers
+  Timer        rtimer; // read deadline timer
+  Timer        wtimer; // write deadline timer
+};
+
+// Waiter is a T waiting on a channel ("sudog" in Go.)
+// A T blocked in chan_select waits on several channels at once, with one Waiter for each.
+// Waiters live on the stack of the waiting T and are protected by the lock of channel c.
+struct Waiter {
+  T*      t;
+  Waiter* next;
+  Waiter* prev;
+  void*   elem;     // data element (may be NULL)
+  Chan*   c;        // channel
+  Waiter* waitlink; // T.waiting list
+  bool    isSelect; // T is participating in a select
+  // success indicates whether communication over channel c succeeded.
+  // It is true if the T was awoken because a value was delivered over channel c,
+  // and false if awoken because c was closed.
+  bool    success;
+};
+
+// WaitQ is a list of Waiters
+typedef struct WaitQ {
+  Waiter* first;
+  Waiter* last;
+} WaitQ;
+
+// CACHE_LINE_SIZE is the assumed size of a CPU cache line
+#define CACHE_LINE_SIZE 64
+
+// Chan is a channel (see "channels" in sched.c)
+struct Chan {
+  u32        dataqsiz; // size of the circular queue (immutable)
+  u16        elemsize; // size of values (immutable)
+  u8*        buf;      // points to an array of dataqsiz elements of size elemsize (immutable)
+  atomic_u32 closed;   // 1 when closed
+  WaitQ      recvq;    // list of recv waiters
+  WaitQ      sendq;    // list of send waiters
+  mtx_t      lock;     // protects all fields in Chan, together with sendtok and recvtok
+
+  // A buffered channel has a send side and a receive side, each with a token. A sender or
+  // receiver holding the token of its side can access that side without c.lock.
+  // Locked code holds both tokens. The sides are kept on separate cache lines so that
+  // a sender and a receiver don't contend.
+  u8         _pad0[CACHE_LINE_SIZE];
+  atomic_u32 sendtok; // 1 while the send side is held
+  u32        sendx;   // send index
+  atomic_u32 nsent;   // number of values ever put in the buffer (wraps around)
+  u8         _pad1[CACHE_LINE_SIZE];
+  atomic_u32 recvtok; // 1 while the receive side is held
+  u32        recvx;   // receive index
+  atomic_u32 nrecv;   // number of values ever taken from the buffer (wraps around)
+  u8         _pad2[CACHE_LINE_SIZE];
+};
+
+// StackCacheStats describes the caches of dead T's and their stacks (see sched_stackcachestats)
+typedef struct StackCacheStats {
+  size_t pbytes;     // total stack size of T's in the caches of all P's (P.tfree)
+  size_t pbytesmax;  // largest total stack size of T's in the cache of a single P
+  u32    n;          // number of T's in the global cache (S.tfree)
+  size_t bytes;      // total stack size of T's in the global cache
+  size_t dirtybytes; // total stack size of T's in the global cache which have not been released
+} StackCacheStats;
+
+// sched_stackcachestats reads statistics of the caches of dead T's, for tests and debugging.
+// The caches of P's are read without synchronization.
+void sched_stackcachestats(StackCacheStats* st);
+
+// netpoll: platform-specific network poller [implemented in netpoll_*.c]
+//
+// netpoll_init initializes the poller. Called only once, before any other netpoll function.
+// netpoll_open registers fd with the poller, edge-triggered for both reading and writing.
+//   Returns 0 on success or an errno value.
+// netpoll_close unregisters fd. Returns 0 on success or an errno value.
+// netpoll_break wakes up a call to netpoll that is blocked.
+// netpoll checks for ready file descriptors and returns a list of Ts that became runnable.
+//   delay < 0: blocks indefinitely
+//   delay == 0: does not block, just polls
+//   delay > 0: blocks for up to delay nanoseconds
+//   Calls netpoll_ready (sched.c) for each ready PollDesc.
+void  netpoll_init();
+int   netpoll_open(int fd, PollDesc* pd);
+int   netpoll_close(int fd);
+void  netpoll_break();
+TList netpoll(i64 delay);
+void  netpoll_ready(TList* toRun, PollDesc* pd, i32 mode);
+
 ASSUME_NONNULL_END
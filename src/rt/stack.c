@@ -31,27 +31,17 @@
 #endif
 
 
-// Allocates stack memory of approximately reqsize size (aligned to memory page size.)
-// Returns the low address (top of stack; not the SB), the actual size in stacksize_out
-// and guard size in guardsize_out (stacksize_out - guardsize_out = usable stack space.)
-//
-// On platforms that support it, stack memory is allocated "lazily" so that only when a page
-// is used is it actually committed & allocated in actual memory. On POSIX systems mmap is used
-// and on MS Windows VirtualAlloc is used (the latter is currently not implemented.)
-//
-void* stackalloc(size_t reqsize, size_t* stacksize_out, size_t* guardsize_out) {
-
-  // read system page size (mem_pagesize returns a cached value; no syscall)
-  const size_t pagesize = mem_pagesize();
-
-  // additional page to use for stack protection
-  const size_t stack_guard_size =
-    #ifdef USE_MPROTECT
-      pagesize;
-    #else
-      0;
-    #endif
+// stack_guardsize returns the size of the guard page(s) at the low end of a stack
+static size_t stack_guardsize(size_t pagesize) {
+  #ifdef USE_MPROTECT
+    return pagesize; // additional page to use for stack protection
+  #else
+    return 0;
+  #endif
+}
 
+// stack_sizelimit returns the OS resource limit for stack size, aligned to pagesize
+static size_t stack_sizelimit(size_t pagesize) {
   // one-time init of OS resource limit for stack size
   // Note: no need for atomics since this function is called early during bootstrap.
   static size_t stacksize_limit = 0;
@@ -70,16 +60,44 @@ void* stackalloc(size_t reqsize, size_t* stacksize_out, size_t* guardsize_out) {
       if (z > stacksize_limit) // through the ceil[ing]
         stacksize_limit = align2(stacksize_limit - pagesize, pagesize); // floor
       // ensure it's at least one page large
-      stacksize_limit = MAX(stacksize_limit, pagesize + stack_guard_size);
+      stacksize_limit = MAX(stacksize_limit, pagesize + stack_guardsize(pagesize));
     }
   }
+  return stacksize_limit;
+}
+
+
+// stackroundsize returns the actual size of a stack that stackalloc allocates for reqsize.
+// Sizes up to STACK_CLASS_MAX are rounded up to a power of two (a stack size class) so that
+// stacks can be reused for coroutines which request similar stack sizes.
+size_t stackroundsize(size_t reqsize) {
+  // read system page size (mem_pagesize returns a cached value; no syscall)
+  const size_t pagesize = mem_pagesize();
+  const size_t guardsize = stack_guardsize(pagesize);
 
   // Adjust reqsize to limits and page alignment.
   // If no specific stack size is requested, use a default size of 1MB (usually =256 pages)
-  assert(STACK_SIZE_DEFAULT > stack_guard_size + pagesize);
-  size_t stacksize = STACK_SIZE_DEFAULT; // default size
-  if (reqsize > 0 && reqsize != STACK_SIZE_DEFAULT)
-    stacksize = MIN(stacksize_limit, align2(reqsize, pagesize) + stack_guard_size);
+  assert(STACK_SIZE_DEFAULT > guardsize + pagesize);
+  if (reqsize == 0 || reqsize == STACK_SIZE_DEFAULT)
+    return STACK_SIZE_DEFAULT;
+  size_t stacksize = align2(reqsize, pagesize) + guardsize;
+  if (stacksize <= STACK_CLASS_MAX) // round up to a power of two
+    stacksize = MAX(STACK_CLASS_MIN, (size_t)1 << (64 - __builtin_clzll((u64)stacksize - 1)));
+  return MIN(stack_sizelimit(pagesize), stacksize);
+}
+
+
+// Allocates stack memory of approximately reqsize size (see stackroundsize.)
+// Returns the low address (top of stack; not the SB), the actual size in stacksize_out
+// and guard size in guardsize_out (stacksize_out - guardsize_out = usable stack space.)
+//
+// On platforms that support it, stack memory is allocated "lazily" so that only when a page
+// is used is it actually committed & allocated in actual memory. On POSIX systems mmap is used
+// and on MS Windows VirtualAlloc is used (the latter is currently not implemented.)
+//
+void* stackalloc(size_t reqsize, size_t* stacksize_out, size_t* guardsize_out) {
+  const size_t stack_guard_size = stack_guardsize(mem_pagesize());
+  const size_t stacksize = stackroundsize(reqsize);
 
   // allocate stack memory
   #ifdef USE_MMAP
@@ -137,3 +155,59 @@ bool stackfree(void* lo, size_t size) {
     #error "TODO"
   #endif
 }
+
+
+// stack_releaserange computes the page-aligned range of a stack which stackrelease releases.
+// Returns false if the range is empty.
+static bool stack_releaserange(
+  void* lo, size_t size, size_t keepsize, void** start_out, size_t* len_out)
+{
+  const size_t pagesize = mem_pagesize();
+  uintptr_t start = (uintptr_t)lo + stack_guardsize(pagesize);
+  uintptr_t end = ((uintptr_t)lo + size - keepsize) & ~(uintptr_t)(pagesize - 1);
+  if (end <= start)
+    return false;
+  *start_out = (void*)start;
+  *len_out = end - start;
+  return true;
+}
+
+
+// stackrelease tells the OS that the pages of the stack at lo of size bytes are not needed,
+// except for the guard and the top keepsize bytes. The memory stays mapped and the OS may
+// reclaim the pages whenever it likes; they are backed by fresh (or the same) memory when
+// touched again. This is much cheaper than stackfree followed by stackalloc.
+void stackrelease(void* lo, size_t size, size_t keepsize) {
+  void* start;
+  size_t len;
+  if (!stack_releaserange(lo, size, keepsize, &start, &len))
+    return;
+  #if R_TARGET_OS_DARWIN && defined(MADV_FREE_REUSABLE)
+    // MADV_FREE_REUSABLE updates the task's memory accounting, unlike MADV_FREE (see stackreuse)
+    madvise(start, len, MADV_FREE_REUSABLE);
+  #elif defined(MADV_FREE)
+    // MADV_FREE (Linux 4.5+) lets the kernel reclaim the pages lazily, only under memory
+    // pressure, which is cheaper than MADV_DONTNEED when the stack is soon used again.
+    // Fall back to MADV_DONTNEED for good when the kernel does not support it.
+    static _Atomic(bool) nofree = false;
+    if (!AtomicLoad(&nofree)) {
+      if (madvise(start, len, MADV_FREE) == 0 || errno != EINVAL)
+        return;
+      AtomicStore(&nofree, true);
+    }
+    madvise(start, len, MADV_DONTNEED);
+  #else
+    madvise(start, len, MADV_DONTNEED);
+  #endif
+}
+
+
+// stackreuse must be called before memory released with stackrelease is used again
+void stackreuse(void* lo, size_t size, size_t keepsize) {
+  #if R_TARGET_OS_DARWIN && defined(MADV_FREE_REUSE)
+    void* start;
+    size_t len;
+    if (stack_releaserange(lo, size, keepsize, &start, &len))
+      madvise(start, len, MADV_FREE_REUSE);
+  #endif
+}